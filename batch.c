@@ -0,0 +1,749 @@
+/**
+ * @file batch.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Conversion of many FITS files in a single process.
+ *
+ * Converting an archive one process per file pays for process start up, library initialisation and
+ * header parsing on every file.  In batch mode, a list of files is converted by a fixed number of worker
+ * threads in one process.  Each worker keeps a pool of image component buffers that is reused from one
+ * image (and one file) to the next, and the basic information read from each FITS header is cached so
+ * that it is only parsed once.  A summary table is written when all files have been converted.
+ *
+ * OpenJPEG 1.99 binds a compressor to a single image when it is set up, so a new compressor is still
+ * created for each image.
+ */
+
+#include "f2j.h"
+
+#include <dirent.h>
+#include <glob.h>
+#include <strings.h>
+
+/**
+ * Number of hash buckets in the cube_info cache.
+ */
+#define CUBE_INFO_CACHE_BUCKETS 4096
+
+/**
+ * Entry in the cache of information read from FITS headers.  An entry is only valid while the size and
+ * modification time of the file are unchanged.
+ */
+typedef struct cube_info_cache_entry {
+	char *path /** Name of the FITS file. */;
+	off_t size /** Size of the file when its header was read. */;
+	time_t mtime /** Modification time of the file when its header was read. */;
+	bool hasInfo /** Has info been read?  Set by openFITSFile. */;
+	cube_info info /** Information on the first image in the file. */;
+	cube_info *images /** Information on every image in the file, in HDU order.  Null if the file hasn't been scanned by scanFITSExtensions. */;
+	int numImages /** Number of entries in images. */;
+	struct cube_info_cache_entry *next /** Next entry in the same hash bucket. */;
+} cube_info_cache_entry;
+
+/**
+ * Cache of information read from FITS headers, shared by all threads.
+ */
+static cube_info_cache_entry *cubeInfoCache[CUBE_INFO_CACHE_BUCKETS];
+
+/**
+ * Mutex protecting cubeInfoCache.
+ */
+static pthread_mutex_t cubeInfoCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * List of FITS files to convert.
+ */
+typedef struct {
+	char **files /** File names. */;
+	long count /** Number of files in the list. */;
+	long capacity /** Size of the files array. */;
+} file_list;
+
+/**
+ * State shared by the worker threads converting a batch of files.
+ */
+typedef struct {
+	file_list *list /** Files to convert. */;
+	conversion_options *options /** Options used for every file. */;
+	conversion_result *results /** Result of converting each file. */;
+	int *statuses /** 0 if each file was converted successfully, 1 otherwise. */;
+	long next /** Index of the next file to convert. */;
+	pthread_mutex_t mutex /** Mutex protecting next. */;
+} batch_queue;
+
+/**
+ * Get the current time from a monotonic clock, for timing conversions.
+ *
+ * @return time in seconds from an arbitrary starting point.
+ */
+double getWallClockTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+
+	return (double) now.tv_sec + ((double) now.tv_nsec)/1.0e9;
+}
+
+/**
+ * Hash a file name for the cube_info cache (djb2).
+ *
+ * @param path File name.
+ *
+ * @return hash bucket for the file name.
+ */
+static unsigned long hashPath(const char *path) {
+	unsigned long hash = 5381;
+
+	while (*path != '\0') {
+		hash = hash*33 + (unsigned char) *path;
+		path++;
+	}
+
+	return hash % CUBE_INFO_CACHE_BUCKETS;
+}
+
+/**
+ * Find the cache entry for a file, creating it if requested.  An entry describing an older version of the
+ * file is emptied.  Must be called with cubeInfoCacheMutex held.
+ *
+ * @param path Name of the FITS file.
+ * @param fileInfo Result of calling stat on the file.
+ * @param create Should an entry be created if there isn't one?
+ *
+ * @return the entry, or null if there isn't one (or it couldn't be created).
+ */
+static cube_info_cache_entry *getCacheEntry(const char *path, struct stat *fileInfo, bool create) {
+	unsigned long bucket = hashPath(path);
+	cube_info_cache_entry *entry;
+
+	for (entry=cubeInfoCache[bucket]; entry!=NULL; entry=entry->next) {
+		if (strcmp(entry->path,path) == 0) {
+			break;
+		}
+	}
+
+	if (entry == NULL) {
+		if (!create) {
+			return NULL;
+		}
+
+		// If memory can't be allocated, the information simply isn't cached.
+		entry = (cube_info_cache_entry *) calloc(1,sizeof(cube_info_cache_entry));
+
+		if (entry == NULL) {
+			return NULL;
+		}
+
+		entry->path = strdup(path);
+
+		if (entry->path == NULL) {
+			free(entry);
+			return NULL;
+		}
+
+		entry->size = fileInfo->st_size;
+		entry->mtime = fileInfo->st_mtime;
+		entry->next = cubeInfoCache[bucket];
+		cubeInfoCache[bucket] = entry;
+	}
+	else if (entry->size != fileInfo->st_size || entry->mtime != fileInfo->st_mtime) {
+		// The file has changed since it was examined.
+		entry->size = fileInfo->st_size;
+		entry->mtime = fileInfo->st_mtime;
+		entry->hasInfo = false;
+		free(entry->images);
+		entry->images = NULL;
+		entry->numImages = 0;
+	}
+
+	return entry;
+}
+
+/**
+ * Open a FITS file and get basic information about it, as getFITSInfo does.  The information is cached,
+ * so if the same (unmodified) file is opened again, its header is not parsed a second time.  Safe to call
+ * from several threads at once, as long as CFITSIO was built to be reentrant.
+ *
+ * @param ffname FITS file to open.
+ * @param fptr Pointer to a pointer to a fitsfile datatype for CFITSIO.  Will be populated by this function.
+ * @param info Data structure which will be populated with information about the data cube.
+ * @param status Reference to status variable used by CFITSIO.  Must have been initialised to 0 by the
+ * time that this function is called.
+ *
+ * @return 0 if the file was opened successfully, 1 otherwise.
+ */
+int openFITSFile(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
+	if (ffname == NULL || fptr == NULL || info == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to openFITSFile cannot be null.\n");
+		return 1;
+	}
+
+	struct stat fileInfo;
+
+	// If the file can't be examined, let CFITSIO report the problem.  It may not be a plain file.
+	if (stat(ffname,&fileInfo) != 0) {
+		return getFITSInfo(ffname,fptr,info,status);
+	}
+
+	cube_info_cache_entry *entry;
+	bool cached = false;
+
+	pthread_mutex_lock(&cubeInfoCacheMutex);
+
+	entry = getCacheEntry(ffname,&fileInfo,false);
+
+	if (entry != NULL && entry->hasInfo) {
+		*info = entry->info;
+		cached = true;
+	}
+
+	pthread_mutex_unlock(&cubeInfoCacheMutex);
+
+	if (cached) {
+		fits_open_file(fptr,ffname,READONLY,status);
+
+		if (*status != 0) {
+			fprintf(stderr,"Unable to open FITS file: %s\n",ffname);
+			return 1;
+		}
+
+		// Move to the HDU containing the image, as getFITSInfo does.
+		fits_movabs_hdu(*fptr,info->hdu,NULL,status);
+
+		if (*status != 0) {
+			fprintf(stderr,"Unable to move to HDU %d of FITS file: %s\n",info->hdu,ffname);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	int result = getFITSInfo(ffname,fptr,info,status);
+
+	if (result != 0) {
+		return result;
+	}
+
+	// Add the information to the cache.
+	pthread_mutex_lock(&cubeInfoCacheMutex);
+
+	entry = getCacheEntry(ffname,&fileInfo,true);
+
+	if (entry != NULL) {
+		entry->info = *info;
+		entry->hasInfo = true;
+	}
+
+	pthread_mutex_unlock(&cubeInfoCacheMutex);
+
+	return 0;
+}
+
+/**
+ * Examine every HDU of a FITS file, getting basic information (as getFITSInfo does) about each HDU containing
+ * an image that can be converted.  The file is opened once and the information is cached, so if the same
+ * (unmodified) file is examined again, its headers are not parsed a second time.  Safe to call from several
+ * threads at once, as long as CFITSIO was built to be reentrant.
+ *
+ * @param ffname FITS file to examine.
+ * @param images Reference to an array which will be allocated and populated with information about each
+ * image, in HDU order.  Must be freed by the caller.
+ * @param count Reference to integer which will be populated with the number of images.
+ * @param status Reference to status variable used by CFITSIO.  Must have been initialised to 0 by the
+ * time that this function is called.
+ *
+ * @return 0 if at least one image was found, 1 otherwise.
+ */
+int scanFITSExtensions(char *ffname, cube_info **images, int *count, int *status) {
+	if (ffname == NULL || images == NULL || count == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to scanFITSExtensions cannot be null.\n");
+		return 1;
+	}
+
+	*images = NULL;
+	*count = 0;
+
+	struct stat fileInfo;
+	bool canCache = stat(ffname,&fileInfo) == 0;
+	cube_info_cache_entry *entry;
+
+	if (canCache) {
+		pthread_mutex_lock(&cubeInfoCacheMutex);
+
+		entry = getCacheEntry(ffname,&fileInfo,false);
+
+		if (entry != NULL && entry->images != NULL) {
+			*images = (cube_info *) malloc(sizeof(cube_info)*entry->numImages);
+
+			if (*images != NULL) {
+				memcpy(*images,entry->images,sizeof(cube_info)*entry->numImages);
+				*count = entry->numImages;
+			}
+		}
+
+		pthread_mutex_unlock(&cubeInfoCacheMutex);
+
+		if (*images != NULL) {
+			return 0;
+		}
+	}
+
+	// Loop variable
+	int ii;
+
+	fitsfile *fptr = NULL;
+	int numHDUs = 0;
+
+	fits_open_file(&fptr,ffname,READONLY,status);
+
+	if (*status != 0) {
+		fprintf(stderr,"Unable to open FITS file: %s\n",ffname);
+		return 1;
+	}
+
+	fits_get_num_hdus(fptr,&numHDUs,status);
+
+	cube_info *found = (cube_info *) malloc(sizeof(cube_info)*(numHDUs > 0 ? numHDUs : 1));
+
+	if (found == NULL) {
+		fprintf(stderr,"Unable to allocate memory to examine FITS file: %s\n",ffname);
+		fits_close_file(fptr,status);
+		return 1;
+	}
+
+	for (ii=1; ii<=numHDUs && *status == 0; ii++) {
+		int hduType;
+		int naxis = 0;
+
+		fits_movabs_hdu(fptr,ii,&hduType,status);
+
+		if (*status != 0) {
+			break;
+		}
+
+		// Skip tables and HDUs without data, such as the empty primary HDU of most multi-extension files.
+		if (hduType != IMAGE_HDU) {
+			continue;
+		}
+
+		fits_get_img_dim(fptr,&naxis,status);
+
+		if (*status != 0 || naxis == 0) {
+			continue;
+		}
+
+		if (getImageInfo(fptr,ffname,&found[*count],status) == 0) {
+			(*count)++;
+		}
+		else {
+			fprintf(stderr,"Skipping HDU %d of FITS file %s.\n",ii,ffname);
+			*status = 0;
+		}
+	}
+
+	if (*status != 0) {
+		fprintf(stderr,"Unable to read HDUs of FITS file: %s\n",ffname);
+		free(found);
+		fits_close_file(fptr,status);
+		return 1;
+	}
+
+	fits_close_file(fptr,status);
+
+	if (*count == 0) {
+		fprintf(stderr,"No images found in FITS file: %s\n",ffname);
+		free(found);
+		return 1;
+	}
+
+	*images = found;
+
+	// Add a copy of the information to the cache.
+	if (canCache) {
+		pthread_mutex_lock(&cubeInfoCacheMutex);
+
+		entry = getCacheEntry(ffname,&fileInfo,true);
+
+		if (entry != NULL && entry->images == NULL) {
+			entry->images = (cube_info *) malloc(sizeof(cube_info)*(*count));
+
+			if (entry->images != NULL) {
+				memcpy(entry->images,found,sizeof(cube_info)*(*count));
+				entry->numImages = *count;
+			}
+		}
+
+		pthread_mutex_unlock(&cubeInfoCacheMutex);
+	}
+
+	return 0;
+}
+
+/**
+ * Add a file name to a list of files.
+ *
+ * @param list List to add to.
+ * @param path File name to add.  It is copied.
+ *
+ * @return 0 if the file was added successfully, 1 otherwise.
+ */
+static int addFile(file_list *list, const char *path) {
+	if (list->count == list->capacity) {
+		long capacity = list->capacity == 0 ? 64 : 2*list->capacity;
+		char **files = (char **) realloc(list->files,sizeof(char *)*capacity);
+
+		if (files == NULL) {
+			fprintf(stderr,"Unable to allocate memory for list of FITS files.\n");
+			return 1;
+		}
+
+		list->files = files;
+		list->capacity = capacity;
+	}
+
+	list->files[list->count] = strdup(path);
+
+	if (list->files[list->count] == NULL) {
+		fprintf(stderr,"Unable to allocate memory for list of FITS files.\n");
+		return 1;
+	}
+
+	list->count++;
+
+	return 0;
+}
+
+/**
+ * Free a list of files.
+ *
+ * @param list List to free.
+ */
+static void freeFileList(file_list *list) {
+	long ii;
+
+	for (ii=0; ii<list->count; ii++) {
+		free(list->files[ii]);
+	}
+
+	free(list->files);
+}
+
+/**
+ * Comparison function for sorting file names with qsort.
+ */
+static int compareFileNames(const void *a, const void *b) {
+	return strcmp(*(char * const *) a,*(char * const *) b);
+}
+
+/**
+ * Does a file name have an extension used for FITS files (.fits, .fit, .fts or .fz)?
+ *
+ * @param name File name.
+ *
+ * @return true if the file name has a FITS extension.
+ */
+static bool hasFITSExtension(const char *name) {
+	const char *dotPosition = strrchr(name,'.');
+
+	if (dotPosition == NULL) {
+		return false;
+	}
+
+	return strcasecmp(dotPosition,".fits") == 0 || strcasecmp(dotPosition,".fit") == 0 ||
+			strcasecmp(dotPosition,".fts") == 0 || strcasecmp(dotPosition,".fz") == 0;
+}
+
+/**
+ * Build the list of FITS files to convert from the source given to -batch.  The source may be a directory
+ * (all FITS files in it are converted), a glob pattern, or a list file naming one FITS file per line.  Blank
+ * lines and lines beginning with # in a list file are ignored.
+ *
+ * @param source Directory, glob pattern or list file.
+ * @param list Reference to an empty file_list which will be populated.
+ *
+ * @return 0 if the list was built successfully, 1 otherwise.
+ */
+static int buildFileList(char *source, file_list *list) {
+	struct stat fileInfo;
+
+	// Directory
+	if (stat(source,&fileInfo) == 0 && S_ISDIR(fileInfo.st_mode)) {
+		DIR *directory = opendir(source);
+
+		if (directory == NULL) {
+			fprintf(stderr,"Unable to open directory: %s\n",source);
+			return 1;
+		}
+
+		struct dirent *directoryEntry;
+		size_t sourceLength = strlen(source);
+
+		while ((directoryEntry = readdir(directory)) != NULL) {
+			if (!hasFITSExtension(directoryEntry->d_name)) {
+				continue;
+			}
+
+			char path[sourceLength + strlen(directoryEntry->d_name) + 2];
+			sprintf(path,"%s/%s",source,directoryEntry->d_name);
+
+			if (addFile(list,path) != 0) {
+				closedir(directory);
+				return 1;
+			}
+		}
+
+		closedir(directory);
+
+		// Convert files in a predictable order.
+		qsort(list->files,list->count,sizeof(char *),compareFileNames);
+
+		return 0;
+	}
+
+	// Glob pattern
+	if (strpbrk(source,"*?[") != NULL) {
+		glob_t matches;
+		size_t ii;
+
+		int globResult = glob(source,0,NULL,&matches);
+
+		if (globResult == GLOB_NOMATCH) {
+			fprintf(stderr,"No files match: %s\n",source);
+			return 1;
+		}
+		else if (globResult != 0) {
+			fprintf(stderr,"Unable to expand pattern: %s\n",source);
+			return 1;
+		}
+
+		for (ii=0; ii<matches.gl_pathc; ii++) {
+			if (addFile(list,matches.gl_pathv[ii]) != 0) {
+				globfree(&matches);
+				return 1;
+			}
+		}
+
+		globfree(&matches);
+
+		return 0;
+	}
+
+	// List file
+	FILE *listFile = fopen(source,"r");
+
+	if (listFile == NULL) {
+		fprintf(stderr,"Unable to open list of FITS files: %s\n",source);
+		return 1;
+	}
+
+	char line[OPJ_PATH_LEN];
+
+	while (fgets(line,sizeof(line),listFile) != NULL) {
+		// Strip trailing white space (including the new line).
+		size_t length = strlen(line);
+
+		while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r' || line[length-1] == ' ' || line[length-1] == '\t')) {
+			length--;
+		}
+
+		line[length] = '\0';
+
+		if (length == 0 || line[0] == '#') {
+			continue;
+		}
+
+		if (addFile(list,line) != 0) {
+			fclose(listFile);
+			return 1;
+		}
+	}
+
+	fclose(listFile);
+
+	return 0;
+}
+
+/**
+ * Worker thread function.  Repeatedly takes the next file from the queue and converts it, until no files
+ * remain.  Component buffers are recycled between the images (and files) converted by this worker.
+ *
+ * @param arg Reference to the batch_queue shared by the workers.
+ *
+ * @return null.
+ */
+static void *batchWorker(void *arg) {
+	batch_queue *queue = (batch_queue *) arg;
+	plane_buffer_pool pool = {NULL,0,0,0};
+
+	while (true) {
+		pthread_mutex_lock(&queue->mutex);
+		long index = queue->next;
+		queue->next++;
+		pthread_mutex_unlock(&queue->mutex);
+
+		if (index >= queue->list->count) {
+			break;
+		}
+
+		queue->statuses[index] = convertFITSFile(queue->list->files[index],queue->options,&pool,&queue->results[index]);
+	}
+
+	freePlaneBufferPool(&pool);
+
+	return NULL;
+}
+
+/**
+ * Convert a batch of FITS files, using the same options for each, and write a summary table to stdout.
+ * A file that can't be converted is reported in the summary and does not stop the other files being
+ * converted.
+ *
+ * @param batchParameters Reference to batch_info structure naming the files and the number of threads to use.
+ * @param options Reference to conversion_options structure specifying how each file is converted.
+ *
+ * @return 0 if all files were converted successfully, 1 otherwise.
+ */
+int runBatch(batch_info *batchParameters, conversion_options *options) {
+	if (batchParameters == NULL || options == NULL) {
+		fprintf(stderr,"Parameters to runBatch cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	long ii;
+
+	file_list list = {NULL,0,0};
+
+	if (buildFileList(batchParameters->source,&list) != 0) {
+		freeFileList(&list);
+		return 1;
+	}
+
+	if (list.count == 0) {
+		fprintf(stderr,"No FITS files found in: %s\n",batchParameters->source);
+		freeFileList(&list);
+		return 1;
+	}
+
+	// Compressed sizes are always recorded, for the summary table.
+	conversion_options batchOptions = *options;
+	batchOptions.compressionBenchmark = true;
+
+	conversion_result *results = (conversion_result *) calloc(list.count,sizeof(conversion_result));
+	int *statuses = (int *) calloc(list.count,sizeof(int));
+
+	if (results == NULL || statuses == NULL) {
+		fprintf(stderr,"Unable to allocate memory for batch results.\n");
+		free(results);
+		free(statuses);
+		freeFileList(&list);
+		return 1;
+	}
+
+	batch_queue queue;
+	queue.list = &list;
+	queue.options = &batchOptions;
+	queue.results = results;
+	queue.statuses = statuses;
+	queue.next = 0;
+	pthread_mutex_init(&queue.mutex,NULL);
+
+	// Don't start more workers than there are files.
+	int threads = batchParameters->threads;
+
+	if (threads > list.count) {
+		threads = list.count;
+	}
+
+	// CFITSIO can only be used from several threads at once if it was built to be reentrant.
+	if (threads > 1 && !fits_is_reentrant()) {
+		fprintf(stderr,"CFITSIO was not built to be reentrant, so files will be converted one at a time.\n");
+		threads = 1;
+	}
+
+	// The noise generators are shared by the whole process, so files with noise added are converted one at a time.
+	if (threads > 1 && isAddingNoise(&batchOptions)) {
+		fprintf(stderr,"Noise is added from a single random number generator, so files will be converted one at a time.\n");
+		threads = 1;
+	}
+
+	// Share the cores between the workers when decompressing tile-compressed images and coding code-blocks,
+	// unless the number of threads was given.
+	if (batchOptions.readThreads == 0) {
+		batchOptions.readThreads = getAutomaticReadThreads(threads);
+	}
+
+	if (batchOptions.encodeThreads == 0) {
+		batchOptions.encodeThreads = getAutomaticReadThreads(threads);
+	}
+
+	double startTime = getWallClockTime();
+
+	if (threads == 1) {
+		batchWorker(&queue);
+	}
+	else {
+		pthread_t workers[threads];
+		int started = 0;
+
+		for (ii=0; ii<threads; ii++) {
+			if (pthread_create(&workers[started],NULL,batchWorker,&queue) == 0) {
+				started++;
+			}
+		}
+
+		// Convert the files in this thread if no workers could be started.
+		if (started == 0) {
+			fprintf(stderr,"Unable to start worker threads, so files will be converted one at a time.\n");
+			batchWorker(&queue);
+		}
+
+		for (ii=0; ii<started; ii++) {
+			pthread_join(workers[ii],NULL);
+		}
+
+		threads = started > 0 ? started : 1;
+	}
+
+	double elapsed = getWallClockTime() - startTime;
+
+	pthread_mutex_destroy(&queue.mutex);
+
+	// Write summary table.  Sizes are compared to the FITS data encoded, not the size of the FITS files.
+	long failed = 0;
+	long images = 0;
+	rate_account totalRates;
+	double totalSeconds = 0.0;
+	double totalReadSeconds = 0.0;
+
+	memset(&totalRates,0,sizeof(rate_account));
+
+	fprintf(stdout,"[FITS file] [images] [size of compressed JPEG 2000 image(s)] [size of FITS data] [bits per pixel] [compression ratio] [time (s)] [status]\n");
+
+	for (ii=0; ii<list.count; ii++) {
+		rate_counter *imageRate = &results[ii].rate.outputs[RATE_IMAGE];
+
+		fprintf(stdout,"%s %ld %llu %llu %f %f %f %s\n",list.files[ii],results[ii].images,imageRate->bytes,imageRate->rawBytes,
+				getBitsPerPixel(imageRate),getCompressionRatio(imageRate),results[ii].seconds,statuses[ii] == 0 ? "OK" : "FAILED");
+
+		if (statuses[ii] != 0) {
+			failed++;
+		}
+		else {
+			images += results[ii].images;
+			addRateAccount(&totalRates,&results[ii].rate);
+			totalSeconds += results[ii].seconds;
+			totalReadSeconds += results[ii].readSeconds;
+		}
+	}
+
+	fprintf(stdout,"Converted %ld of %ld files (%ld images) in %f seconds using %d thread(s).\n",list.count-failed,list.count,images,elapsed,threads);
+	printRateAccount(stdout,"total",&totalRates);
+	fprintf(stdout,"Time waiting for FITS data: %f seconds, computing: %f seconds (summed over files).\n",totalReadSeconds,totalSeconds-totalReadSeconds);
+
+	free(results);
+	free(statuses);
+	freeFileList(&list);
+
+	return failed == 0 ? 0 : 1;
+}
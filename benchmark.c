@@ -42,6 +42,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <limits.h>
 #include "f2j.h"
 
 /**
@@ -63,13 +64,75 @@ void info_callback(const char *msg, void *client_data) {
 }
 
 /**
- * Read a JPEG 2000 image from a file, decompress it and create an OpenJPEG
- * image structure from it.
+ * Decompress a JPEG 2000 image from an OpenJPEG stream and create an OpenJPEG image structure from it.
  *
  * Modified version of code in j2k_to_image.c from OpenJPEG.  Some generality is
  * sacrificed for simplicity, as particular codebranches in j2k_to_image.c will never
  * be called, given the way that our program encodes J2K images.
  *
+ * @param cio Stream to read the image from.  Not destroyed.
+ * @param image Reference to a pointer to OpenJPEG image structure which will be populated
+ * with data from the decompressed J2K image.  The reference should initially point to a
+ * null pointer.
+ * @param codec JPEG 2000 codec (JP2 or J2K) used.
+ *
+ * @return 0 if the image was decompressed successfully, 1 otherwise.
+ */
+static int decodeJ2KStream(opj_stream_t *cio, opj_image_t **image, OPJ_CODEC_FORMAT codec) {
+	opj_dparameters_t parameters;			/* decompression parameters */
+	opj_event_mgr_t event_mgr;				/* event manager */
+	opj_codec_t* dinfo = NULL;				/* Handle to a decompressor */
+
+	/* configure the event callbacks (not required) */
+	memset(&event_mgr, 0, sizeof(opj_event_mgr_t));
+	event_mgr.error_handler = error_callback;
+	event_mgr.warning_handler = warning_callback;
+	event_mgr.info_handler = info_callback;
+
+	/* set decoding parameters to default values */
+	opj_set_default_decoder_parameters(&parameters);
+
+	/* decode the JPEG2000 stream */
+	/* ---------------------- */
+	dinfo = opj_create_decompress_v2(codec);
+
+	/* Setup the decoder decoding parameters using user parameters */
+	if ( !opj_setup_decoder_v2(dinfo, &parameters, &event_mgr) ){
+		fprintf(stderr, "ERROR -> j2k_dump: failed to setup the decoder\n");
+		opj_destroy_codec(dinfo);
+		return 1;
+	}
+
+	/* Read the main header of the codestream and if necessary the JP2 boxes*/
+	if(! opj_read_header(cio, dinfo, image)){
+		fprintf(stderr, "ERROR -> j2k_to_image: failed to read the header\n");
+		opj_destroy_codec(dinfo);
+		opj_image_destroy(*image);
+		*image = NULL;
+		return 1;
+	}
+
+	/* Get the decoded image */
+	if (!(opj_decode_v2(dinfo, cio, *image) && opj_end_decompress(dinfo,	cio))) {
+		fprintf(stderr,"ERROR -> j2k_to_image: failed to decode image!\n");
+		opj_destroy_codec(dinfo);
+		opj_image_destroy(*image);
+		*image = NULL;
+		return 1;
+	}
+
+	/* free remaining structures */
+	if (dinfo) {
+		opj_destroy_codec(dinfo);
+	}
+
+	return 0;
+}
+
+/**
+ * Read a JPEG 2000 image from a file, decompress it and create an OpenJPEG
+ * image structure from it.
+ *
  * Very basic parameter checking is performed, but it is largely left to the
  * calling code to ensure parameters are valid and meaningful.
  *
@@ -93,19 +156,7 @@ int readJ2K(char *imageFile, opj_image_t **image, OPJ_CODEC_FORMAT codec) {
 	}
 
 	FILE *fsrc = NULL;
-	opj_dparameters_t parameters;			/* decompression parameters */
-	opj_event_mgr_t event_mgr;				/* event manager */
 	opj_stream_t *cio = NULL;				/* Stream */
-	opj_codec_t* dinfo = NULL;				/* Handle to a decompressor */
-
-	/* configure the event callbacks (not required) */
-	memset(&event_mgr, 0, sizeof(opj_event_mgr_t));
-	event_mgr.error_handler = error_callback;
-	event_mgr.warning_handler = warning_callback;
-	event_mgr.info_handler = info_callback;
-
-	/* set decoding parameters to default values */
-	opj_set_default_decoder_parameters(&parameters);
 
 	/* read the input file and put it in memory */
 	/* ---------------------------------------- */
@@ -122,49 +173,157 @@ int readJ2K(char *imageFile, opj_image_t **image, OPJ_CODEC_FORMAT codec) {
 		return 1;
 	}
 
-	/* decode the JPEG2000 stream */
-	/* ---------------------- */
-	dinfo = opj_create_decompress_v2(codec);
+	int result = decodeJ2KStream(cio,image,codec);
 
-	/* Setup the decoder decoding parameters using user parameters */
-	if ( !opj_setup_decoder_v2(dinfo, &parameters, &event_mgr) ){
-		fprintf(stderr, "ERROR -> j2k_dump: failed to setup the decoder\n");
-		opj_stream_destroy(cio);
-		fclose(fsrc);
-		opj_destroy_codec(dinfo);
+	/* Close the byte stream */
+	opj_stream_destroy(cio);
+	fclose(fsrc);
+
+	return result;
+}
+
+/**
+ * Decompress a JPEG 2000 image held in memory (e.g. kept by createJPEG2000Image) and create an
+ * OpenJPEG image structure from it, as readJ2K does for a file.
+ *
+ * @param encoded Reference to memory_stream structure holding the encoded image.  Read from its
+ * current offset.
+ * @param image Reference to a pointer to OpenJPEG image structure which will be populated
+ * with data from the decompressed J2K image.  The reference should initially point to a
+ * null pointer.
+ * @param codec JPEG 2000 codec (JP2 or J2K) used.
+ *
+ * @return 0 if the image was decompressed successfully, 1 otherwise.
+ */
+int readJ2KFromMemory(memory_stream *encoded, opj_image_t **image, OPJ_CODEC_FORMAT codec) {
+	if (encoded == NULL || encoded->data == NULL) {
+		fprintf(stderr,"Encoded image provided to readJ2KFromMemory cannot be null.\n");
 		return 1;
 	}
 
-	/* Read the main header of the codestream and if necessary the JP2 boxes*/
-	if(! opj_read_header(cio, dinfo, image)){
-		fprintf(stderr, "ERROR -> j2k_to_image: failed to read the header\n");
-		opj_stream_destroy(cio);
-		fclose(fsrc);
-		opj_destroy_codec(dinfo);
-		opj_image_destroy(*image);
+	if (*image != NULL) {
+		fprintf(stderr,"Image structure pointer provided to readJ2KFromMemory must be null.\n");
 		return 1;
 	}
 
-	/* Get the decoded image */
-	if (!(opj_decode_v2(dinfo, cio, *image) && opj_end_decompress(dinfo,	cio))) {
-		fprintf(stderr,"ERROR -> j2k_to_image: failed to decode image!\n");
-		opj_destroy_codec(dinfo);
-		opj_stream_destroy(cio);
-		opj_image_destroy(*image);
-		fclose(fsrc);
+	opj_stream_t *cio = createMemoryStream(encoded);
+
+	if (cio == NULL) {
 		return 1;
 	}
 
-	/* Close the byte stream */
+	int result = decodeJ2KStream(cio,image,codec);
+
 	opj_stream_destroy(cio);
-	fclose(fsrc);
 
-	/* free remaining structures */
-	if (dinfo) {
-		opj_destroy_codec(dinfo);
+	return result;
+}
+
+/**
+ * Compare the pixels of an uncompressed image component with those of the same component after
+ * compression, accumulating the sums from which the quality benchmarks are calculated.  This is the
+ * inner loop of performQualityBenchmarking.
+ *
+ * @param uncompressed Pixels of the uncompressed component.
+ * @param compressed Pixels of the compressed component.
+ * @param pixels Number of pixels in each component.
+ * @param parameters Reference to quality_benchmark_info structure specifying the benchmarks required.  An
+ * overflow only stops the comparison if it affects one of these.
+ * @param residual Array which will be populated with the residual (uncompressed minus compressed) of each
+ * pixel, clipped to [resMin,resMax].  May be null if no residual is needed.
+ * @param resMin Smallest residual that can be stored.
+ * @param resMax Largest residual that can be stored.
+ * @param name Name of the compressed image, used in messages about clipped residuals.
+ * @param comparison Reference to pixel_comparison structure which will be populated with the sums.
+ *
+ * @return COMPARISON_OK if the comparison was successful, otherwise the overflow that stopped it.
+ */
+comparison_status comparePixels(int *uncompressed, int *compressed, size_t pixels, quality_benchmark_info *parameters,
+		int *residual, int resMin, int resMax, const char *name, pixel_comparison *comparison) {
+	// Loop variable
+	size_t kk;
+
+	// Squared error - initially 0.  Use a 64 bit integer.  (Hopefully this will not overflow!)
+	unsigned long long int squaredError = 0;
+
+	// Absolute error - initially 0.
+	unsigned long long int absoluteError = 0;
+
+	// Pixel intensities (for fidelity metric) - initially 0.
+	unsigned long long int intensitySquareSum = 0;
+
+	// Maximum absolute error - initially 0.  Kept as a long long int, as the difference of two int pixels may not fit
+	// in an int.
+	long long int maxAbsoluteError = 0;
+
+	comparison_status status = COMPARISON_OK;
+
+	for (kk=0; kk<pixels; kk++) {
+		// Get long long int values of pixels (in some cases, we get the intensity square overflowing otherwise).
+		long long int uv = (long long int) uncompressed[kk];
+		long long int cv = (long long int) compressed[kk];
+		long long int error = llabs(uv-cv);
+
+		if (error > maxAbsoluteError) {
+			maxAbsoluteError = error;
+		}
+
+		// Sometimes we get overflow values
+
+		unsigned long long int oldSquareError = squaredError;
+		unsigned long long int oldAbsoluteError = absoluteError;
+		unsigned long long int oldIntensitySquareSum = intensitySquareSum;
+
+		squaredError += (uv-cv)*(uv-cv);
+		absoluteError += error;
+		intensitySquareSum += uv*uv;
+
+		// Check for overflow.  We can never 'wrap around' completely, so we can check if the new
+		// value is less than the old value.
+
+		// We only need to take action on an overflow if it affects one of the quality benchmarks we have
+		// been asked to performed.
+		if (oldSquareError > squaredError) {
+			if (parameters->squaredError || parameters->meanSquaredError || parameters->peakSignalToNoiseRatio || parameters->rootMeanSquaredError || parameters->fidelity) {
+				status = COMPARISON_SQUARED_ERROR_OVERFLOW;
+				break;
+			}
+		}
+
+		if (oldAbsoluteError > absoluteError) {
+			if (parameters->absoluteError || parameters->meanAbsoluteError) {
+				status = COMPARISON_ABSOLUTE_ERROR_OVERFLOW;
+				break;
+			}
+		}
+
+		if (oldIntensitySquareSum > intensitySquareSum) {
+			if (parameters->squaredIntensitySum || parameters->fidelity) {
+				status = COMPARISON_INTENSITY_OVERFLOW;
+				break;
+			}
+		}
+
+		if (residual != NULL) {
+			residual[kk] = uv-cv;
+
+			if (residual[kk] < resMin) {
+				fprintf(stderr,"Overflow calculating residual image of file %s - pixel %zd set to %d\n",name,kk,resMin);
+				residual[kk] = resMin;
+			}
+			else if (residual[kk] > resMax) {
+				fprintf(stderr,"Overflow calculating residual image of file %s - pixel %zd set to %d\n",name,kk,resMax);
+				residual[kk] = resMax;
+			}
+		}
 	}
 
-	return 0;
+	comparison->squaredError = squaredError;
+	comparison->absoluteError = absoluteError;
+	comparison->intensitySquareSum = intensitySquareSum;
+	comparison->maxAbsoluteError = maxAbsoluteError > INT_MAX ? INT_MAX : (int) maxAbsoluteError;
+
+	return status;
 }
 
 /**
@@ -176,27 +335,57 @@ int readJ2K(char *imageFile, opj_image_t **image, OPJ_CODEC_FORMAT codec) {
  *
  * @param image Reference to OpenJPEG image structure representing uncompressed version of image.
  * @param compressedFile File name of compressed JPEG 2000 image.
+ * @param encoded Reference to memory_stream structure holding the contents of compressedFile, kept by
+ * createJPEG2000Image, so that the file isn't read back.  May be null, in which case the file is read.
  * @param parameters Reference to quality_benchmark_info structure specifying what quality benchmarks should be performed.
- * Currently allows specific benchmarks to be specified by the user.
+ * Currently allows specific benchmarks to be specified by the user, and whether they are estimated from a sample (see sample.c).
  * @param codec Codec (such as JP2/JPT/J2K) of compressed image file.
+ * @param cubeParameters Reference to cube_encoding_info structure describing any spectral transform performed on the
+ * components of the image before it was encoded.  The transform is inverted after decoding, so that the planes
+ * themselves are compared.  May be null if no spectral transform was performed.
+ * @param physical Array with one entry per image component holding the physical values of each plane and its
+ * scaling, with which the decoded intensities are compared in physical units if asked to.  May be null.
+ * @param results Array with one entry per image component, which will be populated with the quality benchmarks
+ * calculated for each component (whether or not they were asked to be printed).  May be null.
+ * @param rates Reference to rate_account structure to which the size of the residual image (if written) is added.  May be
+ * null if compression benchmarking is off.
  *
  * @return 0 if the benchmarking was performed successfully, 1 otherwise.
  */
-int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality_benchmark_info *parameters, OPJ_CODEC_FORMAT codec) {
+int performQualityBenchmarking(opj_image_t *image, char *compressedFile, memory_stream *encoded, quality_benchmark_info *parameters,
+		OPJ_CODEC_FORMAT codec, cube_encoding_info *cubeParameters, physical_plane *physical, quality_benchmark_result *results, rate_account *rates) {
 	if (image == NULL || compressedFile == NULL || parameters == NULL) {
 		fprintf(stderr,"Compressed and uncompressed images cannot be null.\n");
 		return 1;
 	}
 
-	// Decompress JPEG 2000 image file into an OpenJPEG image structure.
+	// Estimate the benchmarks from a reduced resolution decode or some of the tiles if asked to (see sample.c).
+	if (isQualitySampled(&parameters->sampling)) {
+		return performSampledQualityBenchmarking(image,compressedFile,encoded,parameters,codec,cubeParameters,results);
+	}
+
+	// Decompress the JPEG 2000 image into an OpenJPEG image structure, from memory if the codestream was kept.
 	opj_image_t *compressedImage = NULL;
-	int readResult = readJ2K(compressedFile,&compressedImage,codec);
+	PROFILE_START(decodeTimer);
+	int readResult = encoded != NULL ? readJ2KFromMemory(encoded,&compressedImage,codec) : readJ2K(compressedFile,&compressedImage,codec);
+	PROFILE_STOP(decodeTimer,PROFILE_DECODE,readResult == 0 ? sizeof(int)*compressedImage->numcomps*compressedImage->comps[0].w*compressedImage->comps[0].h : 0);
 
 	if (readResult != 0) {
 		fprintf(stderr,"Unable to read JPEG file: %s\n",compressedFile);
 		return 1;
 	}
 
+	// Undo any spectral transform performed on the components before encoding.
+	if (cubeParameters != NULL && cubeParameters->spectralTransform != SPECTRAL_NONE && compressedImage->numcomps > 1
+			&& compressedImage->numcomps == image->numcomps) {
+		if (spectralInverseTransform(compressedImage,cubeParameters->spectralTransform,cubeParameters->spectralLevels,
+				image->comps[0].prec,image->comps[0].sgnd) != 0) {
+			fprintf(stderr,"Unable to invert spectral transform of JPEG file: %s\n",compressedFile);
+			opj_image_destroy(compressedImage);
+			return 1;
+		}
+	}
+
 	// Specify whether two images are comparable on a pixel by pixel basis.  For this to be true,
 	// they need to have the same dimensions and the same number of components.
 	// By default true, otherwise we set this to be false when performing sanity checking below.
@@ -204,7 +393,6 @@ int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality
 
 	// Loop variables
 	int ii,jj;
-	size_t kk;
 
 	// Now compare the two images.  Start with some basic sanity checking.
 	if (compressedImage->color_space != image->color_space) {
@@ -265,6 +453,8 @@ int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality
 
 		// Perform pixel by pixel comparison, component by component.  We should have only 1 component, but wrap the code in
 		// a loop in case we eventually have to deal with more.
+		PROFILE_START(qualityTimer);
+
 		for (ii=0; ii<image->numcomps; ii++) {
 			// Get short name references to both compressed & uncompressed components.
 			opj_image_comp_t compUC = image->comps[ii];
@@ -346,86 +536,82 @@ int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality
 				continue;
 			}
 
-			// Squared error - initially 0.  Use a 64 bit integer.  (Hopefully this will not overflow!)
-			unsigned long long int squaredError = 0;
-
-			// Absolute error - initially 0.
-			unsigned long long int absoluteError = 0;
-
-			// Pixel intensities (for fidelity metric) - initially 0.
-			unsigned long long int intensitySquareSum = 0;
-
-			// Maximum absolute error - initially 0.
-			int maxAbsoluteError = 0;
+			// Perform pixel by pixel comparison.
+			pixel_comparison comparison;
+			comparison_status comparisonStatus = comparePixels(compUC.data,compC.data,pixels,parameters,
+					parameters->writeResidual ? residualImage.comps[ii].data : NULL,resMin,resMax,compressedFile,&comparison);
 
 			// Was pixel by pixel comparison successful?
-			bool comparisonSuccessful = true;
+			bool comparisonSuccessful = comparisonStatus == COMPARISON_OK;
 
-			// Perform pixel by pixel comparison.
-			for (kk=0; kk<pixels; kk++) {
-				// Get long long int values of pixels (in some cases, we get the intensity square overflowing otherwise).
-				long long int uv = (long long int) compUC.data[kk];
-				long long int cv = (long long int) compC.data[kk];
+			if (comparisonStatus == COMPARISON_SQUARED_ERROR_OVERFLOW) {
+				fprintf(stdout,"Overflow occurred in MSE pixel by pixel comparison for component %d of file %s\n",ii,compressedFile);
+			}
+			else if (comparisonStatus == COMPARISON_ABSOLUTE_ERROR_OVERFLOW) {
+				fprintf(stdout,"Overflow occurred in MAE pixel by pixel comparison for component %d of file %s\n",ii,compressedFile);
+			}
+			else if (comparisonStatus == COMPARISON_INTENSITY_OVERFLOW) {
+				fprintf(stdout,"Overflow occurred in fidelity pixel by pixel comparison for component %d of file %s\n",ii,compressedFile);
+			}
 
-				if (abs(uv-cv) > maxAbsoluteError) {
-					maxAbsoluteError = abs(uv-cv);
+			unsigned long long int squaredError = comparison.squaredError;
+			unsigned long long int absoluteError = comparison.absoluteError;
+			unsigned long long int intensitySquareSum = comparison.intensitySquareSum;
+			int maxAbsoluteError = comparison.maxAbsoluteError;
+
+			// Structural similarity, over windows rather than pixel by pixel (see ssim.c).
+			double ssim = NAN;
+			double msssim = NAN;
+
+			if (comparisonSuccessful && (parameters->structuralSimilarity || parameters->multiScaleStructuralSimilarity)) {
+				if (computeStructuralSimilarity(compUC.data,compC.data,compUC.w,compUC.h,compUC.prec,parameters->multiScaleStructuralSimilarity,
+						parameters->threads > 0 ? parameters->threads : getAutomaticReadThreads(1),&ssim,&msssim) != 0) {
+					fprintf(stdout,"Unable to calculate SSIM for component %d of file %s\n",ii,compressedFile);
+					ssim = NAN;
+					msssim = NAN;
 				}
+			}
 
-				// Sometimes we get overflow values
-
-				unsigned long long int oldSquareError = squaredError;
-				unsigned long long int oldAbsoluteError = absoluteError;
-				unsigned long long int oldIntensitySquareSum = intensitySquareSum;
-
-				squaredError += (uv-cv)*(uv-cv);
-				absoluteError += abs(uv-cv);
-				intensitySquareSum += uv*uv;
-
-				// Check for overflow.  We can never 'wrap around' completely, so we can check if the new
-				// value is less than the old value.
-
-				// We only need to take action on an overflow if it affects one of the quality benchmarks we have
-				// been asked to performed.
-				if (oldSquareError > squaredError) {
-					if (parameters->squaredError || parameters->meanSquaredError || parameters->peakSignalToNoiseRatio || parameters->rootMeanSquaredError || parameters->fidelity) {
-						comparisonSuccessful = false;
-						fprintf(stdout,"Overflow occurred in MSE pixel by pixel comparison for component %d of file %s\n",ii,compressedFile);
-						break;
-					}
-				}
+			// Error in the units of the FITS data, mapping the decoded intensities back through the inverse of the
+			// transform (see physical.c).
+			double physicalRMSE = NAN;
+			double physicalMaxError = NAN;
 
-				if (oldAbsoluteError > absoluteError) {
-					if (parameters->absoluteError || parameters->meanAbsoluteError) {
-						comparisonSuccessful = false;
-						fprintf(stdout,"Overflow occurred in MAE pixel by pixel comparison for component %d of file %s\n",ii,compressedFile);
-						break;
-					}
+			if (comparisonSuccessful && parameters->physicalError) {
+				if (physical == NULL || comparePhysicalValues(&physical[ii],compC.data,compC.w,compC.h,&physicalRMSE,&physicalMaxError) != 0) {
+					fprintf(stdout,"Unable to map component %d of file %s back to physical values\n",ii,compressedFile);
+					physicalRMSE = NAN;
+					physicalMaxError = NAN;
 				}
+			}
 
-				if (oldIntensitySquareSum > intensitySquareSum) {
-					if (parameters->squaredIntensitySum || parameters->fidelity) {
-						comparisonSuccessful = false;
-						fprintf(stdout,"Overflow occurred in fidelity pixel by pixel comparison for component %d of file %s\n",ii,compressedFile);
-						break;
-					}
-				}
+			// Record quality benchmarks for the caller.
+			if (comparisonSuccessful && results != NULL) {
+				double mse = ((double) squaredError) / ((double) pixels);
 
-				if (parameters->writeResidual) {
-					residualImage.comps[ii].data[kk] = uv-cv;
+				results[ii].valid = true;
+				results[ii].pixels = pixels;
+				results[ii].meanSquaredError = mse;
+				results[ii].peakSignalToNoiseRatio = squaredError == 0 ? INFINITY : 10.0 * log10( ( ((double)maxPixValue) * ((double)maxPixValue) ) / mse );
+				results[ii].meanAbsoluteError = ((double) absoluteError) / ((double) pixels);
+				results[ii].fidelity = 1.0 - ((double) squaredError) / ((double) intensitySquareSum);
+				results[ii].maximumAbsoluteDistortion = maxAbsoluteError;
+				results[ii].structuralSimilarity = parameters->structuralSimilarity ? ssim : NAN;
+				results[ii].multiScaleStructuralSimilarity = msssim;
+				results[ii].physicalRootMeanSquaredError = physicalRMSE;
+				results[ii].physicalMaximumError = physicalMaxError;
+			}
 
-					if (residualImage.comps[ii].data[kk] < resMin) {
-						fprintf(stderr,"Overflow calculating residual image of file %s - pixel %zd set to %d\n",compressedFile,kk,resMin);
-						residualImage.comps[ii].data[kk] = resMin;
-					}
-					else if (residualImage.comps[ii].data[kk] > resMax) {
-						fprintf(stderr,"Overflow calculating residual image of file %s - pixel %zd set to %d\n",compressedFile,kk,resMax);
-						residualImage.comps[ii].data[kk] = resMax;
-					}
-				}
+			if (comparisonSuccessful) {
+				addQualitySummary(parameters->summary,((double) squaredError) / ((double) pixels),((double) absoluteError) / ((double) pixels),
+						maxAbsoluteError,maxPixValue);
 			}
 
 			// Print out quality benchmarks if all relevant computations were successful.
 			if (comparisonSuccessful && parameters->performQualityBenchmarking) {
+				// Images may be benchmarked on several threads (see verify.c), so keep both lines together.
+				flockfile(stdout);
+
 				// Construct string specifying what the output string consists of:
 				fprintf(stdout,"[Compressed File Name] [Pixels]");
 
@@ -456,6 +642,15 @@ int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality
 				if (parameters->maximumAbsoluteDistortion) {
 					fprintf(stdout," [MAD]");
 				}
+				if (parameters->structuralSimilarity) {
+					fprintf(stdout," [SSIM]");
+				}
+				if (parameters->multiScaleStructuralSimilarity) {
+					fprintf(stdout," [MS-SSIM]");
+				}
+				if (parameters->physicalError) {
+					fprintf(stdout," [RMSE-PHYS] [MAXE-PHYS]");
+				}
 				fprintf(stdout,"\n");
 
 				// Calculate metrics to be printed out.
@@ -499,10 +694,39 @@ int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality
 				if (parameters->maximumAbsoluteDistortion) {
 					fprintf(stdout," %d",maxAbsoluteError);
 				}
+				if (parameters->structuralSimilarity) {
+					if (isnan(ssim)) {
+						fprintf(stdout," NO-SSIM");
+					}
+					else {
+						fprintf(stdout," %f",ssim);
+					}
+				}
+				if (parameters->multiScaleStructuralSimilarity) {
+					if (isnan(msssim)) {
+						fprintf(stdout," NO-MS-SSIM");
+					}
+					else {
+						fprintf(stdout," %f",msssim);
+					}
+				}
+				if (parameters->physicalError) {
+					if (isnan(physicalRMSE)) {
+						fprintf(stdout," NO-RMSE-PHYS NO-MAXE-PHYS");
+					}
+					else {
+						fprintf(stdout," %g %g",physicalRMSE,physicalMaxError);
+					}
+				}
 				fprintf(stdout,"\n");
+
+				funlockfile(stdout);
 			}
 		}
 
+		// Both images are read for each pixel compared.
+		PROFILE_STOP(qualityTimer,PROFILE_QUALITY,2*sizeof(int)*image->numcomps*image->comps[0].w*image->comps[0].h);
+
 		if (parameters->writeResidual && canWriteResidual) {
 			// Write residual image to file - we'll use lossless JP2 to store it.
 
@@ -525,7 +749,7 @@ int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality
 			*lastDot = '\0';
 
 			// Name is compressed file name (minus extension) + _RESIDUAL.jp2 - add enough space for terminating \n
-			char residualFile[strlen(lastDot) + 15];
+			char residualFile[strlen(compressedFile) + 15];
 
 			sprintf(residualFile,"%s_RESIDUAL.jp2",compressedFile);
 
@@ -533,7 +757,7 @@ int performQualityBenchmarking(opj_image_t *image, char *compressedFile, quality
 			*lastDot = '.';
 
 			// Perform JPEG 2000 compression.
-			int result = createJPEG2000Image(residualFile,CODEC_JP2,&lossless,&residualImage);
+			int result = createJPEG2000Image(residualFile,CODEC_JP2,&lossless,&residualImage,rates,RATE_RESIDUAL,NULL);
 
 			// Exit unsuccessfully if compression unsuccessful.
 			if (result != 0) {
@@ -0,0 +1,298 @@
+/**
+ * @file extensions.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Conversion of multi-extension FITS (MEF) files.
+ *
+ * Many instruments write a multi-extension FITS file for each exposure, with an image extension per
+ * detector.  The HDUs of such a file are examined once (see scanFITSExtensions, which caches the
+ * information read), then the selected image HDUs are converted concurrently, each by a worker thread
+ * with its own handle on the file, as CFITSIO requires for reading a file from several threads.  The
+ * images written for HDU n are named <FITS file name>_HDU<n>..., so HDUs never overwrite each other.
+ */
+
+#include "f2j.h"
+
+/**
+ * State shared by the worker threads converting the HDUs of a file.
+ */
+typedef struct {
+	char *ffname /** FITS file being converted. */;
+	conversion_options *options /** Options used for every HDU. */;
+	cube_info *images /** Information on each image HDU to convert. */;
+	int count /** Number of image HDUs to convert. */;
+	conversion_result *results /** Result of converting each HDU. */;
+	int *statuses /** 0 if each HDU was converted successfully, 1 otherwise. */;
+	int next /** Index of the next HDU to convert. */;
+	pthread_mutex_t mutex /** Mutex protecting next. */;
+} extension_queue;
+
+/**
+ * Convert a single image HDU of a file.
+ *
+ * @param queue Reference to the extension_queue.
+ * @param index Index of the HDU in queue->images.
+ * @param pool Pool of component buffers to reuse between images.  May be null.
+ */
+static void convertExtension(extension_queue *queue, int index, plane_buffer_pool *pool) {
+	cube_info *info = &queue->images[index];
+	fitsfile *fptr = NULL;
+	int status = 0;
+
+	PROFILE_START(openTimer);
+
+	fits_open_file(&fptr,queue->ffname,READONLY,&status);
+
+	if (status == 0) {
+		fits_movabs_hdu(fptr,info->hdu,NULL,&status);
+	}
+
+	PROFILE_STOP(openTimer,PROFILE_OPEN,0);
+
+	if (status != 0) {
+		fprintf(stderr,"Unable to open HDU %d of FITS file: %s\n",info->hdu,queue->ffname);
+		queue->statuses[index] = 1;
+
+		if (fptr != NULL) {
+			fits_close_file(fptr,&status);
+		}
+
+		return;
+	}
+
+	char baseName[strlen(queue->ffname) + 32];
+	getOutputBaseName(queue->ffname,info->hdu,baseName);
+
+	queue->statuses[index] = convertFITSImage(queue->ffname,baseName,fptr,info,queue->options,pool,&queue->results[index]);
+
+	if (queue->statuses[index] != 0) {
+		fprintf(stderr,"Unable to convert HDU %d of FITS file %s.\n",info->hdu,queue->ffname);
+	}
+
+	fits_close_file(fptr,&status);
+}
+
+/**
+ * Worker thread function.  Converts HDUs from the queue until there are none left, reusing a pool of
+ * component buffers between them.
+ *
+ * @param arg Reference to the extension_queue.
+ *
+ * @return Null.
+ */
+static void *extensionWorker(void *arg) {
+	extension_queue *queue = (extension_queue *) arg;
+	plane_buffer_pool pool = {NULL,0,0,0};
+
+	while (true) {
+		pthread_mutex_lock(&queue->mutex);
+		int index = queue->next++;
+		pthread_mutex_unlock(&queue->mutex);
+
+		if (index >= queue->count) {
+			break;
+		}
+
+		convertExtension(queue,index,&pool);
+	}
+
+	freePlaneBufferPool(&pool);
+
+	return NULL;
+}
+
+/**
+ * Convert the HDUs of a FITS file selected by options->hdus, options->hduThreads at a time.  The information
+ * recorded on each HDU is combined into a single result, in HDU order.
+ *
+ * @param ffname FITS file to convert.
+ * @param options Reference to conversion_options structure specifying how the file should be converted.
+ * @param pool Pool of component buffers to reuse between images if the HDUs are converted one at a time.  May
+ * be null.
+ * @param result Reference to conversion_result structure which will be populated with the number and size of
+ * the images written (and information on each image, if recordImages is true).
+ *
+ * @return 0 if every selected HDU was converted successfully, 1 otherwise.
+ */
+int convertFITSExtensions(char *ffname, conversion_options *options, plane_buffer_pool *pool, conversion_result *result) {
+	if (ffname == NULL || options == NULL || result == NULL) {
+		fprintf(stderr,"Parameters to convertFITSExtensions cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variables
+	int ii,jj;
+	long kk;
+
+	int status = 0;
+	cube_info *images;
+	int count;
+
+	PROFILE_START(scanTimer);
+	int scanResult = scanFITSExtensions(ffname,&images,&count,&status);
+	PROFILE_STOP(scanTimer,PROFILE_OPEN,0);
+
+	if (scanResult != 0) {
+		fprintf(stderr,"FITS file %s cannot be opened or is invalid.\n",ffname);
+		return 1;
+	}
+
+	// Keep only the HDUs that were asked for, in the order given.
+	if (!options->hdus.all) {
+		cube_info *selected = (cube_info *) malloc(sizeof(cube_info)*options->hdus.count);
+
+		if (selected == NULL) {
+			fprintf(stderr,"Unable to allocate memory to select HDUs.\n");
+			free(images);
+			return 1;
+		}
+
+		for (ii=0; ii<options->hdus.count; ii++) {
+			for (jj=0; jj<count; jj++) {
+				if (images[jj].hdu == options->hdus.numbers[ii]) {
+					break;
+				}
+			}
+
+			if (jj == count) {
+				fprintf(stderr,"HDU %d of FITS file %s does not contain an image that can be converted.\n",options->hdus.numbers[ii],ffname);
+				free(selected);
+				free(images);
+				return 1;
+			}
+
+			selected[ii] = images[jj];
+		}
+
+		free(images);
+		images = selected;
+		count = options->hdus.count;
+	}
+
+	conversion_result results[count];
+	int statuses[count];
+
+	for (ii=0; ii<count; ii++) {
+		memset(&results[ii],0,sizeof(conversion_result));
+		results[ii].recordImages = result->recordImages;
+		statuses[ii] = 1;
+	}
+
+	// Don't start more workers than there are HDUs.
+	int threads = options->hduThreads;
+
+	if (threads > count) {
+		threads = count;
+	}
+
+	// CFITSIO can only be used from several threads at once if it was built to be reentrant.
+	if (threads > 1 && !fits_is_reentrant()) {
+		fprintf(stderr,"CFITSIO was not built to be reentrant, so HDUs will be converted one at a time.\n");
+		threads = 1;
+	}
+
+	// The noise generators are shared by the whole process, so HDUs with noise added are converted one at a time.
+	if (threads > 1 && isAddingNoise(options)) {
+		fprintf(stderr,"Noise is added from a single random number generator, so HDUs will be converted one at a time.\n");
+		threads = 1;
+	}
+
+	// Share the cores between the workers when decompressing tile-compressed images and coding code-blocks,
+	// unless the number of threads was given.
+	conversion_options extensionOptions = *options;
+
+	if (extensionOptions.readThreads == 0) {
+		extensionOptions.readThreads = getAutomaticReadThreads(threads);
+	}
+
+	if (extensionOptions.encodeThreads == 0) {
+		extensionOptions.encodeThreads = getAutomaticReadThreads(threads);
+	}
+
+	extension_queue queue;
+	queue.ffname = ffname;
+	queue.options = &extensionOptions;
+	queue.images = images;
+	queue.count = count;
+	queue.results = results;
+	queue.statuses = statuses;
+	queue.next = 0;
+	pthread_mutex_init(&queue.mutex,NULL);
+
+	if (threads <= 1) {
+		for (ii=0; ii<count; ii++) {
+			convertExtension(&queue,ii,pool);
+		}
+	}
+	else {
+		pthread_t workers[threads];
+		int started = 0;
+
+		for (ii=0; ii<threads; ii++) {
+			if (pthread_create(&workers[ii],NULL,extensionWorker,&queue) != 0) {
+				break;
+			}
+			started++;
+		}
+
+		// If no worker could be started, convert the HDUs in this thread instead.
+		if (started == 0) {
+			fprintf(stderr,"Unable to start worker threads, so HDUs will be converted one at a time.\n");
+			extensionWorker(&queue);
+		}
+
+		for (ii=0; ii<started; ii++) {
+			pthread_join(workers[ii],NULL);
+		}
+	}
+
+	pthread_mutex_destroy(&queue.mutex);
+
+	// Combine the results, in HDU order.
+	int failed = 0;
+	long numImages = 0;
+
+	for (ii=0; ii<count; ii++) {
+		numImages += results[ii].images;
+
+		if (statuses[ii] != 0) {
+			failed++;
+		}
+	}
+
+	if (result->recordImages && numImages > 0) {
+		result->imageResults = (image_result *) malloc(sizeof(image_result)*numImages);
+
+		if (result->imageResults == NULL) {
+			fprintf(stderr,"Unable to allocate memory to record information on images.\n");
+			failed++;
+		}
+	}
+
+	for (ii=0; ii<count; ii++) {
+		if (result->imageResults != NULL) {
+			for (kk=0; kk<results[ii].images; kk++) {
+				result->imageResults[result->images + kk] = results[ii].imageResults[kk];
+			}
+
+			free(results[ii].imageResults);
+		}
+		else {
+			freeConversionResult(&results[ii]);
+		}
+
+		result->images += results[ii].images;
+		addRateAccount(&result->rate,&results[ii].rate);
+		result->readSeconds += results[ii].readSeconds;
+	}
+
+	free(images);
+
+	if (failed > 0) {
+		fprintf(stderr,"Unable to convert %d of %d HDUs of FITS file %s.\n",failed,count,ffname);
+		return 1;
+	}
+
+	return 0;
+}
@@ -101,22 +101,8 @@ double gaussianNoisePctStdDeviation = 0.0;
 	}\
 }
 
-/**
- * Macro to update index enable vertical flipping of a FITS file after
- * it has been read.
- */
-#define UPDATE_FLIPPING_INDEX() {\
-	index++;\
-	dif++;\
-	\
-	if (dif >= width) {\
-		dif = 0;\
-		index -= 2*width;\
-	}\
-}
-
 #ifdef noise
-#define TRANSFORM_END ,writeNoiseField ? noiseField->comps[0].data : NULL,writeNoiseField,printNoiseBenchmark
+#define TRANSFORM_END ,writeNoiseField ? noiseField->comps[component].data : NULL,writeNoiseField,printNoiseBenchmark
 #else
 #define TRANSFORM_END
 #endif
@@ -132,6 +118,9 @@ double gaussianNoisePctStdDeviation = 0.0;
  * array that will contain the data read from the FITS file.
  * @param transformFunction Name of the  function used to transform raw input data from the
  * FITS file into output data.
+ *
+ * If physical (double **) is not null, it is given a copy of the raw data as doubles, to which
+ * BSCALE and BZERO are applied once they have been read.  Requires jj (size_t) to be defined.
  */
 #define READ_AND_TRANSFORM(type,fitstype,transformFunction) { \
 	type *imageArray = (type *) malloc(sizeof(type)*info->width*info->height);\
@@ -140,19 +129,31 @@ double gaussianNoisePctStdDeviation = 0.0;
 		return 1;\
 	}\
 	\
-	fits_read_pix(fptr,fitstype,fpixel,info->width*info->height,NULL,imageArray,NULL,status);\
-	\
-	if (*status != 0) {\
-		fprintf(stderr,"Error reading frame %ld of image.\n",frame);\
+	if (readFITSPlane(fptr,fitstype,info,frame,stoke,imageArray,status) != 0) {\
+		free(imageArray);\
 		return 1;\
 	}\
-	int transformResult = transformFunction(imageArray,imageStruct->comps[0].data,transform,info->width*info->height,info->width TRANSFORM_END);\
+	PROFILE_START(transformTimer);\
+	int transformResult = transformFunction(imageArray,imageStruct->comps[component].data,transform,info->width*info->height,info->width TRANSFORM_END);\
+	PROFILE_STOP(transformTimer,PROFILE_TRANSFORM,sizeof(type)*info->width*info->height);\
+	\
+	if (transformResult == 0 && physical != NULL) {\
+		*physical = (double *) malloc(sizeof(double)*info->width*info->height);\
+		if (*physical == NULL) {\
+			fprintf(stderr,"Unable to allocate memory to keep frame %ld of image.\n",frame);\
+			free(imageArray);\
+			return 1;\
+		}\
+		for (jj=0; jj<(size_t) (info->width*info->height); jj++) {\
+			(*physical)[jj] = (double) imageArray[jj];\
+		}\
+	}\
+	free(imageArray);\
 	\
 	if (transformResult != 0) {\
 		fprintf(stderr,"Specified transform could not be performed.\n");\
 		return 1;\
 	}\
-	free(imageArray);\
 }
 
 /**
@@ -165,8 +166,10 @@ double gaussianNoisePctStdDeviation = 0.0;
  * @param name String to append to output file name.
  * @param nameLength Length of the string name.
  * @param outFileStub Start of output file name.
+ * @param output Kind of file being written, for compression benchmarking.  Requires rates (rate_account *,
+ * null if compression benchmarking is off) to be defined in the same scope.
  */
-#define ENCODE_LOSSLESSLY(image,name,nameLength,outFileStub) {\
+#define ENCODE_LOSSLESSLY(image,name,nameLength,outFileStub,output) {\
 	OPJ_CODEC_FORMAT losslessCodec = CODEC_JP2;\
 	opj_cparameters_t lossless;\
 	opj_set_default_encoder_parameters(&lossless);\
@@ -180,7 +183,7 @@ double gaussianNoisePctStdDeviation = 0.0;
 	\
 	sprintf(losslessFile,"%s_" name ".jp2",outFileStub);\
 	\
-	result = createJPEG2000Image(losslessFile,losslessCodec,&lossless,&image);\
+	result = createJPEG2000Image(losslessFile,losslessCodec,&lossless,&image,rates,output,NULL);\
 }
 
 /**
@@ -195,7 +198,111 @@ void displayHelp() {
 
 	fprintf(stdout,"-h           : display this help information \n\n");
 
-	fprintf(stdout,"-i           : FITS file to convert to JPEG 2000 (required) \n\n");
+	fprintf(stdout,"-i           : FITS file to convert to JPEG 2000 (required unless -batch or -serve is present) \n\n");
+
+	fprintf(stdout,"-batch       : convert many FITS files in one run.  Takes a directory (all .fits/.fit/.fts/.fz\n");
+	fprintf(stdout,"               files in it), a quoted glob pattern, or a list file with one FITS file per line.\n");
+	fprintf(stdout,"               The same options are used for every file and a summary table is written at the end.\n\n");
+
+	fprintf(stdout,"-serve       : run as a server, accepting conversion jobs (one JSON object per line) on the\n");
+	fprintf(stdout,"               given Unix domain socket.  Other options given with -serve apply to every job.\n");
+	fprintf(stdout,"               See serve.c for the job format.  Also accepted as --serve.  Noise can't be\n");
+	fprintf(stdout,"               added in server mode.\n\n");
+
+	fprintf(stdout,"-threads     : number of files to convert concurrently in batch or server mode, or number of\n");
+	fprintf(stdout,"               HDUs converted concurrently when -hdu is used on a single file (default 1).\n");
+	fprintf(stdout,"               Requires a reentrant build of CFITSIO.\n\n");
+
+	fprintf(stdout,"-hdu         : HDUs of a multi-extension FITS file to convert: all (every HDU containing an image)\n");
+	fprintf(stdout,"               or a comma separated list of HDU numbers and ranges, e.g. 2,4-9 (1 is the primary HDU).\n");
+	fprintf(stdout,"               The images written for HDU n are named after the FITS file followed by _HDU<n>.\n\n");
+
+	fprintf(stdout,"-readahead   : number of planes of a data cube to read (into the page cache) ahead of the plane\n");
+	fprintf(stdout,"               being encoded, by a background thread.  Helps on network file systems.  The time\n");
+	fprintf(stdout,"               spent waiting for FITS data is reported separately from the time spent computing.\n\n");
+
+	fprintf(stdout,"-read_threads: number of threads decompressing each plane of a tile-compressed (e.g. fpack)\n");
+	fprintf(stdout,"               image.  By default, the cores are shared between the files converted at once.\n");
+	fprintf(stdout,"               Requires a reentrant build of CFITSIO; otherwise planes are decompressed serially.\n\n");
+
+	fprintf(stdout,"-encode_threads: number of threads coding the code-blocks of each image (tier-1 coding).  By\n");
+	fprintf(stdout,"               default, the cores are shared between the files converted at once.  The images\n");
+	fprintf(stdout,"               written are the same for any number of threads.  Requires OpenJPEG to be built\n");
+	fprintf(stdout,"               with patches/0001-parallel-tier1.patch; otherwise code-blocks are coded serially.\n\n");
+
+	fprintf(stdout,"-verify_threads: number of threads verifying the images written (-QB, -QB_RES and the like) while\n");
+	fprintf(stdout,"               the following planes are encoded, rather than decoding each image before the next\n");
+	fprintf(stdout,"               is encoded.  Benchmarks may then be printed out of order; each row names its image.\n");
+	fprintf(stdout,"               Ignored when rate control (-deadline, -min_psnr, -target_bpp) is on.\n\n");
+
+	fprintf(stdout,"-verify_memory: limit (in MB) on the memory held by the images waiting to be verified.  Encoding\n");
+	fprintf(stdout,"               waits for verification when it is reached.  By default, %d.\n\n",VERIFY_DEFAULT_MEMORY);
+
+	fprintf(stdout,"-M_fast      : preset for -M, adding the mode switches that make the block coder fastest to\n");
+	fprintf(stdout,"               encode and decode (-M 9: bypass and vertically causal contexts), for a slightly\n");
+	fprintf(stdout,"               larger file.\n\n");
+
+	fprintf(stdout,"-deadline    : wall clock time (seconds) within which each data cube should be converted.  The\n");
+	fprintf(stdout,"               encoding parameters are adjusted between planes from the measured time per plane:\n");
+	fprintf(stdout,"               bypass mode (-M 1), 64x64 code-blocks, the 9-7 wavelet (lossy only), then fewer\n");
+	fprintf(stdout,"               resolutions (-n), in that order.  See ratecontrol.c.\n\n");
+
+	fprintf(stdout,"-min_psnr    : minimum PSNR (dB) of each plane under rate control.  Takes priority over -deadline\n");
+	fprintf(stdout,"               and -target_bpp.  Each image is decoded again to measure its PSNR.\n\n");
+
+	fprintf(stdout,"-target_bpp  : rate (bits per pixel) of each image under rate control.  The compression ratios\n");
+	fprintf(stdout,"               of the layers (-r) are scaled between planes from the measured size of each image.\n\n");
+
+	fprintf(stdout,"-throughput  : benchmark the conversion of synthetic FITS cubes, reporting Mpixels/s, MB/s, peak\n");
+	fprintf(stdout,"               memory and compression ratio for each combination of a matrix of settings, given as\n");
+	fprintf(stdout,"               key=value[,value...] items separated by semicolons, e.g.\n");
+	fprintf(stdout,"               \"bitpix=16,-32;size=2048;transform=LINEAR,LOG;rate=0,20;threads=1,4;reader=plain,rice\"\n");
+	fprintf(stdout,"               or default.  See throughput.c for every key.\n\n");
+
+	fprintf(stdout,"-microbench  : time each per-pixel kernel in isolation at L1, L2, L3 and DRAM working set sizes,\n");
+	fprintf(stdout,"               reporting ns/pixel, GB/s and bytes/cycle.  all, or a comma separated list of\n");
+	fprintf(stdout,"               transform, minmax, flip, noise and quality.\n\n");
+
+	fprintf(stdout,"-tune        : sample planes of the file given by -i and encode them with each set of parameters in\n");
+	fprintf(stdout,"               a search space, reporting CPU time to encode and decode, compression ratio and PSNR,\n");
+	fprintf(stdout,"               marking the Pareto frontier and writing the set recommended as a parameter profile.\n");
+	fprintf(stdout,"               Given as key=value[,value...] items separated by semicolons, e.g.\n");
+	fprintf(stdout,"               \"block=32,64;resolutions=4,6;mode=0,1;progression=LRCP,RPCL;goal=speed\"\n");
+	fprintf(stdout,"               or default.  See tune.c for every key.  Also accepted as --tune.\n\n");
+
+	fprintf(stdout,"-params      : load a parameter profile, given as file[:name] (the first profile in the file if\n");
+	fprintf(stdout,"               no name is given), e.g. written by -tune or -save_params.  Profiles set the\n");
+	fprintf(stdout,"               compression parameters, transform and quality benchmarks.  Options after -params\n");
+	fprintf(stdout,"               override the profile.  See params.c for the format.\n\n");
+
+	fprintf(stdout,"-save_params : save the options given as a parameter profile, given as file[:name] (named\n");
+	fprintf(stdout,"               default if no name is given).  A profile of the same name in the file is\n");
+	fprintf(stdout,"               replaced.  Without -i, -batch or -serve, nothing is converted.\n\n");
+
+	fprintf(stdout,"-j2f         : convert a JPEG 2000 image written by f2j back to FITS, given as image[:file.fits]\n");
+	fprintf(stdout,"               (IMAGE_DECODED.fits by default).  For images written with -j2f_meta, physical values\n");
+	fprintf(stdout,"               are restored and the WCS keywords recorded in the image are written, adjusted for\n");
+	fprintf(stdout,"               the region and resolution decoded.  Other images are written as their intensities.\n");
+	fprintf(stdout,"               -region decodes only the tiles covering a region, given in pixels of the full\n");
+	fprintf(stdout,"               resolution plane.\n\n");
+
+	fprintf(stdout,"-j2f_meta    : record the scaling of each plane and the WCS and other header cards in the\n");
+	fprintf(stdout,"               comment of each image written, so that -j2f can restore physical values and the\n");
+	fprintf(stdout,"               WCS.  Adds up to about 8 KB to each image (and to the sizes reported by -CB).\n\n");
+
+	fprintf(stdout,"-reduce      : number of resolution levels to discard when decoding with -j2f, each halving the\n");
+	fprintf(stdout,"               width and height of the image (default 0).\n\n");
+
+	fprintf(stdout,"-layers      : number of quality layers to decode with -j2f (default all).\n\n");
+
+	fprintf(stdout,"-decode_threads: number of threads decoding each image with -j2f.  Bands of tiles are decoded\n");
+	fprintf(stdout,"               in parallel, and the code-blocks of each tile if OpenJPEG is built with\n");
+	fprintf(stdout,"               patches/0004-parallel-tier1-decode.patch.  By default, every core is used.\n\n");
+
+	fprintf(stdout,"-profile     : report the wall clock time, CPU time and bytes processed by each stage (opening,\n");
+	fprintf(stdout,"               reading, transforming, encoding, writing, decoding and quality benchmarking) for\n");
+	fprintf(stdout,"               each image and for the whole run.  Format is json or csv, optionally followed by\n");
+	fprintf(stdout,"               :file to write to a file rather than standard output, e.g. -profile json:run.json\n\n");
 
 	fprintf(stdout,"-o           : output format (JP2 for standard JPEG 2000 or J2K for raw codestream) \n\n");
 
@@ -219,9 +326,36 @@ void displayHelp() {
 
 	fprintf(stdout,"-S2          : last stoke of data volume to convert.  Must be accompanied with -S2.\n\n");
 
+	fprintf(stdout,"-region      : convert only a region of each plane, given by the pixel coordinates of opposite\n");
+	fprintf(stdout,"               corners x0,y0,x1,y1 (starting from 1, inclusive).  Only the rows and columns\n");
+	fprintf(stdout,"               covering the region are read.  Use -suffix to keep cutouts apart from full images.\n\n");
+
+	fprintf(stdout,"-region_sky  : as -region, but corners given as world coordinates (RA/longitude,Dec/latitude in\n");
+	fprintf(stdout,"               degrees) ra0,dec0,ra1,dec1, converted to pixels using the WCS keywords in the header.\n\n");
+
+	fprintf(stdout,"-MC          : number of consecutive planes of a data cube to pack as components of each\n");
+	fprintf(stdout,"               JPEG 2000 image (default 1, at most 256).  Output files are named by the range of\n");
+	fprintf(stdout,"               frames they contain, e.g. cube_1-8.jp2.\n\n");
+
+	fprintf(stdout,"-MCT         : apply the JPEG 2000 multi-component transform to each image.  Requires -MC 3.\n\n");
+
+	fprintf(stdout,"-spectral    : transform to decorrelate the planes of each image along the spectral axis\n");
+	fprintf(stdout,"               before encoding (DPCM or DWT53 for a reversible 5-3 wavelet).  Requires -MC.\n");
+	fprintf(stdout,"               The transform is recorded in the codestream comment so it can be inverted.\n");
+	fprintf(stdout,"               DPCM predicts each plane from the original previous plane, so lossy errors\n");
+	fprintf(stdout,"               would add up along the planes: it can only be used for lossless encoding\n");
+	fprintf(stdout,"               (no -r, -q, -f, -I or rate control).  Use DWT53 for lossy encoding.\n\n");
+
+	fprintf(stdout,"-spectral_levels : number of levels of the DWT53 spectral transform (default: as many as possible)\n\n");
+
 	fprintf(stdout,"-CB          : perform compression benchmarking.  Only produces accurate results if\n");
 	fprintf(stdout,"               all planes and stokes of a data cube are converted.\n\n");
 
+	fprintf(stdout,"-CB_detail   : perform compression benchmarking (as -CB), then also display the size of each\n");
+	fprintf(stdout,"               image written (as counted by the encoder) in bits per pixel and compared to the\n");
+	fprintf(stdout,"               size of the FITS data encoded, the totals for each kind of file written (images,\n");
+	fprintf(stdout,"               -LL copies, noise fields and residuals) and for each quality layer of the images.\n\n");
+
 	fprintf(stdout,"-QB          : perform and display all quality benchmarks.  Benchmarks are calculated for each\n");
 	fprintf(stdout,"               plane.  Takes precedence over -QB_* options specifying individual tests.\n\n");
 
@@ -233,7 +367,20 @@ void displayHelp() {
 	fprintf(stdout,"-QB_MAE      : perform and display mean absolute error quality benchmark\n");
 	fprintf(stdout,"-QB_SE       : perform and display squared error sum quality benchmark\n");
 	fprintf(stdout,"-QB_AE       : perform and display absolute error sum quality benchmark\n");
-	fprintf(stdout,"-QB_SI       : perform and display uncompressed squared intensity sum quality benchmark\n\n");
+	fprintf(stdout,"-QB_SI       : perform and display uncompressed squared intensity sum quality benchmark\n");
+	fprintf(stdout,"-QB_SSIM     : perform and display structural similarity (SSIM, over 8x8 windows) quality benchmark\n");
+	fprintf(stdout,"-QB_MSSSIM   : perform and display multi-scale structural similarity (MS-SSIM) quality benchmark\n");
+	fprintf(stdout,"-QB_PHYS     : perform and display root mean squared and maximum error in the units of the FITS data,\n");
+	fprintf(stdout,"               mapping the decoded intensities back through the inverse of the transform.\n");
+	fprintf(stdout,"               SSIM, MS-SSIM and the physical errors cost more than the other benchmarks, so are not\n");
+	fprintf(stdout,"               included in -QB.\n\n");
+	fprintf(stdout,"-QB_sample   : estimate the quality benchmarks from part of each image, for quick-look monitoring,\n");
+	fprintf(stdout,"               e.g. -QB_sample reduce=2,tiles=0.1,planes=8.  reduce=n compares images decoded\n");
+	fprintf(stdout,"               with n resolution levels discarded with the planes reduced by the same wavelet.\n");
+	fprintf(stdout,"               tiles=f compares a random fraction f of the tiles of each image (seed=n varies\n");
+	fprintf(stdout,"               the choice).  planes=n only benchmarks every n-th image of a cube, then prints\n");
+	fprintf(stdout,"               estimates for the whole cube.  Estimates are printed with 95%% confidence\n");
+	fprintf(stdout,"               intervals.  reduce and tiles can't be used with -QB_RES.\n\n");
 
 #ifdef noise
 	fprintf(stdout,"               Note that if -noise is present, quality benchmarks are performed relative to the\n");
@@ -413,6 +560,23 @@ double getPctGaussianNoise() {
 }
 #endif
 
+/**
+ * Is noise added to the images converted with the given options?  The noise is drawn from random number
+ * generators shared by the whole process (see getIntegerGaussianNoise() and getPctGaussianNoise()), which
+ * can't be used from several threads at once, so images with noise must be converted one at a time.
+ *
+ * @param options Reference to the conversion options.
+ *
+ * @return true if noise is added (-noise or -noise_pct), false otherwise.
+ */
+bool isAddingNoise(const conversion_options *options) {
+#ifdef noise
+	return options->printNoiseBenchmark || gaussianNoisePctStdDeviation >= 0.0000001 || gaussianNoisePctStdDeviation <= -0.0000001;
+#else
+	return false;
+#endif
+}
+
 /**
  * Function for transforming a raw array of data from a FITS file (in the form of
  * a long long int array) into grayscale image intensities (between 0 and 2^16-1 inclusive).
@@ -1103,6 +1267,81 @@ int floatDoubleTransform(double *rawData, int *imageData, transform transform, s
 	return 1;
 }
 
+/**
+ * Find the smallest and largest values in an array of raw floating point data, for scaling data whose
+ * header has no DATAMIN/DATAMAX keywords.
+ *
+ * @param data Array to search.
+ * @param len Length of the array.  Must be at least 1.
+ * @param datamin Reference to double which will be set to the smallest value.
+ * @param datamax Reference to double which will be set to the largest value.
+ */
+void findDataRange(double *data, size_t len, double *datamin, double *datamax) {
+	// Loop variable
+	size_t ii;
+
+	// Small assumption here: that we have at least 1 pixel - does not seem unreasonable!
+	double max = data[0];
+	double min = data[0];
+
+	// Search through array to find max/min values.
+	for (ii=1; ii<len; ii++) {
+		if (data[ii] > max) {
+			max = data[ii];
+		}
+
+		if (data[ii] < min) {
+			min = data[ii];
+		}
+	}
+
+	*datamin = min;
+	*datamax = max;
+}
+
+/**
+ * Names of the transforms, in the order of the transform enumerated type.
+ */
+static const char *transformNames[] = {"LOG","NEGATIVE_LOG","LINEAR","NEGATIVE_LINEAR","RAW","NEGATIVE_RAW","SQRT","NEGATIVE_SQRT",
+		"SQUARED","NEGATIVE_SQUARED","POWER","NEGATIVE_POWER","DEFAULT"};
+
+/**
+ * Get the name of a transform, as given to -A.
+ *
+ * @param transform Transform to name.
+ *
+ * @return Name of the transform.
+ */
+const char *getTransformName(transform transform) {
+	if (transform < LOG || transform > DEFAULT) {
+		return "UNKNOWN";
+	}
+
+	return transformNames[transform];
+}
+
+/**
+ * Find the transform with a given name (ignoring case), as given to -A.
+ *
+ * @param name Name of the transform.
+ * @param value Reference to transform which will be set if the name is recognised.
+ *
+ * @return 0 if the name was recognised, 1 otherwise.
+ */
+int parseTransform(const char *name, transform *value) {
+	// Loop variable
+	int ii;
+
+	for (ii=LOG; ii<=DEFAULT; ii++) {
+		if (strcasecmp(name,transformNames[ii]) == 0) {
+			*value = (transform) ii;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 /**
  * Function to open a FITS data file, check that it is a valid data cube that this program
  * may interpret and record some basic information about it.
@@ -1130,9 +1369,8 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
 	// Loop variables
 	int ii;
 
-	// Declare variables used for reading FITS files using CFITSIO.
-	int naxis; // Number of dimensions of image
-	int bitpix; // Type of image
+	// Number of dimensions of image
+	int naxis;
 
 	// Open specified file for read only access.
 	fits_open_file(fptr,ffname, READONLY, status);
@@ -1142,16 +1380,87 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
 		return 1;
 	}
 
-	// Get image type.
-	fits_get_img_type(*fptr,&bitpix,status);
 	// Get number of dimensions.
 	fits_get_img_dim(*fptr,&naxis,status);
 
+	if (*status != 0) {
+		fprintf(stderr,"Unable to get dimensions of FITS file: %s\n",ffname);
+		return 1;
+	}
+
+	// Tile-compressed files (e.g. written by fpack) have an empty primary HDU, with the image stored
+	// in a later HDU.  If the primary HDU has no data, move to the first HDU containing an image.
+	if (naxis == 0) {
+		int numHDUs;
+		int hduType;
+
+		fits_get_num_hdus(*fptr,&numHDUs,status);
+
+		for (ii=2; ii<=numHDUs && *status == 0; ii++) {
+			fits_movabs_hdu(*fptr,ii,&hduType,status);
+
+			if (*status == 0 && hduType == IMAGE_HDU) {
+				fits_get_img_dim(*fptr,&naxis,status);
+
+				if (naxis != 0) {
+					break;
+				}
+			}
+		}
+
+		if (*status != 0) {
+			fprintf(stderr,"Unable to find an image in FITS file: %s\n",ffname);
+			return 1;
+		}
+	}
+
+	return getImageInfo(*fptr,ffname,info,status);
+}
+
+/**
+ * Check that the current HDU of an open FITS file contains a valid data cube that this program may
+ * interpret and record some basic information about it.
+ *
+ * @param fptr Pointer to a fitsfile structure, positioned at the HDU to examine.
+ * @param ffname Name of the FITS file, used in error messages.
+ * @param info Data structure which will be populated with information about the data cube.
+ * @param status Reference to status variable used by CFITSIO.  Must have been initialised to
+ * 0 by the time that this function is called.
+ *
+ * @return 0 if the read was successful or 1 otherwise.
+ */
+int getImageInfo(fitsfile *fptr, char *ffname, cube_info *info, int *status) {
+	// Check parameters.
+	if (fptr == NULL || ffname == NULL || info == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to getImageInfo cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variables
+	int ii;
+
+	// Declare variables used for reading FITS files using CFITSIO.
+	int naxis; // Number of dimensions of image
+	int bitpix; // Type of image
+
+	// Get image type.
+	fits_get_img_type(fptr,&bitpix,status);
+	// Get number of dimensions.
+	fits_get_img_dim(fptr,&naxis,status);
+
 	if (*status != 0) {
 		fprintf(stderr,"Unable to get image type or dimensions of FITS file: %s\n",ffname);
 		return 1;
 	}
 
+	// Record where the image is and how it is stored.
+	fits_get_hdu_num(fptr,&info->hdu);
+	info->compressed = fits_is_compressed_image(fptr,status);
+	info->reader = NULL;
+	info->prefetcher = NULL;
+	info->readSeconds = 0.0;
+	info->headerCards = NULL;
+
 	if (naxis<2) {
 		fprintf(stderr,"Image must have at least 2 dimensions.\n");
 		return 1;
@@ -1169,7 +1478,7 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
 		return 1;
 	}
 
-	fits_get_img_size(*fptr,naxis,naxes,status);
+	fits_get_img_size(fptr,naxis,naxes,status);
 
 	if (*status != 0) {
 		fprintf(stderr,"Unable to get image resolution of FITS file: %s\n",ffname);
@@ -1177,9 +1486,13 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
 		return 1;
 	}
 
-	// Record image dimensions.
+	// Record image dimensions.  The whole of each plane is read unless a region is applied later.
 	info->width = naxes[0];
 	info->height = naxes[1];
+	info->planeWidth = naxes[0];
+	info->planeHeight = naxes[1];
+	info->x0 = 0;
+	info->y0 = 0;
 
 	// Check if we are dealing with a three (or greater) dimensional image.
 	// We can deal with 2 (planar images), 3 (data cubes) or 4 (data cubes with
@@ -1211,7 +1524,7 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
 	int nkeys;
 
 	// Get number of keywords
-	fits_get_hdrspace(*fptr,&nkeys,NULL,status);
+	fits_get_hdrspace(fptr,&nkeys,NULL,status);
 	if (*status != 0) {
 		fprintf(stderr,"Unable to get the number of header keywords in FITS file: %s\n",ffname);
 		return 1;
@@ -1223,7 +1536,7 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
 	char keycomment[FLEN_CARD];
 
 	for (ii=1; ii<=nkeys; ii++) {
-		fits_read_keyn(*fptr,ii,keyname,keyvalue,keycomment,status);
+		fits_read_keyn(fptr,ii,keyname,keyvalue,keycomment,status);
 
 		if (*status != 0) {
 			fprintf(stderr,"Error reading keyword number %d.\n",ii);
@@ -1245,18 +1558,26 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
  * @param transform transform to be performed on raw data from FITS file to create grayscale image intensities
  * for our output image.  See f2j.h for possible values.
  * @param imageStruct Reference to an image structure.  This function will populate most of the data values,
- * however, memory must have been assigned for the image data array (in the first component) by the time
+ * however, memory must have been assigned for the image data array (in the specified component) by the time
  * that this function is called.
  * @param frame Plane of data to read for a 3D data cube.  Must be a valid frame number from 1 to [total number
  * of frames] inclusive.  Arbitrary for a 2D image.
  * @param stoke Stoke of data to read for a 4D data volume.  Must be a valid stoke number from 1 to [total number
  * of stokes] inclusive.  Arbitrary for 2D/3D images.
+ * @param component Index of the image component (and noise field component) that the plane is written to.  Must
+ * be between 0 and imageStruct->numcomps-1 inclusive.  Several planes of a data cube may be packed into the
+ * components of one image.
  * @param info Pointer to a cube_info structure containing data on the image being read.
+ * @param scaling Reference to a plane_scaling structure which will be populated with the transform and scaling used
+ * for this plane, to be recorded with the image.  May be null.
+ * @param physical Reference to a pointer which will be given the physical values of the plane (after any noise
+ * added to raw values), in the order read, for quality benchmarking in physical units.  The array must be freed
+ * by the caller.  Ignored if null or if scaling is null.
  * @param status Pointer to CFITSIO status integer.  The value must have been initialised to 0 by the time
  * that this function is called.
  * @param noiseField Reference to an image structure for the image noise field.  Will be ignored if writeNoiseField
  * is false.  This function will populate most of the data values, however, memory must have been assigned for the
- * image data array (in the first component) by the time that this function is called.  This parameter will disappear
+ * image data array (in the specified component) by the time that this function is called.  This parameter will disappear
  * if the definition of noise is removed from f2j.h.
  * @param writeNoiseField Should the noise field added to this image be written to a JPEG 2000 image?  This parameter will
  * disappear if the definition of noise is removed from f2j.h.
@@ -1265,7 +1586,8 @@ int getFITSInfo(char *ffname, fitsfile **fptr, cube_info *info, int *status) {
  *
  * @return 0 if there were no errors, 1 otherwise.
  */
-int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageStruct, long frame, long stoke, cube_info *info, int *status
+int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageStruct, long frame, long stoke, int component, cube_info *info,
+		plane_scaling *scaling, double **physical, int *status
 #ifdef noise
 		, opj_image_t *noiseField, bool writeNoiseField, bool printNoiseBenchmark
 #endif
@@ -1276,8 +1598,17 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 		return 1;
 	}
 
-	// Loop variables.
-	int ii;
+	if (component < 0 || component >= imageStruct->numcomps) {
+		fprintf(stderr,"Specified component must be between 0 and %d.\n",imageStruct->numcomps-1);
+		return 1;
+	}
+
+	// The BSCALE and BZERO of raw integer data are only read when the scaling is recorded.
+	if (scaling == NULL) {
+		physical = NULL;
+	}
+
+	// Loop variable.
 	size_t jj;
 
 	// Check we have a valid frame if we are dealing with a data cube.  If we are dealing with a 2D FITS file,
@@ -1301,18 +1632,18 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 	imageStruct->icc_profile_buf = NULL;
 	imageStruct->icc_profile_len = 0;
 
-	// Write basic information about the single image component.
-	imageStruct->comps[0].bpp = 16; // Create a 16 bit grayscale image.
-	imageStruct->comps[0].prec = 16;
-	imageStruct->comps[0].dx = 1;
-	imageStruct->comps[0].dy = 1;
-	imageStruct->comps[0].factor = 0;
-	imageStruct->comps[0].resno_decoded = 0;
-	imageStruct->comps[0].w = info->width;
-	imageStruct->comps[0].h = info->height;
-	imageStruct->comps[0].sgnd = 0;
-	imageStruct->comps[0].x0 = 0;
-	imageStruct->comps[0].y0 = 0;
+	// Write basic information about the image component this plane is written to.
+	imageStruct->comps[component].bpp = 16; // Create a 16 bit grayscale image.
+	imageStruct->comps[component].prec = 16;
+	imageStruct->comps[component].dx = 1;
+	imageStruct->comps[component].dy = 1;
+	imageStruct->comps[component].factor = 0;
+	imageStruct->comps[component].resno_decoded = 0;
+	imageStruct->comps[component].w = info->width;
+	imageStruct->comps[component].h = info->height;
+	imageStruct->comps[component].sgnd = 0;
+	imageStruct->comps[component].x0 = 0;
+	imageStruct->comps[component].y0 = 0;
 
 #ifdef noise
 	if (writeNoiseField) {
@@ -1325,43 +1656,21 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 		noiseField->icc_profile_buf = NULL;
 		noiseField->icc_profile_len = 0;
 
-		// Write basic information about the single noise field image component.
-		noiseField->comps[0].bpp = 16; // Create a 16 bit grayscale image.
-		noiseField->comps[0].prec = 16;
-		noiseField->comps[0].dx = 1;
-		noiseField->comps[0].dy = 1;
-		noiseField->comps[0].factor = 0;
-		noiseField->comps[0].resno_decoded = 0;
-		noiseField->comps[0].w = info->width;
-		noiseField->comps[0].h = info->height;
-		noiseField->comps[0].sgnd = 1; // Use a signed image so we can use the noise values.
-		noiseField->comps[0].x0 = 0;
-		noiseField->comps[0].y0 = 0;
+		// Write basic information about the noise field image component this plane is written to.
+		noiseField->comps[component].bpp = 16; // Create a 16 bit grayscale image.
+		noiseField->comps[component].prec = 16;
+		noiseField->comps[component].dx = 1;
+		noiseField->comps[component].dy = 1;
+		noiseField->comps[component].factor = 0;
+		noiseField->comps[component].resno_decoded = 0;
+		noiseField->comps[component].w = info->width;
+		noiseField->comps[component].h = info->height;
+		noiseField->comps[component].sgnd = 1; // Use a signed image so we can use the noise values.
+		noiseField->comps[component].x0 = 0;
+		noiseField->comps[component].y0 = 0;
 	}
 #endif
 
-	// Create array used by CFITSIO to specify starting pixel to read from.
-	long fpixel[info->naxis];
-
-	// Start from the upper left corner of the image.
-	fpixel[0] = 1;
-	fpixel[1] = 1;
-
-	// We need entries 2+ only if we are dealing with an image of > 2 dimensions.
-	if (info->naxis>2) {
-		fpixel[2] = frame;
-
-		if (info->naxis>3) {
-			fpixel[3] = stoke;
-
-			// For any dimension > 4, the width if always 1 if we are dealing with
-			// a valid FITS file for this program.
-			for (ii=4; ii<info->naxis; ii++) {
-				fpixel[ii] = 1;
-			}
-		}
-	}
-
 #ifdef noise
 	// Print information on the current plane & stoke being read.
 	if (printNoiseBenchmark) {
@@ -1384,17 +1693,17 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 
 		// Turn off scaling for this data stream if using raw data scales.
 		if (transform == RAW || transform == NEGATIVE_RAW) {
-			fits_set_bscale(fptr,1.0,0.0,status);
+			setRawScaling(fptr,info,status);
 		}
 
 		// We're only dealing with 8 bit data, so encode an 8 bit grayscale image.
-		imageStruct->comps[0].bpp = 8;
-		imageStruct->comps[0].prec = 8;
+		imageStruct->comps[component].bpp = 8;
+		imageStruct->comps[component].prec = 8;
 
 #ifdef noise
 		if (writeNoiseField) {
-			noiseField->comps[0].bpp = 8;
-			noiseField->comps[0].prec = 8;
+			noiseField->comps[component].bpp = 8;
+			noiseField->comps[component].prec = 8;
 		}
 
 		// Define image maximum intensity for noise simulation PSNR calculations.
@@ -1413,7 +1722,7 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 
 		// Turn off scaling for this data stream if using raw data scales.
 		if (transform == RAW || transform == NEGATIVE_RAW) {
-			fits_set_bscale(fptr,1.0,0.0,status);
+			setRawScaling(fptr,info,status);
 		}
 
 #ifdef noise
@@ -1436,7 +1745,7 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 		getIntegerGaussianNoise(NULL,&max,NULL);
 #endif
 
-		READ_AND_TRANSFORM(int,TLONG,intImgTransform);
+		READ_AND_TRANSFORM(int,TINT,intImgTransform);
 	}
 	// 64 bit signed integer case
 	else if (info->bitpix == LONGLONG_IMG) {
@@ -1482,29 +1791,20 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 			return 1;
 		}
 
-		fits_read_pix(fptr,TDOUBLE,fpixel,info->width*info->height,NULL,imageArray,NULL,status);
-
-		if (*status != 0) {
-			fprintf(stderr,"Error reading frame %ld of image.\n",frame);
+		if (readFITSPlane(fptr,TDOUBLE,info,frame,stoke,imageArray,status) != 0) {
+			free(imageArray);
 			return 1;
 		}
 
-		// Need to find min/max values if they weren't defined in the header.
+		// Need to find min/max values if they weren't defined in the header.  If only a region of the
+		// plane is read, these are the values within the region.
 		if (findMinMax) {
-			// Small assumption here: that we have at least 1 pixel - does not seem unreasonable!
-			datamax = imageArray[0];
-			datamin = imageArray[0];
-
-			// Search through array to find max/min values.
-			for (jj=1; jj<info->width*info->height; jj++) {
-				if (imageArray[jj] > datamax) {
-					datamax = imageArray[jj];
-				}
+			findDataRange(imageArray,info->width*info->height,&datamin,&datamax);
+		}
 
-				if (imageArray[jj] < datamin) {
-					datamin = imageArray[jj];
-				}
-			}
+		if (scaling != NULL) {
+			scaling->datamin = datamin;
+			scaling->datamax = datamax;
 		}
 
 #ifdef noise
@@ -1513,18 +1813,26 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 		getIntegerGaussianNoise(NULL,&max,NULL);
 #endif
 
-		int transformResult = floatDoubleTransform(imageArray,imageStruct->comps[0].data,transform,info->width*info->height,datamin,datamax,info->width
+		PROFILE_START(transformTimer);
+		int transformResult = floatDoubleTransform(imageArray,imageStruct->comps[component].data,transform,info->width*info->height,datamin,datamax,info->width
 #ifdef noise
-				,writeNoiseField ? noiseField->comps[0].data : NULL,writeNoiseField,printNoiseBenchmark
+				,writeNoiseField ? noiseField->comps[component].data : NULL,writeNoiseField,printNoiseBenchmark
 #endif
 				);
+		PROFILE_STOP(transformTimer,PROFILE_TRANSFORM,sizeof(double)*info->width*info->height);
+
+		// Keep the values read if they are to be compared with the decoded image.
+		if (transformResult == 0 && physical != NULL) {
+			*physical = imageArray;
+		}
+		else {
+			free(imageArray);
+		}
 
 		if (transformResult != 0) {
 			fprintf(stderr,"Specified transform could not be performed.\n");
 			return 1;
 		}
-
-		free(imageArray);
 	}
 	// Signed char (8 bit integer) case
 	else if (info->bitpix == SBYTE_IMG) {
@@ -1534,17 +1842,17 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 
 		// Turn off scaling for this data stream if using raw data scales.
 		if (transform == RAW || transform == NEGATIVE_RAW) {
-			fits_set_bscale(fptr,1.0,0.0,status);
+			setRawScaling(fptr,info,status);
 		}
 
 		// We're only dealing with 8 bit data, so encode an 8 bit grayscale image.
-		imageStruct->comps[0].bpp = 8;
-		imageStruct->comps[0].prec = 8;
+		imageStruct->comps[component].bpp = 8;
+		imageStruct->comps[component].prec = 8;
 
 #ifdef noise
 		if (writeNoiseField) {
-			noiseField->comps[0].bpp = 8;
-			noiseField->comps[0].prec = 8;
+			noiseField->comps[component].bpp = 8;
+			noiseField->comps[component].prec = 8;
 		}
 
 		// Define image maximum intensity for noise simulation PSNR calculations.
@@ -1562,7 +1870,7 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 
 		// Turn off scaling for this data stream if using raw data scales.
 		if (transform == RAW || transform == NEGATIVE_RAW) {
-			fits_set_bscale(fptr,1.0,0.0,status);
+			setRawScaling(fptr,info,status);
 		}
 
 #ifdef noise
@@ -1585,13 +1893,47 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
 		getIntegerGaussianNoise(NULL,&max,NULL);
 #endif
 
-		READ_AND_TRANSFORM(unsigned int,TULONG,uIntImgTransform);
+		READ_AND_TRANSFORM(unsigned int,TUINT,uIntImgTransform);
 	}
 	else {
 		fprintf(stderr,"Unsupported FITS image type: %d\n",info->bitpix);
 		return 1;
 	}
 
+	// Record how the plane was scaled.  Raw integer values are read without BSCALE/BZERO scaling, so the
+	// keywords are needed to recover physical values.
+	if (scaling != NULL) {
+		scaling->transform = transform;
+		scaling->bitpix = info->bitpix;
+
+		if (info->bitpix != FLOAT_IMG && info->bitpix != DOUBLE_IMG) {
+			int keyStatus = 0;
+
+			scaling->datamin = 0.0;
+			scaling->datamax = 0.0;
+
+			if (fits_read_key(fptr,TDOUBLE,"BSCALE",&scaling->bscale,NULL,&keyStatus) != 0) {
+				scaling->bscale = 1.0;
+				keyStatus = 0;
+			}
+
+			if (fits_read_key(fptr,TDOUBLE,"BZERO",&scaling->bzero,NULL,&keyStatus) != 0) {
+				scaling->bzero = 0.0;
+			}
+
+			// Raw values were read without scaling.
+			if (physical != NULL && (scaling->bscale != 1.0 || scaling->bzero != 0.0)) {
+				for (jj=0; jj<(size_t) (info->width*info->height); jj++) {
+					(*physical)[jj] = scaling->bscale * (*physical)[jj] + scaling->bzero;
+				}
+			}
+		}
+		else {
+			scaling->bscale = 1.0;
+			scaling->bzero = 0.0;
+		}
+	}
+
 	return 0;
 }
 
@@ -1607,15 +1949,26 @@ int createImageFromFITS(fitsfile *fptr, transform transform, opj_image_t *imageS
  * for legal values.
  * @param parameters compression parameters to use.
  * @param frame image to compress.
+ * @param rates Reference to rate_account structure to which the size of the image is added, taken from the byte
+ * counts of the encoder.  May be null if compression benchmarking is off.
+ * @param output Kind of file being written, for the accounting in rates.
+ * @param encoded Reference to memory_stream structure which is given the contents of the file written, so that it
+ * can be decoded without reading the file back.  The data must be freed by the caller.  May be null if the contents
+ * aren't wanted.
  *
  * @return 0 if compression was successful, 1 otherwise.
  */
-int createJPEG2000Image(char *outfile, OPJ_CODEC_FORMAT codec, opj_cparameters_t *parameters, opj_image_t *frame) {
+int createJPEG2000Image(char *outfile, OPJ_CODEC_FORMAT codec, opj_cparameters_t *parameters, opj_image_t *frame, rate_account *rates,
+		rate_output output, memory_stream *encoded) {
 	if (outfile == NULL || parameters == NULL || frame == NULL) {
 		fprintf(stderr,"Parameters to createJPEG2000Image cannot be null.\n");
 		return 1;
 	}
 
+	if (encoded != NULL) {
+		memset(encoded,0,sizeof(memory_stream));
+	}
+
 	// Write compressed image to file.  This code is based on that in image_to_j2k.c in the
 	// OpenJPEG library.
 
@@ -1647,11 +2000,15 @@ int createJPEG2000Image(char *outfile, OPJ_CODEC_FORMAT codec, opj_cparameters_t
 	// Was compression successful?
 	opj_bool compSuccess;
 
-	// Codestream information (needed for JPIP)
+	// Codestream information (needed for JPIP, and to split the size of the image by quality layer).  OpenJPEG
+	// only fills in the layer thresholds of the index when rate allocation is used, so it isn't built for -f.
 	opj_codestream_info_t cstr_info;
+	bool indexed = (codec == CODEC_JP2 && parameters->jpip_on) || (rates != NULL && !parameters->cp_fixed_alloc);
 
 	// Perform compression and check if it was successful
-	if (codec == CODEC_JP2 && parameters->jpip_on) {
+	PROFILE_START(encodeTimer);
+
+	if (indexed) {
 		// See if we need to encode JPIP index information.
 		compSuccess = opj_encode_with_info(cinfo,cio,frame,&cstr_info);
 	}
@@ -1671,7 +2028,10 @@ int createJPEG2000Image(char *outfile, OPJ_CODEC_FORMAT codec, opj_cparameters_t
 	// Get length of codestream.
 	int codestream_length = cio_tell(cio);
 
+	PROFILE_STOP(encodeTimer,PROFILE_ENCODE,codestream_length);
+
 	// Open FILE handle.
+	PROFILE_START(writeTimer);
 	f = fopen(outfile,writePermissions);
 
 	// Check that file was opened successfully.
@@ -1679,7 +2039,7 @@ int createJPEG2000Image(char *outfile, OPJ_CODEC_FORMAT codec, opj_cparameters_t
 		fprintf(stderr,"Unable to open output file: %s for writing.\n",outfile);
 		opj_cio_close(cio);
 		opj_destroy_compress(cinfo);
-		if (codec == CODEC_JP2 && parameters->jpip_on) {
+		if (indexed) {
 			opj_destroy_cstr_info(&cstr_info);
 		}
 		return 1;
@@ -1691,12 +2051,25 @@ int createJPEG2000Image(char *outfile, OPJ_CODEC_FORMAT codec, opj_cparameters_t
 	// Close file handle.
 	fclose(f);
 
+	PROFILE_STOP(writeTimer,PROFILE_WRITE,codestream_length);
+
+	// Account for the image written.
+	countEncodedRate(rates,output,frame,parameters,indexed ? &cstr_info : NULL,codestream_length);
+
+	// Keep the codestream rather than let opj_cio_close free it.  It was allocated with opj_malloc, which is malloc.
+	if (encoded != NULL) {
+		encoded->data = cio->buffer;
+		encoded->length = codestream_length;
+		encoded->offset = 0;
+		cio->buffer = NULL;
+	}
+
 	// Close the IO stream.
 	opj_cio_close(cio);
 
 	// Free compression structures.
 	opj_destroy_compress(cinfo);
-	if (codec == CODEC_JP2 && parameters->jpip_on) {
+	if (indexed) {
 		opj_destroy_cstr_info(&cstr_info);
 	}
 
@@ -1704,109 +2077,322 @@ int createJPEG2000Image(char *outfile, OPJ_CODEC_FORMAT codec, opj_cparameters_t
 }
 
 /**
- * Function to read a frame from a FITS data cube, create a grayscale image from it, then encode it as a JPEG 2000
- * image using lossy or lossless compression.
+ * Get a buffer for one image component, reusing a buffer from a pool if one is available.
  *
- * The image is compressed using the parameters defined in parameters.  If writeUncompressed is true, a losslessly
- * compressed image will also be created.  If the parameters information passed to the function also describes lossless
- * compression, the two images will be the same, making the duplicate image redundant.  It is the responsibility of
- * client code to check this.
+ * @param pool Pool of buffers to take from.  If null, a new buffer is always allocated.  If the buffers
+ * in the pool are a different length, they are freed and the pool switches to the new length.
+ * @param length Number of pixels in the buffer.
  *
- * This function performs basic checking that the parameters are not null, but in general, it is up to the client
- * code to ensure that parameters are valid and meaningful.
- *
- * @param info Reference to cube_info structure containing information on the data cube.
- * @param fptr Pointer to a fitsfile structure.  Assumed to be initialised by this point.
- * @param transform transform to perform when converting frame to image.
- * @param frameNumber Number of frame in 3D data cube.  Arbitrary for 2D images.
- * @param stokeNumber Number of stoke in 4D data volume.  Arbitrary for 2D/3D images.
- * @param status Reference to status integer for CFITSIO.  Assumed to be initialised to 0 by this point.
- * @param outFileStub File name stub for JPEG 2000 image to be written.  Files will be STUB.jp2/j2k and STUB_LOSSLESS.jp2
- * (if writeUncompressed is true).
- * @param writeUncompressed Should a copy of the image be encoded using lossless compression.  May want to
- * do this to compare lossless VS lossy compression on an image.
- * @param parameters Compression parameters.
- * @param qualityBenchmarkParameters Reference to quality_benchmark_info structure specifying which, if any, quality
- * benchmarks to be performed.  Results will be printed to stdout.
- * @param compressionBenchmark Should compression benchmarking be performed?  If this is the case, the program will add the
- * compressed file size to the size_t value pointed to by fileSize.
- * @param fileSize Pointer to a off_t assumed to hold the cumulative total of the file sizes of the frames compressed so far.
- * Assumed to be initialised to 0 before the first frame is read.  This enables the compression of the full set of JPEG 2000
- * files corresponding to a datacube to be compared to the entire datacube.
- * @param writeNoiseField Should the noise field for the image be written to a lossless JPEG 2000 file?  This parameter will
- * disappear if the definition of noise is removed from f2j.h.
- * @param printNoiseBenchmark Should information on the actual PSNR achieved by adding noise to the image be displayed
- * to the user?  This parameter will disappear if the definition of noise is removed from f2j.h.
+ * @return reference to the buffer, or null if memory could not be allocated.
+ */
+int *getPlaneBuffer(plane_buffer_pool *pool, size_t length) {
+	if (pool != NULL) {
+		if (pool->length != length) {
+			freePlaneBufferPool(pool);
+			pool->length = length;
+		}
+
+		if (pool->count > 0) {
+			pool->count--;
+			return pool->buffers[pool->count];
+		}
+	}
+
+	return (int *) malloc(sizeof(int)*length);
+}
+
+/**
+ * Return a buffer obtained from getPlaneBuffer to a pool so that it can be reused.
  *
- * @return 0 if all operations were successful, 1 otherwise.
+ * @param pool Pool of buffers to return the buffer to.  If null, the buffer is freed.
+ * @param buffer Buffer to return.  May be null, in which case nothing is done.
+ * @param length Number of pixels in the buffer.  If this differs from the length of the buffers in the
+ * pool, the buffer is freed.
  */
-int setupCompression(cube_info *info, fitsfile *fptr, transform transform, long frameNumber, long stokeNumber, int *status, char *outFileStub,
-		bool writeUncompressed, opj_cparameters_t *parameters, quality_benchmark_info *qualityBenchmarkParameters, bool compressionBenchmark, off_t *fileSize
-#ifdef noise
-		, bool writeNoiseField, bool printNoiseBenchmark
-#endif
-		) {
-	// Check parameters
-	if (info == NULL || fptr == NULL || status == NULL || outFileStub == NULL || parameters == NULL || fileSize == NULL) {
-		fprintf(stderr,"Parameters to setupCompression cannot be null.\n");
-		return 1;
+void releasePlaneBuffer(plane_buffer_pool *pool, int *buffer, size_t length) {
+	if (buffer == NULL) {
+		return;
 	}
 
-	// Loop variables
-	int ii;
+	if (pool == NULL || pool->length != length) {
+		free(buffer);
+		return;
+	}
 
-	// Initialise an OpenJPEG image structure with a single component with data storage
-	// initialised to the width and height of the image.
+	// Grow the pool if necessary.
+	if (pool->count == pool->capacity) {
+		int capacity = pool->capacity == 0 ? 8 : 2*pool->capacity;
+		int **buffers = (int **) realloc(pool->buffers,sizeof(int *)*capacity);
 
-	// Create frame structure.
-	opj_image_t frame;
-	frame.comps = (opj_image_comp_t *) malloc(sizeof(opj_image_comp_t));
+		if (buffers == NULL) {
+			free(buffer);
+			return;
+		}
 
-	if (frame.comps == NULL) {
-		fprintf(stderr,"Unable to allocate memory for component array for frame %ld of FITS file.\n",frameNumber);
-		return 1;
+		pool->buffers = buffers;
+		pool->capacity = capacity;
 	}
 
-	frame.numcomps = 1;
-
-	// Create component structure.
-	frame.comps[0].data = (int *) malloc(sizeof(int)*info->width*info->height);
+	pool->buffers[pool->count] = buffer;
+	pool->count++;
+}
 
-	if (frame.comps[0].data == NULL) {
-		fprintf(stderr,"Unable to allocate memory for component data for frame %ld of FITS file.\n",frameNumber);
-		free(frame.comps);
-		return 1;
+/**
+ * Free all the buffers held by a pool.  The pool may still be used afterwards.
+ *
+ * @param pool Pool of buffers to free.
+ */
+void freePlaneBufferPool(plane_buffer_pool *pool) {
+	if (pool == NULL) {
+		return;
 	}
 
-#ifdef noise
-	// Create noise field image structure.
-	opj_image_t noiseField;
+	int ii;
 
-	if (writeNoiseField) {
-		noiseField.comps = (opj_image_comp_t *) malloc(sizeof(opj_image_comp_t));
+	for (ii=0; ii<pool->count; ii++) {
+		free(pool->buffers[ii]);
+	}
 
-		if (noiseField.comps == NULL) {
-			fprintf(stderr,"Unable to allocate memory for component array for noise field of frame %ld of FITS file.\n",frameNumber);
-			for (ii=0; ii<frame.numcomps; ii++) {
-				free(frame.comps[ii].data);
-			}
-			free(frame.comps);
-			return 1;
-		}
+	free(pool->buffers);
+	pool->buffers = NULL;
+	pool->count = 0;
+	pool->capacity = 0;
+}
 
-		noiseField.numcomps = 1;
+/**
+ * Release the data of every component of an image back to a pool and free the component array.
+ *
+ * @param image Image whose components should be released.  Components without data are skipped.
+ * @param pool Pool of buffers to return component data to.  If null, component data is freed.
+ * @param length Number of pixels in each component.
+ */
+static void releaseImageComponents(opj_image_t *image, plane_buffer_pool *pool, size_t length) {
+	int ii;
 
-		noiseField.comps[0].data = (int *) malloc(sizeof(int)*info->width*info->height);
+	for (ii=0; ii<image->numcomps; ii++) {
+		releasePlaneBuffer(pool,image->comps[ii].data,length);
+	}
 
-		if (noiseField.comps[0].data == NULL) {
-			fprintf(stderr,"Unable to allocate memory for component data for noise field of frame %ld of FITS file.\n",frameNumber);
-			free(noiseField.comps);
-			for (ii=0; ii<frame.numcomps; ii++) {
-				free(frame.comps[ii].data);
-			}
-			free(frame.comps);
+	free(image->comps);
+}
+
+/**
+ * Create the comment written to the codestream of an image, recording what is needed to convert it back to FITS
+ * (see j2f.c).  The comment is made of lines: the spectral transform performed (if any), then, if metadata is
+ * recorded (-j2f_meta), one line per component giving the plane it holds and how the plane was scaled and the
+ * header cards of the data cube, then the comment given by the user (if any).  For example:
+ *
+ *   F2J SPECTRAL=DPCM LEVELS=1 PREC=16 SGND=0
+ *   F2J PLANE=5 STOKE=1 TRANSFORM=LINEAR BITPIX=-32 DATAMIN=-0.25 DATAMAX=3.5 BSCALE=1 BZERO=0
+ *   F2J CARD=CTYPE1  = 'RA---SIN'
+ *
+ * @param info Reference to cube_info structure describing the data cube.
+ * @param frameNumber Frame of the plane in the first component.
+ * @param stokeNumber Stoke of the planes in the image.
+ * @param scalings Scaling of the plane in each component.
+ * @param numcomps Number of components in the image.
+ * @param spectral Transform performed along the spectral axis.  SPECTRAL_NONE if none was.
+ * @param spectralLevels Number of levels of the spectral transform performed.
+ * @param prec Precision of the planes before any spectral transform.
+ * @param sgnd Were the planes signed before any spectral transform?
+ * @param userComment Comment given by the user.  May be null.
+ * @param metadata Should the scaling of each plane and the header cards be recorded?
+ *
+ * @return The comment, which should be freed by the caller, or null if memory couldn't be allocated or the comment
+ * is longer than COMMENT_MAX_LENGTH (and so can't be written to the codestream).
+ */
+static char *createImageComment(cube_info *info, long frameNumber, long stokeNumber, plane_scaling *scalings, int numcomps,
+		spectral_transform spectral, int spectralLevels, int prec, int sgnd, const char *userComment, bool metadata) {
+	// Loop variables
+	int ii;
+	size_t kk;
+
+	if (!metadata) {
+		numcomps = 0;
+	}
+
+	// Each plane's line is at most about 200 characters.  Cards are written with a prefix of 9 characters.
+	size_t cardsLength = metadata && info->headerCards != NULL ? strlen(info->headerCards) : 0;
+	size_t cardLines = 0;
+
+	for (kk=0; kk<cardsLength; kk++) {
+		cardLines += info->headerCards[kk] == '\n';
+	}
+
+	size_t length = 100 + 256 * (size_t) numcomps + cardsLength + 10 * (cardLines + 1) + (userComment != NULL ? strlen(userComment) : 0);
+	char *comment = (char *) malloc(length);
+
+	if (comment == NULL) {
+		fprintf(stderr,"Unable to allocate memory for the comment of an image.\n");
+		return NULL;
+	}
+
+	char *end = comment;
+	*end = '\0';
+
+	if (spectral != SPECTRAL_NONE) {
+		end += sprintf(end,"F2J SPECTRAL=%s LEVELS=%d PREC=%d SGND=%d\n",getSpectralTransformName(spectral),spectralLevels,prec,sgnd);
+	}
+
+	for (ii=0; ii<numcomps; ii++) {
+		end += sprintf(end,"F2J PLANE=%ld STOKE=%ld TRANSFORM=%s BITPIX=%d DATAMIN=%.17g DATAMAX=%.17g BSCALE=%.17g BZERO=%.17g\n",
+				info->naxis > 2 ? frameNumber+ii : 1,info->naxis > 3 ? stokeNumber : 1,getTransformName(scalings[ii].transform),
+				scalings[ii].bitpix,scalings[ii].datamin,scalings[ii].datamax,scalings[ii].bscale,scalings[ii].bzero);
+	}
+
+	if (metadata && info->headerCards != NULL) {
+		const char *card = info->headerCards;
+
+		while (*card != '\0') {
+			const char *next = strchr(card,'\n');
+			size_t cardLength = next != NULL ? (size_t) (next-card) : strlen(card);
+
+			end += sprintf(end,"F2J CARD=%.*s\n",(int) cardLength,card);
+			card += cardLength + (next != NULL);
+		}
+	}
+
+	if (userComment != NULL) {
+		strcpy(end,userComment);
+	}
+	else if (end > comment) {
+		// Drop the newline ending the last line.
+		end[-1] = '\0';
+	}
+
+	if (strlen(comment) > COMMENT_MAX_LENGTH) {
+		fprintf(stderr,"The comment of an image (%zu characters with %d planes) can't be longer than %d characters.  Pack fewer planes into each image (option -MC) or shorten the comment (option -C).\n",
+				strlen(comment),numcomps,COMMENT_MAX_LENGTH);
+		free(comment);
+		return NULL;
+	}
+
+	return comment;
+}
+
+/**
+ * Function to read a frame from a FITS data cube, create a grayscale image from it, then encode it as a JPEG 2000
+ * image using lossy or lossless compression.
+ *
+ * The image is compressed using the parameters defined in parameters.  If writeUncompressed is true, a losslessly
+ * compressed image will also be created.  If the parameters information passed to the function also describes lossless
+ * compression, the two images will be the same, making the duplicate image redundant.  It is the responsibility of
+ * client code to check this.
+ *
+ * This function performs basic checking that the parameters are not null, but in general, it is up to the client
+ * code to ensure that parameters are valid and meaningful.
+ *
+ * @param info Reference to cube_info structure containing information on the data cube.
+ * @param fptr Pointer to a fitsfile structure.  Assumed to be initialised by this point.
+ * @param transform transform to perform when converting frame to image.
+ * @param frameNumber Number of frame in 3D data cube.  Arbitrary for 2D images.  If several planes are packed into the
+ * image, this is the first of them.
+ * @param stokeNumber Number of stoke in 4D data volume.  Arbitrary for 2D/3D images.
+ * @param numPlanes Number of consecutive planes (starting at frameNumber) to pack as components of the image.  Must be
+ * 1 for 2D images.
+ * @param status Reference to status integer for CFITSIO.  Assumed to be initialised to 0 by this point.
+ * @param outFileStub File name stub for JPEG 2000 image to be written.  Files will be STUB.jp2/j2k and STUB_LOSSLESS.jp2
+ * (if writeUncompressed is true).
+ * @param writeUncompressed Should a copy of the image be encoded using lossless compression.  May want to
+ * do this to compare lossless VS lossy compression on an image.
+ * @param parameters Compression parameters.
+ * @param cubeParameters Reference to cube_encoding_info structure specifying any transform to be performed along the
+ * spectral axis on the planes packed into the image.
+ * @param qualityBenchmarkParameters Reference to quality_benchmark_info structure specifying which, if any, quality
+ * benchmarks to be performed.  Results will be printed to stdout.
+ * @param compressionBenchmark Should compression benchmarking be performed?  If this is the case, the size of each file
+ * written (as counted by the encoder) is added to the rate_account structure pointed to by totalRates.
+ * @param totalRates Reference to a rate_account structure holding the sizes of the files written for a data cube so
+ * far, so that the full set of JPEG 2000 files corresponding to a data cube can be compared to the entire data cube.
+ * @param pool Pool from which component buffers are taken and to which they are returned, so that they can be
+ * reused for the next image.  May be null, in which case buffers are allocated and freed for every image.
+ * @param imageResult Reference to an image_result structure which will be populated with information on the image
+ * written (its name, size, encoding time and any quality benchmarks) if all operations are successful.  May be null.
+ * @param verifier Reference to quality_verifier structure to which the image is handed for quality benchmarking, so that
+ * its quality benchmarks are only complete once the verifier has finished.  May be null, in which case the image is
+ * benchmarked before returning.
+ * @param writeNoiseField Should the noise field for the image be written to a lossless JPEG 2000 file?  This parameter will
+ * disappear if the definition of noise is removed from f2j.h.
+ * @param printNoiseBenchmark Should information on the actual PSNR achieved by adding noise to the image be displayed
+ * to the user?  This parameter will disappear if the definition of noise is removed from f2j.h.
+ *
+ * @return 0 if all operations were successful, 1 otherwise.
+ */
+int setupCompression(cube_info *info, fitsfile *fptr, transform transform, long frameNumber, long stokeNumber, long numPlanes, int *status, char *outFileStub,
+		bool writeUncompressed, opj_cparameters_t *parameters, cube_encoding_info *cubeParameters, quality_benchmark_info *qualityBenchmarkParameters,
+		bool compressionBenchmark, rate_account *totalRates, plane_buffer_pool *pool, image_result *imageResult, quality_verifier *verifier
+#ifdef noise
+		, bool writeNoiseField, bool printNoiseBenchmark
+#endif
+		) {
+	// Check parameters
+	if (info == NULL || fptr == NULL || status == NULL || outFileStub == NULL || parameters == NULL || cubeParameters == NULL || totalRates == NULL) {
+		fprintf(stderr,"Parameters to setupCompression cannot be null.\n");
+		return 1;
+	}
+
+	if (numPlanes < 1 || (info->naxis > 2 && frameNumber+numPlanes-1 > info->depth) || (info->naxis == 2 && numPlanes != 1)) {
+		fprintf(stderr,"Invalid number of planes (%ld) to pack into image starting at frame %ld.\n",numPlanes,frameNumber);
+		return 1;
+	}
+
+	// Loop variables
+	int ii;
+
+	// Number of pixels in each component.
+	size_t planeLength = info->width*info->height;
+
+	// Initialise an OpenJPEG image structure with one component per plane with data storage
+	// initialised to the width and height of the image.  The component array is zeroed so that
+	// the clean up code below can safely free component data that was never allocated.
+
+	// Create frame structure.
+	opj_image_t frame;
+	frame.comps = (opj_image_comp_t *) calloc(numPlanes,sizeof(opj_image_comp_t));
+
+	if (frame.comps == NULL) {
+		fprintf(stderr,"Unable to allocate memory for component array for frame %ld of FITS file.\n",frameNumber);
+		return 1;
+	}
+
+	frame.numcomps = numPlanes;
+
+	// Create component structures.
+	for (ii=0; ii<frame.numcomps; ii++) {
+		frame.comps[ii].data = getPlaneBuffer(pool,planeLength);
+
+		if (frame.comps[ii].data == NULL) {
+			fprintf(stderr,"Unable to allocate memory for component data for frame %ld of FITS file.\n",frameNumber+ii);
+			releaseImageComponents(&frame,pool,planeLength);
+			return 1;
+		}
+	}
+
+#ifdef noise
+	// Create noise field image structure.
+	opj_image_t noiseField;
+
+	if (writeNoiseField) {
+		noiseField.comps = (opj_image_comp_t *) calloc(numPlanes,sizeof(opj_image_comp_t));
+
+		if (noiseField.comps == NULL) {
+			fprintf(stderr,"Unable to allocate memory for component array for noise field of frame %ld of FITS file.\n",frameNumber);
+			releaseImageComponents(&frame,pool,planeLength);
 			return 1;
 		}
+
+		noiseField.numcomps = numPlanes;
+
+		for (ii=0; ii<noiseField.numcomps; ii++) {
+			noiseField.comps[ii].data = getPlaneBuffer(pool,planeLength);
+
+			if (noiseField.comps[ii].data == NULL) {
+				fprintf(stderr,"Unable to allocate memory for component data for noise field of frame %ld of FITS file.\n",frameNumber+ii);
+				releaseImageComponents(&noiseField,pool,planeLength);
+				releaseImageComponents(&frame,pool,planeLength);
+				return 1;
+			}
+		}
 	}
 #endif
 
@@ -1814,73 +2400,96 @@ int setupCompression(cube_info *info, fitsfile *fptr, transform transform, long
 	// they will be set in createImageFromFITS.  We don't want to get into the minutae of writing
 	// image data at this point.
 
-	// Create image
-	int result = createImageFromFITS(fptr,transform,&frame,frameNumber,stokeNumber,info,status
+	// Keep the planes read if the error is to be measured in physical units.
+	physical_plane *physical = NULL;
+
+	if (qualityBenchmarkParameters->physicalError) {
+		physical = (physical_plane *) calloc(numPlanes,sizeof(physical_plane));
+
+		if (physical == NULL) {
+			fprintf(stderr,"Unable to allocate memory to keep frame %ld of FITS file.\n",frameNumber);
 #ifdef noise
-			,&noiseField,writeNoiseField,printNoiseBenchmark
+			if (writeNoiseField) {
+				releaseImageComponents(&noiseField,pool,planeLength);
+			}
 #endif
-	);
+			releaseImageComponents(&frame,pool,planeLength);
+			return 1;
+		}
+	}
+
+	// Create image, reading each plane into its own component.  The scaling of each plane is recorded with the image.
+	int result = 0;
+	plane_scaling scalings[numPlanes];
+
+	for (ii=0; ii<frame.numcomps && result == 0; ii++) {
+		result = createImageFromFITS(fptr,transform,&frame,frameNumber+ii,stokeNumber,ii,info,&scalings[ii],physical != NULL ? &physical[ii].values : NULL,status
+#ifdef noise
+				,&noiseField,writeNoiseField,printNoiseBenchmark
+#endif
+		);
+	}
 
 	if (result != 0) {
-		fprintf(stderr,"Unable to create image from frame %ld of FITS file.\n",frameNumber);
+		fprintf(stderr,"Unable to create image from frame %ld of FITS file.\n",frameNumber+ii-1);
 #ifdef noise
 		if (writeNoiseField) {
-			for (ii=0; ii<noiseField.numcomps; ii++) {
-				free(noiseField.comps[ii].data);
-			}
-			free(noiseField.comps);
+			releaseImageComponents(&noiseField,pool,planeLength);
 		}
 #endif
+		freePhysicalPlanes(physical,numPlanes);
+		releaseImageComponents(&frame,pool,planeLength);
+		return 1;
+	}
+
+	if (physical != NULL) {
 		for (ii=0; ii<frame.numcomps; ii++) {
-			free(frame.comps[ii].data);
+			physical[ii].scaling = scalings[ii];
 		}
-		free(frame.comps);
-		return 1;
 	}
 
 	size_t stublen = strlen(outFileStub);
 
+	// Sizes of the files written for this image, if compression benchmarking is on.
+	rate_account imageRates;
+	rate_account *rates = NULL;
+
+	if (compressionBenchmark) {
+		memset(&imageRates,0,sizeof(rate_account));
+		rates = &imageRates;
+	}
+
 	if (writeUncompressed) {
-		ENCODE_LOSSLESSLY(frame,"LOSSLESS",8,outFileStub);
+		ENCODE_LOSSLESSLY(frame,"LOSSLESS",8,outFileStub,RATE_LOSSLESS);
 
 		// Exit unsuccessfully if compression unsuccessful.
 		if (result != 0) {
 			fprintf(stderr,"Unable to compress frame %ld of FITS file.\n",frameNumber);
 #ifdef noise
 			if (writeNoiseField) {
-				for (ii=0; ii<noiseField.numcomps; ii++) {
-					free(noiseField.comps[ii].data);
-				}
-				free(noiseField.comps);
+				releaseImageComponents(&noiseField,pool,planeLength);
 			}
 #endif
-			for (ii=0; ii<frame.numcomps; ii++) {
-				free(frame.comps[ii].data);
-			}
-			free(frame.comps);
+			freePhysicalPlanes(physical,numPlanes);
+			releaseImageComponents(&frame,pool,planeLength);
 			return 1;
 		}
 	}
 
 #ifdef noise
 	if (writeNoiseField) {
-		ENCODE_LOSSLESSLY(noiseField,"NOISEFIELD",10,outFileStub);
+		ENCODE_LOSSLESSLY(noiseField,"NOISEFIELD",10,outFileStub,RATE_NOISE_FIELD);
 
 		// Exit unsuccessfully if compression unsuccessful.
 		if (result != 0) {
 			fprintf(stderr,"Unable to compress noise field for frame %ld of FITS file.\n",frameNumber);
 
 			if (writeNoiseField) {
-				for (ii=0; ii<noiseField.numcomps; ii++) {
-					free(noiseField.comps[ii].data);
-				}
-				free(noiseField.comps);
+				releaseImageComponents(&noiseField,pool,planeLength);
 			}
 
-			for (ii=0; ii<frame.numcomps; ii++) {
-				free(frame.comps[ii].data);
-			}
-			free(frame.comps);
+			freePhysicalPlanes(physical,numPlanes);
+			releaseImageComponents(&frame,pool,planeLength);
 			return 1;
 		}
 	}
@@ -1899,249 +2508,513 @@ int setupCompression(cube_info *info, fitsfile *fptr, transform transform, long
 		sprintf(compressedFile,"%s.j2k",outFileStub);
 	}
 
+	// The multi-component transform can only be applied to images with exactly 3 components.  The last
+	// image of a data cube may contain fewer planes than the others, so check each image individually.
+	opj_cparameters_t imageParameters = *parameters;
+
+	if (frame.numcomps != 3) {
+		imageParameters.tcp_mct = 0;
+	}
+
+	// Decorrelate the planes along the spectral axis.  This is done after any lossless copy and noise field
+	// have been written, so that those files hold the planes themselves.
+	bool spectral = cubeParameters->spectralTransform != SPECTRAL_NONE && frame.numcomps > 1;
+	int planePrec = frame.comps[0].prec;
+	int planeSgnd = frame.comps[0].sgnd;
+
+	if (spectral) {
+		result = spectralForwardTransform(&frame,cubeParameters->spectralTransform,cubeParameters->spectralLevels);
+
+		if (result != 0) {
+			fprintf(stderr,"Unable to perform spectral transform on frame %ld of FITS file.\n",frameNumber);
+#ifdef noise
+			if (writeNoiseField) {
+				releaseImageComponents(&noiseField,pool,planeLength);
+			}
+#endif
+			freePhysicalPlanes(physical,numPlanes);
+			releaseImageComponents(&frame,pool,planeLength);
+			return 1;
+		}
+	}
+
+	// Record the spectral transform and, if asked to (-j2f_meta), the scaling of each plane and the header cards in the
+	// codestream comment, so that the image can be converted back to FITS.  Otherwise the user's comment is written.
+	char *imageComment = NULL;
+
+	if (spectral || cubeParameters->recordMetadata) {
+		imageComment = createImageComment(info,frameNumber,stokeNumber,scalings,frame.numcomps,
+				spectral ? cubeParameters->spectralTransform : SPECTRAL_NONE,getSpectralLevels(frame.numcomps,cubeParameters->spectralLevels),
+				planePrec,planeSgnd,parameters->cp_comment,cubeParameters->recordMetadata);
+	}
+
+	if ((spectral || cubeParameters->recordMetadata) && imageComment == NULL) {
+		fprintf(stderr,"Unable to create the comment of frame %ld of FITS file.\n",frameNumber);
+#ifdef noise
+		if (writeNoiseField) {
+			releaseImageComponents(&noiseField,pool,planeLength);
+		}
+#endif
+		freePhysicalPlanes(physical,numPlanes);
+		releaseImageComponents(&frame,pool,planeLength);
+		return 1;
+	}
+
+	if (imageComment != NULL) {
+		imageParameters.cp_comment = imageComment;
+	}
+
+	// Keep the codestream if it is to be decoded for quality benchmarks, so that the file isn't read back.
+	bool decodeQuality = qualityBenchmarkParameters->performQualityBenchmarking || qualityBenchmarkParameters->calculate ||
+		qualityBenchmarkParameters->writeResidual;
+	memory_stream encoded;
+
 	// Perform JPEG 2000 compression.
-	result = createJPEG2000Image(compressedFile,parameters->cod_format,parameters,&frame);
+	double encodeStart = getWallClockTime();
+	result = createJPEG2000Image(compressedFile,imageParameters.cod_format,&imageParameters,&frame,rates,RATE_IMAGE,decodeQuality ? &encoded : NULL);
+	double encodeSeconds = getWallClockTime() - encodeStart;
+
+	// Recover the original planes, so that quality benchmarks compare against them.
+	if (spectral) {
+		spectralInverseTransform(&frame,cubeParameters->spectralTransform,cubeParameters->spectralLevels,planePrec,planeSgnd);
+	}
+
+	free(imageComment);
 
 	// Exit unsuccessfully if compression unsuccessful.
 	if (result != 0) {
 		fprintf(stderr,"Unable to compress frame %ld of FITS file.\n",frameNumber);
 #ifdef noise
 		if (writeNoiseField) {
-			for (ii=0; ii<noiseField.numcomps; ii++) {
-				free(noiseField.comps[ii].data);
-			}
-			free(noiseField.comps);
+			releaseImageComponents(&noiseField,pool,planeLength);
 		}
 #endif
-		for (ii=0; ii<frame.numcomps; ii++) {
-			free(frame.comps[ii].data);
-		}
-		free(frame.comps);
+		freePhysicalPlanes(physical,numPlanes);
+		releaseImageComponents(&frame,pool,planeLength);
 		return 1;
 	}
 
-	if (qualityBenchmarkParameters->performQualityBenchmarking || qualityBenchmarkParameters->writeResidual) {
-		// Perform quality benchmarking.  Currently we specify no benchmarking options (NULL).
-		performQualityBenchmarking(&frame,compressedFile,qualityBenchmarkParameters,parameters->cod_format);
+	// Quality benchmarks for each component, if they are to be recorded.
+	quality_benchmark_result *quality = NULL;
+	int numcomps = frame.numcomps;
+
+	if (decodeQuality) {
+		if (imageResult != NULL && (qualityBenchmarkParameters->performQualityBenchmarking || qualityBenchmarkParameters->calculate)) {
+			quality = (quality_benchmark_result *) calloc(frame.numcomps,sizeof(quality_benchmark_result));
+		}
+
+		// Hand the planes and the codestream to the verifier if there is one, otherwise perform quality benchmarking now.
+		if (verifier == NULL || submitVerification(verifier,&frame,planeLength,&physical,&encoded,compressedFile,parameters->cod_format,quality,pool) != 0) {
+			performQualityBenchmarking(&frame,compressedFile,&encoded,qualityBenchmarkParameters,parameters->cod_format,cubeParameters,physical,quality,rates);
+			free(encoded.data);
+		}
 	}
 
+	freePhysicalPlanes(physical,numcomps);
+
 #ifdef noise
 	if (writeNoiseField) {
-		for (ii=0; ii<noiseField.numcomps; ii++) {
-			free(noiseField.comps[ii].data);
-		}
-		free(noiseField.comps);
+		releaseImageComponents(&noiseField,pool,planeLength);
 	}
 #endif
-	for (ii=0; ii<frame.numcomps; ii++) {
-		free(frame.comps[ii].data);
-	}
-	free(frame.comps);
+	releaseImageComponents(&frame,pool,planeLength);
 
 	if (compressionBenchmark) {
-		// Get compressed file size using stat.
-		struct stat fileInfo;
+		setRawPayload(&imageRates,info->bitpix);
+		addRateAccount(totalRates,&imageRates);
+	}
 
-		int gotSize = stat(compressedFile,&fileInfo);
+	if (imageResult != NULL) {
+		imageResult->file = strdup(compressedFile);
 
-		if (gotSize != 0) {
-			fprintf(stdout,"Unable to get size of file %s\n",compressedFile);
+		if (compressionBenchmark) {
+			imageResult->rate = imageRates.outputs[RATE_IMAGE];
+		}
+		else {
+			memset(&imageResult->rate,0,sizeof(rate_counter));
 		}
 
-		*fileSize += fileInfo.st_size;
+		imageResult->seconds = encodeSeconds;
+		imageResult->numcomps = numcomps;
+		imageResult->quality = quality;
 	}
 
+	finishProfiledImage(compressedFile);
+
 	return 0;
 }
 
 /**
- * Main function run from the command line.
+ * Macro used by convertFITSImage to make sure there is space to record information on the next image
+ * written, if image information is being recorded.  Requires result (conversion_result *),
+ * imageResultsCapacity (long), info (cube_info *), verifier (quality_verifier *), pool
+ * (plane_buffer_pool *) and summary (quality_summary) to be defined in the same scope.  Returns 1 from the calling function if
+ * memory can't be allocated.
  */
-int main(int argc, char *argv[]) {
-	// Transform (if any) to perform on raw data.  This is the default value.  May be changed
-	// when parsing user input from the command line.
-	transform transform = DEFAULT;
+#define RESERVE_IMAGE_RESULT() {\
+	if (result->recordImages && result->images == imageResultsCapacity) {\
+		long capacity = imageResultsCapacity == 0 ? 16 : 2*imageResultsCapacity;\
+		image_result *imageResults = (image_result *) realloc(result->imageResults,sizeof(image_result)*capacity);\
+		\
+		if (imageResults == NULL) {\
+			fprintf(stderr,"Unable to allocate memory to record information on images.\n");\
+			finishQualityVerifier(verifier,pool,NULL,0);\
+			pthread_mutex_destroy(&summary.mutex);\
+			stopPrefetcher(info);\
+			destroyParallelReader(info);\
+			freeHeaderCards(info);\
+			return 1;\
+		}\
+		\
+		result->imageResults = imageResults;\
+		imageResultsCapacity = capacity;\
+	}\
+}
 
-	// Should a lossless version of image be written?  By default, no.  May be changed
-	// when parsing user input from the command line.
-	bool writeUncompressed = false;
+/**
+ * Macro used by convertFITSImage to choose the parameters for the next image when rate control is on.  Requires
+ * rateControl (bool), controller (rate_controller), imageParameters (opj_cparameters_t *), controlledParameters
+ * (opj_cparameters_t), imageResult (image_result *), controlResult (image_result) and result (conversion_result *)
+ * to be defined in the same scope.
+ */
+#define START_RATE_CONTROLLED_IMAGE() {\
+	imageResult = result->recordImages ? &result->imageResults[result->images] : NULL;\
+	\
+	if (rateControl) {\
+		getRateControlledParameters(&controller,&controlledParameters);\
+		imageParameters = &controlledParameters;\
+		\
+		if (imageResult == NULL) {\
+			imageResult = &controlResult;\
+		}\
+	}\
+}
 
-	// Information on what quality benchmarks to perform.  By default, no tests performed.  May be
-	// changed when parsing user input from the command line.
-	quality_benchmark_info qualityBenchmarkParameters;
+/**
+ * Macro used by convertFITSImage to update rate control once an image has been written.  Requires the same
+ * variables as START_RATE_CONTROLLED_IMAGE.
+ */
+#define FINISH_RATE_CONTROLLED_IMAGE() {\
+	if (rateControl) {\
+		updateRateControl(&controller,imageResult);\
+		\
+		if (imageResult == &controlResult) {\
+			free(controlResult.file);\
+			free(controlResult.quality);\
+		}\
+	}\
+}
+
+/**
+ * Find the extension of a FITS file name, which is replaced in the names of the images written.  The
+ * extension of a compressed file (e.g. .fits.fz or .fits.gz) includes both parts.
+ *
+ * @param name FITS file name.
+ *
+ * @return Pointer to the dot starting the extension, or null if the name has no extension.
+ */
+static char *findFITSExtension(char *name) {
+	char *dotPosition = strrchr(name,'.');
+
+	if (dotPosition != NULL && (strcmp(dotPosition,".fz") == 0 || strcmp(dotPosition,".gz") == 0)) {
+		// Look for a dot before this one, in the same path component.
+		*dotPosition = '\0';
+		char *innerDotPosition = strrchr(name,'.');
+		*dotPosition = '.';
+
+		if (innerDotPosition != NULL && strchr(innerDotPosition,'/') == NULL) {
+			dotPosition = innerDotPosition;
+		}
+	}
 
-	// Should compression rate benchmarking be performed on compress images?  By default no.  May be
-	// changed when parsing user input from the command line.
-	bool performCompressionBenchmarking = false;
+	return dotPosition;
+}
 
-	// Size of compressed file(s).  Used to compare compression rate relative to FITS.
-	off_t compressedFileSize = 0;
+/**
+ * Set conversion options to their default values, as used when no command line parameters are given.
+ *
+ * @param options Reference to conversion_options structure to initialise.
+ */
+void setDefaultConversionOptions(conversion_options *options) {
+	// Transform (if any) to perform on raw data.
+	options->transform = DEFAULT;
 
-	// Structure to hold compression parameters.
-	opj_cparameters_t parameters;
+	// Should a lossless version of image be written?  By default, no.
+	options->writeUncompressed = false;
 
-	// Initialise to default values.
-	opj_set_default_encoder_parameters(&parameters);
+	// Information on what quality benchmarks to perform.  By default, no tests performed.
+	memset(&options->qualityBenchmarkParameters,0,sizeof(quality_benchmark_info));
 
-	// Start frame - first frame of 3D data cube to read.  Ignored for 2D images.
-	long startFrame = -1;
+	// Should compression rate benchmarking be performed on compress images?  By default no.
+	options->compressionBenchmark = false;
 
-	// End frame - last frame of 3D data cube to read.  Ignored for 2D images.
-	long endFrame = -1;
+	// Adaptive rate control.  By default off.
+	memset(&options->rateControl,0,sizeof(rate_control_info));
 
-	// Start stoke - first stoke of 4D data volume to read.  Ignored for 2D/3D images.
-	long startStoke = -1;
+	// How planes of a data cube are grouped into images.  By default, one plane per image.
+	options->cubeParameters.planesPerImage = 1;
+	options->cubeParameters.multiComponentTransform = false;
+	options->cubeParameters.spectralTransform = SPECTRAL_NONE;
+	options->cubeParameters.spectralLevels = 0;
+	options->cubeParameters.recordMetadata = false;
 
-	// End stoke - last stoke of 4D data volume to read.  Ignored for 2D/3D images.
-	long endStoke = -1;
+	// Region of each plane to convert.  By default, the whole plane.
+	options->region.type = REGION_NONE;
 
-#ifdef noise
-	// Seed for random number generator.
-	unsigned long seed = 0;
+	// Number of threads decompressing each plane of a tile-compressed image.  By default, chosen automatically.
+	options->readThreads = 0;
 
-	// Has a RNG seed been set?
-	bool seedSet = false;
+	// Number of threads coding the code-blocks of each image.  By default, chosen automatically.
+	options->encodeThreads = 0;
 
-	// PSNR of image (in DB) after noise has been added.
-	double noiseDB = 0.0;
+	// HDUs of a multi-extension file to convert.  By default, only the first HDU containing an image,
+	// converted by one thread.
+	options->hdus.all = false;
+	options->hdus.count = 0;
+	options->hduThreads = 1;
 
-	// Has PSNR of image (after noise has been added) been set?
-	bool noiseSet = false;
+	// Number of planes of a data cube to read ahead.  By default, none.
+	options->readahead = 0;
+
+	// Threads verifying images while the next planes are encoded.  By default, none: each image is verified
+	// before the next is encoded.
+	options->verifyThreads = 0;
+	options->verifyMemory = VERIFY_DEFAULT_MEMORY;
 
+	// Initialise compression parameters to default values.
+	opj_set_default_encoder_parameters(&options->parameters);
+
+	// First and last frames of 3D data cube to read.  Ignored for 2D images.
+	options->startFrame = -1;
+	options->endFrame = -1;
+
+	// First and last stokes of 4D data volume to read.  Ignored for 2D/3D images.
+	options->startStoke = -1;
+	options->endStoke = -1;
+
+#ifdef noise
 	// Should the noise field added to the image be written to a file?
-	bool writeNoiseField = false;
+	options->writeNoiseField = false;
 
 	// Should information on the actual PSNR achieved after adding noise be displayed?
-	bool printNoiseBenchmark = false;
+	options->printNoiseBenchmark = false;
 #endif
+}
 
-	// Parse command line parameters.
-	int result = parse_cmdline_encoder(argc,argv,&parameters,&transform,&writeUncompressed,&startFrame,&endFrame,
-			&qualityBenchmarkParameters,&performCompressionBenchmarking,&startStoke,&endStoke
-#ifdef noise
-			,&noiseDB,&noiseSet,&seed,&seedSet,&gaussianNoisePctStdDeviation,&writeNoiseField
-#endif
-	);
+/**
+ * Get the name from which the names of the images written for a FITS file (or one HDU of it) are built:
+ * the name of the FITS file without its extension, followed by _HDU[n] if an HDU is given.
+ *
+ * @param ffname FITS file name.
+ * @param hdu Number of the HDU being converted (1 for the primary HDU), or 0 to leave it out of the name.
+ * @param baseName String which will be populated with the name.  Must have room for strlen(ffname) + 32
+ * characters.
+ */
+void getOutputBaseName(char *ffname, int hdu, char *baseName) {
+	strcpy(baseName,ffname);
 
-#ifdef noise
-	// Initialise getIntegerGaussianNoise() function.
-	if (noiseSet) {
-		// Set noise.
-		getIntegerGaussianNoise(&noiseDB,NULL,NULL);
+	// Get the start of the extension
+	char *dotPosition = findFITSExtension(baseName);
 
-		// Print information on the PSNR of the image after adding noise.
-		printNoiseBenchmark = true;
+	// Terminate the string at this point.
+	if (dotPosition != NULL) {
+		*dotPosition = '\0';
+	}
 
-		if (seedSet) {
-			// Set seed.
-			getIntegerGaussianNoise(NULL,NULL,&seed);
-		}
+	if (hdu > 0) {
+		sprintf(baseName + strlen(baseName),"_HDU%d",hdu);
 	}
-#endif
+}
 
-	if (result != 0) {
-		fprintf(stderr,"Error parsing command parameters.\n");
-		displayHelp();
+/**
+ * Convert the image in the current HDU of an open FITS file to JPEG 2000 image(s).  Each plane (or group of
+ * planes, see cube_encoding_info) in the requested range of frames and stokes is written to its own image.
+ *
+ * @param ffname Name of the FITS file, used in error messages.
+ * @param baseName Name from which the names of the images are built (see getOutputBaseName).
+ * @param fptr Pointer to a fitsfile structure, positioned at the HDU to convert.  Not closed by this function.
+ * @param info Reference to cube_info structure describing the image in the HDU.  A region is applied to it
+ * if one is requested.
+ * @param options Reference to conversion_options structure specifying how the image should be converted.
+ * @param pool Pool of component buffers to reuse between images.  May be null.
+ * @param result Reference to conversion_result structure which will be populated with the number and size
+ * of the images written (and information on each image, if recordImages is true).
+ *
+ * @return 0 if the image was converted successfully, 1 otherwise.
+ */
+int convertFITSImage(char *ffname, char *baseName, fitsfile *fptr, cube_info *info, conversion_options *options, plane_buffer_pool *pool, conversion_result *result) {
+	if (ffname == NULL || baseName == NULL || fptr == NULL || info == NULL || options == NULL || result == NULL) {
+		fprintf(stderr,"Parameters to convertFITSImage cannot be null.\n");
+		return 1;
 	}
 
-	// image_to_j2k.c sets this to 1 if the image to be encoded has 3 components, or 0
-	// otherwise.  We always set it to 0, as we are always encoding 1 component (grayscale)
-	// images.
-	parameters.tcp_mct = 0;
+	result->images = 0;
+	memset(&result->rate,0,sizeof(rate_account));
+	result->readSeconds = 0.0;
+	result->imageResults = NULL;
 
-	// FITS file to read.
-	char *ffname = parameters.infile;
+	info->readSeconds = 0.0;
+
+	// Size of the imageResults array.
+	long imageResultsCapacity = 0;
 
-	// Declare variables for reading FITS files needed by CFITSIO.
-	fitsfile *fptr;
+	// Short names for the options used most often.
+	opj_cparameters_t *parameters = &options->parameters;
+	cube_encoding_info *cubeParameters = &options->cubeParameters;
+
+	// CFITSIO status.
 	int status = 0;
 
 	// Loop variables
 	long ii,jj;
 
-	// Information on the data cube
-	cube_info info;
+	// Result of compressing each image.
+	int conversionResult;
 
-	// Read basic information on FITS file.
-	result = getFITSInfo(ffname,&fptr,&info,&status);
+	// Adjust the compression parameters between images if rate control is on.  Rate control needs the size of
+	// each image, and its PSNR if a minimum is given, whether or not they are to be reported.
+	bool rateControl = isRateControlOn(&options->rateControl);
+	bool compressionBenchmark = options->compressionBenchmark || rateControl;
+	quality_benchmark_info qualityParameters = options->qualityBenchmarkParameters;
+	rate_controller controller;
+	opj_cparameters_t controlledParameters;
+	opj_cparameters_t *imageParameters = parameters;
+	image_result controlResult;
+	image_result *imageResult;
 
-	// Display error if FITS file could not be opened.
-	if (result != 0) {
-		fprintf(stderr,"FITS file %s cannot be opened or is invalid.\n",ffname);
-		fits_close_file(fptr,&status);
-		exit(EXIT_FAILURE);
+	if (rateControl && options->rateControl.minPSNR > 0.0) {
+		qualityParameters.calculate = true;
 	}
 
-	// Input file length
-	size_t ilen = strlen(ffname);
-	size_t slen = strlen(parameters.outfile);
+	// If only every n-th image is benchmarked (-QB_sample planes=n), the others are written without benchmarks or
+	// residual images, and the benchmarks of the images sampled are summarised once the cube is converted.
+	long samplePlanes = qualityParameters.sampling.planes > 1 ? qualityParameters.sampling.planes : 1;
+	quality_benchmark_info unsampledParameters = qualityParameters;
+	quality_summary summary;
 
-	// Read each frame of the FITS file and compress it to JPEG 2000.
-	// 2 dimensional image case
-	if (info.naxis == 2) {
-		// Output file will be input file name (minus FITS extension) + .JP2/J2K.
-		// An additional 10 characters is sufficient for the additional data.
-		// We also add a user specified suffix if it is available.
-		size_t oflen = ilen + 10 + slen;
+	memset(&summary,0,sizeof(quality_summary));
 
-		char intermediate[oflen];
-		char outFileStub[oflen];
+	if (samplePlanes > 1) {
+		qualityParameters.summary = &summary;
+	}
 
-		// Copy input file name to intermediary string.
-		strcpy(intermediate,ffname);
+	unsampledParameters.performQualityBenchmarking = false;
+	unsampledParameters.physicalError = false;
+	unsampledParameters.writeResidual = false;
+	unsampledParameters.summary = NULL;
 
-		// Get the last dot
-		char *dotPosition = strrchr(intermediate,'.');
+	// Restrict reading to the requested region of each plane, if any.
+	if (applyRegion(fptr,info,&options->region,&status) != 0) {
+		fprintf(stderr,"Unable to apply region to FITS file %s.\n",ffname);
+		return 1;
+	}
 
-		// Terminate the string at this point.
-		*dotPosition = '\0';
+	// Read the header cards recorded in each image (-j2f_meta), which describe the region read.
+	if (cubeParameters->recordMetadata && readHeaderCards(fptr,info,&status) != 0) {
+		fprintf(stderr,"Unable to read the header of FITS file %s.\n",ffname);
+		return 1;
+	}
+
+	// Only initialised once the file is set up, as every return from here on destroys it.
+	pthread_mutex_init(&summary.mutex,NULL);
 
-		sprintf(outFileStub,"%s%s",intermediate,parameters.outfile);
+	// Verify the images on threads of their own while the following planes are encoded, if asked to.  Rate control
+	// needs the quality of each image before choosing the parameters of the next, so it verifies images inline.
+	quality_verifier *verifier = NULL;
+
+	if (options->verifyThreads > 0 && !rateControl && (qualityParameters.performQualityBenchmarking || qualityParameters.calculate ||
+			qualityParameters.writeResidual)) {
+		verifier = startQualityVerifier(&qualityParameters,cubeParameters,compressionBenchmark,options->verifyThreads,options->verifyMemory);
+	}
+
+	// Decompress the planes of a tile-compressed image using several threads, if possible.
+	createParallelReader(fptr,info,options->readThreads > 0 ? options->readThreads : getAutomaticReadThreads(1),&status);
+
+#ifdef OPJ_HAVE_TIER1_THREADS
+	// Code the code-blocks of each image using several threads, sharing the cores as for reading.  The options
+	// are shared with other files, so the number of threads is set in a copy.
+	opj_cparameters_t threadedParameters = *parameters;
+	threadedParameters.tier1_threads = options->encodeThreads > 0 ? options->encodeThreads : getAutomaticReadThreads(1);
+	parameters = &threadedParameters;
+	imageParameters = parameters;
+#endif
+
+	// Output file names are built from the base name.  An additional 50 characters is sufficient for the
+	// additional data.  We also add a user specified suffix if it is available.
+	size_t oflen = strlen(baseName) + 50 + strlen(parameters->outfile);
+	char outFileStub[oflen];
+
+	// Read each frame of the FITS file and compress it to JPEG 2000.
+	// 2 dimensional image case
+	if (info->naxis == 2) {
+		// Output file will be input file name (minus FITS extension) + .JP2/J2K.
+		sprintf(outFileStub,"%s%s",baseName,parameters->outfile);
 
 		// Setup and perform compression.
-		result = setupCompression(&info,fptr,transform,1,1,&status,outFileStub,writeUncompressed,
-				&parameters,&qualityBenchmarkParameters,performCompressionBenchmarking,&compressedFileSize
+		RESERVE_IMAGE_RESULT();
+
+		if (rateControl) {
+			startRateControl(&controller,&options->rateControl,parameters,(unsigned long long) info->width*info->height);
+		}
+
+		START_RATE_CONTROLLED_IMAGE();
+
+		conversionResult = setupCompression(info,fptr,options->transform,1,1,1,&status,outFileStub,options->writeUncompressed,
+				imageParameters,cubeParameters,&qualityParameters,compressionBenchmark,&result->rate,pool,imageResult,verifier
 #ifdef noise
-				,writeNoiseField,printNoiseBenchmark
+				,options->writeNoiseField,options->printNoiseBenchmark
 #endif
 				);
 
 		// Exit unsuccessfully if compression unsuccessful.
-		if (result != 0) {
+		if (conversionResult != 0) {
 			fprintf(stderr,"Unable to compress file %s.\n",ffname);
-			fits_close_file(fptr,&status);
-			exit(EXIT_FAILURE);
+			finishQualityVerifier(verifier,pool,NULL,0);
+			pthread_mutex_destroy(&summary.mutex);
+			destroyParallelReader(info);
+			freeHeaderCards(info);
+			return 1;
 		}
+
+		FINISH_RATE_CONTROLLED_IMAGE();
+
+		result->images++;
 	}
 	else {
+		// The requested ranges are copied, as they are adjusted to fit this particular image.
+		long startFrame = options->startFrame;
+		long endFrame = options->endFrame;
+		long startStoke = options->startStoke;
+		long endStoke = options->endStoke;
+
 		// Valid start and end frames specified
-		if (1<=startFrame && startFrame<=endFrame && endFrame<=info.depth) {
+		if (1<=startFrame && startFrame<=endFrame && endFrame<=info->depth) {
 			// Do nothing, parameters already set.
 		}
 		// Valid start frame only - just read this one
-		else if (1<=startFrame && startFrame<=info.depth) {
+		else if (1<=startFrame && startFrame<=info->depth) {
 			endFrame = startFrame;
 		}
 		// If both specified start and end frames are invalid, read all frames.
 		else {
 			startFrame = 1;
-			endFrame = info.depth;
+			endFrame = info->depth;
 		}
 
 		// Check if stoke range has been specified.
-		if (info.naxis>3) {
+		if (info->naxis>3) {
 			// Valid start and end stokes specified.
-			if (1<=startStoke && startStoke<=endStoke && endStoke<=info.stokes) {
+			if (1<=startStoke && startStoke<=endStoke && endStoke<=info->stokes) {
 				// Do nothing, parameters already set.
 			}
 			// Valid start stoke only - just read this one.
-			else if (1<=startStoke && startStoke<=info.stokes) {
+			else if (1<=startStoke && startStoke<=info->stokes) {
 				endStoke = startStoke;
 			}
 			// If both specified start and end stokes are invalid, read all stokes.
 			else {
 				startStoke = 1;
-				endStoke = info.stokes;
+				endStoke = info->stokes;
 			}
 		}
 		else {
@@ -2151,86 +3024,418 @@ int main(int argc, char *argv[]) {
 			endStoke = 1;
 		}
 
-		for (ii=startFrame; ii<=endFrame; ii++) {
-			for (jj=startStoke; jj<=endStoke; jj++) {
-				// Setup and perform compression for this frame.  Each time the loop runs, memory for a new
-				// image structure is allocatged as part of the setupCompression function.
-				// If this code was being run in serial, we could save time by initialising the image structure
-				// outside of the loop, to prevent a new memory allocation being performed every time the loop
-				// ran.  However, if this code is to be parallelised, we want a separate memory allocation for
-				// each frame of the image, to allow this process to be run in parallel.
-
-				// Output file will be input file name (minus FITS extension) + _ + frame number + .JP2 for a
-				// data cube or input file name (minus FITS extension) + _ + frame number + _ + stoke number + .JP2
-				// for a data volume.
-				// An additional 50 characters is sufficient for the additional data.
-				size_t oflen = ilen + 50 + slen;
+		if (rateControl) {
+			startRateControl(&controller,&options->rateControl,parameters,
+					(unsigned long long) (endFrame-startFrame+1)*(endStoke-startStoke+1)*info->width*info->height);
+		}
 
-				char intermediate[oflen];
-				char outFileStub[oflen];
+		// Read the planes ahead of them being needed, if requested.
+		startPrefetcher(fptr,info,startFrame,endFrame,startStoke,endStoke,cubeParameters->planesPerImage,options->readahead);
 
-				// Copy input file name to intermediary string.
-				strcpy(intermediate,ffname);
+		// Planes are read in groups of cubeParameters->planesPerImage consecutive frames, each group
+		// being packed into a single image.  The last group may be smaller than the others.
+		for (ii=startFrame; ii<=endFrame; ii+=cubeParameters->planesPerImage) {
+			long numPlanes = cubeParameters->planesPerImage;
 
-				// Get the last dot
-				char *dotPosition = strrchr(intermediate,'.');
+			if (ii+numPlanes-1 > endFrame) {
+				numPlanes = endFrame-ii+1;
+			}
 
-				// Overwrite it with an underscore.
-				*dotPosition = '_';
-				*(dotPosition+1) = '\0';
+			for (jj=startStoke; jj<=endStoke; jj++) {
+				// Setup and perform compression for this frame.  Component buffers are taken from the pool
+				// (if there is one) and returned to it afterwards, so that consecutive images of the same size
+				// reuse the same memory rather than allocating it afresh.
 
-				if (info.naxis>3) {
-					sprintf(outFileStub,"%s%ld_%ld%s",intermediate,ii,jj,parameters.outfile);
+				// Output file will be input file name (minus FITS extension) + _ + frame number + .JP2 for a
+				// data cube or input file name (minus FITS extension) + _ + frame number + _ + stoke number + .JP2
+				// for a data volume.  If several planes are packed into each image, the frame number is replaced
+				// by the range of frames in the image (first-last).
+				if (cubeParameters->planesPerImage > 1) {
+					if (info->naxis>3) {
+						sprintf(outFileStub,"%s_%ld-%ld_%ld%s",baseName,ii,ii+numPlanes-1,jj,parameters->outfile);
+					}
+					else {
+						sprintf(outFileStub,"%s_%ld-%ld%s",baseName,ii,ii+numPlanes-1,parameters->outfile);
+					}
+				}
+				else if (info->naxis>3) {
+					sprintf(outFileStub,"%s_%ld_%ld%s",baseName,ii,jj,parameters->outfile);
 				}
 				else {
-					sprintf(outFileStub,"%s%ld%s",intermediate,ii,parameters.outfile);
+					sprintf(outFileStub,"%s_%ld%s",baseName,ii,parameters->outfile);
 				}
 
 				// Setup and perform compression.
-				result = setupCompression(&info,fptr,transform,ii,jj,&status,outFileStub,writeUncompressed,
-						&parameters,&qualityBenchmarkParameters,performCompressionBenchmarking,&compressedFileSize
+				RESERVE_IMAGE_RESULT();
+				START_RATE_CONTROLLED_IMAGE();
+
+				conversionResult = setupCompression(info,fptr,options->transform,ii,jj,numPlanes,&status,outFileStub,options->writeUncompressed,
+						imageParameters,cubeParameters,result->images % samplePlanes == 0 ? &qualityParameters : &unsampledParameters,
+						compressionBenchmark,&result->rate,pool,imageResult,verifier
 #ifdef noise
-						,writeNoiseField,printNoiseBenchmark
+						,options->writeNoiseField,options->printNoiseBenchmark
 #endif
 						);
 
 				// Exit unsuccessfully if compression unsuccessful.
-				if (result != 0) {
-					if (info.naxis>3) {
+				if (conversionResult != 0) {
+					if (info->naxis>3) {
 						fprintf(stderr,"Unable to compress frame %ld of stoke %ld of file %s.\n",ii,jj,ffname);
 					}
 					else {
 						fprintf(stderr,"Unable to compress frame %ld of file %s.\n",ii,ffname);
 					}
 
-					fits_close_file(fptr,&status);
-					exit(EXIT_FAILURE);
+					finishQualityVerifier(verifier,pool,NULL,0);
+					pthread_mutex_destroy(&summary.mutex);
+					stopPrefetcher(info);
+					destroyParallelReader(info);
+					freeHeaderCards(info);
+					return 1;
 				}
+
+				FINISH_RATE_CONTROLLED_IMAGE();
+
+				result->images++;
 			}
 		}
 	}
 
-	// Close FITS file.
-	fits_close_file(fptr, &status);
+	// Wait for the images to be verified, so that their quality benchmarks are complete.
+	finishQualityVerifier(verifier,pool,&result->rate,info->bitpix);
 
-	if (performCompressionBenchmarking) {
-		off_t fitsSize;
+	if (samplePlanes > 1 && qualityParameters.performQualityBenchmarking) {
+		printQualitySummary(stdout,ffname,&summary,result->images,&qualityParameters);
+	}
 
-		// Get compressed file size using stat.
-		struct stat fileInfo;
+	pthread_mutex_destroy(&summary.mutex);
+
+	stopPrefetcher(info);
+	destroyParallelReader(info);
+	freeHeaderCards(info);
+
+	result->readSeconds = info->readSeconds;
+
+	return 0;
+}
+
+/**
+ * Convert a FITS file to JPEG 2000 image(s).  Each plane (or group of planes, see cube_encoding_info) in the
+ * requested range of frames and stokes is written to its own image, named after the FITS file.  If HDUs are
+ * selected (options->hdus), each selected image HDU is converted (see convertFITSExtensions), otherwise the
+ * first HDU containing an image is.
+ *
+ * This function does not modify the options passed to it, so the same options may be shared by several
+ * files being converted at once (as long as noise simulation, which uses global state, is off).
+ *
+ * @param ffname FITS file to convert.
+ * @param options Reference to conversion_options structure specifying how the file should be converted.
+ * @param pool Pool of component buffers to reuse between images.  May be null.
+ * @param result Reference to conversion_result structure which will be populated with information on the
+ * conversion.  recordImages must be set by the caller.  Information on each image is recorded (even if
+ * the conversion fails part way through) if it is true, and must be freed with freeConversionResult.
+ *
+ * @return 0 if the file was converted successfully, 1 otherwise.
+ */
+int convertFITSFile(char *ffname, conversion_options *options, plane_buffer_pool *pool, conversion_result *result) {
+	if (ffname == NULL || options == NULL || result == NULL) {
+		fprintf(stderr,"Parameters to convertFITSFile cannot be null.\n");
+		return 1;
+	}
+
+	double startTime = getWallClockTime();
+
+	result->images = 0;
+	memset(&result->rate,0,sizeof(rate_account));
+	result->seconds = 0.0;
+	result->readSeconds = 0.0;
+	result->imageResults = NULL;
+
+	int conversionResult;
+
+	if (options->hdus.all || options->hdus.count > 0) {
+		// Convert the selected HDUs of a multi-extension file.
+		conversionResult = convertFITSExtensions(ffname,options,pool,result);
+	}
+	else {
+		// Declare variables for reading FITS files needed by CFITSIO.
+		fitsfile *fptr = NULL;
+		int status = 0;
+
+		// Information on the data cube
+		cube_info info;
+
+		// Read basic information on FITS file.  This may have been cached from an earlier conversion.
+		PROFILE_START(openTimer);
+		conversionResult = openFITSFile(ffname,&fptr,&info,&status);
+		PROFILE_STOP(openTimer,PROFILE_OPEN,0);
+
+		// Display error if FITS file could not be opened.
+		if (conversionResult != 0) {
+			fprintf(stderr,"FITS file %s cannot be opened or is invalid.\n",ffname);
+			if (fptr != NULL) {
+				fits_close_file(fptr,&status);
+			}
+			return 1;
+		}
+
+		char baseName[strlen(ffname) + 32];
+		getOutputBaseName(ffname,0,baseName);
+
+		conversionResult = convertFITSImage(ffname,baseName,fptr,&info,options,pool,result);
 
-		int gotSize = stat(ffname,&fileInfo);
+		// Close FITS file.
+		fits_close_file(fptr,&status);
+	}
+
+	if (conversionResult != 0) {
+		return 1;
+	}
+
+	result->seconds = getWallClockTime() - startTime;
+
+	return 0;
+}
+
+/**
+ * Free the information on each image recorded in a conversion_result structure.
+ *
+ * @param result Reference to conversion_result structure.
+ */
+void freeConversionResult(conversion_result *result) {
+	if (result == NULL || result->imageResults == NULL) {
+		return;
+	}
+
+	long ii;
+
+	for (ii=0; ii<result->images; ii++) {
+		free(result->imageResults[ii].file);
+		free(result->imageResults[ii].quality);
+	}
+
+	free(result->imageResults);
+	result->imageResults = NULL;
+}
+
+/**
+ * Main function run from the command line.
+ */
+int main(int argc, char *argv[]) {
+	// Options controlling the conversion.  Initialised to default values here, may be changed when
+	// parsing user input from the command line.
+	conversion_options options;
+	setDefaultConversionOptions(&options);
+
+	// Files to convert in batch mode.  By default, only the file specified by -i is converted.
+	batch_info batchParameters;
+	batchParameters.source[0] = '\0';
+	batchParameters.socket[0] = '\0';
+	batchParameters.throughput[0] = '\0';
+	batchParameters.microbench[0] = '\0';
+	batchParameters.tune[0] = '\0';
+	batchParameters.saveParams[0] = '\0';
+	batchParameters.j2f[0] = '\0';
+	batchParameters.decode.reduce = 0;
+	batchParameters.decode.layers = 0;
+	batchParameters.decode.region.type = REGION_NONE;
+	batchParameters.decode.threads = 0;
+	batchParameters.threads = 1;
+	batchParameters.readThreads = 0;
+	batchParameters.encodeThreads = 0;
+	batchParameters.verifyThreads = 0;
+	batchParameters.verifyMemory = 0;
+	batchParameters.rateDetail = false;
+
+#ifdef noise
+	// Seed for random number generator.
+	unsigned long seed = 0;
+
+	// Has a RNG seed been set?
+	bool seedSet = false;
+
+	// PSNR of image (in DB) after noise has been added.
+	double noiseDB = 0.0;
+
+	// Has PSNR of image (after noise has been added) been set?
+	bool noiseSet = false;
+#endif
+
+	// Parse command line parameters.
+	int result = parse_cmdline_encoder(argc,argv,&options.parameters,&options.transform,&options.writeUncompressed,&options.startFrame,
+			&options.endFrame,&options.qualityBenchmarkParameters,&options.compressionBenchmark,&options.startStoke,&options.endStoke,
+			&options.cubeParameters,&options.region,&options.hdus,&options.readahead,&options.rateControl,&batchParameters
+#ifdef noise
+			,&noiseDB,&noiseSet,&seed,&seedSet,&gaussianNoisePctStdDeviation,&options.writeNoiseField
+#endif
+	);
+
+#ifdef noise
+	// Initialise getIntegerGaussianNoise() function.
+	if (noiseSet) {
+		// Set noise.
+		getIntegerGaussianNoise(&noiseDB,NULL,NULL);
+
+		// Print information on the PSNR of the image after adding noise.
+		options.printNoiseBenchmark = true;
+
+		if (seedSet) {
+			// Set seed.
+			getIntegerGaussianNoise(NULL,NULL,&seed);
+		}
+	}
+#endif
 
-		if (gotSize != 0) {
+	if (result != 0) {
+		fprintf(stderr,"Error parsing command parameters.\n");
+		displayHelp();
+	}
+
+	// image_to_j2k.c sets this to 1 if the image to be encoded has 3 components, or 0
+	// otherwise.  We encode 1 component (grayscale) images unless several planes are packed
+	// into each image, so only set it if the user asked for the multi-component transform.
+	// setupCompression turns it off again for any image that does not have 3 components.
+	options.parameters.tcp_mct = options.cubeParameters.multiComponentTransform ? 1 : 0;
+
+	// Threads decompressing each plane of a tile-compressed image.  0 leaves the choice to convertFITSFile
+	// (or runBatch/runServer, which share the cores between their workers).
+	options.readThreads = batchParameters.readThreads;
+	options.encodeThreads = batchParameters.encodeThreads;
+
+	// Threads verifying images while the next planes are encoded.
+	options.verifyThreads = batchParameters.verifyThreads;
+
+	if (batchParameters.verifyMemory > 0) {
+		options.verifyMemory = batchParameters.verifyMemory;
+	}
+
+	// When a single file is converted, -threads sets the number of its HDUs converted concurrently.
+	options.hduThreads = batchParameters.threads;
+
+	// Save the options as a parameter profile if asked to, stopping there if there is nothing else to do.
+	if (batchParameters.saveParams[0] != '\0') {
+		result = saveParameterProfile(batchParameters.saveParams,"default",NULL,&options.parameters,options.transform,
+				&options.qualityBenchmarkParameters);
+
+		if (result != 0) {
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(stdout,"Parameters saved to %s.  Convert with -params %s\n",batchParameters.saveParams,batchParameters.saveParams);
+
+		if (options.parameters.infile[0] == '\0' && batchParameters.source[0] == '\0' && batchParameters.socket[0] == '\0' &&
+				batchParameters.throughput[0] == '\0' && batchParameters.microbench[0] == '\0') {
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	// Accept conversion jobs if in server mode.
+	if (batchParameters.socket[0] != '\0') {
+		result = runServer(&batchParameters,argc,argv,&options);
+		writeProfile();
+		exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Time the per-pixel kernels in isolation if asked to.
+	if (batchParameters.microbench[0] != '\0') {
+		result = runMicrobenchmarks(batchParameters.microbench);
+		exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Benchmark the conversion of synthetic FITS cubes if asked to.
+	if (batchParameters.throughput[0] != '\0') {
+		result = runThroughputBenchmark(batchParameters.throughput,&options);
+		writeProfile();
+		exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Tune the compression parameters on the input file if asked to.
+	if (batchParameters.tune[0] != '\0') {
+		result = runTuner(batchParameters.tune,&options);
+		exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Convert a JPEG 2000 image back to FITS if asked to.  IMAGE.jp2 is written to IMAGE_DECODED.fits unless
+	// the FITS file is given as IMAGE.jp2:FILE.fits.
+	if (batchParameters.j2f[0] != '\0') {
+		char *imageFile = batchParameters.j2f;
+		char *colon = strrchr(imageFile,':');
+		char fitsFile[OPJ_PATH_LEN+16];
+
+		if (colon != NULL) {
+			*colon = '\0';
+			snprintf(fitsFile,sizeof(fitsFile),"%s",colon+1);
+		}
+		else {
+			char *dot = strrchr(imageFile,'.');
+			int stem = (dot != NULL && strchr(dot,'/') == NULL) ? (int) (dot-imageFile) : (int) strlen(imageFile);
+			snprintf(fitsFile,sizeof(fitsFile),"%.*s_DECODED.fits",stem,imageFile);
+		}
+
+		batchParameters.decode.region = options.region;
+		result = convertJPEG2000File(imageFile,fitsFile,&batchParameters.decode);
+		exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Convert a set of files if in batch mode.
+	if (batchParameters.source[0] != '\0') {
+		result = runBatch(&batchParameters,&options);
+		writeProfile();
+		exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// FITS file to read.
+	char *ffname = options.parameters.infile;
+
+	// Information on the conversion, including the size of the compressed file(s).  Used to compare
+	// compression rate relative to FITS.
+	conversion_result conversionResult;
+	conversionResult.recordImages = options.compressionBenchmark && batchParameters.rateDetail;
+
+	result = convertFITSFile(ffname,&options,NULL,&conversionResult);
+
+	// Write the time spent in each stage, even if the conversion failed part way through.
+	writeProfile();
+
+	// Exit unsuccessfully if conversion unsuccessful.
+	if (result != 0) {
+		freeConversionResult(&conversionResult);
+		exit(EXIT_FAILURE);
+	}
+
+	if (options.compressionBenchmark) {
+		off_t fitsSize = 0;
+
+		// Get FITS file size using stat.
+		struct stat fileInfo;
+
+		if (stat(ffname,&fileInfo) != 0) {
 			fprintf(stdout,"Unable to get size of file %s\n",ffname);
 		}
+		else {
+			fitsSize = fileInfo.st_size;
+		}
 
-		fitsSize = fileInfo.st_size;
+		unsigned long long compressedFileSize = conversionResult.rate.outputs[RATE_IMAGE].bytes;
 
 		// Print out compression info in the format
 		// [original FITS file name] [size of compressed files(s)] [size of FITS file] [compression rate]
 		fprintf(stdout,"[FITS file] [size of compressed JPEG 2000 image(s)] [size of FITS file] [compression ratio]\n");
-		fprintf(stdout,"%s %llu %llu %f\n",ffname,(unsigned long long)compressedFileSize,(unsigned long long)fitsSize,((double)compressedFileSize)/((double)fitsSize));
+		fprintf(stdout,"%s %llu %llu %f\n",ffname,compressedFileSize,(unsigned long long)fitsSize,((double)compressedFileSize)/((double)fitsSize));
+
+		// Then, if asked to, the size of each image, then of each kind of file and each quality layer over the whole file.
+		if (batchParameters.rateDetail) {
+			printImageRates(stdout,&conversionResult);
+			printRateAccount(stdout,ffname,&conversionResult.rate);
+		}
+
+		freeConversionResult(&conversionResult);
+	}
+
+	// Show how much of the time was spent waiting for the FITS file, to judge the effect of reading ahead.
+	if (options.readahead > 0 || profilingEnabled) {
+		fprintf(stdout,"[time (s)] [waiting for FITS data (s)] [computing (s)]\n");
+		fprintf(stdout,"%f %f %f\n",conversionResult.seconds,conversionResult.readSeconds,conversionResult.seconds-conversionResult.readSeconds);
 	}
 
 	exit(EXIT_SUCCESS);
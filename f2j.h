@@ -101,28 +101,145 @@
 #include <math.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <openjpeg-1.99/openjpeg.h>
 
 #ifdef noise
-#include <time.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
 #endif
 
 #include "fitsio.h"
 
+/**
+ * Set of independently opened handles on a tile-compressed FITS image, one per thread, used to
+ * decompress the tiles covering a plane in parallel.
+ */
+typedef struct {
+	fitsfile **handles /** Handles on the image, each positioned at the HDU being converted. */;
+	int count /** Number of handles (threads). */;
+	long tileHeight /** Number of rows in each compressed tile. */;
+} parallel_reader;
+
+/**
+ * State of a thread reading the planes of a data cube into the page cache ahead of them being read
+ * (see readahead.c).
+ */
+typedef struct {
+	int fd /** File descriptor for the FITS file. */;
+	char *buffer /** Buffer that planes are read through. */;
+	off_t *offsets /** Position in the file of each plane, in the order the planes are read. */;
+	long *frames /** Frame of each plane, in the order the planes are read. */;
+	long *stokes /** Stoke of each plane, in the order the planes are read. */;
+	long count /** Number of planes read. */;
+	off_t length /** Number of bytes read ahead for each plane. */;
+	int depth /** Number of planes kept read ahead of the plane being read. */;
+	long position /** Index of the plane being read. */;
+	long next /** Index of the next plane to read ahead. */;
+	long target /** Index of the last plane to read ahead for now. */;
+	bool stop /** Should the thread stop?  Only read or written while holding mutex. */;
+	bool started /** Was the thread started? */;
+	pthread_mutex_t mutex /** Mutex protecting the indices and stop. */;
+	pthread_cond_t condition /** Signalled when the target changes or the thread should stop. */;
+	pthread_t thread /** The prefetch thread. */;
+} plane_prefetcher;
+
 /**
  * Structure for defining essential properties of a FITS datacube.
  */
 typedef struct {
-	long width /** Image width. */;
-	long height /** Image height. */;
+	long width /** Image width.  The width of the region read, if only a region of each plane is converted. */;
+	long height /** Image height.  The height of the region read, if only a region of each plane is converted. */;
 	long depth /** Image depth.  Arbitrary for 2D images. */;
 	long stokes /** Number of stokes in image.  Arbitrary for 2D or 3D images. */;
 	int naxis /** Number of dimensions of the data cube. */;
 	int bitpix /** Image data type.  Same as BITPIX in CFITSIO. */;
+	long x0 /** First column of each plane read (starting from 0).  0 unless only a region is converted. */;
+	long y0 /** First row of each plane read (starting from 0).  0 unless only a region is converted. */;
+	long planeWidth /** Width of each plane in the FITS file. */;
+	long planeHeight /** Height of each plane in the FITS file. */;
+	int hdu /** Number of the HDU containing the image (1 for the primary HDU). */;
+	bool compressed /** Is the image stored as a tile-compressed image (e.g. written by fpack)? */;
+	parallel_reader *reader /** Handles used to decompress the tiles of each plane in parallel.  Null if the image is read serially. */;
+	plane_prefetcher *prefetcher /** Thread reading planes ahead of them being needed.  Null if planes aren't read ahead. */;
+	double readSeconds /** Wall clock time spent waiting for planes to be read (and decompressed). */;
+	char *headerCards /** WCS and other keywords describing the data, as header cards separated by newlines, recorded in each image written (see readHeaderCards).  Null if they haven't been read. */;
 } cube_info;
 
+/**
+ * Enumerated type defining how the region of each plane to convert is specified.
+ */
+typedef enum {
+	REGION_NONE /** Convert the whole of each plane. */,
+	REGION_PIXEL /** Region given by the pixel coordinates of opposite corners. */,
+	REGION_SKY /** Region given by the world (sky) coordinates of opposite corners, using the WCS keywords in the header. */
+} region_type;
+
+/**
+ * Structure specifying a rectangular region (cutout) of each plane to convert.
+ */
+typedef struct {
+	region_type type /** How the region is specified. */;
+	double x0 /** First corner: pixel column (starting from 1) or right ascension/longitude in degrees. */;
+	double y0 /** First corner: pixel row (starting from 1) or declination/latitude in degrees. */;
+	double x1 /** Opposite corner: pixel column or right ascension/longitude in degrees. */;
+	double y1 /** Opposite corner: pixel row or declination/latitude in degrees. */;
+} region_info;
+
+/**
+ * Maximum number of resolution levels that can be discarded when decoding (-reduce), so that the scale factor
+ * 2^reduce fits in an int.  An image can't be decoded with as many levels discarded as it has resolution levels.
+ */
+#define MAX_REDUCE 30
+
+/**
+ * Structure specifying how a JPEG 2000 image is decoded, when converting it back to FITS (-j2f) or benchmarking
+ * decoding.
+ */
+typedef struct {
+	int reduce /** Number of the highest resolution levels discarded, each halving the width and height (cp_reduce).  0 decodes at full resolution. */;
+	int layers /** Number of quality layers decoded (cp_layer).  0 decodes every layer. */;
+	region_info region /** Region of the image to decode, in pixels (starting from 1) of the full resolution FITS plane.  REGION_NONE or REGION_PIXEL. */;
+	int threads /** Number of threads decoding each image.  0 chooses automatically. */;
+} decode_options;
+
+/**
+ * Encoded image (or any other data) held in memory and read through an OpenJPEG stream (see createMemoryStream).
+ */
+typedef struct {
+	unsigned char *data /** Start of the data. */;
+	size_t length /** Number of bytes of data. */;
+	size_t offset /** Position of the next byte to read. */;
+} memory_stream;
+
+/**
+ * Structure specifying how quality benchmarks are estimated from part of each data cube (-QB_sample), to make
+ * them cheaper (see sample.c).  Zeroed to benchmark every pixel of every plane.
+ */
+typedef struct {
+	int reduce /** Number of resolution levels discarded when decoding each image, which is compared with the planes reduced by the same wavelet.  0 compares at full resolution. */;
+	double tiles /** Fraction of the tiles of each image decoded and compared, chosen at random.  0 compares every tile. */;
+	long planes /** Only every planes-th image of a data cube is benchmarked.  0 or 1 benchmarks every image. */;
+	unsigned int seed /** Seed of the random choice of tiles. */;
+} quality_sampling;
+
+/**
+ * Benchmarks of the planes of a data cube sampled with quality_sampling.planes, accumulated from the threads
+ * benchmarking them to estimate the benchmarks of the whole cube.
+ */
+typedef struct {
+	long planes /** Number of planes benchmarked. */;
+	double meanSquaredErrorSum /** Sum of the mean squared error of each plane. */;
+	double meanSquaredErrorSquares /** Sum of the squares of the mean squared error of each plane. */;
+	double meanAbsoluteErrorSum /** Sum of the mean absolute error of each plane. */;
+	double meanAbsoluteErrorSquares /** Sum of the squares of the mean absolute error of each plane. */;
+	int maximumAbsoluteDistortion /** Largest maximum absolute distortion of the planes. */;
+	double peak /** Largest pixel value of the planes, for the PSNR. */;
+	pthread_mutex_t mutex /** Mutex protecting the sums. */;
+} quality_summary;
+
 /**
  * Structure allowing parameters for quality benchmarking to be specified
  * by the user.  Currently, numerous different quality benchmarks can be
@@ -146,11 +263,82 @@ typedef struct {
 	bool squaredError /** Squared error. */;
 	bool absoluteError /** Absolute error. */;
 	bool squaredIntensitySum /** Sum of squared uncompressed image intensities. */;
+	bool structuralSimilarity /** Structural similarity (SSIM). */;
+	bool multiScaleStructuralSimilarity /** Multi-scale structural similarity (MS-SSIM). */;
+	bool physicalError /** Root mean squared and maximum error in the units of the FITS data, keeping the planes read until they are compared. */;
 
 	bool performQualityBenchmarking /** Is at least one quality benchmark selected?  Intended to provide a quick check.  Client code must keep this up to date.  */;
+	bool calculate /** Should the benchmarks be calculated for the caller even if none is selected for display?  Used by rate control to measure PSNR.  */;
 	bool writeResidual /** Should the residual image be written to a file?  */;
+	quality_sampling sampling /** How the benchmarks are estimated from part of each data cube.  Zeroed to benchmark everything. */;
+	quality_summary *summary /** Where the benchmarks of the planes sampled are accumulated.  Null unless only some planes are benchmarked. */;
+	int threads /** Number of threads calculating SSIM and MS-SSIM for each image.  0 chooses automatically. */;
 } quality_benchmark_info;
 
+/**
+ * Structure holding the quality benchmarks calculated for one component of a compressed image, so that
+ * they can be reported by callers (such as the server) as well as printed.
+ */
+typedef struct {
+	bool valid /** Were the benchmarks calculated successfully? */;
+	size_t pixels /** Number of pixels compared. */;
+	double meanSquaredError /** Mean squared error. */;
+	double peakSignalToNoiseRatio /** Peak signal to noise ratio.  Infinite if the images are identical. */;
+	double meanAbsoluteError /** Mean absolute error. */;
+	double fidelity /** Fidelity. */;
+	int maximumAbsoluteDistortion /** Maximum absolute distortion.  Of the pixels compared, if only some were. */;
+	double meanSquaredErrorInterval /** Half width of the 95% confidence interval of meanSquaredError if it was estimated from some of the tiles.  0 if it is exact, NaN if unknown. */;
+	double structuralSimilarity /** Structural similarity (SSIM).  NaN if not calculated. */;
+	double multiScaleStructuralSimilarity /** Multi-scale structural similarity (MS-SSIM).  NaN if not calculated. */;
+	double physicalRootMeanSquaredError /** Root mean squared error in the units of the FITS data.  NaN if not calculated. */;
+	double physicalMaximumError /** Maximum absolute error in the units of the FITS data.  NaN if not calculated. */;
+} quality_benchmark_result;
+
+/**
+ * Structure holding the sums accumulated by comparing the pixels of an uncompressed image component
+ * with those of the compressed component, from which the quality benchmarks are calculated.
+ */
+typedef struct {
+	unsigned long long int squaredError /** Sum of squared errors. */;
+	unsigned long long int absoluteError /** Sum of absolute errors. */;
+	unsigned long long int intensitySquareSum /** Sum of squared uncompressed intensities. */;
+	int maxAbsoluteError /** Maximum absolute error. */;
+} pixel_comparison;
+
+/**
+ * Enumerated type defining the outcome of comparing the pixels of two image components.
+ */
+typedef enum {
+	COMPARISON_OK /** The comparison was successful. */,
+	COMPARISON_SQUARED_ERROR_OVERFLOW /** The sum of squared errors overflowed. */,
+	COMPARISON_ABSOLUTE_ERROR_OVERFLOW /** The sum of absolute errors overflowed. */,
+	COMPARISON_INTENSITY_OVERFLOW /** The sum of squared intensities overflowed. */
+} comparison_status;
+
+/**
+ * Enumerated type defining the transforms that may be performed along the spectral axis of
+ * a data cube to decorrelate the planes packed into a single JPEG 2000 image.
+ */
+typedef enum {
+	SPECTRAL_NONE /** Planes are encoded without decorrelation. */,
+	SPECTRAL_DPCM /** Each plane is replaced by its difference from the previous plane. */,
+	SPECTRAL_DWT53 /** Reversible 5-3 integer wavelet transform along the spectral axis. */
+} spectral_transform;
+
+/**
+ * Structure specifying how the planes of a data cube are grouped into JPEG 2000 images.
+ * By default, each plane is written to its own single component image.  Packing several
+ * consecutive planes into the components of one image reduces the number of files written
+ * and allows the encoder to exploit the correlation between neighbouring planes.
+ */
+typedef struct {
+	long planesPerImage /** Number of consecutive planes packed as components of each JPEG 2000 image.  1 encodes each plane separately. */;
+	bool multiComponentTransform /** Should the JPEG 2000 multi-component transform (tcp_mct) be applied?  Only possible for images with exactly 3 components. */;
+	spectral_transform spectralTransform /** Transform performed along the spectral axis on the planes of each image before encoding. */;
+	int spectralLevels /** Number of levels of the spectral wavelet transform.  0 performs as many levels as possible. */;
+	bool recordMetadata /** Should the scaling of each plane and the header cards be recorded in the comment of each image, so that -j2f can restore physical values and the WCS (-j2f_meta)? */;
+} cube_encoding_info;
+
 /**
  * Enumerated type defining the transformations that may be performed
  * on raw FITS data to convert each datum into a 16 bit grayscale
@@ -174,18 +362,526 @@ typedef enum {
 	DEFAULT /** Default transform to use if no transform is explicitly specified.  This will depend on the FITS data type.  */
 } transform;
 
+/**
+ * Structure recording how the raw values of a plane were scaled to image intensities, so that the scaling can be
+ * written with the image and inverted when it is decoded (see j2f.c).
+ */
+typedef struct {
+	transform transform /** Transform performed.  Never DEFAULT. */;
+	int bitpix /** Type of the FITS data, as recorded in cube_info. */;
+	double datamin /** Minimum value used to scale floating point data.  0 for integer data. */;
+	double datamax /** Maximum value used to scale floating point data.  0 for integer data. */;
+	double bscale /** BSCALE of integer data read without scaling (RAW and NEGATIVE_RAW).  1 otherwise. */;
+	double bzero /** BZERO of integer data read without scaling (RAW and NEGATIVE_RAW).  0 otherwise. */;
+} plane_scaling;
+
+/**
+ * Enumerated type defining the function undoing a transform, applied to an affine map of the image intensities
+ * (see physical.c).
+ */
+typedef enum {
+	INVERSE_AFFINE /** None: the affine map alone inverts LINEAR and RAW (and their NEGATIVE_ forms). */,
+	INVERSE_EXP /** Exponential, inverting LOG. */,
+	INVERSE_SQUARE /** Square, inverting SQRT. */,
+	INVERSE_SQRT /** Square root, inverting SQUARED. */,
+	INVERSE_LOG /** Natural logarithm, inverting POWER. */
+} inverse_function;
+
+/**
+ * Inverse of the scaling of a plane to image intensities: physical = outerScale * f(scale * intensity + offset) +
+ * outerOffset, where f is the inverse_function.  NEGATIVE_ transforms are folded into scale and offset.
+ */
+typedef struct {
+	inverse_function function /** Function undoing the transform. */;
+	double scale /** Scale of the map of intensities applied before the function. */;
+	double offset /** Offset of the map of intensities applied before the function. */;
+	double outerScale /** Scale applied after the function.  1 for INVERSE_AFFINE. */;
+	double outerOffset /** Offset applied after the function.  0 for INVERSE_AFFINE. */;
+} physical_inverse;
+
+/**
+ * Physical values of a plane, kept until its image has been decoded so that the error can be measured in the
+ * units of the FITS data (-QB_PHYS).
+ */
+typedef struct {
+	double *values /** Physical values, in the order read from the FITS file: the rows are the reverse of those of the image. */;
+	plane_scaling scaling /** Scaling of the plane to image intensities. */;
+} physical_plane;
+
+/**
+ * Maximum length of the header cards recorded in each JPEG 2000 image.  The comment holding them, the scaling of
+ * each plane and any user comment must fit in a single COM marker (see COMMENT_MAX_LENGTH).
+ */
+#define HEADER_CARDS_MAX_LENGTH 8192
+
+/**
+ * Maximum length of the comment written to each JPEG 2000 image.  OpenJPEG writes it to a single COM marker whose
+ * 16 bit length (Lcom) counts itself and Rcom (2 bytes each) as well as the text, and longer comments would wrap
+ * the length and corrupt the codestream.  Images whose comment is longer are not written.
+ */
+#define COMMENT_MAX_LENGTH 65531
+
+/**
+ * Maximum number of planes packed into each JPEG 2000 image (-MC).  The scaling of each plane takes a line of up
+ * to about 200 characters of the comment, so that those of this many planes, the header cards and a short user
+ * comment fit in COMMENT_MAX_LENGTH.
+ */
+#define MAX_PLANES_PER_IMAGE 256
+
+/**
+ * Enumerated type defining the stages of a conversion timed when profiling (-profile).
+ */
+typedef enum {
+	PROFILE_OPEN /** Opening a FITS file and reading its header. */,
+	PROFILE_READ /** Reading (and decompressing) planes of FITS data. */,
+	PROFILE_TRANSFORM /** Transforming raw FITS values to image intensities. */,
+	PROFILE_ENCODE /** Encoding JPEG 2000 images. */,
+	PROFILE_WRITE /** Writing JPEG 2000 files. */,
+	PROFILE_DECODE /** Decoding JPEG 2000 files for quality benchmarking. */,
+	PROFILE_QUALITY /** Comparing decoded images with the originals for quality benchmarking. */,
+	PROFILE_STAGES /** Number of stages. */
+} profile_stage;
+
+/**
+ * Enumerated type defining the formats in which a profile can be written.
+ */
+typedef enum {
+	PROFILE_OFF /** Profiling is turned off. */,
+	PROFILE_JSON /** A JSON document. */,
+	PROFILE_CSV /** CSV, one row per image and stage. */
+} profile_format;
+
+/**
+ * Structure accumulating the time spent in a stage of a conversion.
+ */
+typedef struct {
+	double wallSeconds /** Wall clock time spent in the stage. */;
+	double cpuSeconds /** CPU time spent in the stage by the thread doing the work. */;
+	unsigned long long bytes /** Number of bytes processed by the stage. */;
+	long calls /** Number of times the stage was timed. */;
+} profile_counter;
+
+/**
+ * Structure recording when the timing of a stage started.
+ */
+typedef struct {
+	double wallSeconds /** Wall clock time when the stage started. */;
+	double cpuSeconds /** CPU time of the thread when the stage started. */;
+} profile_timer;
+
+/**
+ * Start timing a stage, declaring a profile_timer called name.  Only checks a flag if profiling is off.  As it
+ * declares a variable (used by PROFILE_STOP), it can't be wrapped in do { ... } while (0), so must be used as a
+ * statement of its own in the block enclosing the matching PROFILE_STOP, never as the body of an if or loop
+ * without braces.
+ */
+#define PROFILE_START(name) \
+	profile_timer name; \
+	if (profilingEnabled) { \
+		startProfileTimer(&name); \
+	}
+
+/**
+ * Stop timing a stage started with PROFILE_START.  bytes is only evaluated if profiling is on.
+ */
+#define PROFILE_STOP(name,stage,bytes) \
+	do { \
+		if (profilingEnabled) { \
+			stopProfileTimer(&name,stage,(unsigned long long) (bytes)); \
+		} \
+	} while (0)
+
+/**
+ * Macro to update index enable vertical flipping of a FITS file after
+ * it has been read.  Requires index and dif (size_t, starting at len-width
+ * and 0) and width to be defined in the same scope.
+ */
+#define UPDATE_FLIPPING_INDEX() {\
+	index++;\
+	dif++;\
+	\
+	if (dif >= width) {\
+		dif = 0;\
+		index -= 2*width;\
+	}\
+}
+
+/**
+ * Parameters added to the end of the transform functions when noise simulation is enabled.
+ */
+#ifdef noise
+#define TRANSFORM_NOISE_PARAMETERS ,int *,bool,bool
+#else
+#define TRANSFORM_NOISE_PARAMETERS
+#endif
+
+/**
+ * Maximum number of HDUs that can be listed for conversion with -hdu.
+ */
+#define MAX_SELECTED_HDUS 1024
+
+/**
+ * Structure specifying which HDUs of a (multi-extension) FITS file to convert.
+ */
+typedef struct {
+	bool all /** Convert every HDU containing an image. */;
+	int count /** Number of HDUs listed.  If 0 (and all is false), only the first HDU containing an image is converted. */;
+	int numbers[MAX_SELECTED_HDUS] /** Numbers of the HDUs to convert (1 for the primary HDU). */;
+} hdu_selection;
+
+/**
+ * Structure specifying adaptive rate control (see ratecontrol.c), which adjusts the encoding parameters between the
+ * images of a data cube so that the cube is converted within a time budget, at a given rate or above a given PSNR.
+ */
+typedef struct {
+	double deadline /** Wall clock time (in seconds) within which each data cube should be converted.  0 if there is no deadline. */;
+	double minPSNR /** Minimum PSNR (in dB) of each plane.  0 if there is no minimum. */;
+	double targetBPP /** Rate (in bits per pixel) to aim for in each image.  0 if there is no target. */;
+} rate_control_info;
+
+/**
+ * Structure holding all the options that control the conversion of a FITS file to JPEG 2000 image(s).
+ * Populated from the command line and shared (read only) by every file converted in a batch.
+ */
+typedef struct {
+	transform transform /** Transform to perform on raw FITS data. */;
+	bool writeUncompressed /** Should a lossless version of each image also be written? */;
+	long startFrame /** First frame of a data cube to convert.  -1 if not specified. */;
+	long endFrame /** Last frame of a data cube to convert.  -1 if not specified. */;
+	long startStoke /** First stoke of a data volume to convert.  -1 if not specified. */;
+	long endStoke /** Last stoke of a data volume to convert.  -1 if not specified. */;
+	quality_benchmark_info qualityBenchmarkParameters /** Quality benchmarks to perform. */;
+	bool compressionBenchmark /** Should the size of the compressed image(s) be recorded? */;
+	cube_encoding_info cubeParameters /** How planes are grouped into images. */;
+	region_info region /** Region of each plane to convert. */;
+	int readThreads /** Number of threads used to decompress each plane of a tile-compressed image.  0 chooses automatically. */;
+	int encodeThreads /** Number of threads coding the code-blocks of each image (see patches/).  0 chooses automatically. */;
+	hdu_selection hdus /** HDUs to convert.  Images written for each HDU are given the suffix _HDU[n] if HDUs are selected. */;
+	int hduThreads /** Number of HDUs of a multi-extension file to convert concurrently. */;
+	int readahead /** Number of planes of a data cube to read ahead of the plane being encoded.  0 turns read ahead off. */;
+	int verifyThreads /** Number of threads verifying (decoding and benchmarking) images while the next planes are encoded.  0 verifies each image before the next is encoded. */;
+	int verifyMemory /** Limit (in MB) on the memory held by the images waiting to be verified. */;
+	rate_control_info rateControl /** Adaptive rate control.  Off unless a deadline, minimum PSNR or target rate is given. */;
+	opj_cparameters_t parameters /** JPEG 2000 compression parameters. */;
+#ifdef noise
+	bool writeNoiseField /** Should the noise field be written to a file? */;
+	bool printNoiseBenchmark /** Should the PSNR achieved by adding noise be displayed? */;
+#endif
+} conversion_options;
+
+/**
+ * Maximum length of the name of a parameter profile, including the terminating null character.
+ */
+#define PARAMETER_PROFILE_NAME_LENGTH 64
+
+/**
+ * A named set of options read from a parameter profile file (see params.c).
+ */
+typedef struct {
+	char name[PARAMETER_PROFILE_NAME_LENGTH] /** Name of the profile. */;
+	unsigned int keys /** Keys given in the profile, one bit for each. */;
+	opj_cparameters_t parameters /** Compression parameters given in the profile. */;
+	transform transform /** Transform given in the profile. */;
+	quality_benchmark_info qualityBenchmarkParameters /** Quality benchmarks given in the profile. */;
+} parameter_profile;
+
+/**
+ * Kinds of file written, whose compressed size is accounted for separately by compression benchmarking (-CB).
+ */
+typedef enum {
+	RATE_IMAGE /** The JPEG 2000 images themselves. */,
+	RATE_LOSSLESS /** Lossless copies of the images (-LL). */,
+	RATE_NOISE_FIELD /** Noise fields added to the images. */,
+	RATE_RESIDUAL /** Residual images written by quality benchmarking (-QB_RES). */,
+	RATE_OUTPUTS /** Number of kinds of file.  Not a kind of file itself. */
+} rate_output;
+
+/**
+ * Maximum number of quality layers for which the compressed size is recorded separately.  Same as the
+ * maximum number of layers OpenJPEG can encode.
+ */
+#define RATE_MAX_LAYERS 100
+
+/**
+ * Compressed size of a set of files of one kind, taken from the byte counts of the encoder.
+ */
+typedef struct {
+	long images /** Number of files written. */;
+	unsigned long long bytes /** Total size of the files (codestream and any JP2 boxes). */;
+	unsigned long long headerBytes /** Part of bytes not in any packet: main and tile-part headers, and JP2 boxes. */;
+	unsigned long long pixels /** Number of pixels encoded, summed over the components of each image. */;
+	unsigned long long rawBytes /** Size of the FITS data encoded (pixels multiplied by |BITPIX|/8), not counting FITS headers. */;
+} rate_counter;
+
+/**
+ * Compressed size of the files written by a conversion, for each kind of file and for each quality layer
+ * of the JPEG 2000 images.
+ */
+typedef struct {
+	rate_counter outputs[RATE_OUTPUTS] /** Compressed size of each kind of file. */;
+	int layers /** Number of quality layers in layerBytes.  0 if the split by layer isn't known, e.g. if progression order changes were used or images with different numbers of layers were combined. */;
+	unsigned long long layerBytes[RATE_MAX_LAYERS] /** Size of the packets of each quality layer of the JPEG 2000 images (RATE_IMAGE only). */;
+} rate_account;
+
+/**
+ * Structure recording information on a single JPEG 2000 image written.
+ */
+typedef struct {
+	char *file /** Name of the JPEG 2000 image. */;
+	rate_counter rate /** Compressed size of the JPEG 2000 image.  Only recorded if compression benchmarking is on. */;
+	double seconds /** Wall clock time taken to encode the image. */;
+	int numcomps /** Number of components (planes) in the image. */;
+	quality_benchmark_result *quality /** Quality benchmarks for each component.  Null if quality benchmarking was not performed. */;
+} image_result;
+
+/**
+ * Structure recording the outcome of converting a single FITS file.
+ */
+typedef struct {
+	long images /** Number of JPEG 2000 images written (not counting lossless copies or noise fields). */;
+	rate_account rate /** Compressed size of the files written, by kind and by quality layer.  Only recorded if compression benchmarking is on. */;
+	double seconds /** Wall clock time taken to convert the file. */;
+	double readSeconds /** Part of seconds spent waiting for FITS data to be read (and decompressed).  The rest is spent computing. */;
+	bool recordImages /** Should information on each image be recorded in imageResults?  Set by the caller.  */;
+	image_result *imageResults /** Information on each image written (images entries), if recordImages is true.  Free with freeConversionResult. */;
+} conversion_result;
+
+/**
+ * Mode switches set by -M_fast, a preset for -M: bypass of the arithmetic coder in the lower bit-planes (1) and
+ * vertically causal context formation (8).
+ */
+#define FAST_MODE_SWITCHES 9
+
+/**
+ * Maximum number of steps by which rate control can speed up encoding (see ratecontrol.c).
+ */
+#define RATE_CONTROL_MAX_LEVELS 36
+
+/**
+ * State of the rate control of one data cube, updated after each image is written.
+ */
+typedef struct {
+	rate_control_info *info /** Rate control requested. */;
+	opj_cparameters_t base /** Compression parameters given by the user, from which each image's parameters are derived. */;
+	int level /** Current speed level.  0 uses the parameters given by the user, each higher level encodes faster. */;
+	int maxLevel /** Highest level that may be used.  Lowered if a level fails to reach the minimum PSNR. */;
+	double levelSeconds[RATE_CONTROL_MAX_LEVELS] /** Smoothed wall clock time per pixel measured at each level.  0 if not measured. */;
+	double rateScale /** Factor applied to the compression ratios (-r) given by the user, to reach the target rate or minimum PSNR. */;
+	double maxRateScale /** Largest value of rateScale allowed.  Lowered if the minimum PSNR isn't reached. */;
+	double startTime /** Wall clock time when conversion of the data cube started. */;
+	double lastTime /** Wall clock time when the last image was finished. */;
+	unsigned long long pixels /** Number of pixels in the data cube (or the part of it being converted). */;
+	unsigned long long pixelsDone /** Number of pixels converted so far. */;
+} rate_controller;
+
+/**
+ * Pool of image component buffers of a single length, allowing buffers to be recycled between
+ * images rather than allocated and freed for every plane.  A pool must only be used by one thread
+ * at a time.
+ */
+typedef struct {
+	int **buffers /** Buffers available for reuse. */;
+	int count /** Number of buffers available for reuse. */;
+	int capacity /** Size of the buffers array. */;
+	size_t length /** Number of pixels in each buffer. */;
+} plane_buffer_pool;
+
+/**
+ * Default limit on the memory (in MB) held by the images waiting to be verified by a quality_verifier.
+ */
+#define VERIFY_DEFAULT_MEMORY 256
+
+/**
+ * Image waiting to be verified by a quality_verifier: the planes encoded and the codestream they were encoded to.
+ */
+typedef struct verification_job {
+	opj_image_t frame /** Planes encoded, with any spectral transform undone.  The component data belongs to the job. */;
+	size_t planeLength /** Number of pixels in each component. */;
+	memory_stream encoded /** Codestream of the image.  The data belongs to the job. */;
+	char *file /** Name of the JPEG 2000 image. */;
+	OPJ_CODEC_FORMAT codec /** Codec of the image. */;
+	quality_benchmark_result *quality /** Where the quality benchmarks of each component are recorded.  May be null. */;
+	physical_plane *physical /** Physical values of each plane (-QB_PHYS).  Belongs to the job.  May be null. */;
+	rate_account rates /** Size of the residual image, if one is written and compression benchmarking is on. */;
+	size_t bytes /** Memory held by the job, counted against the limit of the verifier. */;
+	struct verification_job *next /** Next job in the same list. */;
+} verification_job;
+
+/**
+ * Stage decoding and benchmarking the images written for a data cube on threads of its own, while the following
+ * planes are encoded (see verify.c).
+ */
+typedef struct {
+	quality_benchmark_info parameters /** Quality benchmarks to perform. */;
+	cube_encoding_info cubeParameters /** How planes are grouped into images, to undo any spectral transform. */;
+	bool countRates /** Should the size of residual images be counted? */;
+	rate_account rates /** Size of the residual images written by the finished jobs. */;
+	verification_job *queued /** Jobs waiting to be verified, in the order they were submitted. */;
+	verification_job *lastQueued /** Last job in queued. */;
+	verification_job *finished /** Jobs verified, whose planes haven't been returned to the pool yet. */;
+	size_t bytes /** Memory held by the jobs queued, running or finished. */;
+	size_t maxBytes /** Limit on bytes.  A job is always accepted when no other job holds memory. */;
+	bool stop /** Should the threads stop once the queue is empty? */;
+	int numThreads /** Number of threads verifying images. */;
+	pthread_t *threads /** Threads verifying images. */;
+	pthread_mutex_t mutex /** Mutex protecting the lists, bytes, rates and stop. */;
+	pthread_cond_t queuedCondition /** Signalled when a job is queued or the threads should stop. */;
+	pthread_cond_t finishedCondition /** Signalled when a job is finished. */;
+} quality_verifier;
+
+/**
+ * Structure specifying how a set of FITS files should be converted in batch, server or throughput benchmarking mode.
+ */
+typedef struct {
+	char source[OPJ_PATH_LEN] /** List file, directory or glob pattern naming the FITS files to convert.  Empty if not in batch mode. */;
+	char socket[OPJ_PATH_LEN] /** Unix domain socket on which to accept conversion jobs.  Empty if not in server mode. */;
+	char throughput[OPJ_PATH_LEN] /** Matrix of settings to benchmark on synthetic FITS cubes (see throughput.c).  Empty if not benchmarking throughput. */;
+	char microbench[OPJ_PATH_LEN] /** Groups of kernels to time in isolation (see microbench.c).  Empty if not running microbenchmarks. */;
+	char tune[OPJ_PATH_LEN] /** Search space of parameters to tune on the file given by -i (see tune.c).  Empty if not tuning. */;
+	char saveParams[OPJ_PATH_LEN] /** Parameter profile, as file[:name], to save the options given to (see params.c).  Empty if not saving. */;
+	char j2f[OPJ_PATH_LEN] /** JPEG 2000 image, as image[:FITS file], to convert back to FITS (see j2f.c).  Empty if not converting back. */;
+	decode_options decode /** How the image given by j2f is decoded.  The region is taken from the conversion options. */;
+	int threads /** Number of files to convert concurrently. */;
+	int readThreads /** Number of threads used to decompress each plane of a tile-compressed image.  0 chooses automatically. */;
+	int encodeThreads /** Number of threads coding the code-blocks of each image.  0 chooses automatically. */;
+	int verifyThreads /** Number of threads verifying images while the next planes are encoded.  0 verifies each image before the next is encoded. */;
+	int verifyMemory /** Limit (in MB) on the memory held by the images waiting to be verified.  0 if not given. */;
+	bool rateDetail /** Should -CB also print the size of each image, kind of file and quality layer (-CB_detail)? */;
+} batch_info;
+
 // External function declarations.
 // f2j.c
 extern void displayHelp();
-int createJPEG2000Image(char *,OPJ_CODEC_FORMAT,opj_cparameters_t *,opj_image_t *);
+#ifdef noise
+extern double gaussianNoisePctStdDeviation;
+extern int getIntegerGaussianNoise(double *,int *,unsigned long int *);
+extern double getPctGaussianNoise();
+#endif
+extern bool isAddingNoise(const conversion_options *);
+extern int longLongImgTransform(long long int *,int *,transform,size_t,size_t TRANSFORM_NOISE_PARAMETERS);
+extern int intImgTransform(int *,int *,transform,size_t,size_t TRANSFORM_NOISE_PARAMETERS);
+extern int uIntImgTransform(unsigned int *,int *,transform,size_t,size_t TRANSFORM_NOISE_PARAMETERS);
+extern int shortImgTransform(short *,int *,transform,size_t,size_t TRANSFORM_NOISE_PARAMETERS);
+extern int uShortImgTransform(unsigned short *,int *,transform,size_t,size_t TRANSFORM_NOISE_PARAMETERS);
+extern int byteImgTransform(unsigned char *,int *,transform,size_t,size_t TRANSFORM_NOISE_PARAMETERS);
+extern int sByteImgTransform(signed char *,int *,transform,size_t,size_t TRANSFORM_NOISE_PARAMETERS);
+extern int floatDoubleTransform(double *,int *,transform,size_t,double,double,size_t TRANSFORM_NOISE_PARAMETERS);
+int createJPEG2000Image(char *,OPJ_CODEC_FORMAT,opj_cparameters_t *,opj_image_t *,rate_account *,rate_output,memory_stream *);
+extern void findDataRange(double *,size_t,double *,double *);
+extern const char *getTransformName(transform);
+extern int parseTransform(const char *,transform *);
+extern int getFITSInfo(char *,fitsfile **,cube_info *,int *);
+extern int createImageFromFITS(fitsfile *,transform,opj_image_t *,long,long,int,cube_info *,plane_scaling *,double **,int *
+#ifdef noise
+		,opj_image_t *,bool,bool
+#endif
+);
+extern int getImageInfo(fitsfile *,char *,cube_info *,int *);
+extern void getOutputBaseName(char *,int,char *);
+extern int convertFITSImage(char *,char *,fitsfile *,cube_info *,conversion_options *,plane_buffer_pool *,conversion_result *);
+extern void setDefaultConversionOptions(conversion_options *);
+extern int convertFITSFile(char *,conversion_options *,plane_buffer_pool *,conversion_result *);
+extern void freeConversionResult(conversion_result *);
+extern void releasePlaneBuffer(plane_buffer_pool *,int *,size_t);
+extern void freePlaneBufferPool(plane_buffer_pool *);
+// j2f.c
+extern opj_stream_t *createMemoryStream(memory_stream *);
+extern int readJPEG2000File(char *,unsigned char **,size_t *,OPJ_CODEC_FORMAT *);
+extern char *readJPEG2000Comment(unsigned char *,size_t,OPJ_CODEC_FORMAT);
+extern OPJ_INT32 reduceCoordinate(OPJ_INT32,int);
+extern int decodeJPEG2000Image(unsigned char *,size_t,OPJ_CODEC_FORMAT,decode_options *,opj_image_t **);
+extern int convertJPEG2000File(char *,char *,decode_options *);
+// microbench.c
+extern int runMicrobenchmarks(const char *);
 // openjpeg.c
-extern int parse_cmdline_encoder(int,char **,opj_cparameters_t *,transform *,bool *,long *,long *,quality_benchmark_info *,bool *, long *, long *
+extern int parse_cmdline_encoder(int,char **,opj_cparameters_t *,transform *,bool *,long *,long *,quality_benchmark_info *,bool *, long *, long *, cube_encoding_info *, region_info *, hdu_selection *, int *, rate_control_info *, batch_info *
 #ifdef noise
 		, double *, bool *, unsigned long *, bool *, double *, bool *
 #endif
 );
 void encode_help_display();
 // benchmark.c
-extern int performQualityBenchmarking(opj_image_t *,char *,quality_benchmark_info *,OPJ_CODEC_FORMAT);
+extern void error_callback(const char *,void *);
+extern void warning_callback(const char *,void *);
+extern void info_callback(const char *,void *);
+extern int readJ2K(char *,opj_image_t **,OPJ_CODEC_FORMAT);
+extern int readJ2KFromMemory(memory_stream *,opj_image_t **,OPJ_CODEC_FORMAT);
+extern comparison_status comparePixels(int *,int *,size_t,quality_benchmark_info *,int *,int,int,const char *,pixel_comparison *);
+extern int performQualityBenchmarking(opj_image_t *,char *,memory_stream *,quality_benchmark_info *,OPJ_CODEC_FORMAT,cube_encoding_info *,physical_plane *,quality_benchmark_result *,rate_account *);
+// batch.c
+extern int openFITSFile(char *,fitsfile **,cube_info *,int *);
+extern int scanFITSExtensions(char *,cube_info **,int *,int *);
+extern int runBatch(batch_info *,conversion_options *);
+extern double getWallClockTime();
+// extensions.c
+extern int convertFITSExtensions(char *,conversion_options *,plane_buffer_pool *,conversion_result *);
+// params.c
+extern const char *getProgressionName(OPJ_PROG_ORDER);
+extern int loadParameterProfile(const char *,opj_cparameters_t *,transform *,quality_benchmark_info *);
+extern int saveParameterProfile(const char *,const char *,const char *,opj_cparameters_t *,transform,quality_benchmark_info *);
+// physical.c
+extern bool getPhysicalInverse(plane_scaling *,physical_inverse *);
+extern void intensitiesToPhysical(physical_inverse *,const int *,double *,size_t);
+extern int comparePhysicalValues(physical_plane *,const int *,size_t,size_t,double *,double *);
+extern void freePhysicalPlanes(physical_plane *,int);
+// profile.c
+extern bool profilingEnabled;
+extern double getThreadCPUTime();
+extern int setProfileOutput(const char *);
+extern void startProfileTimer(profile_timer *);
+extern void stopProfileTimer(profile_timer *,profile_stage,unsigned long long);
+extern void finishProfiledImage(const char *);
+extern int writeProfile();
+// rate.c
+extern const char *getRateOutputName(rate_output);
+extern void countEncodedRate(rate_account *,rate_output,opj_image_t *,opj_cparameters_t *,opj_codestream_info_t *,int);
+extern void setRawPayload(rate_account *,int);
+extern void addRateAccount(rate_account *,rate_account *);
+extern double getBitsPerPixel(rate_counter *);
+extern double getCompressionRatio(rate_counter *);
+extern void printImageRates(FILE *,conversion_result *);
+extern void printRateAccount(FILE *,const char *,rate_account *);
+// ratecontrol.c
+extern bool isRateControlOn(rate_control_info *);
+extern void startRateControl(rate_controller *,rate_control_info *,opj_cparameters_t *,unsigned long long);
+extern void getRateControlledParameters(rate_controller *,opj_cparameters_t *);
+extern void updateRateControl(rate_controller *,image_result *);
+// readahead.c
+extern int startPrefetcher(fitsfile *,cube_info *,long,long,long,long,long,int);
+extern void advancePrefetcher(plane_prefetcher *,long,long);
+extern void stopPrefetcher(cube_info *);
+// reader.c
+extern int applyRegion(fitsfile *,cube_info *,region_info *,int *);
+extern int readFITSPlane(fitsfile *,int,cube_info *,long,long,void *,int *);
+extern int setRawScaling(fitsfile *,cube_info *,int *);
+extern int readHeaderCards(fitsfile *,cube_info *,int *);
+extern void freeHeaderCards(cube_info *);
+extern int getAutomaticReadThreads(int);
+extern int createParallelReader(fitsfile *,cube_info *,int,int *);
+extern void destroyParallelReader(cube_info *);
+// sample.c
+extern int parseQualitySampling(const char *,quality_sampling *);
+extern bool isQualitySampled(quality_sampling *);
+extern int performSampledQualityBenchmarking(opj_image_t *,char *,memory_stream *,quality_benchmark_info *,OPJ_CODEC_FORMAT,cube_encoding_info *,quality_benchmark_result *);
+extern void addQualitySummary(quality_summary *,double,double,int,double);
+extern void printQualitySummary(FILE *,const char *,quality_summary *,long,quality_benchmark_info *);
+// serve.c
+extern int runServer(batch_info *,int,char **,conversion_options *);
+// spectral.c
+extern int getSpectralLevels(int,int);
+extern const char *getSpectralTransformName(spectral_transform);
+extern int checkSpectralTransform(spectral_transform,const opj_cparameters_t *,const rate_control_info *);
+extern int spectralForwardTransform(opj_image_t *,spectral_transform,int);
+extern int spectralInverseTransform(opj_image_t *,spectral_transform,int,int,int);
+// ssim.c
+extern int computeStructuralSimilarity(int *,int *,long,long,int,bool,int,double *,double *);
+// throughput.c
+extern int runThroughputBenchmark(const char *,conversion_options *);
+// tune.c
+extern int runTuner(const char *,conversion_options *);
+// verify.c
+extern quality_verifier *startQualityVerifier(quality_benchmark_info *,cube_encoding_info *,bool,int,int);
+extern int submitVerification(quality_verifier *,opj_image_t *,size_t,physical_plane **,memory_stream *,char *,OPJ_CODEC_FORMAT,quality_benchmark_result *,plane_buffer_pool *);
+extern void finishQualityVerifier(quality_verifier *,plane_buffer_pool *,rate_account *,int);
 
 #endif /* F2J_H_ */
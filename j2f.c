@@ -0,0 +1,1171 @@
+/**
+ * @file j2f.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Functions for decoding JPEG 2000 images and converting them back to FITS files (-j2f).
+ *
+ * Images are decoded from memory.  The tiles of the region decoded are split into bands (of whole rows or
+ * columns of tiles), each decoded by its own thread with its own decoder reading the shared encoded data, so
+ * that images with several tiles decode on several cores.  With the bundled OpenJPEG patched with
+ * 0004-parallel-tier1-decode.patch, the code-blocks of each tile are also decoded on several threads, which
+ * is what speeds up images made of a single tile.  Only the tiles covering the region are decoded, and
+ * discarding resolution levels (cp_reduce) skips both their code-blocks and their wavelet synthesis.
+ *
+ * With -j2f_meta, f2j records in the comment of each image the planes it holds, how each was scaled to image intensities and
+ * the keywords of the FITS header describing the data (see createImageComment in f2j.c).  These are used to
+ * write the decoded image as FITS with physical values (inverting the scaling, see physical.c) and a world
+ * coordinate system describing the pixels decoded.
+ */
+
+#include "f2j.h"
+
+/**
+ * Size of the buffer of the streams reading encoded data from memory.
+ */
+#define MEMORY_STREAM_CHUNK_SIZE 0x100000
+
+/**
+ * Read from a memory stream.  Callback for OpenJPEG.
+ *
+ * @param buffer Buffer to read into.
+ * @param bytes Number of bytes to read.
+ * @param userData Reference to the memory_stream structure read.
+ *
+ * @return Number of bytes read, or -1 at the end of the data.
+ */
+static OPJ_SIZE_T readMemoryStream(void *buffer, OPJ_SIZE_T bytes, void *userData) {
+	memory_stream *stream = (memory_stream *) userData;
+
+	if (stream->offset >= stream->length) {
+		return (OPJ_SIZE_T) -1;
+	}
+
+	size_t count = stream->length - stream->offset;
+
+	if (count > bytes) {
+		count = bytes;
+	}
+
+	memcpy(buffer,stream->data+stream->offset,count);
+	stream->offset += count;
+
+	return (OPJ_SIZE_T) count;
+}
+
+/**
+ * Skip forwards or backwards in a memory stream.  As for a file, skipping past the end succeeds and
+ * later reads find the end of the data.  Callback for OpenJPEG.
+ *
+ * @param bytes Number of bytes to skip.
+ * @param userData Reference to the memory_stream structure read.
+ *
+ * @return Number of bytes skipped, or -1 if the skip would move before the start of the data.
+ */
+static OPJ_OFF_T skipMemoryStream(OPJ_OFF_T bytes, void *userData) {
+	memory_stream *stream = (memory_stream *) userData;
+
+	if (bytes < 0 && (size_t) -bytes > stream->offset) {
+		return -1;
+	}
+
+	if (bytes > 0 && (size_t) bytes > stream->length - stream->offset) {
+		stream->offset = stream->length;
+	}
+	else {
+		stream->offset += bytes;
+	}
+
+	return bytes;
+}
+
+/**
+ * Move to a position in a memory stream.  Callback for OpenJPEG.
+ *
+ * @param offset Position to move to.
+ * @param userData Reference to the memory_stream structure read.
+ *
+ * @return 0 on success, 1 if the position is outside the data (the convention of OpenJPEG's file streams).
+ */
+static opj_bool seekMemoryStream(OPJ_OFF_T offset, void *userData) {
+	memory_stream *stream = (memory_stream *) userData;
+
+	if (offset < 0 || (size_t) offset > stream->length) {
+		return 1;
+	}
+
+	stream->offset = (size_t) offset;
+	return 0;
+}
+
+/**
+ * Create an OpenJPEG stream reading encoded data held in memory, so that an image can be decoded without
+ * writing it to a file.  The stream reads from the current offset of the memory_stream structure, which
+ * must remain valid until the stream is destroyed (with opj_stream_destroy).  The data isn't copied, so
+ * several streams (each with its own memory_stream structure) may read the same data concurrently.
+ *
+ * @param stream Reference to the memory_stream structure describing the data.
+ *
+ * @return The stream, or null if it couldn't be created.
+ */
+opj_stream_t *createMemoryStream(memory_stream *stream) {
+	if (stream == NULL || stream->data == NULL) {
+		fprintf(stderr,"Parameters to createMemoryStream cannot be null.\n");
+		return NULL;
+	}
+
+	opj_stream_t *cio = opj_stream_create(MEMORY_STREAM_CHUNK_SIZE,1);
+
+	if (cio == NULL) {
+		fprintf(stderr,"Unable to create a stream reading from memory.\n");
+		return NULL;
+	}
+
+	opj_stream_set_read_function(cio,readMemoryStream);
+	opj_stream_set_skip_function(cio,skipMemoryStream);
+	opj_stream_set_seek_function(cio,seekMemoryStream);
+	opj_stream_set_user_data(cio,stream);
+	opj_stream_set_user_data_length(cio,stream->length);
+
+	return cio;
+}
+
+/**
+ * Read a JPEG 2000 file into memory and find which codec (JP2 or J2K) it was written with from its
+ * signature.
+ *
+ * @param imageFile Name of the file to read.
+ * @param data Reference to a pointer which will point to the contents of the file, to be freed by the caller.
+ * @param length Reference to a variable which will hold the length of the file in bytes.
+ * @param codec Reference to a variable which will hold the codec used.
+ *
+ * @return 0 if the file was read successfully, 1 otherwise.
+ */
+int readJPEG2000File(char *imageFile, unsigned char **data, size_t *length, OPJ_CODEC_FORMAT *codec) {
+	if (imageFile == NULL || data == NULL || length == NULL || codec == NULL) {
+		fprintf(stderr,"Parameters to readJPEG2000File cannot be null.\n");
+		return 1;
+	}
+
+	static const unsigned char jp2Signature[12] = {0x00,0x00,0x00,0x0C,0x6A,0x50,0x20,0x20,0x0D,0x0A,0x87,0x0A};
+	static const unsigned char j2kSignature[4] = {0xFF,0x4F,0xFF,0x51};
+
+	FILE *file = fopen(imageFile,"rb");
+
+	if (file == NULL) {
+		fprintf(stderr,"Unable to open %s for reading.\n",imageFile);
+		return 1;
+	}
+
+	long size = -1;
+
+	if (fseek(file,0,SEEK_END) == 0) {
+		size = ftell(file);
+	}
+
+	if (size <= 0 || fseek(file,0,SEEK_SET) != 0) {
+		fprintf(stderr,"Unable to find the length of %s.\n",imageFile);
+		fclose(file);
+		return 1;
+	}
+
+	*data = (unsigned char *) malloc(size);
+
+	if (*data == NULL) {
+		fprintf(stderr,"Unable to allocate memory to read %s.\n",imageFile);
+		fclose(file);
+		return 1;
+	}
+
+	if (fread(*data,1,size,file) != (size_t) size) {
+		fprintf(stderr,"Unable to read %s.\n",imageFile);
+		fclose(file);
+		free(*data);
+		*data = NULL;
+		return 1;
+	}
+
+	fclose(file);
+	*length = (size_t) size;
+
+	if (*length >= sizeof(jp2Signature) && memcmp(*data,jp2Signature,sizeof(jp2Signature)) == 0) {
+		*codec = CODEC_JP2;
+	}
+	else if (*length >= sizeof(j2kSignature) && memcmp(*data,j2kSignature,sizeof(j2kSignature)) == 0) {
+		*codec = CODEC_J2K;
+	}
+	else {
+		fprintf(stderr,"%s is not a JPEG 2000 image.\n",imageFile);
+		free(*data);
+		*data = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Read a big endian integer of up to 8 bytes.
+ *
+ * @param data Start of the integer.
+ * @param bytes Number of bytes in the integer.
+ *
+ * @return The integer.
+ */
+static unsigned long long readBigEndian(const unsigned char *data, int bytes) {
+	// Loop variable
+	int ii;
+
+	unsigned long long value = 0;
+
+	for (ii=0; ii<bytes; ii++) {
+		value = (value << 8) | data[ii];
+	}
+
+	return value;
+}
+
+/**
+ * Find the codestream of a JPEG 2000 image.  For a JP2 file, this is the contents of its contiguous
+ * codestream box.
+ *
+ * @param data Encoded image.
+ * @param length Number of bytes of encoded data.
+ * @param codec JPEG 2000 codec (JP2 or J2K) used.
+ * @param start Reference to a variable which will hold the offset of the start of the codestream (its SOC marker).
+ * @param end Reference to a variable which will hold the offset of the end of the codestream.
+ *
+ * @return true if the codestream was found, false otherwise.
+ */
+static bool findCodestream(unsigned char *data, size_t length, OPJ_CODEC_FORMAT codec, size_t *start, size_t *end) {
+	*start = 0;
+	*end = length;
+
+	if (codec == CODEC_JP2) {
+		bool found = false;
+
+		// Each box starts with its length (LBox, including the header) and type (TBox).  An LBox of 1 means
+		// the length follows as 8 bytes (XLBox) and 0 means the box runs to the end of the file.
+		while (*start + 8 <= length) {
+			unsigned long long boxLength = readBigEndian(data+*start,4);
+			size_t headerLength = 8;
+
+			if (boxLength == 1) {
+				if (*start + 16 > length) {
+					break;
+				}
+
+				boxLength = readBigEndian(data+*start+8,8);
+				headerLength = 16;
+			}
+			else if (boxLength == 0) {
+				boxLength = length - *start;
+			}
+
+			if (boxLength < headerLength || boxLength > length - *start) {
+				break;
+			}
+
+			if (memcmp(data+*start+4,"jp2c",4) == 0) {
+				*end = *start + boxLength;
+				*start += headerLength;
+				found = true;
+				break;
+			}
+
+			*start += boxLength;
+		}
+
+		if (!found) {
+			return false;
+		}
+	}
+
+	// The codestream starts with SOC (0xFF4F).
+	return *start + 2 <= *end && data[*start] == 0xFF && data[*start+1] == 0x4F;
+}
+
+/**
+ * Read the size of the image on the reference grid from the SIZ marker, which follows SOC.
+ *
+ * @param data Encoded image.
+ * @param length Number of bytes of encoded data.
+ * @param codec JPEG 2000 codec (JP2 or J2K) used.
+ * @param x0 Reference to a variable which will hold the left edge of the image (XOsiz).
+ * @param y0 Reference to a variable which will hold the top edge of the image (YOsiz).
+ * @param x1 Reference to a variable which will hold the right edge (exclusive) of the image (Xsiz).
+ * @param y1 Reference to a variable which will hold the bottom edge (exclusive) of the image (Ysiz).
+ *
+ * @return true if the size was read, false otherwise.
+ */
+static bool readImageSize(unsigned char *data, size_t length, OPJ_CODEC_FORMAT codec, long *x0, long *y0, long *x1, long *y1) {
+	size_t start,end;
+
+	// SOC, then SIZ, Lsiz and Rsiz (2 bytes each), then Xsiz, Ysiz, XOsiz and YOsiz (4 bytes each).
+	if (!findCodestream(data,length,codec,&start,&end) || start + 24 > end || readBigEndian(data+start+2,2) != 0xFF51) {
+		return false;
+	}
+
+	*x1 = (long) readBigEndian(data+start+8,4);
+	*y1 = (long) readBigEndian(data+start+12,4);
+	*x0 = (long) readBigEndian(data+start+16,4);
+	*y0 = (long) readBigEndian(data+start+20,4);
+
+	return true;
+}
+
+/**
+ * Read the comments (COM markers holding text) of the main header of a JPEG 2000 codestream.  OpenJPEG
+ * skips these when decoding, so the markers of the main header are walked here.
+ *
+ * @param data Encoded image.
+ * @param length Number of bytes of encoded data.
+ * @param codec JPEG 2000 codec (JP2 or J2K) used.
+ *
+ * @return The comments, separated by newlines, to be freed by the caller.  Null if the codestream has no
+ * comments, or they couldn't be read.
+ */
+char *readJPEG2000Comment(unsigned char *data, size_t length, OPJ_CODEC_FORMAT codec) {
+	size_t start,end;
+
+	if (data == NULL || !findCodestream(data,length,codec,&start,&end)) {
+		return NULL;
+	}
+
+	// Every marker of the main header up to the first SOT (0xFF90) is followed by its length, which includes
+	// the two bytes of the length.
+	char *comment = NULL;
+	size_t commentLength = 0;
+	size_t position = start + 2;
+
+	while (position + 4 <= end) {
+		unsigned int marker = (unsigned int) readBigEndian(data+position,2);
+		size_t markerLength = (size_t) readBigEndian(data+position+2,2);
+
+		if ((marker >> 8) != 0xFF || marker == 0xFF90 || markerLength < 2 || position + 2 + markerLength > end) {
+			break;
+		}
+
+		// COM: Rcom (1 for text) then the comment.
+		if (marker == 0xFF64 && markerLength >= 4 && readBigEndian(data+position+4,2) == 1) {
+			size_t textLength = markerLength - 4;
+			char *joined = (char *) realloc(comment,commentLength + textLength + 2);
+
+			if (joined == NULL) {
+				free(comment);
+				return NULL;
+			}
+
+			comment = joined;
+
+			if (commentLength > 0) {
+				comment[commentLength++] = '\n';
+			}
+
+			memcpy(comment+commentLength,data+position+6,textLength);
+			commentLength += textLength;
+			comment[commentLength] = '\0';
+		}
+
+		position += 2 + markerLength;
+	}
+
+	return comment;
+}
+
+/**
+ * Print errors reported by OpenJPEG while decoding.
+ */
+static void decodeErrorCallback(const char *msg, void *client_data) {
+	fprintf(stderr,"OpenJPEG: %s",msg);
+}
+
+/**
+ * Divide a coordinate by 2^reduce, rounding up, giving the corresponding coordinate at a reduced resolution.
+ *
+ * @param value Coordinate at full resolution.
+ * @param reduce Number of resolution levels discarded.
+ *
+ * @return The coordinate at the reduced resolution.
+ */
+OPJ_INT32 reduceCoordinate(OPJ_INT32 value, int reduce) {
+	return (OPJ_INT32) ((value + (1 << reduce) - 1) >> reduce);
+}
+
+/**
+ * Structure describing a band of tiles decoded by one thread.
+ */
+typedef struct {
+	unsigned char *data /** Encoded image. */;
+	size_t length /** Number of bytes of encoded data. */;
+	OPJ_CODEC_FORMAT codec /** JPEG 2000 codec (JP2 or J2K) used. */;
+	opj_dparameters_t *parameters /** Decoding parameters. */;
+	OPJ_INT32 x0 /** Left edge of the band, on the reference grid. */;
+	OPJ_INT32 y0 /** Top edge of the band, on the reference grid. */;
+	OPJ_INT32 x1 /** Right edge (exclusive) of the band, on the reference grid. */;
+	OPJ_INT32 y1 /** Bottom edge (exclusive) of the band, on the reference grid. */;
+	opj_image_t *image /** Image the decoded band is copied into. */;
+	OPJ_INT32 imageX0 /** Left edge of image, at the reduced resolution. */;
+	OPJ_INT32 imageY0 /** Top edge of image, at the reduced resolution. */;
+	int result /** 0 if the band was decoded successfully, 1 otherwise. */;
+} decode_band;
+
+/**
+ * Decode a band of tiles with a decoder of its own and copy it into the image.  Runs as a thread.
+ *
+ * @param arg Reference to the decode_band structure describing the band.
+ *
+ * @return null.
+ */
+static void *decodeBand(void *arg) {
+	decode_band *band = (decode_band *) arg;
+
+	// Loop variables
+	int ii;
+	OPJ_UINT32 jj;
+
+	band->result = 1;
+
+	opj_event_mgr_t event_mgr;
+	memset(&event_mgr,0,sizeof(opj_event_mgr_t));
+	event_mgr.error_handler = decodeErrorCallback;
+	event_mgr.warning_handler = warning_callback;
+	event_mgr.info_handler = info_callback;
+
+	memory_stream stream = {band->data,band->length,0};
+	opj_stream_t *cio = createMemoryStream(&stream);
+
+	if (cio == NULL) {
+		return NULL;
+	}
+
+	opj_codec_t *dinfo = opj_create_decompress_v2(band->codec);
+	opj_image_t *decoded = NULL;
+
+	if (dinfo == NULL || !opj_setup_decoder_v2(dinfo,band->parameters,&event_mgr)) {
+		fprintf(stderr,"Unable to set up the JPEG 2000 decoder.\n");
+	}
+	else if (!opj_read_header(cio,dinfo,&decoded)) {
+		fprintf(stderr,"Unable to read the header of the JPEG 2000 image.\n");
+	}
+	else if (!opj_set_decode_area(dinfo,decoded,band->x0,band->y0,band->x1,band->y1)) {
+		fprintf(stderr,"Unable to decode the area (%d,%d) to (%d,%d) of the JPEG 2000 image.\n",band->x0,band->y0,band->x1,band->y1);
+	}
+	else if (!(opj_decode_v2(dinfo,cio,decoded) && opj_end_decompress(dinfo,cio))) {
+		fprintf(stderr,"Unable to decode the JPEG 2000 image.\n");
+	}
+	else {
+		OPJ_INT32 left = reduceCoordinate(band->x0,band->parameters->cp_reduce) - band->imageX0;
+		OPJ_INT32 top = reduceCoordinate(band->y0,band->parameters->cp_reduce) - band->imageY0;
+
+		band->result = 0;
+
+		for (ii=0; ii<band->image->numcomps; ii++) {
+			opj_image_comp_t *source = &decoded->comps[ii];
+			opj_image_comp_t *target = &band->image->comps[ii];
+
+			if (source->data == NULL || left + source->w > target->w || top + source->h > target->h) {
+				fprintf(stderr,"Decoded band of component %d doesn't fit in the image.\n",ii);
+				band->result = 1;
+				break;
+			}
+
+			for (jj=0; jj<source->h; jj++) {
+				memcpy(target->data + (size_t) (top+jj) * target->w + left,source->data + (size_t) jj * source->w,sizeof(int) * source->w);
+			}
+		}
+	}
+
+	opj_stream_destroy(cio);
+
+	if (dinfo != NULL) {
+		opj_destroy_codec(dinfo);
+	}
+
+	if (decoded != NULL) {
+		opj_image_destroy(decoded);
+	}
+
+	return NULL;
+}
+
+/**
+ * Decode a JPEG 2000 image held in memory, optionally only a region of it, at a reduced resolution or from
+ * fewer quality layers.
+ *
+ * The tiles covering the region are split into bands along the direction in which there are more of them,
+ * one band per thread, and each band is decoded by its own decoder.  Threads left over (when there are fewer
+ * tiles than threads) decode the code-blocks of each tile, if the bundled OpenJPEG has been patched to do so.
+ *
+ * The region is given in pixels of the full resolution FITS plane (starting from 1 at the bottom left), as
+ * for -region.  f2j flips planes vertically, so the first row of the image is the last row of the plane.
+ *
+ * @param data Encoded image.
+ * @param length Number of bytes of encoded data.
+ * @param codec JPEG 2000 codec (JP2 or J2K) used.
+ * @param options Reference to decode_options structure specifying what to decode.  May be null, in which case
+ * the whole image is decoded at full resolution on one thread.
+ * @param image Reference to a pointer which will point to the decoded image, to be destroyed by the caller (with
+ * opj_image_destroy).  Should initially point to null.  Its components are the size of the decoded region and
+ * its x0/y0 are the position of the region at the reduced resolution.
+ *
+ * @return 0 if the image was decoded successfully, 1 otherwise.
+ */
+int decodeJPEG2000Image(unsigned char *data, size_t length, OPJ_CODEC_FORMAT codec, decode_options *options, opj_image_t **image) {
+	if (data == NULL || image == NULL) {
+		fprintf(stderr,"Parameters to decodeJPEG2000Image cannot be null.\n");
+		return 1;
+	}
+
+	if (*image != NULL) {
+		fprintf(stderr,"Image structure pointer provided to decodeJPEG2000Image must be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	decode_options defaults = {0,0,{REGION_NONE,0.0,0.0,0.0,0.0},1};
+
+	if (options == NULL) {
+		options = &defaults;
+	}
+
+	opj_dparameters_t parameters;
+	opj_set_default_decoder_parameters(&parameters);
+	parameters.cp_reduce = options->reduce;
+	parameters.cp_layer = options->layers;
+
+	opj_event_mgr_t event_mgr;
+	memset(&event_mgr,0,sizeof(opj_event_mgr_t));
+	event_mgr.error_handler = decodeErrorCallback;
+	event_mgr.warning_handler = warning_callback;
+	event_mgr.info_handler = info_callback;
+
+	// Read the main header for the size of the image, its components and its tiles.
+	memory_stream stream = {data,length,0};
+	opj_stream_t *cio = createMemoryStream(&stream);
+
+	if (cio == NULL) {
+		return 1;
+	}
+
+	opj_codec_t *dinfo = opj_create_decompress_v2(codec);
+	opj_image_t *header = NULL;
+	opj_codestream_info_v2_t *cstrInfo = NULL;
+
+	if (dinfo == NULL || !opj_setup_decoder_v2(dinfo,&parameters,&event_mgr) || !opj_read_header(cio,dinfo,&header)
+			|| (cstrInfo = opj_get_cstr_info(dinfo)) == NULL) {
+		fprintf(stderr,"Unable to read the header of the JPEG 2000 image.\n");
+		opj_stream_destroy(cio);
+
+		if (dinfo != NULL) {
+			opj_destroy_codec(dinfo);
+		}
+
+		if (header != NULL) {
+			opj_image_destroy(header);
+		}
+
+		return 1;
+	}
+
+	OPJ_INT32 tileX0 = cstrInfo->tx0;
+	OPJ_INT32 tileY0 = cstrInfo->ty0;
+	OPJ_INT32 tileWidth = cstrInfo->tdx;
+	OPJ_INT32 tileHeight = cstrInfo->tdy;
+
+	// Resolution levels can only be discarded while at least one remains in every component.
+	OPJ_UINT32 numResolutions = 0;
+
+	for (ii=0; ii<(int) cstrInfo->nbcomps; ii++) {
+		OPJ_UINT32 componentResolutions = cstrInfo->m_default_tile_info.tccp_info[ii].numresolutions;
+
+		if (ii == 0 || componentResolutions < numResolutions) {
+			numResolutions = componentResolutions;
+		}
+	}
+
+	opj_destroy_cstr_info_v2(&cstrInfo);
+	opj_stream_destroy(cio);
+	opj_destroy_codec(dinfo);
+
+	int numcomps = header->numcomps;
+	opj_image_cmptparm_t compParameters[numcomps];
+	OPJ_INT32 x0 = header->x0;
+	OPJ_INT32 y0 = header->y0;
+	OPJ_INT32 x1 = header->x1;
+	OPJ_INT32 y1 = header->y1;
+
+	for (ii=0; ii<numcomps; ii++) {
+		if (header->comps[ii].dx != 1 || header->comps[ii].dy != 1) {
+			fprintf(stderr,"Only JPEG 2000 images whose components aren't subsampled can be decoded.\n");
+			opj_image_destroy(header);
+			return 1;
+		}
+
+		memset(&compParameters[ii],0,sizeof(opj_image_cmptparm_t));
+		compParameters[ii].dx = 1;
+		compParameters[ii].dy = 1;
+		compParameters[ii].prec = header->comps[ii].prec;
+		compParameters[ii].bpp = header->comps[ii].bpp;
+		compParameters[ii].sgnd = header->comps[ii].sgnd;
+	}
+
+	OPJ_COLOR_SPACE colourSpace = header->color_space;
+	opj_image_destroy(header);
+
+	if (options->reduce < 0 || options->reduce > MAX_REDUCE || (OPJ_UINT32) options->reduce >= numResolutions
+			|| reduceCoordinate(x1,options->reduce) <= reduceCoordinate(x0,options->reduce)
+			|| reduceCoordinate(y1,options->reduce) <= reduceCoordinate(y0,options->reduce)) {
+		fprintf(stderr,"Unable to discard %d resolution levels of a %dx%d image with %u resolution levels.\n",options->reduce,x1-x0,y1-y0,
+				numResolutions);
+		return 1;
+	}
+
+	// Convert the region from FITS pixels to the reference grid.
+	if (options->region.type == REGION_PIXEL) {
+		OPJ_INT32 height = y1 - y0;
+		long firstColumn = (long) floor(fmin(options->region.x0,options->region.x1) + 0.5);
+		long lastColumn = (long) floor(fmax(options->region.x0,options->region.x1) + 0.5);
+		long firstRow = (long) floor(fmin(options->region.y0,options->region.y1) + 0.5);
+		long lastRow = (long) floor(fmax(options->region.y0,options->region.y1) + 0.5);
+
+		OPJ_INT32 areaX0 = x0 + (OPJ_INT32) fmax(firstColumn - 1,0);
+		OPJ_INT32 areaX1 = x0 + (OPJ_INT32) fmin(lastColumn,x1 - x0);
+		OPJ_INT32 areaY0 = y0 + (OPJ_INT32) fmax(height - lastRow,0);
+		OPJ_INT32 areaY1 = y0 + (OPJ_INT32) fmin(height - firstRow + 1,height);
+
+		if (areaX1 <= areaX0 || areaY1 <= areaY0) {
+			fprintf(stderr,"Region to decode lies outside the image.\n");
+			return 1;
+		}
+
+		x0 = areaX0;
+		y0 = areaY0;
+		x1 = areaX1;
+		y1 = areaY1;
+	}
+
+	OPJ_INT32 imageX0 = reduceCoordinate(x0,options->reduce);
+	OPJ_INT32 imageY0 = reduceCoordinate(y0,options->reduce);
+
+	for (ii=0; ii<numcomps; ii++) {
+		compParameters[ii].x0 = imageX0;
+		compParameters[ii].y0 = imageY0;
+		compParameters[ii].w = reduceCoordinate(x1,options->reduce) - imageX0;
+		compParameters[ii].h = reduceCoordinate(y1,options->reduce) - imageY0;
+	}
+
+	if (numcomps < 1 || compParameters[0].w < 1 || compParameters[0].h < 1) {
+		fprintf(stderr,"Nothing to decode at the resolution requested.\n");
+		return 1;
+	}
+
+	*image = opj_image_create(numcomps,compParameters,colourSpace);
+
+	if (*image == NULL) {
+		fprintf(stderr,"Unable to allocate memory for the decoded image.\n");
+		return 1;
+	}
+
+	(*image)->x0 = imageX0;
+	(*image)->y0 = imageY0;
+	(*image)->x1 = reduceCoordinate(x1,options->reduce);
+	(*image)->y1 = reduceCoordinate(y1,options->reduce);
+
+	// Tiles covering the region, and the direction to split them in.
+	OPJ_INT32 firstTileX = (x0 - tileX0) / tileWidth;
+	OPJ_INT32 firstTileY = (y0 - tileY0) / tileHeight;
+	OPJ_INT32 tilesX = (x1 - 1 - tileX0) / tileWidth - firstTileX + 1;
+	OPJ_INT32 tilesY = (y1 - 1 - tileY0) / tileHeight - firstTileY + 1;
+	bool splitRows = tilesY >= tilesX;
+	OPJ_INT32 tiles = splitRows ? tilesY : tilesX;
+
+	int threads = options->threads > 0 ? options->threads : getAutomaticReadThreads(1);
+	int numBands = threads < tiles ? threads : (int) tiles;
+
+#ifdef OPJ_HAVE_TIER1_DECODE_THREADS
+	parameters.tier1_threads = threads / numBands;
+#endif
+
+	decode_band bands[numBands];
+	pthread_t workers[numBands];
+	bool started[numBands];
+
+	for (ii=0; ii<numBands; ii++) {
+		OPJ_INT32 firstTile = (OPJ_INT32) ((long long) tiles * ii / numBands);
+		OPJ_INT32 lastTile = (OPJ_INT32) ((long long) tiles * (ii+1) / numBands);
+
+		bands[ii].data = data;
+		bands[ii].length = length;
+		bands[ii].codec = codec;
+		bands[ii].parameters = &parameters;
+		bands[ii].x0 = x0;
+		bands[ii].y0 = y0;
+		bands[ii].x1 = x1;
+		bands[ii].y1 = y1;
+		bands[ii].image = *image;
+		bands[ii].imageX0 = imageX0;
+		bands[ii].imageY0 = imageY0;
+		bands[ii].result = 1;
+
+		if (splitRows) {
+			bands[ii].y0 = (OPJ_INT32) fmax(y0,tileY0 + (firstTileY + firstTile) * tileHeight);
+			bands[ii].y1 = (OPJ_INT32) fmin(y1,tileY0 + (firstTileY + lastTile) * tileHeight);
+		}
+		else {
+			bands[ii].x0 = (OPJ_INT32) fmax(x0,tileX0 + (firstTileX + firstTile) * tileWidth);
+			bands[ii].x1 = (OPJ_INT32) fmin(x1,tileX0 + (firstTileX + lastTile) * tileWidth);
+		}
+	}
+
+	// The first band is decoded by this thread.  If a thread can't be started, its band is decoded here too.
+	for (ii=1; ii<numBands; ii++) {
+		started[ii] = pthread_create(&workers[ii],NULL,decodeBand,&bands[ii]) == 0;
+	}
+
+	decodeBand(&bands[0]);
+
+	for (ii=1; ii<numBands; ii++) {
+		if (started[ii]) {
+			pthread_join(workers[ii],NULL);
+		}
+		else {
+			decodeBand(&bands[ii]);
+		}
+	}
+
+	for (ii=0; ii<numBands; ii++) {
+		if (bands[ii].result != 0) {
+			opj_image_destroy(*image);
+			*image = NULL;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Adjust a header card recorded by f2j to describe the pixels decoded: the reference pixels of the first two
+ * axes move with the region and resolution decoded, the increments of the first two axes grow with the
+ * resolution discarded, and the reference pixels of the spectral and Stokes axes move to the planes held.
+ * Cards for other keywords are left unchanged.
+ *
+ * @param card Card to adjust, in a buffer of at least FLEN_CARD characters.
+ * @param reduce Number of resolution levels discarded.
+ * @param left First column decoded, at the reduced resolution, counted from the left edge of the image.
+ * @param top First row decoded, at the reduced resolution, counted from the top edge of the image.
+ * @param height Height of the image at full resolution.
+ * @param decodedHeight Number of rows decoded.
+ * @param firstPlane First plane held by the image.
+ * @param stoke Stoke held by the image.
+ */
+static void adjustHeaderCard(char *card, int reduce, long left, long top, long height, long decodedHeight, long firstPlane, long stoke) {
+	size_t nameLength = strcspn(card," =");
+
+	if (nameLength > 8 || strncmp(card+8,"= ",2) != 0) {
+		return;
+	}
+
+	char name[9];
+	memcpy(name,card,nameLength);
+	name[nameLength] = '\0';
+
+	double factor = ldexp(1.0,reduce);
+	double value = strtod(card+10,NULL);
+	bool alternate = nameLength == 7 && name[6] >= 'A' && name[6] <= 'Z';
+
+	// Rows of the image run from the top of the plane down: row height - p holds FITS row p.
+	if (strncmp(name,"CRPIX",5) == 0 && (nameLength == 6 || alternate)) {
+		if (name[5] == '1') {
+			value = (value - 1.0) / factor + 1.0 - left;
+		}
+		else if (name[5] == '2') {
+			value = top + decodedHeight - (height - value) / factor;
+		}
+		else if (name[5] == '3') {
+			value -= firstPlane - 1;
+		}
+		else if (name[5] == '4') {
+			value -= stoke - 1;
+		}
+		else {
+			return;
+		}
+	}
+	else if (strncmp(name,"CDELT",5) == 0 && (nameLength == 6 || alternate) && (name[5] == '1' || name[5] == '2')) {
+		value *= factor;
+	}
+	else if (strncmp(name,"CD",2) == 0 && name[3] == '_' && (nameLength == 5 || (nameLength == 6 && name[5] >= 'A' && name[5] <= 'Z'))
+			&& (name[4] == '1' || name[4] == '2')) {
+		value *= factor;
+	}
+	else {
+		return;
+	}
+
+	snprintf(card,FLEN_CARD,"%-8s= %20.15G",name,value);
+}
+
+/**
+ * Write a decoded image to a FITS file.  Each component becomes a plane of the data cube.  If every plane
+ * was scaled by the same affine map, the image intensities are written as integers with BSCALE and BZERO
+ * giving the physical values, unless they need more than 16 bits and the planes were read from floating
+ * point data.  Otherwise physical values are written as floating point numbers.  Planes whose scaling can't
+ * be inverted keep their image intensities.
+ *
+ * @param fitsFile Name of the FITS file to write.
+ * @param image Decoded image.  The rows of each component are written in reverse order, undoing the flip
+ * performed by f2j.
+ * @param inverse Map from intensities to physical values for each component (see physical.c).
+ * @param floatingPoint Were any of the planes read from floating point data (as recorded in the comment)?
+ * @param cards Header cards to write, separated by newlines.  May be null.
+ * @param history HISTORY lines to write, separated by newlines.  May be null.
+ * @param status Reference to status integer for CFITSIO.
+ *
+ * @return 0 if the file was written successfully, 1 otherwise.
+ */
+static int writeDecodedFITS(char *fitsFile, opj_image_t *image, physical_inverse *inverse, bool floatingPoint, char *cards, char *history,
+		int *status) {
+	// Loop variables
+	int ii;
+	size_t jj,kk;
+
+	int numcomps = image->numcomps;
+	size_t width = image->comps[0].w;
+	size_t height = image->comps[0].h;
+	size_t planeSize = width * height;
+	bool sameScaling = true;
+	int prec = 0;
+	bool sgnd = false;
+
+	for (ii=0; ii<numcomps; ii++) {
+		sameScaling &= inverse[ii].function == INVERSE_AFFINE && inverse[ii].scale == inverse[0].scale && inverse[ii].offset == inverse[0].offset;
+		prec = image->comps[ii].prec > prec ? image->comps[ii].prec : prec;
+		sgnd |= image->comps[ii].sgnd != 0;
+	}
+
+	// Integers are written if they fit in 16 bits, or if they are wider but weren't read from floating point data, so
+	// that integer data round trips exactly.  Unsigned 16 bit values are stored offset by 32768.  Components hold
+	// ints, so wider values always fit in 32 bits.
+	int bitpix = FLOAT_IMG;
+	double offset = 0.0;
+
+	if (sameScaling && prec <= 8 && !sgnd) {
+		bitpix = BYTE_IMG;
+	}
+	else if (sameScaling && prec <= 16) {
+		bitpix = SHORT_IMG;
+		offset = sgnd ? 0.0 : 32768.0;
+	}
+	else if (sameScaling && !floatingPoint) {
+		bitpix = LONG_IMG;
+	}
+
+	// The cards describe at most four axes, whose extent may be 1.
+	int naxis = numcomps > 1 ? 3 : 2;
+
+	if (cards != NULL && strstr(cards,"CTYPE3 ") != NULL && naxis < 3) {
+		naxis = 3;
+	}
+
+	if (cards != NULL && strstr(cards,"CTYPE4 ") != NULL) {
+		naxis = 4;
+	}
+
+	long naxes[4] = {(long) width,(long) height,numcomps,1};
+
+	void *array;
+
+	if (bitpix == BYTE_IMG) {
+		array = malloc(planeSize * numcomps);
+	}
+	else if (bitpix == SHORT_IMG) {
+		array = malloc(sizeof(short) * planeSize * numcomps);
+	}
+	else if (bitpix == LONG_IMG) {
+		array = malloc(sizeof(int) * planeSize * numcomps);
+	}
+	else {
+		array = malloc(sizeof(float) * planeSize * numcomps);
+	}
+
+	// Physical values of a row, for floating point output.
+	double *values = bitpix == FLOAT_IMG ? (double *) malloc(sizeof(double) * width) : NULL;
+
+	if (array == NULL || (bitpix == FLOAT_IMG && values == NULL)) {
+		fprintf(stderr,"Unable to allocate memory to write %s.\n",fitsFile);
+		free(array);
+		free(values);
+		return 1;
+	}
+
+	for (ii=0; ii<numcomps; ii++) {
+		for (jj=0; jj<height; jj++) {
+			int *row = image->comps[ii].data + (height-1-jj) * width;
+			size_t start = ii * planeSize + jj * width;
+
+			if (bitpix == BYTE_IMG) {
+				for (kk=0; kk<width; kk++) {
+					((unsigned char *) array)[start+kk] = (unsigned char) row[kk];
+				}
+			}
+			else if (bitpix == SHORT_IMG) {
+				for (kk=0; kk<width; kk++) {
+					((short *) array)[start+kk] = (short) (row[kk] - offset);
+				}
+			}
+			else if (bitpix == LONG_IMG) {
+				memcpy((int *) array + start,row,sizeof(int) * width);
+			}
+			else {
+				intensitiesToPhysical(&inverse[ii],row,values,width);
+
+				for (kk=0; kk<width; kk++) {
+					((float *) array)[start+kk] = (float) values[kk];
+				}
+			}
+		}
+	}
+
+	free(values);
+
+	fitsfile *fptr = NULL;
+	fits_create_file(&fptr,fitsFile,status);
+	fits_create_img(fptr,bitpix,naxis,naxes,status);
+
+	if (*status != 0) {
+		fprintf(stderr,"Unable to create FITS file %s.\n",fitsFile);
+		free(array);
+		return 1;
+	}
+
+	if (bitpix != FLOAT_IMG && (inverse[0].scale != 1.0 || inverse[0].offset + offset * inverse[0].scale != 0.0)) {
+		double bscale = inverse[0].scale;
+		double bzero = inverse[0].offset + offset * inverse[0].scale;
+
+		fits_write_key(fptr,TDOUBLE,"BSCALE",&bscale,"Physical value = BZERO + BSCALE * array value",status);
+		fits_write_key(fptr,TDOUBLE,"BZERO",&bzero,"Physical value = BZERO + BSCALE * array value",status);
+	}
+
+	if (cards != NULL) {
+		char *saveptr;
+		char *card = strtok_r(cards,"\n",&saveptr);
+
+		while (card != NULL && *status == 0) {
+			fits_write_record(fptr,card,status);
+			card = strtok_r(NULL,"\n",&saveptr);
+		}
+	}
+
+	if (history != NULL) {
+		char *saveptr;
+		char *line = strtok_r(history,"\n",&saveptr);
+
+		while (line != NULL && *status == 0) {
+			fits_write_history(fptr,line,status);
+			line = strtok_r(NULL,"\n",&saveptr);
+		}
+	}
+
+	long fpixel[4] = {1,1,1,1};
+	int datatype = bitpix == BYTE_IMG ? TBYTE : (bitpix == SHORT_IMG ? TSHORT : (bitpix == LONG_IMG ? TINT : TFLOAT));
+	fits_write_pix(fptr,datatype,fpixel,planeSize * numcomps,array,status);
+	free(array);
+
+	int closeStatus = 0;
+	fits_close_file(fptr,&closeStatus);
+
+	if (*status != 0 || closeStatus != 0) {
+		fprintf(stderr,"Unable to write FITS file %s.\n",fitsFile);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Convert a JPEG 2000 image written by f2j back to a FITS file (-j2f).  The image is decoded (see
+ * decodeJPEG2000Image) and the spectral transform recorded in its comment (if any) is inverted.  The scaling
+ * of each plane to image intensities recorded in the comment is inverted (see physical.c), restoring physical
+ * values.  Scalings that can't be inverted (such as those of planes whose range isn't finite) are
+ * noted in the HISTORY of the file and the image intensities are written.  The header cards recorded are written with the reference pixels and
+ * increments adjusted for the region and resolution decoded.  Images without the scaling recorded (such as
+ * lossless copies and images written without -j2f_meta) are written as their image intensities.
+ *
+ * @param imageFile JPEG 2000 image to convert.
+ * @param fitsFile Name of the FITS file to write.  Overwritten if it exists.
+ * @param options Reference to decode_options structure specifying what to decode.
+ *
+ * @return 0 if the image was converted successfully, 1 otherwise.
+ */
+int convertJPEG2000File(char *imageFile, char *fitsFile, decode_options *options) {
+	if (imageFile == NULL || fitsFile == NULL || options == NULL) {
+		fprintf(stderr,"Parameters to convertJPEG2000File cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	unsigned char *data = NULL;
+	size_t length;
+	OPJ_CODEC_FORMAT codec;
+	long x0,y0,x1,y1;
+
+	if (readJPEG2000File(imageFile,&data,&length,&codec) != 0) {
+		return 1;
+	}
+
+	if (!readImageSize(data,length,codec,&x0,&y0,&x1,&y1)) {
+		fprintf(stderr,"Unable to read the size of %s.\n",imageFile);
+		free(data);
+		return 1;
+	}
+
+	char *comment = readJPEG2000Comment(data,length,codec);
+	opj_image_t *image = NULL;
+	double start = getWallClockTime();
+
+	if (decodeJPEG2000Image(data,length,codec,options,&image) != 0) {
+		fprintf(stderr,"Unable to decode %s.\n",imageFile);
+		free(comment);
+		free(data);
+		return 1;
+	}
+
+	double seconds = getWallClockTime() - start;
+	free(data);
+
+	int numcomps = image->numcomps;
+	physical_inverse inverse[numcomps];
+	plane_scaling scalings[numcomps];
+	int numScalings = 0;
+	long firstPlane = 1;
+	long stoke = 1;
+	spectral_transform spectral = SPECTRAL_NONE;
+	int spectralLevels = 0, prec = 0, sgnd = 0;
+
+	// Every card in the comment takes at least 19 characters ("F2J CARD=" and the name).
+	size_t commentLength = comment != NULL ? strlen(comment) : 0;
+	char *cards = (char *) malloc((commentLength / 19 + 1) * (FLEN_CARD + 1));
+	char *history = (char *) malloc(commentLength + 128 * (numcomps + 2) + strlen(imageFile));
+
+	if (cards == NULL || history == NULL) {
+		fprintf(stderr,"Unable to allocate memory for the header of %s.\n",fitsFile);
+		free(cards);
+		free(history);
+		free(comment);
+		opj_image_destroy(image);
+		return 1;
+	}
+
+	char *cardsEnd = cards;
+	char *historyEnd = history;
+	*cards = '\0';
+	*history = '\0';
+
+	// Position of the pixels decoded relative to the image, at the reduced resolution.
+	long left = image->x0 - ((x0 + (1L << options->reduce) - 1) >> options->reduce);
+	long top = image->y0 - ((y0 + (1L << options->reduce) - 1) >> options->reduce);
+
+	// Sort the lines of the comment into the spectral transform, the scaling of each plane, header cards
+	// (adjusted for the pixels decoded) and other lines, which are kept as HISTORY.  The scalings come
+	// before the cards.
+	if (comment != NULL) {
+		char *saveptr;
+		char *line = strtok_r(comment,"\n",&saveptr);
+
+		while (line != NULL) {
+			char name[32];
+			long plane,lineStoke;
+
+			if (sscanf(line,"F2J SPECTRAL=%31s LEVELS=%d PREC=%d SGND=%d",name,&spectralLevels,&prec,&sgnd) == 4) {
+				spectral = strcmp(name,"DPCM") == 0 ? SPECTRAL_DPCM : (strcmp(name,"DWT53") == 0 ? SPECTRAL_DWT53 : SPECTRAL_NONE);
+				historyEnd += sprintf(historyEnd,"%s\n",line);
+			}
+			else if (numScalings < numcomps && sscanf(line,"F2J PLANE=%ld STOKE=%ld TRANSFORM=%31s BITPIX=%d DATAMIN=%lg DATAMAX=%lg BSCALE=%lg BZERO=%lg",
+					&plane,&lineStoke,name,&scalings[numScalings].bitpix,&scalings[numScalings].datamin,&scalings[numScalings].datamax,
+					&scalings[numScalings].bscale,&scalings[numScalings].bzero) == 8 && parseTransform(name,&scalings[numScalings].transform) == 0) {
+				if (numScalings == 0) {
+					firstPlane = plane;
+					stoke = lineStoke;
+				}
+
+				numScalings++;
+				historyEnd += sprintf(historyEnd,"%s\n",line);
+			}
+			else if (strncmp(line,"F2J CARD=",9) == 0) {
+				char card[FLEN_CARD];
+
+				snprintf(card,FLEN_CARD,"%s",line+9);
+				adjustHeaderCard(card,options->reduce,left,top,y1-y0,image->comps[0].h,firstPlane,stoke);
+				cardsEnd += sprintf(cardsEnd,"%s\n",card);
+			}
+			else {
+				historyEnd += sprintf(historyEnd,"%s\n",line);
+			}
+
+			line = strtok_r(NULL,"\n",&saveptr);
+		}
+	}
+
+	free(comment);
+
+	if (spectral != SPECTRAL_NONE && spectralInverseTransform(image,spectral,spectralLevels,prec,sgnd) != 0) {
+		fprintf(stderr,"Unable to invert the spectral transform of %s.\n",imageFile);
+		free(cards);
+		free(history);
+		opj_image_destroy(image);
+		return 1;
+	}
+
+	// Planes without a recorded scaling keep their image intensities.  Note whether any plane was read from floating
+	// point data, which decides how wide intensities are written.
+	bool floatingPoint = false;
+
+	for (ii=0; ii<numcomps; ii++) {
+		floatingPoint |= ii < numScalings && scalings[ii].bitpix < 0;
+
+		if (ii >= numScalings) {
+			inverse[ii].function = INVERSE_AFFINE;
+			inverse[ii].scale = 1.0;
+			inverse[ii].offset = 0.0;
+			inverse[ii].outerScale = 1.0;
+			inverse[ii].outerOffset = 0.0;
+		}
+		else if (!getPhysicalInverse(&scalings[ii],&inverse[ii])) {
+			historyEnd += sprintf(historyEnd,"Plane %d holds image intensities: its %s scaling can't be inverted.\n",ii+1,
+					getTransformName(scalings[ii].transform));
+		}
+	}
+
+	if (options->reduce > 0) {
+		historyEnd += sprintf(historyEnd,"Decoded from %s at 1/%d of full resolution.\n",imageFile,1 << options->reduce);
+	}
+	else {
+		historyEnd += sprintf(historyEnd,"Decoded from %s.\n",imageFile);
+	}
+
+	// CFITSIO overwrites a file whose name starts with !.
+	char outFile[strlen(fitsFile)+2];
+	sprintf(outFile,"%s%s",fitsFile[0] == '!' ? "" : "!",fitsFile);
+
+	int status = 0;
+	int result = writeDecodedFITS(outFile,image,inverse,floatingPoint,cards,history,&status);
+
+	if (result == 0) {
+		double pixels = (double) image->comps[0].w * image->comps[0].h * numcomps;
+
+		fprintf(stdout,"Decoded %s (%dx%d, %d component%s) in %.3f s (%.2f Mpixels/s) and wrote %s.\n",imageFile,image->comps[0].w,
+				image->comps[0].h,numcomps,numcomps == 1 ? "" : "s",seconds,seconds > 0.0 ? pixels / seconds / 1e6 : 0.0,outFile+1);
+	}
+
+	free(cards);
+	free(history);
+	opj_image_destroy(image);
+
+	return result;
+}
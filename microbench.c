@@ -0,0 +1,580 @@
+/**
+ * @file microbench.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Microbenchmarks of the per-pixel kernels (-microbench).
+ *
+ * The throughput benchmark (throughput.c) times the whole pipeline.  The microbenchmarks time each kernel
+ * in isolation, on arrays sized to fit in the L1, L2 and L3 caches and to spill to main memory (DRAM),
+ * reporting nanoseconds per pixel, GB/s and bytes per cycle.  A kernel whose time per pixel grows as its
+ * working set leaves the caches is limited by memory bandwidth; one whose time is flat is compute bound.
+ * The scalar kernels timed here are the baseline against which any vectorised versions should be checked.
+ *
+ * Kernels (groups selected with -microbench, comma separated, or all):
+ * - transform: every *ImgTransform function with every transform (unsupported combinations are listed as such).
+ * - minmax: the scan for the smallest and largest values of floating point data (findDataRange).
+ * - flip: the vertical flip performed by every transform, as a plain copy.
+ * - noise: the noise added to raw floating point values and to integer intensities (if noise simulation is
+ *   compiled in).  These rows include the cost of the transform; compare them with the LINEAR rows.
+ * - quality: the pixel comparison of quality benchmarking (comparePixels), with and without a residual, the
+ *   structural similarity benchmarks (SSIM and MS-SSIM, on a single thread) and the comparison in physical units
+ *   (comparePhysicalValues) of floating point data with the inverse of every transform.
+ *
+ * Cache sizes are taken from sysconf where available.  Cycles are counted with the time stamp counter on
+ * x86, which runs at the nominal clock rate rather than the actual one; elsewhere, bytes per cycle is not
+ * reported.
+ */
+
+#include "f2j.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MICROBENCH_HAS_CYCLES 1
+#endif
+
+/**
+ * Minimum time over which each kernel is timed.
+ */
+#define MICROBENCH_SECONDS 0.1
+
+/**
+ * Number of working set sizes (L1, L2, L3, DRAM).
+ */
+#define WORKING_SETS 4
+
+/**
+ * Enumerated type defining the kernels that can be timed.
+ */
+typedef enum {
+	KERNEL_TRANSFORM /** A transform function. */,
+	KERNEL_MINMAX /** Scan for the smallest and largest values. */,
+	KERNEL_FLIP /** Vertical flip. */,
+	KERNEL_NOISE_RAW /** Transform of floating point data with noise added to the raw values. */,
+	KERNEL_NOISE_INTEGER /** Transform of short data with noise added to the intensities. */,
+	KERNEL_QUALITY /** Pixel comparison of quality benchmarking. */,
+	KERNEL_QUALITY_RESIDUAL /** Pixel comparison of quality benchmarking, also computing the residual. */,
+	KERNEL_SSIM /** Structural similarity. */,
+	KERNEL_MSSSIM /** Multi-scale structural similarity. */,
+	KERNEL_PHYSICAL /** Comparison in physical units: the inverse of a transform of floating point data and the error sums. */
+} kernel_type;
+
+/**
+ * Structure describing a kernel and the arrays it is run on.
+ */
+typedef struct {
+	kernel_type type /** Kernel to run. */;
+	int bitpix /** Type of the raw data (a CFITSIO BITPIX value).  Doubles are used for floating point data. */;
+	transform transform /** Transform performed, for transform and noise kernels. */;
+	void *input /** Raw data, or the uncompressed intensities for quality kernels. */;
+	int *output /** Intensities written, or the compressed intensities for quality kernels. */;
+	int *extra /** Noise field or residual written, if needed. */;
+	size_t pixels /** Number of pixels. */;
+	size_t width /** Width of the image. */;
+} microbench_kernel;
+
+/**
+ * Raw data types whose transforms are timed, and the names used for them.
+ */
+static const int kernelBitpix[] = {BYTE_IMG,SBYTE_IMG,SHORT_IMG,USHORT_IMG,LONG_IMG,ULONG_IMG,DOUBLE_IMG};
+static const char *kernelTypeNames[] = {"uint8","int8","int16","uint16","int32","uint32","float64"};
+
+/**
+ * Get the size of each raw datum of a type.
+ *
+ * @param bitpix Type of the raw data.
+ *
+ * @return Size in bytes.
+ */
+static size_t getRawSize(int bitpix) {
+	switch (bitpix) {
+		case BYTE_IMG: case SBYTE_IMG: return 1;
+		case SHORT_IMG: case USHORT_IMG: return 2;
+		case LONG_IMG: case ULONG_IMG: return 4;
+		default: return 8;
+	}
+}
+
+/**
+ * Get the name of a raw data type.
+ *
+ * @param bitpix Type of the raw data.
+ *
+ * @return Name of the type.
+ */
+static const char *getRawTypeName(int bitpix) {
+	// Loop variable
+	size_t ii;
+
+	for (ii=0; ii<sizeof(kernelBitpix)/sizeof(kernelBitpix[0]); ii++) {
+		if (kernelBitpix[ii] == bitpix) {
+			return kernelTypeNames[ii];
+		}
+	}
+
+	return "unknown";
+}
+
+/**
+ * Get the sizes of the working sets: half of the L1, L2 and L3 data caches (so that the arrays stay in the
+ * cache), and twice the L3 cache (at least 64 MB), so that the arrays come from main memory.
+ *
+ * @param sizes Array which will be populated with the working set sizes in bytes.
+ */
+static void getWorkingSetSizes(size_t sizes[WORKING_SETS]) {
+	long l1 = -1, l2 = -1, l3 = -1;
+
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+	l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+	l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+
+	// Common sizes if the caches can't be found.
+	if (l1 <= 0) {
+		l1 = 32 * 1024;
+	}
+
+	if (l2 <= 0) {
+		l2 = 1024 * 1024;
+	}
+
+	if (l3 <= 0) {
+		l3 = 8 * 1024 * 1024;
+	}
+
+	sizes[0] = l1 / 2;
+	sizes[1] = l2 / 2;
+	sizes[2] = l3 / 2;
+	sizes[3] = 2 * (size_t) l3 > 64 * 1024 * 1024 ? 2 * (size_t) l3 : 64 * 1024 * 1024;
+}
+
+/**
+ * Get the number of bytes read and written for each pixel by a kernel.
+ *
+ * @param kernel Reference to the kernel.
+ *
+ * @return Number of bytes.
+ */
+static size_t getBytesPerPixel(microbench_kernel *kernel) {
+	switch (kernel->type) {
+		case KERNEL_TRANSFORM:
+		case KERNEL_NOISE_RAW:
+		case KERNEL_PHYSICAL:
+			return getRawSize(kernel->bitpix) + sizeof(int);
+		case KERNEL_MINMAX:
+			return sizeof(double);
+		case KERNEL_FLIP:
+		case KERNEL_QUALITY:
+		case KERNEL_SSIM:
+		case KERNEL_MSSSIM:
+			return 2 * sizeof(int);
+		case KERNEL_NOISE_INTEGER:
+		case KERNEL_QUALITY_RESIDUAL:
+			return getRawSize(kernel->bitpix) + 2 * sizeof(int);
+	}
+
+	return 0;
+}
+
+/**
+ * Run a kernel once.
+ *
+ * @param kernel Reference to the kernel.
+ *
+ * @return 0 if the kernel ran successfully, 1 otherwise (e.g. an unsupported transform).
+ */
+static int runKernel(microbench_kernel *kernel) {
+	// Arguments for noise simulation, if compiled in.
+#ifdef noise
+#define KERNEL_NOISE_ARGUMENTS ,NULL,false,false
+#else
+#define KERNEL_NOISE_ARGUMENTS
+#endif
+
+	switch (kernel->type) {
+		case KERNEL_TRANSFORM:
+			switch (kernel->bitpix) {
+				case BYTE_IMG:
+					return byteImgTransform((unsigned char *) kernel->input,kernel->output,kernel->transform,kernel->pixels,kernel->width KERNEL_NOISE_ARGUMENTS);
+				case SBYTE_IMG:
+					return sByteImgTransform((signed char *) kernel->input,kernel->output,kernel->transform,kernel->pixels,kernel->width KERNEL_NOISE_ARGUMENTS);
+				case SHORT_IMG:
+					return shortImgTransform((short *) kernel->input,kernel->output,kernel->transform,kernel->pixels,kernel->width KERNEL_NOISE_ARGUMENTS);
+				case USHORT_IMG:
+					return uShortImgTransform((unsigned short *) kernel->input,kernel->output,kernel->transform,kernel->pixels,kernel->width KERNEL_NOISE_ARGUMENTS);
+				case LONG_IMG:
+					return intImgTransform((int *) kernel->input,kernel->output,kernel->transform,kernel->pixels,kernel->width KERNEL_NOISE_ARGUMENTS);
+				case ULONG_IMG:
+					return uIntImgTransform((unsigned int *) kernel->input,kernel->output,kernel->transform,kernel->pixels,kernel->width KERNEL_NOISE_ARGUMENTS);
+				default:
+					return floatDoubleTransform((double *) kernel->input,kernel->output,kernel->transform,kernel->pixels,1.0,10001.0,kernel->width KERNEL_NOISE_ARGUMENTS);
+			}
+		case KERNEL_MINMAX:
+		{
+			double datamin, datamax;
+			findDataRange((double *) kernel->input,kernel->pixels,&datamin,&datamax);
+
+			// Keep the result, so that the scan can't be optimised away.
+			kernel->output[0] = (int) (datamax - datamin);
+			return 0;
+		}
+		case KERNEL_FLIP:
+		{
+			// Loop variable
+			size_t ii;
+
+			// The same index arithmetic as the transforms.
+			int *rawData = (int *) kernel->input;
+			int *imageData = kernel->output;
+			size_t width = kernel->width;
+			size_t index = kernel->pixels - width;
+			size_t dif = 0;
+
+			for (ii=0; ii<kernel->pixels; ii++) {
+				imageData[ii] = rawData[index];
+				UPDATE_FLIPPING_INDEX();
+			}
+			return 0;
+		}
+#ifdef noise
+		case KERNEL_NOISE_RAW:
+			return floatDoubleTransform((double *) kernel->input,kernel->output,kernel->transform,kernel->pixels,1.0,10001.0,kernel->width,NULL,false,false);
+		case KERNEL_NOISE_INTEGER:
+			return shortImgTransform((short *) kernel->input,kernel->output,kernel->transform,kernel->pixels,kernel->width,kernel->extra,true,false);
+#else
+		case KERNEL_NOISE_RAW:
+		case KERNEL_NOISE_INTEGER:
+			return 1;
+#endif
+		case KERNEL_QUALITY:
+		case KERNEL_QUALITY_RESIDUAL:
+		{
+			quality_benchmark_info parameters;
+			memset(&parameters,0,sizeof(quality_benchmark_info));
+			parameters.meanSquaredError = true;
+			parameters.peakSignalToNoiseRatio = true;
+			parameters.meanAbsoluteError = true;
+			parameters.fidelity = true;
+			parameters.maximumAbsoluteDistortion = true;
+			parameters.performQualityBenchmarking = true;
+			parameters.writeResidual = kernel->type == KERNEL_QUALITY_RESIDUAL;
+
+			pixel_comparison comparison;
+
+			return comparePixels((int *) kernel->input,kernel->output,kernel->pixels,&parameters,parameters.writeResidual ? kernel->extra : NULL,
+					-32768,32767,"microbenchmark",&comparison) == COMPARISON_OK ? 0 : 1;
+		}
+		case KERNEL_SSIM:
+		case KERNEL_MSSSIM:
+		{
+			double ssim, msssim;
+
+			return computeStructuralSimilarity((int *) kernel->input,kernel->output,kernel->width,kernel->pixels / kernel->width,16,
+					kernel->type == KERNEL_MSSSIM,1,&ssim,&msssim);
+		}
+		case KERNEL_PHYSICAL:
+		{
+			// The same range as the transform kernels.
+			physical_plane plane;
+			plane.values = (double *) kernel->input;
+			plane.scaling.transform = kernel->transform;
+			plane.scaling.bitpix = DOUBLE_IMG;
+			plane.scaling.datamin = 1.0;
+			plane.scaling.datamax = 10001.0;
+			plane.scaling.bscale = 1.0;
+			plane.scaling.bzero = 0.0;
+
+			double rmse, maxError;
+
+			return comparePhysicalValues(&plane,kernel->output,kernel->width,kernel->pixels / kernel->width,&rmse,&maxError);
+		}
+	}
+
+#undef KERNEL_NOISE_ARGUMENTS
+
+	return 1;
+}
+
+/**
+ * Time a kernel, running it repeatedly for at least MICROBENCH_SECONDS after a warm up run.
+ *
+ * @param kernel Reference to the kernel.
+ * @param nsPerPixel Reference to double which will be set to the time per pixel in nanoseconds.
+ * @param cyclesPerPixel Reference to double which will be set to the number of cycles per pixel (0 if
+ * cycles can't be counted).
+ *
+ * @return 0 if the kernel ran successfully, 1 otherwise.
+ */
+static int timeKernel(microbench_kernel *kernel, double *nsPerPixel, double *cyclesPerPixel) {
+	// The warm up run also brings the arrays into the cache (or memory).
+	if (runKernel(kernel) != 0) {
+		return 1;
+	}
+
+	long runs = 0;
+	double startTime = getWallClockTime();
+	double elapsed;
+
+#ifdef MICROBENCH_HAS_CYCLES
+	unsigned long long startCycles = __rdtsc();
+#endif
+
+	do {
+		runKernel(kernel);
+		runs++;
+		elapsed = getWallClockTime() - startTime;
+	} while (elapsed < MICROBENCH_SECONDS);
+
+	double pixels = ((double) runs) * kernel->pixels;
+
+	*nsPerPixel = elapsed * 1.0e9 / pixels;
+
+#ifdef MICROBENCH_HAS_CYCLES
+	*cyclesPerPixel = ((double) (__rdtsc() - startCycles)) / pixels;
+#else
+	*cyclesPerPixel = 0.0;
+#endif
+
+	return 0;
+}
+
+/**
+ * Does a kernel compare uncompressed and compressed intensities?
+ *
+ * @param type Kernel.
+ *
+ * @return true for the quality kernels.
+ */
+static bool isQualityKernel(kernel_type type) {
+	return type == KERNEL_QUALITY || type == KERNEL_QUALITY_RESIDUAL || type == KERNEL_SSIM || type == KERNEL_MSSSIM;
+}
+
+/**
+ * Fill the arrays of a kernel with data in the range expected by the kernel.
+ *
+ * @param kernel Reference to the kernel.
+ */
+static void fillKernelData(microbench_kernel *kernel) {
+	// Loop variable
+	size_t ii;
+
+	// Linear congruential generator, so that runs are reproducible.
+	unsigned int state = 12345;
+
+	for (ii=0; ii<kernel->pixels; ii++) {
+		state = state * 1103515245u + 12345u;
+		unsigned int value = state >> 8;
+
+		switch (kernel->bitpix) {
+			case BYTE_IMG: ((unsigned char *) kernel->input)[ii] = (unsigned char) value; break;
+			case SBYTE_IMG: ((signed char *) kernel->input)[ii] = (signed char) value; break;
+			case SHORT_IMG: ((short *) kernel->input)[ii] = (short) value; break;
+			case USHORT_IMG: ((unsigned short *) kernel->input)[ii] = (unsigned short) value; break;
+			case LONG_IMG: ((int *) kernel->input)[ii] = (int) (value << 8); break;
+			case ULONG_IMG: ((unsigned int *) kernel->input)[ii] = value << 8; break;
+			default: ((double *) kernel->input)[ii] = 1.0 + (value % 10000); break;
+		}
+
+		kernel->output[ii] = (int) (value & 0xffff);
+	}
+
+	// Quality kernels compare 16 bit intensities differing by a little noise.
+	if (isQualityKernel(kernel->type)) {
+		for (ii=0; ii<kernel->pixels; ii++) {
+			((int *) kernel->input)[ii] = kernel->output[ii] + (int) (ii % 7) - 3;
+		}
+	}
+}
+
+/**
+ * Time a kernel at each working set size and write a row of the results table for each.
+ *
+ * @param type Kernel to time.
+ * @param bitpix Type of the raw data.
+ * @param transform Transform performed.
+ * @param sizes Working set sizes.
+ *
+ * @return 0 if the kernel ran successfully, 1 if it is unsupported or memory couldn't be allocated.
+ */
+static int benchmarkKernel(kernel_type type, int bitpix, transform transform, size_t sizes[WORKING_SETS]) {
+	// Loop variable
+	int ii;
+
+	static const char *workingSetNames[WORKING_SETS] = {"L1","L2","L3","DRAM"};
+	static const char *kernelNames[] = {"transform","minmax","flip","noise_raw","noise_integer","quality","quality_residual","ssim","msssim","physical"};
+
+	microbench_kernel kernel;
+	kernel.type = type;
+	kernel.bitpix = bitpix;
+	kernel.transform = transform;
+
+	size_t bytesPerPixel = getBytesPerPixel(&kernel);
+
+	for (ii=0; ii<WORKING_SETS; ii++) {
+		// Whole rows, as the transforms flip the image.
+		size_t width = sizes[ii] / bytesPerPixel >= 256 * 16 ? 256 : 32;
+		size_t pixels = (sizes[ii] / bytesPerPixel / width) * width;
+
+		if (pixels == 0) {
+			pixels = width;
+		}
+
+		kernel.width = width;
+		kernel.pixels = pixels;
+		kernel.input = malloc(pixels * (isQualityKernel(type) || type == KERNEL_FLIP ? sizeof(int) : getRawSize(bitpix)));
+		kernel.output = (int *) malloc(pixels * sizeof(int));
+		kernel.extra = (int *) malloc(pixels * sizeof(int));
+
+		if (kernel.input == NULL || kernel.output == NULL || kernel.extra == NULL) {
+			fprintf(stderr,"Unable to allocate memory for microbenchmark of %zu pixels.\n",pixels);
+			free(kernel.input);
+			free(kernel.output);
+			free(kernel.extra);
+			return 1;
+		}
+
+		// Flip copies ints.
+		kernel.bitpix = type == KERNEL_FLIP || isQualityKernel(type) ? LONG_IMG : bitpix;
+		fillKernelData(&kernel);
+		kernel.bitpix = bitpix;
+
+		double nsPerPixel, cyclesPerPixel;
+		int result = timeKernel(&kernel,&nsPerPixel,&cyclesPerPixel);
+
+		free(kernel.input);
+		free(kernel.output);
+		free(kernel.extra);
+
+		if (result != 0) {
+			fprintf(stdout,"%s %s %s - - unsupported\n",kernelNames[type],getRawTypeName(bitpix),
+					type == KERNEL_TRANSFORM || type == KERNEL_NOISE_RAW || type == KERNEL_NOISE_INTEGER || type == KERNEL_PHYSICAL ? getTransformName(transform) : "-");
+			return 1;
+		}
+
+		fprintf(stdout,"%s %s %s %s %zu %f %f ",kernelNames[type],getRawTypeName(bitpix),
+				type == KERNEL_TRANSFORM || type == KERNEL_NOISE_RAW || type == KERNEL_NOISE_INTEGER || type == KERNEL_PHYSICAL ? getTransformName(transform) : "-",
+				workingSetNames[ii],pixels*bytesPerPixel,nsPerPixel,bytesPerPixel/nsPerPixel);
+
+		if (cyclesPerPixel > 0.0) {
+			fprintf(stdout,"%f\n",bytesPerPixel/cyclesPerPixel);
+		}
+		else {
+			fprintf(stdout,"-\n");
+		}
+
+		fflush(stdout);
+	}
+
+	return 0;
+}
+
+/**
+ * Check whether a group of kernels was selected.
+ *
+ * @param selection Comma separated list of groups, or all.
+ * @param group Group to look for.
+ *
+ * @return Was the group selected?
+ */
+static bool isGroupSelected(const char *selection, const char *group) {
+	if (strcmp(selection,"all") == 0) {
+		return true;
+	}
+
+	size_t length = strlen(group);
+	const char *position;
+
+	for (position=strstr(selection,group); position != NULL; position=strstr(position+1,group)) {
+		if ((position == selection || position[-1] == ',') && (position[length] == '\0' || position[length] == ',')) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Run the microbenchmarks and write a table of the results to stdout.
+ *
+ * @param selection Comma separated list of the groups of kernels to time (transform, minmax, flip, noise and
+ * quality), or all.
+ *
+ * @return 0 if the selection is valid, 1 otherwise.
+ */
+int runMicrobenchmarks(const char *selection) {
+	if (selection == NULL) {
+		fprintf(stderr,"Parameters to runMicrobenchmarks cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variables
+	size_t ii;
+	int jj;
+
+	if (!isGroupSelected(selection,"transform") && !isGroupSelected(selection,"minmax") && !isGroupSelected(selection,"flip") &&
+			!isGroupSelected(selection,"noise") && !isGroupSelected(selection,"quality")) {
+		fprintf(stderr,"Microbenchmarks (option -microbench) must be all or a list of transform, minmax, flip, noise and quality.\n");
+		return 1;
+	}
+
+	size_t sizes[WORKING_SETS];
+	getWorkingSetSizes(sizes);
+
+	fprintf(stdout,"Working sets: L1 %zu, L2 %zu, L3 %zu, DRAM %zu bytes.  ",sizes[0],sizes[1],sizes[2],sizes[3]);
+#ifdef MICROBENCH_HAS_CYCLES
+	fprintf(stdout,"Cycles are time stamp counter cycles.\n");
+#else
+	fprintf(stdout,"Cycles can't be counted on this platform.\n");
+#endif
+	fprintf(stdout,"[kernel] [type] [transform] [working set] [bytes] [ns/pixel] [GB/s] [bytes/cycle]\n");
+
+	if (isGroupSelected(selection,"transform")) {
+		for (ii=0; ii<sizeof(kernelBitpix)/sizeof(kernelBitpix[0]); ii++) {
+			for (jj=LOG; jj<DEFAULT; jj++) {
+				benchmarkKernel(KERNEL_TRANSFORM,kernelBitpix[ii],(transform) jj,sizes);
+			}
+		}
+	}
+
+	if (isGroupSelected(selection,"minmax")) {
+		benchmarkKernel(KERNEL_MINMAX,DOUBLE_IMG,DEFAULT,sizes);
+	}
+
+	if (isGroupSelected(selection,"flip")) {
+		benchmarkKernel(KERNEL_FLIP,LONG_IMG,DEFAULT,sizes);
+	}
+
+	if (isGroupSelected(selection,"quality")) {
+		benchmarkKernel(KERNEL_QUALITY,LONG_IMG,DEFAULT,sizes);
+		benchmarkKernel(KERNEL_QUALITY_RESIDUAL,LONG_IMG,DEFAULT,sizes);
+		benchmarkKernel(KERNEL_SSIM,LONG_IMG,DEFAULT,sizes);
+		benchmarkKernel(KERNEL_MSSSIM,LONG_IMG,DEFAULT,sizes);
+
+		for (jj=LOG; jj<DEFAULT; jj++) {
+			if (jj != RAW && jj != NEGATIVE_RAW) {
+				benchmarkKernel(KERNEL_PHYSICAL,DOUBLE_IMG,(transform) jj,sizes);
+			}
+		}
+	}
+
+	// Noise is timed last, as integer noise can't be turned off again once it is set up.
+	if (isGroupSelected(selection,"noise")) {
+#ifdef noise
+		double savedPct = gaussianNoisePctStdDeviation;
+		gaussianNoisePctStdDeviation = 1.0;
+		benchmarkKernel(KERNEL_NOISE_RAW,DOUBLE_IMG,LINEAR,sizes);
+		gaussianNoisePctStdDeviation = savedPct;
+
+		double noiseDB = 40.0;
+		int maxIntensity = 65535;
+		unsigned long seed = 1;
+		getIntegerGaussianNoise(&noiseDB,&maxIntensity,&seed);
+		benchmarkKernel(KERNEL_NOISE_INTEGER,SHORT_IMG,LINEAR,sizes);
+#else
+		fprintf(stderr,"Noise simulation is not compiled in (see f2j.h), so the noise kernels are not timed.\n");
+#endif
+	}
+
+	return 0;
+}
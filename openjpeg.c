@@ -51,6 +51,44 @@ but we need the code, and it's better not to place an unmodified source file in
 if we can import it from elsewhere.  */
 #include "format_defs.h"
 
+/**
+ * Values returned by opj_getopt_long for long options that have no single character equivalent.  The
+ * single characters are all taken, so these start beyond the range of characters.
+ */
+enum {
+	OPTION_BATCH = 256,
+	OPTION_THREADS,
+	OPTION_SERVE,
+	OPTION_REGION,
+	OPTION_REGION_SKY,
+	OPTION_READ_THREADS,
+	OPTION_ENCODE_THREADS,
+	OPTION_HDU,
+	OPTION_READAHEAD,
+	OPTION_PROFILE,
+	OPTION_THROUGHPUT,
+	OPTION_MICROBENCH,
+	OPTION_DEADLINE,
+	OPTION_MIN_PSNR,
+	OPTION_TARGET_BPP,
+	OPTION_TUNE,
+	OPTION_PARAMS,
+	OPTION_SAVE_PARAMS,
+	OPTION_M_FAST,
+	OPTION_J2F,
+	OPTION_J2F_META,
+	OPTION_CB_DETAIL,
+	OPTION_REDUCE,
+	OPTION_LAYERS,
+	OPTION_DECODE_THREADS,
+	OPTION_VERIFY_THREADS,
+	OPTION_VERIFY_MEMORY,
+	OPTION_QB_SAMPLE,
+	OPTION_QB_SSIM,
+	OPTION_QB_MSSSIM,
+	OPTION_QB_PHYS
+};
+
 /**
  * Display usage information for image_to_j2k command line parameters that are used
  * by f2j.  Largely taken from image_to_j2k.c.
@@ -282,8 +320,10 @@ OPJ_PROG_ORDER give_progression(char progression[4]) {
  * individual benchmarks may be turned on by specifying QB_FID for fidelity, QB_PSNR for peak signal
  * to noise ratio, QB_MAD for maximum absolute distortion, QB_MSE for mean square error, QB_RMSE for
  * root mean square error, QB_MAE for mean absolute error, QB_SE for squared error, QB_AE for absolute
- * error and QB_SI for sum of uncompressed squared image intensities.  QB_RES specifies if a residual
- * image should be written.
+ * error, QB_SI for sum of uncompressed squared image intensities, QB_SSIM for structural similarity,
+ * QB_MSSSIM for multi-scale structural similarity and QB_PHYS for the root mean squared and maximum error in
+ * the units of the FITS data (which QB doesn't include).  QB_RES specifies if a residual
+ * image should be written.  QB_sample estimates the benchmarks from part of each image or cube.
  * @param performCompressionBenchmarking Reference to boolean specifying if compression benchmarking
  * should be performed on the images being compressed.  This will be set to true if the CB parameter
  * is present on the command line.
@@ -292,6 +332,25 @@ OPJ_PROG_ORDER give_progression(char progression[4]) {
  * value will be interpreted as a single stoke to read.
  * @param lastStoke Last stoke of data volume to read.  Ignored for 2D or 3D images.  Will only be
  * modified if the S2 parameter is present.
+ * @param cubeParameters Reference to cube_encoding_info structure specifying how the planes of a data cube
+ * are grouped into JPEG 2000 images.  Assumed to be initialised to one plane per image before this function
+ * is called.  The MC parameter sets the number of planes packed into each image and MCT turns on the
+ * multi-component transform (only valid for 3 planes per image).  The spectral parameter selects a transform
+ * (DPCM or DWT53) to decorrelate the planes of each image and spectral_levels sets the number of wavelet levels.
+ * @param region Reference to region_info structure specifying the region of each plane to convert.  Assumed to be
+ * initialised to REGION_NONE before this function is called.  Set by the region (pixel coordinates) and region_sky
+ * (world coordinates) parameters, each of which takes the coordinates of opposite corners as x0,y0,x1,y1.
+ * @param hdus Reference to hdu_selection structure specifying the HDUs of a multi-extension file to convert.  Assumed
+ * to be initialised to no selection before this function is called.  Set by the hdu parameter, which takes "all" or a
+ * comma separated list of HDU numbers and ranges (e.g. 2,4-9), where 1 is the primary HDU.
+ * @param readahead Reference to the number of planes of a data cube to read ahead of the plane being encoded.  Will only
+ * be modified if the readahead parameter is present.
+ * @param rateControl Reference to rate_control_info structure specifying adaptive rate control.  Assumed to be initialised
+ * to no rate control before this function is called.  Set by the deadline (seconds per data cube), min_psnr (dB) and
+ * target_bpp (bits per pixel) parameters.
+ * @param batchParameters Reference to batch_info structure specifying a set of FITS files to convert in batch mode.
+ * Assumed to be initialised to an empty source and socket and one thread before this function is called.  Set by the
+ * batch, serve and threads parameters.  The -i parameter is not required in batch or server mode.
  * @param noiseDB Reference to a double specifying the PSNR of the image after (Gaussian noise) has been added.
  * Will not be changed unless the -noise command line parameter is present.
  *  If the definition of noise is removed from f2j.h, this parameter will disappear.
@@ -318,7 +377,8 @@ OPJ_PROG_ORDER give_progression(char progression[4]) {
  */
 int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters, transform *transform, bool *writeUncompressed,
 		long *startFrame, long *endFrame, quality_benchmark_info *benchmarkQualityParameters, bool *performCompressionBenchmarking,
-		long *firstStoke, long *lastStoke
+		long *firstStoke, long *lastStoke, cube_encoding_info *cubeParameters, region_info *region, hdu_selection *hdus, int *readahead,
+		rate_control_info *rateControl, batch_info *batchParameters
 #ifdef noise
 		, double *noiseDB, bool *noiseSet, unsigned long *seed, bool *seedSet, double *noisePct, bool *writeNoiseField
 #endif
@@ -347,9 +407,46 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 		{"QB_AE",NO_ARG, NULL, 'Y'},
 		{"QB_SI",NO_ARG, NULL, 'X'},
 		{"QB_RES",NO_ARG, NULL, 'Z'},
+		{"QB_sample",REQ_ARG, NULL,OPTION_QB_SAMPLE},
+		{"QB_SSIM",NO_ARG, NULL,OPTION_QB_SSIM},
+		{"QB_MSSSIM",NO_ARG, NULL,OPTION_QB_MSSSIM},
+		{"QB_PHYS",NO_ARG, NULL,OPTION_QB_PHYS},
 		{"suffix",REQ_ARG, NULL, 'O'},
 		{"CB",NO_ARG,NULL,'g'},
-		{"LL",NO_ARG, NULL,'l'}
+		{"CB_detail",NO_ARG,NULL,OPTION_CB_DETAIL},
+		{"LL",NO_ARG, NULL,'l'},
+		{"MC",REQ_ARG, NULL,'j'},
+		{"MCT",NO_ARG, NULL,'k'},
+		{"spectral",REQ_ARG, NULL,'v'},
+		{"spectral_levels",REQ_ARG, NULL,'w'},
+		{"batch",REQ_ARG, NULL,OPTION_BATCH},
+		{"threads",REQ_ARG, NULL,OPTION_THREADS},
+		{"serve",REQ_ARG, NULL,OPTION_SERVE},
+		{"-serve",REQ_ARG, NULL,OPTION_SERVE}, /* Also accept --serve. */
+		{"region",REQ_ARG, NULL,OPTION_REGION},
+		{"region_sky",REQ_ARG, NULL,OPTION_REGION_SKY},
+		{"read_threads",REQ_ARG, NULL,OPTION_READ_THREADS},
+		{"encode_threads",REQ_ARG, NULL,OPTION_ENCODE_THREADS},
+		{"hdu",REQ_ARG, NULL,OPTION_HDU},
+		{"readahead",REQ_ARG, NULL,OPTION_READAHEAD},
+		{"profile",REQ_ARG, NULL,OPTION_PROFILE},
+		{"throughput",REQ_ARG, NULL,OPTION_THROUGHPUT},
+		{"microbench",REQ_ARG, NULL,OPTION_MICROBENCH},
+		{"deadline",REQ_ARG, NULL,OPTION_DEADLINE},
+		{"min_psnr",REQ_ARG, NULL,OPTION_MIN_PSNR},
+		{"target_bpp",REQ_ARG, NULL,OPTION_TARGET_BPP},
+		{"tune",REQ_ARG, NULL,OPTION_TUNE},
+		{"-tune",REQ_ARG, NULL,OPTION_TUNE}, /* Also accept --tune. */
+		{"params",REQ_ARG, NULL,OPTION_PARAMS},
+		{"save_params",REQ_ARG, NULL,OPTION_SAVE_PARAMS},
+		{"M_fast",NO_ARG, NULL,OPTION_M_FAST},
+		{"j2f",REQ_ARG, NULL,OPTION_J2F},
+		{"j2f_meta",NO_ARG, NULL,OPTION_J2F_META},
+		{"reduce",REQ_ARG, NULL,OPTION_REDUCE},
+		{"layers",REQ_ARG, NULL,OPTION_LAYERS},
+		{"decode_threads",REQ_ARG, NULL,OPTION_DECODE_THREADS},
+		{"verify_threads",REQ_ARG, NULL,OPTION_VERIFY_THREADS},
+		{"verify_memory",REQ_ARG, NULL,OPTION_VERIFY_MEMORY}
 #ifdef noise
 		,{"noise",REQ_ARG, NULL, '1'},
 		{"noise_pct",REQ_ARG, NULL, '2'},
@@ -370,6 +467,9 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 
 	totlen=sizeof(long_option);
 
+	// The command line may be parsed more than once (once per job in server mode).
+	reset_options_reading();
+
 	// Use JP2 if no output format is specified.
 	parameters->cod_format = CODEC_JP2;
 
@@ -537,6 +637,30 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 			}
 			break;
 
+			/* Structural similarity? */
+			case OPTION_QB_SSIM:
+			{
+				benchmarkQualityParameters->structuralSimilarity = true;
+				benchmarkQualityParameters->performQualityBenchmarking = true;
+			}
+			break;
+
+			/* Multi-scale structural similarity? */
+			case OPTION_QB_MSSSIM:
+			{
+				benchmarkQualityParameters->multiScaleStructuralSimilarity = true;
+				benchmarkQualityParameters->performQualityBenchmarking = true;
+			}
+			break;
+
+			/* Error in physical units? */
+			case OPTION_QB_PHYS:
+			{
+				benchmarkQualityParameters->physicalError = true;
+				benchmarkQualityParameters->performQualityBenchmarking = true;
+			}
+			break;
+
 			/* Should a residual image be written? */
 			case 'Z':
 			{
@@ -544,6 +668,15 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 			}
 			break;
 
+			/* Should the quality benchmarks be estimated from part of each image or cube? */
+			case OPTION_QB_SAMPLE:
+			{
+				if (parseQualitySampling(opj_optarg,&benchmarkQualityParameters->sampling) != 0) {
+					return 1;
+				}
+			}
+			break;
+
 			/* Should compression benchmarking be performed? */
 			case 'g':
 			{
@@ -551,6 +684,14 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 			}
 			break;
 
+			/* Should compression benchmarking also account for each image, kind of file and quality layer? */
+			case OPTION_CB_DETAIL:
+			{
+				*performCompressionBenchmarking = true;
+				batchParameters->rateDetail = true;
+			}
+			break;
+
 			/* What is the first stoke of the data volume to read? */
 			case 'a':
 			{
@@ -565,63 +706,370 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 			}
 			break;
 
-			/* What is the first frame of the data cube to read? */
-			case 'x':
+			/* How many planes should be packed into each JPEG 2000 image? */
+			case 'j':
 			{
-				*startFrame = strtol(opj_optarg,NULL,10);
+				cubeParameters->planesPerImage = strtol(opj_optarg,NULL,10);
+
+				if (cubeParameters->planesPerImage < 1 || cubeParameters->planesPerImage > MAX_PLANES_PER_IMAGE) {
+					fprintf(stderr,"Number of planes per image (option -MC) must be between 1 and %d.\n",MAX_PLANES_PER_IMAGE);
+					return 1;
+				}
 			}
 			break;
 
-			/* What is the last frame of the data cube to read? */
-			case 'y':
+			/* Should the multi-component transform be applied to each image? */
+			case 'k':
 			{
-				*endFrame = strtol(opj_optarg,NULL,10);
+				cubeParameters->multiComponentTransform = true;
 			}
 			break;
 
-			/* What transform should be performed on the raw FITS data? */
-			case 'A':
+			/* What transform should be performed along the spectral axis? */
+			case 'v':
+			{
+				if (strcasecmp(opj_optarg,"DPCM") == 0) {
+					cubeParameters->spectralTransform = SPECTRAL_DPCM;
+				}
+				else if (strcasecmp(opj_optarg,"DWT53") == 0) {
+					cubeParameters->spectralTransform = SPECTRAL_DWT53;
+				}
+				else if (strcasecmp(opj_optarg,"NONE") == 0) {
+					cubeParameters->spectralTransform = SPECTRAL_NONE;
+				}
+				else {
+					fprintf(stderr,"Unknown spectral transform specified: %s [DPCM, DWT53, NONE]\n",opj_optarg);
+					return 1;
+				}
+			}
+			break;
+
+			/* How many levels of the spectral wavelet transform should be performed? */
+			case 'w':
 			{
-				// This should be synced with the possibilities in f2j.h.
-				char *transformString = opj_optarg;
+				cubeParameters->spectralLevels = strtol(opj_optarg,NULL,10);
 
-				if (strcasecmp(transformString,"LOG") == 0) {
-					*transform = LOG;
+				if (cubeParameters->spectralLevels < 0) {
+					fprintf(stderr,"Number of spectral wavelet levels (option -spectral_levels) cannot be negative.\n");
+					return 1;
 				}
-				else if (strcasecmp(transformString,"NEGATIVE_LOG") == 0) {
-					*transform = NEGATIVE_LOG;
+			}
+			break;
+
+			/* FITS files to convert in batch mode. */
+			case OPTION_BATCH:
+			{
+				strncpy(batchParameters->source,opj_optarg,sizeof(batchParameters->source)-1);
+			}
+			break;
+
+			/* Region of each plane to convert, in pixel or world coordinates. */
+			case OPTION_REGION:
+			case OPTION_REGION_SKY:
+			{
+				if (sscanf(opj_optarg,"%lf,%lf,%lf,%lf",&region->x0,&region->y0,&region->x1,&region->y1) != 4) {
+					fprintf(stderr,"Region must be given as x0,y0,x1,y1.\n");
+					return 1;
 				}
-				else if (strcasecmp(transformString,"LINEAR") == 0) {
-					*transform = LINEAR;
+
+				region->type = (c == OPTION_REGION) ? REGION_PIXEL : REGION_SKY;
+			}
+			break;
+
+			/* HDUs of a multi-extension file to convert: all, or a list of numbers and ranges. */
+			case OPTION_HDU:
+			{
+				hdus->all = false;
+				hdus->count = 0;
+
+				if (strcmp(opj_optarg,"all") == 0) {
+					hdus->all = true;
+					break;
 				}
-				else if (strcasecmp(transformString,"NEGATIVE_LINEAR") == 0) {
-					*transform = NEGATIVE_LINEAR;
+
+				char *position = opj_optarg;
+
+				while (*position != '\0') {
+					char *end;
+					long first = strtol(position,&end,10);
+					long last = first;
+
+					if (end == position) {
+						fprintf(stderr,"HDUs (option -hdu) must be all or a list of HDU numbers and ranges, such as 2,4-9.\n");
+						return 1;
+					}
+
+					if (*end == '-') {
+						position = end+1;
+						last = strtol(position,&end,10);
+
+						if (end == position) {
+							fprintf(stderr,"HDUs (option -hdu) must be all or a list of HDU numbers and ranges, such as 2,4-9.\n");
+							return 1;
+						}
+					}
+
+					if (first < 1 || last < first) {
+						fprintf(stderr,"HDU numbers (option -hdu) must be at least 1, with the first HDU of each range before the last.\n");
+						return 1;
+					}
+
+					for (; first<=last; first++) {
+						if (hdus->count == MAX_SELECTED_HDUS) {
+							fprintf(stderr,"At most %d HDUs can be listed (option -hdu).  Use -hdu all to convert every HDU.\n",MAX_SELECTED_HDUS);
+							return 1;
+						}
+
+						hdus->numbers[hdus->count++] = (int) first;
+					}
+
+					position = (*end == ',') ? end+1 : end;
+
+					if (*end != ',' && *end != '\0') {
+						fprintf(stderr,"HDUs (option -hdu) must be all or a list of HDU numbers and ranges, such as 2,4-9.\n");
+						return 1;
+					}
 				}
-				else if (strcasecmp(transformString,"RAW") == 0) {
-					*transform = RAW;
+			}
+			break;
+
+			/* Number of planes of a data cube to read ahead of the plane being encoded. */
+			case OPTION_READAHEAD:
+			{
+				*readahead = strtol(opj_optarg,NULL,10);
+
+				if (*readahead < 0) {
+					fprintf(stderr,"Number of planes to read ahead (option -readahead) cannot be negative.\n");
+					return 1;
 				}
-				else if (strcasecmp(transformString,"NEGATIVE_RAW") == 0) {
-					*transform = NEGATIVE_RAW;
+			}
+			break;
+
+			/* Format (and file) in which to write the time spent in each stage of the conversion. */
+			case OPTION_PROFILE:
+			{
+				if (setProfileOutput(opj_optarg) != 0) {
+					return 1;
 				}
-				else if (strcasecmp(transformString,"SQRT") == 0) {
-					*transform = SQRT;
+			}
+			break;
+
+			/* Matrix of settings to benchmark on synthetic FITS cubes. */
+			case OPTION_THROUGHPUT:
+			{
+				strncpy(batchParameters->throughput,opj_optarg,sizeof(batchParameters->throughput)-1);
+			}
+			break;
+
+			/* Groups of kernels to time in isolation. */
+			case OPTION_MICROBENCH:
+			{
+				strncpy(batchParameters->microbench,opj_optarg,sizeof(batchParameters->microbench)-1);
+			}
+			break;
+
+			/* Wall clock time within which each data cube should be converted, adjusting the parameters between planes. */
+			case OPTION_DEADLINE:
+			{
+				rateControl->deadline = strtod(opj_optarg,NULL);
+
+				if (rateControl->deadline <= 0.0) {
+					fprintf(stderr,"Deadline (option -deadline) must be a positive number of seconds.\n");
+					return 1;
 				}
-				else if (strcasecmp(transformString,"NEGATIVE_SQRT") == 0) {
-					*transform = NEGATIVE_SQRT;
+			}
+			break;
+
+			/* Minimum PSNR of each plane under rate control. */
+			case OPTION_MIN_PSNR:
+			{
+				rateControl->minPSNR = strtod(opj_optarg,NULL);
+
+				if (rateControl->minPSNR <= 0.0) {
+					fprintf(stderr,"Minimum PSNR (option -min_psnr) must be a positive number of dB.\n");
+					return 1;
 				}
-				else if (strcasecmp(transformString,"SQUARED") == 0) {
-					*transform = SQUARED;
+			}
+			break;
+
+			/* Rate of each image under rate control. */
+			case OPTION_TARGET_BPP:
+			{
+				rateControl->targetBPP = strtod(opj_optarg,NULL);
+
+				if (rateControl->targetBPP <= 0.0) {
+					fprintf(stderr,"Target rate (option -target_bpp) must be a positive number of bits per pixel.\n");
+					return 1;
 				}
-				else if (strcasecmp(transformString,"NEGATIVE_SQUARED") == 0) {
-					*transform = NEGATIVE_SQUARED;
+			}
+			break;
+
+			/* Search space of parameters to tune on the input file. */
+			case OPTION_TUNE:
+			{
+				strncpy(batchParameters->tune,opj_optarg,sizeof(batchParameters->tune)-1);
+			}
+			break;
+
+			/* Parameter profile (e.g. written by -tune or -save_params) to apply to the options given so far. */
+			case OPTION_PARAMS:
+			{
+				if (loadParameterProfile(opj_optarg,parameters,transform,benchmarkQualityParameters) != 0) {
+					return 1;
 				}
-				else if (strcasecmp(transformString,"POWER") == 0) {
-					*transform = POWER;
+			}
+			break;
+
+			/* Parameter profile to save the options to. */
+			case OPTION_SAVE_PARAMS:
+			{
+				strncpy(batchParameters->saveParams,opj_optarg,sizeof(batchParameters->saveParams)-1);
+			}
+			break;
+
+			/* JPEG 2000 image, and optionally the FITS file to write, to convert back to FITS. */
+			case OPTION_J2F:
+			{
+				strncpy(batchParameters->j2f,opj_optarg,sizeof(batchParameters->j2f)-1);
+			}
+			break;
+
+			/* Record what -j2f needs to restore physical values and the WCS in the comment of each image. */
+			case OPTION_J2F_META:
+			{
+				cubeParameters->recordMetadata = true;
+			}
+			break;
+
+			/* Number of resolution levels to discard when decoding. */
+			case OPTION_REDUCE:
+			{
+				batchParameters->decode.reduce = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->decode.reduce < 0 || batchParameters->decode.reduce > MAX_REDUCE) {
+					fprintf(stderr,"Number of resolution levels to discard (option -reduce) must be between 0 and %d.\n",MAX_REDUCE);
+					return 1;
 				}
-				else if (strcasecmp(transformString,"NEGATIVE_POWER") == 0) {
-					*transform = NEGATIVE_POWER;
+			}
+			break;
+
+			/* Number of quality layers to decode. */
+			case OPTION_LAYERS:
+			{
+				batchParameters->decode.layers = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->decode.layers < 1) {
+					fprintf(stderr,"Number of quality layers to decode (option -layers) must be at least 1.\n");
+					return 1;
 				}
-				else {
+			}
+			break;
+
+			/* Number of threads decoding each image. */
+			case OPTION_DECODE_THREADS:
+			{
+				batchParameters->decode.threads = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->decode.threads < 1) {
+					fprintf(stderr,"Number of threads (option -decode_threads) must be at least 1.\n");
+					return 1;
+				}
+
+#ifndef OPJ_HAVE_TIER1_DECODE_THREADS
+				fprintf(stderr,"OpenJPEG was built without patches/0004-parallel-tier1-decode.patch, so only images with several tiles decode on several threads.\n");
+#endif
+			}
+			break;
+
+			/* Number of threads verifying images while the next planes are encoded. */
+			case OPTION_VERIFY_THREADS:
+			{
+				batchParameters->verifyThreads = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->verifyThreads < 1) {
+					fprintf(stderr,"Number of threads (option -verify_threads) must be at least 1.\n");
+					return 1;
+				}
+			}
+			break;
+
+			/* Limit on the memory held by the images waiting to be verified. */
+			case OPTION_VERIFY_MEMORY:
+			{
+				batchParameters->verifyMemory = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->verifyMemory < 1) {
+					fprintf(stderr,"Memory limit (option -verify_memory) must be at least 1 MB.\n");
+					return 1;
+				}
+			}
+			break;
+
+			/* Socket on which to accept conversion jobs in server mode. */
+			case OPTION_SERVE:
+			{
+				strncpy(batchParameters->socket,opj_optarg,sizeof(batchParameters->socket)-1);
+			}
+			break;
+
+			/* Number of files to convert concurrently in batch or server mode. */
+			case OPTION_THREADS:
+			{
+				batchParameters->threads = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->threads < 1) {
+					fprintf(stderr,"Number of threads (option -threads) must be at least 1.\n");
+					return 1;
+				}
+			}
+			break;
+
+			/* Number of threads decompressing each plane of a tile-compressed image. */
+			case OPTION_READ_THREADS:
+			{
+				batchParameters->readThreads = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->readThreads < 1) {
+					fprintf(stderr,"Number of threads (option -read_threads) must be at least 1.\n");
+					return 1;
+				}
+			}
+			break;
+
+			/* Number of threads coding the code-blocks of each image. */
+			case OPTION_ENCODE_THREADS:
+			{
+				batchParameters->encodeThreads = strtol(opj_optarg,NULL,10);
+
+				if (batchParameters->encodeThreads < 1) {
+					fprintf(stderr,"Number of threads (option -encode_threads) must be at least 1.\n");
+					return 1;
+				}
+
+#ifndef OPJ_HAVE_TIER1_THREADS
+				fprintf(stderr,"OpenJPEG was built without patches/0001-parallel-tier1.patch, so code-blocks will be coded serially.\n");
+#endif
+			}
+			break;
+
+			/* What is the first frame of the data cube to read? */
+			case 'x':
+			{
+				*startFrame = strtol(opj_optarg,NULL,10);
+			}
+			break;
+
+			/* What is the last frame of the data cube to read? */
+			case 'y':
+			{
+				*endFrame = strtol(opj_optarg,NULL,10);
+			}
+			break;
+
+			/* What transform should be performed on the raw FITS data? */
+			case 'A':
+			{
+				if (parseTransform(opj_optarg,transform) != 0) {
 					fprintf(stderr,"Unknown transform specified: %s.  Using default instead.\n",opj_optarg);
 				}
 			}
@@ -903,6 +1351,15 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 
 				/* ------------------------------------------------------ */
 
+			/* Preset for -M: the mode switches that make the block coder fastest. */
+			case OPTION_M_FAST:
+			{
+				parameters->mode |= FAST_MODE_SWITCHES;
+			}
+			break;
+
+				/* ------------------------------------------------------ */
+
 			case 'R':			/* ROI */
 			{
 				if (sscanf(opj_optarg, "c=%d,U=%d", &parameters->roi_compno,
@@ -1298,7 +1755,8 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 	} while (c != -1);
 
 	/* check for possible errors */
-	if((parameters->infile[0] == 0)) {
+	if((parameters->infile[0] == 0) && (batchParameters->source[0] == 0) && (batchParameters->socket[0] == 0) && (batchParameters->throughput[0] == 0)
+			&& (batchParameters->microbench[0] == 0) && (batchParameters->saveParams[0] == 0) && (batchParameters->j2f[0] == 0)) {
 		fprintf(stderr, "No input file specified - Example: %s -i image.fits\n",argv[0]);
 		fprintf(stderr, "    Try: %s -h\n",argv[0]);
 		return 1;
@@ -1341,6 +1799,130 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 		fprintf(stderr,"or data volume are converted.  Beware of this when interpreting results.\n");
 	}
 
+	/*
+	 * The target rate is reached by scaling the compression ratios of the layers, so requires rate allocation by ratio.
+	 */
+	if (rateControl->targetBPP > 0.0 && (parameters->cp_fixed_quality || parameters->cp_fixed_alloc)) {
+		fprintf(stderr,"Option -target_bpp cannot be used with -q or -f.\n");
+		return 1;
+	}
+
+	/*
+	 * A single input file is ignored in batch mode.
+	 */
+	if (parameters->infile[0] != 0 && batchParameters->source[0] != 0) {
+		fprintf(stderr,"Both -i and -batch specified.  Only the files named by -batch will be converted.\n");
+		parameters->infile[0] = 0;
+	}
+
+	/*
+	 * Batch and server modes are separate ways of running the program.
+	 */
+	if (batchParameters->source[0] != 0 && batchParameters->socket[0] != 0) {
+		fprintf(stderr,"Options -batch and -serve cannot be used together.\n");
+		return 1;
+	}
+
+	/*
+	 * The throughput benchmark converts its own synthetic cubes.
+	 */
+	if (batchParameters->throughput[0] != 0 && (batchParameters->source[0] != 0 || batchParameters->socket[0] != 0)) {
+		fprintf(stderr,"Option -throughput cannot be used with -batch or -serve.\n");
+		return 1;
+	}
+
+	if (batchParameters->throughput[0] != 0 && parameters->infile[0] != 0) {
+		fprintf(stderr,"Both -i and -throughput specified.  Only synthetic FITS cubes will be converted.\n");
+		parameters->infile[0] = 0;
+	}
+
+	/*
+	 * The tuner samples the planes of the single file given by -i.
+	 */
+	if (batchParameters->tune[0] != 0 && (batchParameters->source[0] != 0 || batchParameters->socket[0] != 0 || batchParameters->throughput[0] != 0)) {
+		fprintf(stderr,"Option -tune cannot be used with -batch, -serve or -throughput.\n");
+		return 1;
+	}
+
+	if (batchParameters->tune[0] != 0 && parameters->infile[0] == 0) {
+		fprintf(stderr,"Option -tune requires a FITS file to sample (option -i).\n");
+		return 1;
+	}
+
+	/*
+	 * Converting a JPEG 2000 image back to FITS is a separate way of running the program.
+	 */
+	if (batchParameters->j2f[0] != 0 && (batchParameters->source[0] != 0 || batchParameters->socket[0] != 0 ||
+			batchParameters->throughput[0] != 0 || batchParameters->tune[0] != 0)) {
+		fprintf(stderr,"Option -j2f cannot be used with -batch, -serve, -throughput or -tune.\n");
+		return 1;
+	}
+
+	if (batchParameters->j2f[0] != 0 && parameters->infile[0] != 0) {
+		fprintf(stderr,"Both -i and -j2f specified.  Only the JPEG 2000 image will be converted.\n");
+		parameters->infile[0] = 0;
+	}
+
+	if (batchParameters->j2f[0] != 0 && region->type == REGION_SKY) {
+		fprintf(stderr,"The region of a JPEG 2000 image to decode must be given in pixels (option -region).\n");
+		return 1;
+	}
+
+	/*
+	 * Sampling only applies to the benchmarks displayed, and residual images are of whole images.
+	 */
+	quality_sampling *sampling = &benchmarkQualityParameters->sampling;
+
+	if ((sampling->reduce > 0 || sampling->tiles > 0.0 || sampling->planes > 1) && !benchmarkQualityParameters->performQualityBenchmarking) {
+		fprintf(stderr,"Option -QB_sample requires quality benchmarks to be displayed (option -QB or -QB_*).\n");
+		return 1;
+	}
+
+	if (isQualitySampled(sampling) && benchmarkQualityParameters->writeResidual) {
+		fprintf(stderr,"Residual images (option -QB_RES) can't be written from a reduced resolution or some of the tiles (option -QB_sample).\n");
+		return 1;
+	}
+
+	if (isQualitySampled(sampling) && (benchmarkQualityParameters->structuralSimilarity || benchmarkQualityParameters->multiScaleStructuralSimilarity)) {
+		fprintf(stderr,"SSIM and MS-SSIM (options -QB_SSIM and -QB_MSSSIM) are calculated over whole images, so can't be estimated from a reduced resolution or some of the tiles (option -QB_sample).\n");
+		return 1;
+	}
+
+	if (isQualitySampled(sampling) && benchmarkQualityParameters->physicalError) {
+		fprintf(stderr,"Errors in physical units (option -QB_PHYS) compare every pixel read, so can't be estimated from a reduced resolution or some of the tiles (option -QB_sample).\n");
+		return 1;
+	}
+
+	/*
+	 * The multi-component transform in OpenJPEG only operates on the first three components of an image.
+	 */
+	if (cubeParameters->multiComponentTransform && cubeParameters->planesPerImage != 3) {
+		fprintf(stderr,"The multi-component transform (option -MCT) requires 3 planes per image (-MC 3).\n");
+		return 1;
+	}
+
+	/*
+	 * Only one transform may be performed across the components of an image.
+	 */
+	if (cubeParameters->multiComponentTransform && cubeParameters->spectralTransform != SPECTRAL_NONE) {
+		fprintf(stderr,"Options -MCT and -spectral cannot be used together.\n");
+		return 1;
+	}
+
+	/*
+	 * DPCM accumulates quantisation errors along the planes of each image unless they are encoded losslessly.
+	 */
+	if (checkSpectralTransform(cubeParameters->spectralTransform,parameters,rateControl) != 0) {
+		return 1;
+	}
+
+	/*
+	 * A spectral transform has nothing to decorrelate unless several planes are packed into each image.
+	 */
+	if (cubeParameters->spectralTransform != SPECTRAL_NONE && cubeParameters->planesPerImage < 2) {
+		fprintf(stderr,"A spectral transform has no effect unless several planes are packed into each image (option -MC).\n");
+	}
+
 #ifdef noise
 	/*
 	 * Note if a seed was set but not a noise value.
@@ -1350,6 +1932,29 @@ int parse_cmdline_encoder(int argc, char **argv, opj_cparameters_t *parameters,
 		fprintf(stderr,"The seed will therefore be ignored.\n");
 	}
 
+	/*
+	 * The random number generator used to simulate noise is shared, so files can't be converted concurrently.
+	 */
+	if ((*noiseSet || *noisePct != 0.0) && batchParameters->socket[0] != 0) {
+		fprintf(stderr,"Noise cannot be added to images in server mode.\n");
+		return 1;
+	}
+
+	if ((*noiseSet || *noisePct != 0.0) && batchParameters->throughput[0] != 0) {
+		fprintf(stderr,"Noise cannot be added to images when benchmarking throughput.\n");
+		return 1;
+	}
+
+	if ((*noiseSet || *noisePct != 0.0) && batchParameters->tune[0] != 0) {
+		fprintf(stderr,"Noise cannot be added to images when tuning parameters.\n");
+		return 1;
+	}
+
+	if ((*noiseSet || *noisePct != 0.0) && batchParameters->threads > 1) {
+		fprintf(stderr,"Files are converted one at a time when noise is added to them.\n");
+		batchParameters->threads = 1;
+	}
+
 	/*
 	 * Note if we were asked to write a noise field but not actually asked to add any noise.
 	 */
@@ -0,0 +1,1372 @@
+/**
+ * @file params.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Parameter profiles: named, validated sets of compression parameters, transform and quality
+ * benchmarks, written with -save_params (or by the auto-tuner, -tune) and loaded with -params.
+ *
+ * A profile file holds one or more profiles, each starting with its name in square brackets, followed by
+ * one key = value pair per line.  Blank lines and lines starting with # are ignored.  For example:
+ *
+ *   [survey]
+ *   rates = 40,20,10
+ *   resolutions = 6
+ *   codeblock = 64x64
+ *   transform = LINEAR
+ *
+ * The keys are:
+ * - format: JP2 or J2K (as -o).
+ * - rates: compression ratios of the layers (as -r).  0 for a lossless layer.
+ * - quality: PSNRs of the layers (as -q).  Cannot be given with rates.
+ * - resolutions: number of resolutions (as -n).
+ * - codeblock: code-block width and height, e.g. 64x64 (as -b).
+ * - precincts: precinct width and height of each resolution, from the highest, e.g. 256x256,128x128, or none (as -c).
+ * - progression: progression order (as -p).
+ * - poc: progression order changes, as given to -P, or none.
+ * - mode: mode switches, as the sum of the values given to -M.
+ * - wavelet: 5-3 (reversible) or 9-7 (irreversible, as -I).
+ * - tile: tile width and height, e.g. 512x512, or none for a single tile (as -t).
+ * - tile_offset: offset of the first tile, x,y (as -T).
+ * - image_offset: offset of the image on the reference grid, x,y (as -d).
+ * - subsampling: subsampling factors, dx,dy (as -s).
+ * - sop, eph: yes or no (as -SOP and -EPH).
+ * - roi: component and shift of the region of interest, c,shift, or none (as -ROI).
+ * - tile_parts: R, L or C, or none (as -TP).
+ * - comment: comment written to the codestream (as -C).  The rest of the line.
+ * - transform: transform performed on the raw FITS data (as -A).
+ * - quality_benchmark: quality benchmarks performed, as a comma separated list of mse, rmse, psnr, mae,
+ *   fidelity, mad, se, ae, isum, ssim, msssim and physical, or none.
+ * - residual: yes or no (as -QB_residual).
+ *
+ * Profiles are validated when they are loaded: as well as the checks made on the command line, the
+ * compression ratios must decrease (and PSNRs increase) from layer to layer, code-block and precinct
+ * sizes must be powers of two and there can't be more precinct sizes than resolutions.
+ *
+ * Only the keys present in a profile are changed, and a profile is applied where -params appears on the
+ * command line, so options given after it override the profile.  Each file is read once and kept in
+ * memory, shared by every job in batch and server mode, until it is modified.  The parameters of
+ * OpenJPEG's encoder can't be set up ahead of the image they encode, so a profile saves the parsing and
+ * validation of the options, not the setting up of the encoder.
+ */
+
+#include "f2j.h"
+
+#include <ctype.h>
+#include <strings.h>
+
+/**
+ * Keys of a parameter profile, giving the bits of parameter_profile.keys.
+ */
+typedef enum {
+	PARAMS_FORMAT,
+	PARAMS_RATES,
+	PARAMS_QUALITY,
+	PARAMS_RESOLUTIONS,
+	PARAMS_CODEBLOCK,
+	PARAMS_PRECINCTS,
+	PARAMS_PROGRESSION,
+	PARAMS_POC,
+	PARAMS_MODE,
+	PARAMS_WAVELET,
+	PARAMS_TILE,
+	PARAMS_TILE_OFFSET,
+	PARAMS_IMAGE_OFFSET,
+	PARAMS_SUBSAMPLING,
+	PARAMS_SOP,
+	PARAMS_EPH,
+	PARAMS_ROI,
+	PARAMS_TILE_PARTS,
+	PARAMS_COMMENT,
+	PARAMS_TRANSFORM,
+	PARAMS_QUALITY_BENCHMARK,
+	PARAMS_RESIDUAL,
+	PARAMS_KEYS
+} params_key;
+
+/**
+ * Names of the keys, in the order of params_key.
+ */
+static const char *profileKeyNames[PARAMS_KEYS] = {"format","rates","quality","resolutions","codeblock","precincts","progression",
+		"poc","mode","wavelet","tile","tile_offset","image_offset","subsampling","sop","eph","roi","tile_parts","comment","transform",
+		"quality_benchmark","residual"};
+
+/**
+ * Names of the progression orders, in the order of OPJ_PROG_ORDER.
+ */
+static const char *progressionNames[] = {"LRCP","RLCP","RPCL","PCRL","CPRL"};
+
+/**
+ * Names of the quality benchmarks, as given to the quality_benchmark key.
+ */
+static const char *benchmarkNames[] = {"mse","rmse","psnr","mae","fidelity","mad","se","ae","isum","ssim","msssim","physical"};
+
+/**
+ * Number of quality benchmarks.
+ */
+#define PARAMS_BENCHMARKS 12
+
+/**
+ * A file of parameter profiles, kept in memory.  The profiles are only valid while the size and
+ * modification time of the file are unchanged.
+ */
+typedef struct parameter_profile_file {
+	char *path /** Name of the file. */;
+	off_t size /** Size of the file when it was read. */;
+	time_t mtime /** Modification time of the file when it was read. */;
+	parameter_profile *profiles /** Profiles in the file, in order. */;
+	int count /** Number of profiles. */;
+	struct parameter_profile_file *next /** Next file read. */;
+} parameter_profile_file;
+
+/**
+ * Files of parameter profiles read so far, shared by all threads.
+ */
+static parameter_profile_file *profileFiles = NULL;
+
+/**
+ * Mutex protecting profileFiles and the profiles in them.
+ */
+static pthread_mutex_t profileFilesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the name of a progression order.
+ *
+ * @param order Progression order.
+ *
+ * @return name of the progression order, e.g. LRCP.
+ */
+const char *getProgressionName(OPJ_PROG_ORDER order) {
+	return order >= LRCP && order <= CPRL ? progressionNames[order] : "unknown";
+}
+
+/**
+ * Find the progression order with a given name (ignoring case).
+ *
+ * @param name Name of the progression order.
+ *
+ * @return the progression order, or PROG_UNKNOWN if the name isn't recognised.
+ */
+static OPJ_PROG_ORDER parseProgression(const char *name) {
+	// Loop variable
+	int ii;
+
+	for (ii=LRCP; ii<=CPRL; ii++) {
+		if (strcasecmp(name,progressionNames[ii]) == 0) {
+			return (OPJ_PROG_ORDER) ii;
+		}
+	}
+
+	return PROG_UNKNOWN;
+}
+
+/**
+ * Is a value a power of two?
+ *
+ * @param value Value to check.
+ *
+ * @return true if the value is a positive power of two, false otherwise.
+ */
+static bool isPowerOfTwo(int value) {
+	return value > 0 && (value & (value-1)) == 0;
+}
+
+/**
+ * Is a string a valid profile name (letters, digits, '_', '-' and '.')?
+ *
+ * @param name Name to check.
+ *
+ * @return true if the name is valid, false otherwise.
+ */
+static bool isProfileName(const char *name) {
+	size_t length = strlen(name);
+
+	return length > 0 && length < PARAMETER_PROFILE_NAME_LENGTH && strspn(name,
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-.") == length;
+}
+
+/**
+ * Split a profile specification, file[:name], into the name of the file and of the profile.
+ *
+ * @param specification Specification to split.
+ * @param path Array of OPJ_PATH_LEN characters which will be populated with the name of the file.
+ * @param name Array of PARAMETER_PROFILE_NAME_LENGTH characters which will be populated with the name of the
+ * profile, or set to an empty string if none is given.
+ */
+static void splitProfileSpecification(const char *specification, char *path, char *name) {
+	const char *colon = strrchr(specification,':');
+
+	name[0] = '\0';
+
+	if (colon != NULL && isProfileName(colon+1) && (size_t) (colon - specification) < OPJ_PATH_LEN) {
+		strncpy(path,specification,colon - specification);
+		path[colon - specification] = '\0';
+		strcpy(name,colon+1);
+	}
+	else {
+		strncpy(path,specification,OPJ_PATH_LEN-1);
+		path[OPJ_PATH_LEN-1] = '\0';
+	}
+}
+
+/**
+ * Parse a pair of integers given as AxB or A,B (or a single integer, used for both).
+ *
+ * @param value Value to parse.
+ * @param first Reference which will be set to the first integer.
+ * @param second Reference which will be set to the second integer.
+ *
+ * @return 0 if the value is valid, 1 otherwise.
+ */
+static int parseIntegerPair(const char *value, int *first, int *second) {
+	char *end;
+
+	*first = strtol(value,&end,10);
+
+	if (end == value) {
+		return 1;
+	}
+
+	if (*end == 'x' || *end == 'X' || *end == ',') {
+		const char *start = end+1;
+		*second = strtol(start,&end,10);
+
+		if (end == start) {
+			return 1;
+		}
+	}
+	else {
+		*second = *first;
+	}
+
+	return *end == '\0' ? 0 : 1;
+}
+
+/**
+ * Parse a comma separated list of numbers.
+ *
+ * @param value Value to parse.
+ * @param numbers Array of 100 entries (the number of layers OpenJPEG allows) which will be populated.
+ *
+ * @return number of numbers, or -1 if the list is invalid.
+ */
+static int parseNumberList(const char *value, float *numbers) {
+	int count = 0;
+	const char *position = value;
+
+	while (*position != '\0') {
+		char *end;
+
+		if (count == 100) {
+			return -1;
+		}
+
+		numbers[count++] = strtof(position,&end);
+
+		if (end == position || (*end != ',' && *end != '\0')) {
+			return -1;
+		}
+
+		position = *end == ',' ? end+1 : end;
+	}
+
+	return count;
+}
+
+/**
+ * Parse a yes or no value.
+ *
+ * @param value Value to parse.
+ * @param result Reference which will be set to the value.
+ *
+ * @return 0 if the value is valid, 1 otherwise.
+ */
+static int parseYesNo(const char *value, bool *result) {
+	if (strcasecmp(value,"yes") == 0) {
+		*result = true;
+	}
+	else if (strcasecmp(value,"no") == 0) {
+		*result = false;
+	}
+	else {
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse the value of a key of a parameter profile into the profile.
+ *
+ * @param profile Reference to the profile being read.
+ * @param key Key given.
+ * @param value Value given.
+ * @param location Name of the file and line, used in error messages.
+ *
+ * @return 0 if the value is valid, 1 otherwise.
+ */
+static int parseProfileValue(parameter_profile *profile, params_key key, char *value, const char *location) {
+	// Loop variables
+	int ii,count;
+
+	opj_cparameters_t *parameters = &profile->parameters;
+	int first,second;
+	bool flag;
+	char *end;
+
+	switch (key) {
+		case PARAMS_FORMAT:
+			if (strcasecmp(value,"JP2") == 0) {
+				parameters->cod_format = CODEC_JP2;
+			}
+			else if (strcasecmp(value,"J2K") == 0) {
+				parameters->cod_format = CODEC_J2K;
+			}
+			else {
+				fprintf(stderr,"%s: format must be JP2 or J2K.\n",location);
+				return 1;
+			}
+			break;
+
+		case PARAMS_RATES:
+		case PARAMS_QUALITY:
+			count = parseNumberList(value,key == PARAMS_RATES ? parameters->tcp_rates : parameters->tcp_distoratio);
+
+			if (count < 1) {
+				fprintf(stderr,"%s: %s must be a comma separated list of between 1 and 100 numbers.\n",location,profileKeyNames[key]);
+				return 1;
+			}
+
+			parameters->tcp_numlayers = count;
+			break;
+
+		case PARAMS_RESOLUTIONS:
+			parameters->numresolution = strtol(value,&end,10);
+
+			if (*end != '\0' || parameters->numresolution < 1 || parameters->numresolution > J2K_MAXRLVLS) {
+				fprintf(stderr,"%s: resolutions must be between 1 and %d.\n",location,J2K_MAXRLVLS);
+				return 1;
+			}
+			break;
+
+		case PARAMS_CODEBLOCK:
+			// Same restrictions as -b.
+			if (parseIntegerPair(value,&first,&second) != 0 || first < 4 || second < 4 || first > 1024 || second > 1024 || first*second > 4096) {
+				fprintf(stderr,"%s: codeblock must be WxH, with W and H between 4 and 1024 and WxH at most 4096.\n",location);
+				return 1;
+			}
+
+			parameters->cblockw_init = first;
+			parameters->cblockh_init = second;
+			break;
+
+		case PARAMS_PRECINCTS:
+			parameters->csty &= ~0x01;
+			parameters->res_spec = 0;
+
+			if (strcasecmp(value,"none") != 0) {
+				char *savePointer = NULL;
+				char *size;
+
+				for (size=strtok_r(value,",",&savePointer); size != NULL; size=strtok_r(NULL,",",&savePointer)) {
+					if (parameters->res_spec == J2K_MAXRLVLS || parseIntegerPair(size,&first,&second) != 0 || first < 1 || second < 1) {
+						fprintf(stderr,"%s: precincts must be a comma separated list of WxH, or none.\n",location);
+						return 1;
+					}
+
+					parameters->prcw_init[parameters->res_spec] = first;
+					parameters->prch_init[parameters->res_spec] = second;
+					parameters->res_spec++;
+				}
+
+				parameters->csty |= parameters->res_spec > 0 ? 0x01 : 0;
+			}
+			break;
+
+		case PARAMS_PROGRESSION:
+			parameters->prog_order = parseProgression(value);
+
+			if (parameters->prog_order == PROG_UNKNOWN) {
+				fprintf(stderr,"%s: progression must be LRCP, RLCP, RPCL, PCRL or CPRL.\n",location);
+				return 1;
+			}
+			break;
+
+		case PARAMS_POC:
+			parameters->numpocs = 0;
+
+			if (strcasecmp(value,"none") != 0) {
+				// As -P.
+				char *savePointer = NULL;
+				char *change;
+
+				for (change=strtok_r(value,"/",&savePointer); change != NULL; change=strtok_r(NULL,"/",&savePointer)) {
+					opj_poc_t *poc = &parameters->POC[parameters->numpocs];
+					int resno0,compno0,layno1,resno1,compno1;
+
+					memset(poc,0,sizeof(opj_poc_t));
+
+					if (parameters->numpocs == 32 || sscanf(change,"T%d=%d,%d,%d,%d,%d,%4s",&poc->tile,&resno0,&compno0,&layno1,&resno1,
+							&compno1,poc->progorder) != 7 || (poc->prg1 = parseProgression(poc->progorder)) == PROG_UNKNOWN ||
+							resno0 < 0 || compno0 < 0 || layno1 < 0 || resno1 < 0 || compno1 < 0) {
+						fprintf(stderr,"%s: poc must be given as for -P (at most 32 changes), or none.\n",location);
+						return 1;
+					}
+
+					poc->resno0 = resno0;
+					poc->compno0 = compno0;
+					poc->layno1 = layno1;
+					poc->resno1 = resno1;
+					poc->compno1 = compno1;
+					parameters->numpocs++;
+				}
+			}
+			break;
+
+		case PARAMS_MODE:
+			parameters->mode = strtol(value,&end,10);
+
+			if (*end != '\0' || parameters->mode < 0 || parameters->mode > 63) {
+				fprintf(stderr,"%s: mode must be between 0 and 63.\n",location);
+				return 1;
+			}
+			break;
+
+		case PARAMS_WAVELET:
+			if (strcmp(value,"5-3") == 0) {
+				parameters->irreversible = 0;
+			}
+			else if (strcmp(value,"9-7") == 0) {
+				parameters->irreversible = 1;
+			}
+			else {
+				fprintf(stderr,"%s: wavelet must be 5-3 or 9-7.\n",location);
+				return 1;
+			}
+			break;
+
+		case PARAMS_TILE:
+			if (strcasecmp(value,"none") == 0) {
+				parameters->tile_size_on = OPJ_FALSE;
+			}
+			else if (parseIntegerPair(value,&first,&second) != 0 || first < 1 || second < 1) {
+				fprintf(stderr,"%s: tile must be WxH, or none.\n",location);
+				return 1;
+			}
+			else {
+				parameters->cp_tdx = first;
+				parameters->cp_tdy = second;
+				parameters->tile_size_on = OPJ_TRUE;
+			}
+			break;
+
+		case PARAMS_TILE_OFFSET:
+		case PARAMS_IMAGE_OFFSET:
+			if (parseIntegerPair(value,&first,&second) != 0 || first < 0 || second < 0) {
+				fprintf(stderr,"%s: %s must be x,y.\n",location,profileKeyNames[key]);
+				return 1;
+			}
+
+			if (key == PARAMS_TILE_OFFSET) {
+				parameters->cp_tx0 = first;
+				parameters->cp_ty0 = second;
+			}
+			else {
+				parameters->image_offset_x0 = first;
+				parameters->image_offset_y0 = second;
+			}
+			break;
+
+		case PARAMS_SUBSAMPLING:
+			if (parseIntegerPair(value,&first,&second) != 0 || first < 1 || second < 1) {
+				fprintf(stderr,"%s: subsampling must be dx,dy.\n",location);
+				return 1;
+			}
+
+			parameters->subsampling_dx = first;
+			parameters->subsampling_dy = second;
+			break;
+
+		case PARAMS_SOP:
+		case PARAMS_EPH:
+			if (parseYesNo(value,&flag) != 0) {
+				fprintf(stderr,"%s: %s must be yes or no.\n",location,profileKeyNames[key]);
+				return 1;
+			}
+
+			if (flag) {
+				parameters->csty |= key == PARAMS_SOP ? 0x02 : 0x04;
+			}
+			else {
+				parameters->csty &= key == PARAMS_SOP ? ~0x02 : ~0x04;
+			}
+			break;
+
+		case PARAMS_ROI:
+			if (strcasecmp(value,"none") == 0) {
+				parameters->roi_compno = -1;
+				parameters->roi_shift = 0;
+			}
+			else if (parseIntegerPair(value,&first,&second) != 0 || first < 0 || second < 0 || second > 255) {
+				fprintf(stderr,"%s: roi must be component,shift (shift at most 255), or none.\n",location);
+				return 1;
+			}
+			else {
+				parameters->roi_compno = first;
+				parameters->roi_shift = second;
+			}
+			break;
+
+		case PARAMS_TILE_PARTS:
+			if (strcasecmp(value,"none") == 0) {
+				parameters->tp_on = 0;
+				parameters->tp_flag = 0;
+			}
+			else if (strcmp(value,"R") == 0 || strcmp(value,"L") == 0 || strcmp(value,"C") == 0) {
+				parameters->tp_on = 1;
+				parameters->tp_flag = value[0];
+			}
+			else {
+				fprintf(stderr,"%s: tile_parts must be R, L or C, or none.\n",location);
+				return 1;
+			}
+			break;
+
+		case PARAMS_COMMENT:
+			free(parameters->cp_comment);
+			parameters->cp_comment = strdup(value);
+
+			if (parameters->cp_comment == NULL) {
+				fprintf(stderr,"%s: unable to allocate memory for the comment.\n",location);
+				return 1;
+			}
+			break;
+
+		case PARAMS_TRANSFORM:
+			if (parseTransform(value,&profile->transform) != 0) {
+				fprintf(stderr,"%s: unknown transform %s.\n",location,value);
+				return 1;
+			}
+			break;
+
+		case PARAMS_QUALITY_BENCHMARK:
+		{
+			quality_benchmark_info *quality = &profile->qualityBenchmarkParameters;
+			bool *benchmarks[PARAMS_BENCHMARKS] = {&quality->meanSquaredError,&quality->rootMeanSquaredError,&quality->peakSignalToNoiseRatio,
+					&quality->meanAbsoluteError,&quality->fidelity,&quality->maximumAbsoluteDistortion,&quality->squaredError,
+					&quality->absoluteError,&quality->squaredIntensitySum,&quality->structuralSimilarity,&quality->multiScaleStructuralSimilarity,
+					&quality->physicalError};
+
+			for (ii=0; ii<PARAMS_BENCHMARKS; ii++) {
+				*benchmarks[ii] = false;
+			}
+
+			if (strcasecmp(value,"none") != 0) {
+				char *savePointer = NULL;
+				char *name;
+
+				for (name=strtok_r(value,",",&savePointer); name != NULL; name=strtok_r(NULL,",",&savePointer)) {
+					for (ii=0; ii<PARAMS_BENCHMARKS; ii++) {
+						if (strcasecmp(name,benchmarkNames[ii]) == 0) {
+							*benchmarks[ii] = true;
+							break;
+						}
+					}
+
+					if (ii == PARAMS_BENCHMARKS) {
+						fprintf(stderr,"%s: unknown quality benchmark %s [mse, rmse, psnr, mae, fidelity, mad, se, ae, isum, ssim, msssim, physical].\n",location,name);
+						return 1;
+					}
+				}
+			}
+
+			quality->performQualityBenchmarking = false;
+
+			for (ii=0; ii<PARAMS_BENCHMARKS; ii++) {
+				quality->performQualityBenchmarking = quality->performQualityBenchmarking || *benchmarks[ii];
+			}
+		}
+		break;
+
+		case PARAMS_RESIDUAL:
+			if (parseYesNo(value,&profile->qualityBenchmarkParameters.writeResidual) != 0) {
+				fprintf(stderr,"%s: residual must be yes or no.\n",location);
+				return 1;
+			}
+			break;
+
+		default:
+			return 1;
+	}
+
+	profile->keys |= 1u << key;
+
+	return 0;
+}
+
+/**
+ * Check that the values given in a profile are consistent with each other.
+ *
+ * @param profile Reference to the profile to check.
+ * @param file Name of the file the profile was read from, used in error messages.
+ *
+ * @return 0 if the profile is valid, 1 otherwise.
+ */
+static int validateParameterProfile(parameter_profile *profile, const char *file) {
+	// Loop variable
+	int ii;
+
+	opj_cparameters_t *parameters = &profile->parameters;
+	unsigned int keys = profile->keys;
+
+	if ((keys & (1u << PARAMS_RATES)) && (keys & (1u << PARAMS_QUALITY))) {
+		fprintf(stderr,"Profile %s in %s: rates and quality cannot be given together.\n",profile->name,file);
+		return 1;
+	}
+
+	if (keys & (1u << PARAMS_RATES)) {
+		for (ii=0; ii<parameters->tcp_numlayers; ii++) {
+			float rate = parameters->tcp_rates[ii];
+
+			// Each layer adds to the ones before it, so must have a lower ratio.  Only the last layer can be lossless.
+			if (rate < 0.0f || (rate == 0.0f && ii < parameters->tcp_numlayers-1) || (ii > 0 && rate > 0.0f && rate >= parameters->tcp_rates[ii-1])) {
+				fprintf(stderr,"Profile %s in %s: rates must decrease from layer to layer, with only the last layer lossless (0).\n",
+						profile->name,file);
+				return 1;
+			}
+		}
+	}
+
+	if (keys & (1u << PARAMS_QUALITY)) {
+		for (ii=0; ii<parameters->tcp_numlayers; ii++) {
+			if (parameters->tcp_distoratio[ii] <= 0.0f || (ii > 0 && parameters->tcp_distoratio[ii] <= parameters->tcp_distoratio[ii-1])) {
+				fprintf(stderr,"Profile %s in %s: quality must increase from layer to layer.\n",profile->name,file);
+				return 1;
+			}
+		}
+	}
+
+	// Code-block and precinct sizes are written to the codestream as exponents.
+	if ((keys & (1u << PARAMS_CODEBLOCK)) && (!isPowerOfTwo(parameters->cblockw_init) || !isPowerOfTwo(parameters->cblockh_init))) {
+		fprintf(stderr,"Profile %s in %s: code-block width and height must be powers of two.\n",profile->name,file);
+		return 1;
+	}
+
+	if (keys & (1u << PARAMS_PRECINCTS)) {
+		for (ii=0; ii<parameters->res_spec; ii++) {
+			if (!isPowerOfTwo(parameters->prcw_init[ii]) || !isPowerOfTwo(parameters->prch_init[ii])) {
+				fprintf(stderr,"Profile %s in %s: precinct widths and heights must be powers of two.\n",profile->name,file);
+				return 1;
+			}
+		}
+
+		if ((keys & (1u << PARAMS_RESOLUTIONS)) && parameters->res_spec > parameters->numresolution) {
+			fprintf(stderr,"Profile %s in %s: more precinct sizes than resolutions.\n",profile->name,file);
+			return 1;
+		}
+	}
+
+	if ((keys & (1u << PARAMS_TILE)) && (keys & (1u << PARAMS_RESOLUTIONS)) && parameters->tile_size_on) {
+		int smallest = parameters->cp_tdx < parameters->cp_tdy ? parameters->cp_tdx : parameters->cp_tdy;
+
+		if ((smallest >> (parameters->numresolution-1)) < 1) {
+			fprintf(stderr,"Profile %s in %s: too many resolutions for %dx%d tiles.\n",profile->name,file,parameters->cp_tdx,parameters->cp_tdy);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Free the profiles read from a file.
+ *
+ * @param profiles Profiles to free.
+ * @param count Number of profiles.
+ */
+static void freeParameterProfiles(parameter_profile *profiles, int count) {
+	// Loop variable
+	int ii;
+
+	for (ii=0; ii<count; ii++) {
+		free(profiles[ii].parameters.cp_comment);
+	}
+
+	free(profiles);
+}
+
+/**
+ * Read and validate every profile in a file.  Keys before the first name in square brackets form a
+ * profile named default.
+ *
+ * @param file Name of the file to read.
+ * @param profiles Reference which will be set to an array of the profiles, to be freed with freeParameterProfiles.
+ * @param count Reference which will be set to the number of profiles.
+ *
+ * @return 0 if the file was read successfully, 1 otherwise.
+ */
+static int readParameterProfiles(const char *file, parameter_profile **profiles, int *count) {
+	*profiles = NULL;
+	*count = 0;
+
+	FILE *in = fopen(file,"r");
+
+	if (in == NULL) {
+		fprintf(stderr,"Unable to open parameter profile file %s.\n",file);
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	char *line = NULL;
+	size_t lineCapacity = 0;
+	int lineNumber = 0;
+	int capacity = 0;
+	int result = 0;
+	parameter_profile *profile = NULL;
+
+	while (result == 0 && getline(&line,&lineCapacity,in) != -1) {
+		lineNumber++;
+
+		char location[strlen(file) + 32];
+		sprintf(location,"%s, line %d",file,lineNumber);
+
+		// Strip surrounding white space from the line.
+		char *start = line;
+
+		while (isspace((unsigned char) *start)) {
+			start++;
+		}
+
+		char *end = start + strlen(start);
+
+		while (end > start && isspace((unsigned char) end[-1])) {
+			end--;
+		}
+
+		*end = '\0';
+
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+
+		bool named = *start == '[';
+
+		// Start a new profile, named or not.
+		if (named || profile == NULL) {
+			if (*count == capacity) {
+				capacity = capacity > 0 ? 2*capacity : 4;
+				parameter_profile *grown = (parameter_profile *) realloc(*profiles,capacity * sizeof(parameter_profile));
+
+				if (grown == NULL) {
+					fprintf(stderr,"Unable to allocate memory for parameter profiles.\n");
+					result = 1;
+					break;
+				}
+
+				*profiles = grown;
+			}
+
+			profile = &(*profiles)[(*count)++];
+			memset(profile,0,sizeof(parameter_profile));
+			strcpy(profile->name,"default");
+		}
+
+		if (named) {
+			if (end[-1] != ']') {
+				fprintf(stderr,"%s: profile name must be given as [name].\n",location);
+				result = 1;
+				break;
+			}
+
+			end[-1] = '\0';
+
+			if (!isProfileName(start+1)) {
+				fprintf(stderr,"%s: profile names can only contain letters, digits, '_', '-' and '.' (at most %d characters).\n",location,
+						PARAMETER_PROFILE_NAME_LENGTH-1);
+				result = 1;
+				break;
+			}
+
+			strcpy(profile->name,start+1);
+
+			for (ii=0; ii<*count-1; ii++) {
+				if (strcmp((*profiles)[ii].name,profile->name) == 0) {
+					fprintf(stderr,"%s: profile %s is given more than once.\n",location,profile->name);
+					result = 1;
+					break;
+				}
+			}
+
+			continue;
+		}
+
+		char *equals = strchr(start,'=');
+
+		if (equals == NULL) {
+			fprintf(stderr,"%s: expected key = value.\n",location);
+			result = 1;
+			break;
+		}
+
+		char *value = equals+1;
+		end = equals;
+
+		while (end > start && isspace((unsigned char) end[-1])) {
+			end--;
+		}
+
+		*end = '\0';
+
+		while (isspace((unsigned char) *value)) {
+			value++;
+		}
+
+		for (ii=0; ii<PARAMS_KEYS; ii++) {
+			if (strcmp(start,profileKeyNames[ii]) == 0) {
+				break;
+			}
+		}
+
+		if (ii == PARAMS_KEYS) {
+			fprintf(stderr,"%s: unknown key %s.\n",location,start);
+			result = 1;
+		}
+		else if (profile->keys & (1u << ii)) {
+			fprintf(stderr,"%s: %s is given more than once in profile %s.\n",location,start,profile->name);
+			result = 1;
+		}
+		else {
+			result = parseProfileValue(profile,(params_key) ii,value,location);
+		}
+	}
+
+	free(line);
+	fclose(in);
+
+	for (ii=0; ii<*count && result == 0; ii++) {
+		result = validateParameterProfile(&(*profiles)[ii],file);
+	}
+
+	if (result == 0 && *count == 0) {
+		fprintf(stderr,"Parameter profile file %s contains no profiles.\n",file);
+		result = 1;
+	}
+
+	if (result != 0) {
+		freeParameterProfiles(*profiles,*count);
+		*profiles = NULL;
+		*count = 0;
+	}
+
+	return result;
+}
+
+/**
+ * Find a file of profiles in memory, reading it if it hasn't been read or has changed since.  Must be
+ * called with profileFilesMutex held.
+ *
+ * @param path Name of the file.
+ *
+ * @return the file, or null if it couldn't be read.
+ */
+static parameter_profile_file *getParameterProfileFile(const char *path) {
+	struct stat fileInfo;
+
+	if (stat(path,&fileInfo) != 0) {
+		fprintf(stderr,"Unable to open parameter profile file %s.\n",path);
+		return NULL;
+	}
+
+	parameter_profile_file *entry;
+
+	for (entry=profileFiles; entry!=NULL; entry=entry->next) {
+		if (strcmp(entry->path,path) == 0) {
+			break;
+		}
+	}
+
+	if (entry != NULL && entry->size == fileInfo.st_size && entry->mtime == fileInfo.st_mtime) {
+		return entry;
+	}
+
+	parameter_profile *profiles;
+	int count;
+
+	if (readParameterProfiles(path,&profiles,&count) != 0) {
+		return NULL;
+	}
+
+	if (entry == NULL) {
+		entry = (parameter_profile_file *) calloc(1,sizeof(parameter_profile_file));
+
+		if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+			fprintf(stderr,"Unable to allocate memory for parameter profiles.\n");
+			free(entry);
+			freeParameterProfiles(profiles,count);
+			return NULL;
+		}
+
+		entry->next = profileFiles;
+		profileFiles = entry;
+	}
+	else {
+		// The file has changed since it was read.
+		freeParameterProfiles(entry->profiles,entry->count);
+	}
+
+	entry->size = fileInfo.st_size;
+	entry->mtime = fileInfo.st_mtime;
+	entry->profiles = profiles;
+	entry->count = count;
+
+	return entry;
+}
+
+/**
+ * Apply a profile to a set of options, changing only the keys given in the profile.
+ *
+ * @param profile Reference to the profile to apply.
+ * @param parameters Reference to the compression parameters to change.
+ * @param transform Reference to the transform to change.
+ * @param qualityParameters Reference to the quality benchmarks to change.
+ *
+ * @return 0 if the profile was applied successfully, 1 otherwise.
+ */
+static int applyParameterProfile(parameter_profile *profile, opj_cparameters_t *parameters, transform *transform,
+		quality_benchmark_info *qualityParameters) {
+	opj_cparameters_t *given = &profile->parameters;
+	unsigned int keys = profile->keys;
+
+#define PARAMS_HAS(key) (keys & (1u << (key)))
+
+	if (PARAMS_HAS(PARAMS_FORMAT)) {
+		parameters->cod_format = given->cod_format;
+	}
+
+	// The layers given replace any rate allocation given before the profile.
+	if (PARAMS_HAS(PARAMS_RATES) || PARAMS_HAS(PARAMS_QUALITY)) {
+		parameters->tcp_numlayers = given->tcp_numlayers;
+		memcpy(parameters->tcp_rates,given->tcp_rates,sizeof(parameters->tcp_rates));
+		memcpy(parameters->tcp_distoratio,given->tcp_distoratio,sizeof(parameters->tcp_distoratio));
+		parameters->cp_disto_alloc = PARAMS_HAS(PARAMS_RATES) ? 1 : 0;
+		parameters->cp_fixed_quality = PARAMS_HAS(PARAMS_QUALITY) ? 1 : 0;
+		parameters->cp_fixed_alloc = 0;
+	}
+
+	if (PARAMS_HAS(PARAMS_RESOLUTIONS)) {
+		parameters->numresolution = given->numresolution;
+	}
+
+	if (PARAMS_HAS(PARAMS_CODEBLOCK)) {
+		parameters->cblockw_init = given->cblockw_init;
+		parameters->cblockh_init = given->cblockh_init;
+	}
+
+	if (PARAMS_HAS(PARAMS_PRECINCTS)) {
+		parameters->csty = (parameters->csty & ~0x01) | (given->csty & 0x01);
+		parameters->res_spec = given->res_spec;
+		memcpy(parameters->prcw_init,given->prcw_init,sizeof(parameters->prcw_init));
+		memcpy(parameters->prch_init,given->prch_init,sizeof(parameters->prch_init));
+	}
+
+	if (PARAMS_HAS(PARAMS_PROGRESSION)) {
+		parameters->prog_order = given->prog_order;
+	}
+
+	if (PARAMS_HAS(PARAMS_POC)) {
+		parameters->numpocs = given->numpocs;
+		memcpy(parameters->POC,given->POC,sizeof(parameters->POC));
+	}
+
+	if (PARAMS_HAS(PARAMS_MODE)) {
+		parameters->mode = given->mode;
+	}
+
+	if (PARAMS_HAS(PARAMS_WAVELET)) {
+		parameters->irreversible = given->irreversible;
+	}
+
+	if (PARAMS_HAS(PARAMS_TILE)) {
+		parameters->tile_size_on = given->tile_size_on;
+		parameters->cp_tdx = given->cp_tdx;
+		parameters->cp_tdy = given->cp_tdy;
+	}
+
+	if (PARAMS_HAS(PARAMS_TILE_OFFSET)) {
+		parameters->cp_tx0 = given->cp_tx0;
+		parameters->cp_ty0 = given->cp_ty0;
+	}
+
+	if (PARAMS_HAS(PARAMS_IMAGE_OFFSET)) {
+		parameters->image_offset_x0 = given->image_offset_x0;
+		parameters->image_offset_y0 = given->image_offset_y0;
+	}
+
+	if (PARAMS_HAS(PARAMS_SUBSAMPLING)) {
+		parameters->subsampling_dx = given->subsampling_dx;
+		parameters->subsampling_dy = given->subsampling_dy;
+	}
+
+	if (PARAMS_HAS(PARAMS_SOP)) {
+		parameters->csty = (parameters->csty & ~0x02) | (given->csty & 0x02);
+	}
+
+	if (PARAMS_HAS(PARAMS_EPH)) {
+		parameters->csty = (parameters->csty & ~0x04) | (given->csty & 0x04);
+	}
+
+	if (PARAMS_HAS(PARAMS_ROI)) {
+		parameters->roi_compno = given->roi_compno;
+		parameters->roi_shift = given->roi_shift;
+	}
+
+	if (PARAMS_HAS(PARAMS_TILE_PARTS)) {
+		parameters->tp_on = given->tp_on;
+		parameters->tp_flag = given->tp_flag;
+	}
+
+	if (PARAMS_HAS(PARAMS_COMMENT)) {
+		// The options own their comment, as when it is given by -C.
+		parameters->cp_comment = strdup(given->cp_comment);
+
+		if (parameters->cp_comment == NULL) {
+			fprintf(stderr,"Unable to allocate memory for the comment of profile %s.\n",profile->name);
+			return 1;
+		}
+	}
+
+	if (PARAMS_HAS(PARAMS_TRANSFORM) && transform != NULL) {
+		*transform = profile->transform;
+	}
+
+	if (qualityParameters != NULL) {
+		quality_benchmark_info *quality = &profile->qualityBenchmarkParameters;
+
+		if (PARAMS_HAS(PARAMS_QUALITY_BENCHMARK)) {
+			qualityParameters->meanSquaredError = quality->meanSquaredError;
+			qualityParameters->rootMeanSquaredError = quality->rootMeanSquaredError;
+			qualityParameters->peakSignalToNoiseRatio = quality->peakSignalToNoiseRatio;
+			qualityParameters->meanAbsoluteError = quality->meanAbsoluteError;
+			qualityParameters->fidelity = quality->fidelity;
+			qualityParameters->maximumAbsoluteDistortion = quality->maximumAbsoluteDistortion;
+			qualityParameters->squaredError = quality->squaredError;
+			qualityParameters->absoluteError = quality->absoluteError;
+			qualityParameters->squaredIntensitySum = quality->squaredIntensitySum;
+			qualityParameters->structuralSimilarity = quality->structuralSimilarity;
+			qualityParameters->multiScaleStructuralSimilarity = quality->multiScaleStructuralSimilarity;
+			qualityParameters->physicalError = quality->physicalError;
+			qualityParameters->performQualityBenchmarking = quality->performQualityBenchmarking;
+		}
+
+		if (PARAMS_HAS(PARAMS_RESIDUAL)) {
+			qualityParameters->writeResidual = quality->writeResidual;
+		}
+	}
+
+#undef PARAMS_HAS
+
+	return 0;
+}
+
+/**
+ * Load a parameter profile, changing the options given in it.  The file is only read (and validated) the
+ * first time it is used, or if it has changed since; safe to call from several threads at once.
+ *
+ * @param specification Profile to load, as file[:name].  If no name is given, the first profile in the file is loaded.
+ * @param parameters Reference to the compression parameters to change.
+ * @param transform Reference to the transform to change.  May be null.
+ * @param qualityParameters Reference to the quality benchmarks to change.  May be null.
+ *
+ * @return 0 if the profile was loaded successfully, 1 otherwise.
+ */
+int loadParameterProfile(const char *specification, opj_cparameters_t *parameters, transform *transform, quality_benchmark_info *qualityParameters) {
+	if (specification == NULL || parameters == NULL) {
+		fprintf(stderr,"Parameters to loadParameterProfile cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	char path[OPJ_PATH_LEN];
+	char name[PARAMETER_PROFILE_NAME_LENGTH];
+	splitProfileSpecification(specification,path,name);
+
+	int result = 1;
+
+	pthread_mutex_lock(&profileFilesMutex);
+
+	parameter_profile_file *entry = getParameterProfileFile(path);
+
+	if (entry != NULL) {
+		for (ii=0; ii<entry->count; ii++) {
+			if (name[0] == '\0' || strcmp(entry->profiles[ii].name,name) == 0) {
+				result = applyParameterProfile(&entry->profiles[ii],parameters,transform,qualityParameters);
+				break;
+			}
+		}
+
+		if (ii == entry->count) {
+			fprintf(stderr,"No profile named %s in parameter profile file %s.\n",name,path);
+		}
+	}
+
+	pthread_mutex_unlock(&profileFilesMutex);
+
+	return result;
+}
+
+/**
+ * Write a profile holding a full set of options.
+ *
+ * @param out Stream to write to.
+ * @param name Name of the profile.
+ * @param description Description written as a comment before the profile.  May be null.
+ * @param parameters Reference to the compression parameters to write.
+ * @param transform Transform to write.
+ * @param qualityParameters Reference to the quality benchmarks to write.  May be null, in which case none are written.
+ */
+static void writeProfileSection(FILE *out, const char *name, const char *description, opj_cparameters_t *parameters, transform transform,
+		quality_benchmark_info *qualityParameters) {
+	// Loop variable
+	int ii;
+
+	if (description != NULL) {
+		fprintf(out,"# %s\n",description);
+	}
+
+	fprintf(out,"[%s]\n",name);
+	fprintf(out,"format = %s\n",parameters->cod_format == CODEC_J2K ? "J2K" : "JP2");
+
+	if (parameters->tcp_numlayers > 0) {
+		fprintf(out,parameters->cp_fixed_quality ? "quality = " : "rates = ");
+
+		for (ii=0; ii<parameters->tcp_numlayers; ii++) {
+			fprintf(out,"%s%g",ii > 0 ? "," : "",parameters->cp_fixed_quality ? parameters->tcp_distoratio[ii] : parameters->tcp_rates[ii]);
+		}
+
+		fputc('\n',out);
+	}
+
+	fprintf(out,"resolutions = %d\n",parameters->numresolution);
+	fprintf(out,"codeblock = %dx%d\n",parameters->cblockw_init,parameters->cblockh_init);
+
+	if ((parameters->csty & 0x01) && parameters->res_spec > 0) {
+		fprintf(out,"precincts = ");
+
+		for (ii=0; ii<parameters->res_spec; ii++) {
+			fprintf(out,"%s%dx%d",ii > 0 ? "," : "",parameters->prcw_init[ii],parameters->prch_init[ii]);
+		}
+
+		fputc('\n',out);
+	}
+	else {
+		fprintf(out,"precincts = none\n");
+	}
+
+	fprintf(out,"progression = %s\n",getProgressionName(parameters->prog_order));
+
+	if (parameters->numpocs > 0) {
+		fprintf(out,"poc = ");
+
+		for (ii=0; ii<parameters->numpocs; ii++) {
+			opj_poc_t *poc = &parameters->POC[ii];
+
+			fprintf(out,"%sT%d=%d,%d,%d,%d,%d,%s",ii > 0 ? "/" : "",poc->tile,(int) poc->resno0,(int) poc->compno0,(int) poc->layno1,
+					(int) poc->resno1,(int) poc->compno1,getProgressionName(poc->prg1));
+		}
+
+		fputc('\n',out);
+	}
+	else {
+		fprintf(out,"poc = none\n");
+	}
+
+	fprintf(out,"mode = %d\n",parameters->mode);
+	fprintf(out,"wavelet = %s\n",parameters->irreversible ? "9-7" : "5-3");
+
+	if (parameters->tile_size_on) {
+		fprintf(out,"tile = %dx%d\n",parameters->cp_tdx,parameters->cp_tdy);
+	}
+	else {
+		fprintf(out,"tile = none\n");
+	}
+
+	fprintf(out,"tile_offset = %d,%d\n",parameters->cp_tx0,parameters->cp_ty0);
+	fprintf(out,"image_offset = %d,%d\n",parameters->image_offset_x0,parameters->image_offset_y0);
+	fprintf(out,"subsampling = %d,%d\n",parameters->subsampling_dx,parameters->subsampling_dy);
+	fprintf(out,"sop = %s\n",(parameters->csty & 0x02) ? "yes" : "no");
+	fprintf(out,"eph = %s\n",(parameters->csty & 0x04) ? "yes" : "no");
+
+	if (parameters->roi_compno >= 0) {
+		fprintf(out,"roi = %d,%d\n",parameters->roi_compno,parameters->roi_shift);
+	}
+	else {
+		fprintf(out,"roi = none\n");
+	}
+
+	if (parameters->tp_on) {
+		fprintf(out,"tile_parts = %c\n",parameters->tp_flag);
+	}
+	else {
+		fprintf(out,"tile_parts = none\n");
+	}
+
+	// A comment runs to the end of its line.
+	if (parameters->cp_comment != NULL && parameters->cp_comment[0] != '\0' && strchr(parameters->cp_comment,'\n') == NULL) {
+		fprintf(out,"comment = %s\n",parameters->cp_comment);
+	}
+
+	fprintf(out,"transform = %s\n",getTransformName(transform));
+
+	if (qualityParameters != NULL) {
+		bool benchmarks[PARAMS_BENCHMARKS] = {qualityParameters->meanSquaredError,qualityParameters->rootMeanSquaredError,
+				qualityParameters->peakSignalToNoiseRatio,qualityParameters->meanAbsoluteError,qualityParameters->fidelity,
+				qualityParameters->maximumAbsoluteDistortion,qualityParameters->squaredError,qualityParameters->absoluteError,
+				qualityParameters->squaredIntensitySum,qualityParameters->structuralSimilarity,qualityParameters->multiScaleStructuralSimilarity,
+				qualityParameters->physicalError};
+		bool first = true;
+
+		fprintf(out,"quality_benchmark = ");
+
+		for (ii=0; ii<PARAMS_BENCHMARKS; ii++) {
+			if (benchmarks[ii]) {
+				fprintf(out,"%s%s",first ? "" : ",",benchmarkNames[ii]);
+				first = false;
+			}
+		}
+
+		fprintf(out,"%s\n",first ? "none" : "");
+		fprintf(out,"residual = %s\n",qualityParameters->writeResidual ? "yes" : "no");
+	}
+}
+
+/**
+ * Save a full set of options as a named profile.  If the file exists, a profile of the same name in it is
+ * replaced and other profiles are kept.
+ *
+ * @param specification Profile to save, as file[:name].
+ * @param defaultName Name of the profile if the specification doesn't give one.
+ * @param description Description written as a comment before the profile.  May be null.
+ * @param parameters Reference to the compression parameters to save.
+ * @param transform Transform to save.
+ * @param qualityParameters Reference to the quality benchmarks to save.  May be null, in which case none are saved.
+ *
+ * @return 0 if the profile was saved successfully, 1 otherwise.
+ */
+int saveParameterProfile(const char *specification, const char *defaultName, const char *description, opj_cparameters_t *parameters,
+		transform transform, quality_benchmark_info *qualityParameters) {
+	if (specification == NULL || defaultName == NULL || parameters == NULL) {
+		fprintf(stderr,"Parameters to saveParameterProfile cannot be null.\n");
+		return 1;
+	}
+
+	char path[OPJ_PATH_LEN];
+	char name[PARAMETER_PROFILE_NAME_LENGTH];
+	splitProfileSpecification(specification,path,name);
+
+	if (name[0] == '\0') {
+		strncpy(name,defaultName,sizeof(name)-1);
+		name[sizeof(name)-1] = '\0';
+	}
+
+	if (parameters->cp_fixed_alloc) {
+		fprintf(stderr,"Fixed layer allocation (option -f) cannot be saved in a parameter profile.\n");
+		return 1;
+	}
+
+	// Keep the rest of an existing file, except a profile of the same name (and the comments just before it).
+	char *kept = NULL;
+	size_t keptLength = 0;
+	FILE *keptStream = open_memstream(&kept,&keptLength);
+
+	if (keptStream == NULL) {
+		fprintf(stderr,"Unable to allocate memory to save parameter profile %s.\n",specification);
+		return 1;
+	}
+
+	FILE *in = fopen(path,"r");
+
+	if (in != NULL) {
+		char *line = NULL;
+		size_t lineCapacity = 0;
+		char *comments = NULL;
+		size_t commentsLength = 0;
+		FILE *commentStream = open_memstream(&comments,&commentsLength);
+		bool skipping = false;
+
+		while (commentStream != NULL && getline(&line,&lineCapacity,in) != -1) {
+			const char *start = line + strspn(line," \t");
+
+			if (*start == '#') {
+				fputs(line,commentStream);
+				continue;
+			}
+
+			if (*start == '[') {
+				size_t nameLength = strlen(name);
+				skipping = strncmp(start+1,name,nameLength) == 0 && start[nameLength+1] == ']';
+			}
+
+			fflush(commentStream);
+
+			if (!skipping) {
+				fwrite(comments,1,commentsLength,keptStream);
+				fputs(line,keptStream);
+			}
+
+			rewind(commentStream);
+			commentsLength = 0;
+		}
+
+		if (commentStream != NULL) {
+			fflush(commentStream);
+
+			if (!skipping) {
+				fwrite(comments,1,commentsLength,keptStream);
+			}
+
+			fclose(commentStream);
+		}
+
+		free(comments);
+		free(line);
+		fclose(in);
+	}
+
+	fclose(keptStream);
+
+	FILE *out = fopen(path,"w");
+
+	if (out == NULL) {
+		fprintf(stderr,"Unable to write parameter profile file %s.\n",path);
+		free(kept);
+		return 1;
+	}
+
+	// Separate the profile from the rest of the file by a blank line.
+	if (keptLength > 0) {
+		fwrite(kept,1,keptLength,out);
+
+		if (kept[keptLength-1] != '\n') {
+			fputc('\n',out);
+		}
+
+		if (keptLength < 2 || kept[keptLength-1] != '\n' || kept[keptLength-2] != '\n') {
+			fputc('\n',out);
+		}
+	}
+
+	free(kept);
+
+	writeProfileSection(out,name,description,parameters,transform,qualityParameters);
+
+	if (fclose(out) != 0) {
+		fprintf(stderr,"Unable to write parameter profile file %s.\n",path);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,377 @@
+/**
+ * @file physical.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Inverting the transforms of FITS data to image intensities, and quality benchmarks in physical units.
+ *
+ * The quality benchmarks of benchmark.c compare image intensities, after a transform such as LOG or SQRT, so an
+ * error of one intensity stands for very different errors in the units of the data (such as Jy/beam) at each end
+ * of the range.  Every transform of floatDoubleTransform, and the RAW transforms of integer data, is inverted here
+ * from the plane_scaling recorded with each image: an affine map of the intensities, the function undoing the
+ * transform (exp for LOG, the square for SQRT, the square root for SQUARED and log for POWER) and a second affine
+ * map (see physical_inverse).  j2f uses the same inverse to write physical values.  Floating point data is
+ * truncated to intensities, so each intensity is mapped back to the middle of the values it stands for; raw
+ * integer data is mapped back exactly.
+ *
+ * Quality benchmarking in physical units (-QB_PHYS) keeps the planes read from the FITS file until their image
+ * has been decoded, and compares them with the decoded intensities mapped back in a single pass: each block of
+ * PHYSICAL_BLOCK pixels of a row is inverted into a buffer that stays in the L1 cache and the error sums are taken
+ * from it straight away.  The affine maps, the square and the square root, and the error sums, are computed two
+ * at a time with SSE2 where it is available; exp and log are taken from the C library.
+ */
+
+#include "f2j.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Number of pixels of a row mapped back to physical values at a time when comparing them with the values read.
+ */
+#define PHYSICAL_BLOCK 256
+
+/**
+ * Set an inverse to leave intensities unchanged.
+ *
+ * @param inverse Reference to the physical_inverse structure.
+ */
+static void setIdentityInverse(physical_inverse *inverse) {
+	inverse->function = INVERSE_AFFINE;
+	inverse->scale = 1.0;
+	inverse->offset = 0.0;
+	inverse->outerScale = 1.0;
+	inverse->outerOffset = 0.0;
+}
+
+/**
+ * Find the inverse of the scaling of a plane to image intensities, undoing the forward maps of
+ * floatDoubleTransform (for floating point data) and the raw transforms of integer data.
+ *
+ * @param scaling Reference to plane_scaling structure describing the scaling.
+ * @param inverse Reference to physical_inverse structure which will be populated with the inverse.
+ *
+ * @return true if the scaling can be inverted, false otherwise (in which case the inverse leaves intensities
+ * unchanged).
+ */
+bool getPhysicalInverse(plane_scaling *scaling, physical_inverse *inverse) {
+	setIdentityInverse(inverse);
+
+	if (scaling->bitpix == FLOAT_IMG || scaling->bitpix == DOUBLE_IMG) {
+		double datamin = scaling->datamin;
+		double datamax = scaling->datamax;
+
+		if (!isfinite(datamin) || !isfinite(datamax)) {
+			return false;
+		}
+
+		// Every pixel of a constant plane holds datamin, whatever the transform.
+		if (datamin == datamax) {
+			inverse->scale = 0.0;
+			inverse->offset = datamin;
+			return true;
+		}
+
+		// Scale of the forward map, and any value added to the intensity divided by it.
+		double forward;
+		double shift = 0.0;
+
+		if (scaling->transform == LOG || scaling->transform == NEGATIVE_LOG) {
+			double absMin = datamin;
+			double zero = 0.0;
+
+			if (datamin < 0.0) {
+				absMin = -absMin;
+				zero = 2*absMin;
+			}
+			else if (datamin <= 0.0) {
+				absMin = 0.000001;
+				zero = absMin;
+			}
+
+			// intensity = forward * log((x + zero) / absMin)
+			forward = 65535.0/log((datamax+zero)/absMin);
+			inverse->function = INVERSE_EXP;
+			inverse->outerScale = absMin;
+			inverse->outerOffset = -zero;
+		}
+		else if (scaling->transform == LINEAR || scaling->transform == NEGATIVE_LINEAR) {
+			// intensity = forward * x
+			forward = 65535.0/(datamax + (datamin < 0.0 ? -datamin : 0.0));
+		}
+		else if (scaling->transform == SQRT || scaling->transform == NEGATIVE_SQRT) {
+			// intensity = forward * sqrt(x - datamin)
+			forward = 65535.0/sqrt(datamax-datamin);
+			inverse->function = INVERSE_SQUARE;
+			inverse->outerOffset = datamin;
+		}
+		else if (scaling->transform == SQUARED || scaling->transform == NEGATIVE_SQUARED) {
+			// intensity = forward * (x - datamin)^2
+			forward = 65535.0/( (datamax-datamin)*(datamax-datamin) );
+			inverse->function = INVERSE_SQRT;
+			inverse->outerOffset = datamin;
+		}
+		else if (scaling->transform == POWER || scaling->transform == NEGATIVE_POWER) {
+			// intensity = forward * (exp(x) - exp(datamin))
+			forward = 65535.0/( exp(datamax) - exp(datamin) );
+			shift = exp(datamin);
+			inverse->function = INVERSE_LOG;
+		}
+		else {
+			return false;
+		}
+
+		if (!(forward > 0.0) || isinf(forward) || isinf(shift)) {
+			setIdentityInverse(inverse);
+			return false;
+		}
+
+		// Intensities are truncated, so take the middle of the values each stands for.  The NEGATIVE_ transforms
+		// subtract the intensity from 65535.
+		bool negative = scaling->transform == NEGATIVE_LOG || scaling->transform == NEGATIVE_LINEAR || scaling->transform == NEGATIVE_SQRT ||
+			scaling->transform == NEGATIVE_SQUARED || scaling->transform == NEGATIVE_POWER;
+
+		inverse->scale = (negative ? -1.0 : 1.0) / forward;
+		inverse->offset = (negative ? 65535.5 : 0.5) / forward + shift;
+		return true;
+	}
+
+	if (scaling->transform != RAW && scaling->transform != NEGATIVE_RAW) {
+		return false;
+	}
+
+	bool negative = scaling->transform == NEGATIVE_RAW;
+	double s,o;
+
+	// Raw values from image intensities.  NEGATIVE_RAW for signed bytes is intensity = 127 + raw.
+	if (scaling->bitpix == BYTE_IMG) {
+		s = negative ? -1.0 : 1.0;
+		o = negative ? 255.0 : 0.0;
+	}
+	else if (scaling->bitpix == SHORT_IMG) {
+		s = negative ? -1.0 : 1.0;
+		o = negative ? 32767.0 : -32768.0;
+	}
+	else if (scaling->bitpix == USHORT_IMG) {
+		s = negative ? -1.0 : 1.0;
+		o = negative ? 65535.0 : 0.0;
+	}
+	else if (scaling->bitpix == SBYTE_IMG) {
+		s = 1.0;
+		o = negative ? -127.0 : -128.0;
+	}
+	else {
+		return false;
+	}
+
+	inverse->scale = scaling->bscale * s;
+	inverse->offset = scaling->bscale * o + scaling->bzero;
+	return true;
+}
+
+/**
+ * Map image intensities back to physical values.
+ *
+ * @param inverse Reference to physical_inverse structure (see getPhysicalInverse).
+ * @param intensities Image intensities.
+ * @param physical Array of at least len doubles, which will be populated with the physical values.
+ * @param len Number of intensities.
+ */
+void intensitiesToPhysical(physical_inverse *inverse, const int *intensities, double *physical, size_t len) {
+	// Loop variable
+	size_t ii = 0;
+
+	inverse_function function = inverse->function;
+	double scale = inverse->scale;
+	double offset = inverse->offset;
+
+	// exp and log are applied afterwards, a pixel at a time, together with the map following them.
+	bool library = function == INVERSE_EXP || function == INVERSE_LOG;
+	double outerScale = library ? 1.0 : inverse->outerScale;
+	double outerOffset = library ? 0.0 : inverse->outerOffset;
+
+#ifdef __SSE2__
+	__m128d scale2 = _mm_set1_pd(scale);
+	__m128d offset2 = _mm_set1_pd(offset);
+	__m128d outerScale2 = _mm_set1_pd(outerScale);
+	__m128d outerOffset2 = _mm_set1_pd(outerOffset);
+	__m128d zero2 = _mm_setzero_pd();
+
+	for (; ii+2<=len; ii+=2) {
+		__m128d t = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i *) (intensities+ii)));
+		t = _mm_add_pd(_mm_mul_pd(t,scale2),offset2);
+
+		if (function == INVERSE_SQUARE) {
+			t = _mm_mul_pd(t,t);
+		}
+		else if (function == INVERSE_SQRT) {
+			t = _mm_sqrt_pd(_mm_max_pd(t,zero2));
+		}
+
+		_mm_storeu_pd(physical+ii,_mm_add_pd(_mm_mul_pd(t,outerScale2),outerOffset2));
+	}
+#endif
+
+	for (; ii<len; ii++) {
+		double t = scale * intensities[ii] + offset;
+
+		if (function == INVERSE_SQUARE) {
+			t *= t;
+		}
+		else if (function == INVERSE_SQRT) {
+			t = sqrt(t > 0.0 ? t : 0.0);
+		}
+
+		physical[ii] = t * outerScale + outerOffset;
+	}
+
+	if (function == INVERSE_EXP) {
+		for (ii=0; ii<len; ii++) {
+			physical[ii] = inverse->outerScale * exp(physical[ii]) + inverse->outerOffset;
+		}
+	}
+	else if (function == INVERSE_LOG) {
+		for (ii=0; ii<len; ii++) {
+			physical[ii] = inverse->outerScale * log(physical[ii]) + inverse->outerOffset;
+		}
+	}
+}
+
+/**
+ * Add the errors of a block of physical values to the error sums.  Pixels whose original value isn't finite
+ * (such as blank pixels, read as NaN) are skipped.
+ *
+ * @param values Physical values mapped back from the decoded intensities.
+ * @param original Physical values read from the FITS file.
+ * @param len Number of values.
+ * @param squaredError Reference to the sum of squared errors, which is added to.
+ * @param maximumError Reference to the largest absolute error, which is updated.
+ *
+ * @return Number of pixels compared.
+ */
+static size_t addPhysicalErrors(const double *values, const double *original, size_t len, double *squaredError, double *maximumError) {
+	// Loop variable
+	size_t ii = 0;
+
+	size_t pixels = 0;
+	double sum = 0.0;
+	double max = *maximumError;
+
+#ifdef __SSE2__
+	__m128d sum2 = _mm_setzero_pd();
+	__m128d max2 = _mm_set1_pd(max);
+	__m128d infinity2 = _mm_set1_pd(INFINITY);
+	__m128d sign2 = _mm_set1_pd(-0.0);
+
+	for (; ii+2<=len; ii+=2) {
+		__m128d x = _mm_loadu_pd(original+ii);
+
+		// |x| < infinity is false for NaN and infinite values, whose lanes are zeroed.
+		__m128d finite = _mm_cmplt_pd(_mm_andnot_pd(sign2,x),infinity2);
+		__m128d error = _mm_andnot_pd(sign2,_mm_and_pd(finite,_mm_sub_pd(_mm_loadu_pd(values+ii),x)));
+		int mask = _mm_movemask_pd(finite);
+
+		sum2 = _mm_add_pd(sum2,_mm_mul_pd(error,error));
+		max2 = _mm_max_pd(error,max2);
+		pixels += (mask & 1) + (mask >> 1);
+	}
+
+	double lanes[2];
+
+	_mm_storeu_pd(lanes,sum2);
+	sum = lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes,max2);
+	max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+#endif
+
+	for (; ii<len; ii++) {
+		if (isfinite(original[ii])) {
+			double error = fabs(values[ii] - original[ii]);
+
+			sum += error * error;
+
+			if (error > max) {
+				max = error;
+			}
+
+			pixels++;
+		}
+	}
+
+	*squaredError += sum;
+	*maximumError = max;
+
+	return pixels;
+}
+
+/**
+ * Compare the physical values of a plane with its decoded image intensities mapped back to physical values, in
+ * a single pass over both (see PHYSICAL_BLOCK).  Pixels whose original value isn't finite are skipped.
+ *
+ * @param plane Reference to physical_plane structure holding the physical values of the plane and its scaling.
+ * @param decoded Decoded image intensities of the plane, whose rows are the reverse of those read from the FITS file.
+ * @param width Width of the plane.
+ * @param height Height of the plane.
+ * @param rootMeanSquaredError Reference to double which will be set to the root mean squared error (NaN if no pixel
+ * was compared).
+ * @param maximumError Reference to double which will be set to the largest absolute error (NaN if no pixel was
+ * compared).
+ *
+ * @return 0 if the plane was compared, 1 if its scaling can't be inverted.
+ */
+int comparePhysicalValues(physical_plane *plane, const int *decoded, size_t width, size_t height, double *rootMeanSquaredError,
+		double *maximumError) {
+	// Loop variables
+	size_t ii,jj;
+
+	physical_inverse inverse;
+
+	if (plane == NULL || plane->values == NULL || decoded == NULL || !getPhysicalInverse(&plane->scaling,&inverse)) {
+		return 1;
+	}
+
+	double values[PHYSICAL_BLOCK];
+	double squaredError = 0.0;
+	double maxError = 0.0;
+	size_t pixels = 0;
+
+	for (ii=0; ii<height; ii++) {
+		// Row ii of the image holds row height-1-ii of the plane read.
+		const int *decodedRow = decoded + ii * width;
+		const double *originalRow = plane->values + (height-1-ii) * width;
+
+		for (jj=0; jj<width; jj+=PHYSICAL_BLOCK) {
+			size_t len = width - jj < PHYSICAL_BLOCK ? width - jj : PHYSICAL_BLOCK;
+
+			intensitiesToPhysical(&inverse,decodedRow+jj,values,len);
+			pixels += addPhysicalErrors(values,originalRow+jj,len,&squaredError,&maxError);
+		}
+	}
+
+	*rootMeanSquaredError = pixels > 0 ? sqrt(squaredError / pixels) : NAN;
+	*maximumError = pixels > 0 ? maxError : NAN;
+
+	return 0;
+}
+
+/**
+ * Free the physical values of the planes of an image and the array holding them.
+ *
+ * @param planes Array of physical_plane structures.  Nothing is done if it is null.
+ * @param numPlanes Number of planes in the array.
+ */
+void freePhysicalPlanes(physical_plane *planes, int numPlanes) {
+	// Loop variable
+	int ii;
+
+	if (planes == NULL) {
+		return;
+	}
+
+	for (ii=0; ii<numPlanes; ii++) {
+		free(planes[ii].values);
+	}
+
+	free(planes);
+}
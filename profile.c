@@ -0,0 +1,367 @@
+/**
+ * @file profile.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Instrumentation of the stages of a conversion (-profile).
+ *
+ * The wall clock time, CPU time (of the thread doing the work) and number of bytes processed are recorded
+ * for each stage of the pipeline: opening FITS files, reading planes, transforming raw values to intensities,
+ * encoding, writing JPEG 2000 files, decoding them again and comparing them for quality benchmarking.  The
+ * figures are aggregated for each image written (one plane, or group of planes packed into one image) and
+ * for the whole run, and written as JSON or CSV when the run finishes.
+ *
+ * Stages are timed with the PROFILE_START/PROFILE_STOP macros (see f2j.h), which only test a global flag
+ * when profiling is off.  Counters are kept per thread while an image is being produced and only merged
+ * (under a mutex) once the image is finished, so profiling doesn't serialise the worker threads.  Stages
+ * that happen outside an image, such as opening a file, are counted with the next image produced by the
+ * same thread.
+ */
+
+#include "f2j.h"
+
+/**
+ * Is profiling turned on?  Tested by the PROFILE_START and PROFILE_STOP macros.
+ */
+bool profilingEnabled = false;
+
+/**
+ * Names of the stages, used in the output.
+ */
+static const char *stageNames[PROFILE_STAGES] = {"open","read","transform","encode","write","decode","quality"};
+
+/**
+ * Counters for a single image written.
+ */
+typedef struct {
+	char *image /** Name of the JPEG 2000 image. */;
+	profile_counter stages[PROFILE_STAGES] /** Counters for each stage. */;
+} profile_record;
+
+/**
+ * Format in which the profile is written.
+ */
+static profile_format outputFormat = PROFILE_OFF;
+
+/**
+ * File the profile is written to.  Empty for standard output.
+ */
+static char outputFile[OPJ_PATH_LEN] = "";
+
+/**
+ * Wall clock time when profiling was turned on.
+ */
+static double profileStartTime = 0.0;
+
+/**
+ * Counters for the image currently being produced by each thread.
+ */
+static __thread profile_counter currentImage[PROFILE_STAGES];
+
+/**
+ * Counters for every image written, and for the whole run.
+ */
+static profile_record *records = NULL;
+static long numRecords = 0;
+static long recordsCapacity = 0;
+static profile_counter runTotals[PROFILE_STAGES];
+
+/**
+ * Mutex protecting records and runTotals.
+ */
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the CPU time used by the calling thread.
+ *
+ * @return CPU time in seconds.
+ */
+double getThreadCPUTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID,&now);
+
+	return (double) now.tv_sec + ((double) now.tv_nsec)/1.0e9;
+}
+
+/**
+ * Turn on profiling, as specified by the -profile parameter.  May be called more than once with the same
+ * specification (e.g. when the command line is parsed again in server mode).
+ *
+ * @param specification json or csv, optionally followed by :file to write the profile to a file rather than
+ * standard output.
+ *
+ * @return 0 if the specification is valid, 1 otherwise.
+ */
+int setProfileOutput(const char *specification) {
+	if (specification == NULL) {
+		fprintf(stderr,"Parameters to setProfileOutput cannot be null.\n");
+		return 1;
+	}
+
+	const char *colon = strchr(specification,':');
+	size_t formatLength = colon != NULL ? (size_t) (colon - specification) : strlen(specification);
+	profile_format format;
+
+	if (formatLength == 4 && strncmp(specification,"json",4) == 0) {
+		format = PROFILE_JSON;
+	}
+	else if (formatLength == 3 && strncmp(specification,"csv",3) == 0) {
+		format = PROFILE_CSV;
+	}
+	else {
+		fprintf(stderr,"Profile format (option -profile) must be json or csv, optionally followed by :file.\n");
+		return 1;
+	}
+
+	pthread_mutex_lock(&profileMutex);
+
+	outputFormat = format;
+
+	if (colon != NULL) {
+		strncpy(outputFile,colon+1,sizeof(outputFile)-1);
+	}
+	else {
+		outputFile[0] = '\0';
+	}
+
+	if (!profilingEnabled) {
+		profileStartTime = getWallClockTime();
+		profilingEnabled = true;
+	}
+
+	pthread_mutex_unlock(&profileMutex);
+
+	return 0;
+}
+
+/**
+ * Start timing a stage.  Used by PROFILE_START.
+ *
+ * @param timer Reference to the timer to start.
+ */
+void startProfileTimer(profile_timer *timer) {
+	timer->wallSeconds = getWallClockTime();
+	timer->cpuSeconds = getThreadCPUTime();
+}
+
+/**
+ * Stop timing a stage, adding the time taken to the counters of the image being produced by this thread.
+ * Used by PROFILE_STOP.
+ *
+ * @param timer Reference to the timer started by startProfileTimer.
+ * @param stage Stage timed.
+ * @param bytes Number of bytes processed by the stage.
+ */
+void stopProfileTimer(profile_timer *timer, profile_stage stage, unsigned long long bytes) {
+	profile_counter *counter = &currentImage[stage];
+
+	counter->wallSeconds += getWallClockTime() - timer->wallSeconds;
+	counter->cpuSeconds += getThreadCPUTime() - timer->cpuSeconds;
+	counter->bytes += bytes;
+	counter->calls++;
+}
+
+/**
+ * Finish the image being produced by this thread, recording its counters and adding them to the totals
+ * for the run.  Nothing is done if profiling is off.
+ *
+ * @param image Name of the JPEG 2000 image written.
+ */
+void finishProfiledImage(const char *image) {
+	if (!profilingEnabled) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	pthread_mutex_lock(&profileMutex);
+
+	if (numRecords == recordsCapacity) {
+		long capacity = recordsCapacity == 0 ? 64 : 2*recordsCapacity;
+		profile_record *newRecords = (profile_record *) realloc(records,sizeof(profile_record)*capacity);
+
+		if (newRecords != NULL) {
+			records = newRecords;
+			recordsCapacity = capacity;
+		}
+	}
+
+	// If memory can't be allocated, the image is still counted in the totals for the run.
+	if (numRecords < recordsCapacity) {
+		records[numRecords].image = strdup(image != NULL ? image : "");
+		memcpy(records[numRecords].stages,currentImage,sizeof(currentImage));
+		numRecords++;
+	}
+
+	for (ii=0; ii<PROFILE_STAGES; ii++) {
+		runTotals[ii].wallSeconds += currentImage[ii].wallSeconds;
+		runTotals[ii].cpuSeconds += currentImage[ii].cpuSeconds;
+		runTotals[ii].bytes += currentImage[ii].bytes;
+		runTotals[ii].calls += currentImage[ii].calls;
+	}
+
+	pthread_mutex_unlock(&profileMutex);
+
+	memset(currentImage,0,sizeof(currentImage));
+}
+
+/**
+ * Write a string to a JSON document, escaping it as needed.
+ *
+ * @param out Stream to write to.
+ * @param value String to write.
+ */
+static void writeProfileString(FILE *out, const char *value) {
+	fputc('"',out);
+
+	for (; value != NULL && *value != '\0'; value++) {
+		if (*value == '"' || *value == '\\') {
+			fputc('\\',out);
+			fputc(*value,out);
+		}
+		else if ((unsigned char) *value < 0x20) {
+			fprintf(out,"\\u%04x",(unsigned char) *value);
+		}
+		else {
+			fputc(*value,out);
+		}
+	}
+
+	fputc('"',out);
+}
+
+/**
+ * Write the counters for each stage as a JSON object.
+ *
+ * @param out Stream to write to.
+ * @param stages Counters for each stage.
+ */
+static void writeProfileStagesJSON(FILE *out, profile_counter *stages) {
+	// Loop variable
+	int ii;
+	bool first = true;
+
+	fputc('{',out);
+
+	for (ii=0; ii<PROFILE_STAGES; ii++) {
+		if (stages[ii].calls == 0) {
+			continue;
+		}
+
+		fprintf(out,"%s\"%s\":{\"calls\":%ld,\"wall_seconds\":%f,\"cpu_seconds\":%f,\"bytes\":%llu}",first ? "" : ",",stageNames[ii],
+				stages[ii].calls,stages[ii].wallSeconds,stages[ii].cpuSeconds,stages[ii].bytes);
+		first = false;
+	}
+
+	fputc('}',out);
+}
+
+/**
+ * Write the counters for each stage as CSV rows.
+ *
+ * @param out Stream to write to.
+ * @param image Value of the image column.
+ * @param stages Counters for each stage.
+ */
+static void writeProfileStagesCSV(FILE *out, const char *image, profile_counter *stages) {
+	// Loop variables
+	int ii;
+	const char *c;
+
+	for (ii=0; ii<PROFILE_STAGES; ii++) {
+		if (stages[ii].calls == 0) {
+			continue;
+		}
+
+		// Quote the image name, doubling any quotes in it.
+		fputc('"',out);
+		for (c=image; *c != '\0'; c++) {
+			if (*c == '"') {
+				fputc('"',out);
+			}
+			fputc(*c,out);
+		}
+		fputc('"',out);
+
+		fprintf(out,",%s,%ld,%f,%f,%llu\n",stageNames[ii],stages[ii].calls,stages[ii].wallSeconds,stages[ii].cpuSeconds,stages[ii].bytes);
+	}
+}
+
+/**
+ * Write the profile collected during the run, in the format given by -profile, then free it.  Nothing is
+ * done if profiling is off.
+ *
+ * @return 0 if the profile was written successfully (or profiling is off), 1 otherwise.
+ */
+int writeProfile() {
+	if (!profilingEnabled) {
+		return 0;
+	}
+
+	// Loop variable
+	long ii;
+
+	// Stages outside any image (e.g. opening a file that couldn't be converted) are only in the totals.
+	finishProfiledImage(NULL);
+
+	if (numRecords > 0 && records[numRecords-1].image[0] == '\0') {
+		free(records[numRecords-1].image);
+		numRecords--;
+	}
+
+	FILE *out = stdout;
+
+	if (outputFile[0] != '\0') {
+		out = fopen(outputFile,"w");
+
+		if (out == NULL) {
+			fprintf(stderr,"Unable to open profile file %s for writing.\n",outputFile);
+			return 1;
+		}
+	}
+
+	double wallSeconds = getWallClockTime() - profileStartTime;
+
+	if (outputFormat == PROFILE_JSON) {
+		fprintf(out,"{\"wall_seconds\":%f,\"images\":%ld,\"run\":",wallSeconds,numRecords);
+		writeProfileStagesJSON(out,runTotals);
+		fprintf(out,",\"per_image\":[");
+
+		for (ii=0; ii<numRecords; ii++) {
+			fprintf(out,"%s{\"image\":",ii == 0 ? "" : ",");
+			writeProfileString(out,records[ii].image);
+			fprintf(out,",\"stages\":");
+			writeProfileStagesJSON(out,records[ii].stages);
+			fputc('}',out);
+		}
+
+		fprintf(out,"]}\n");
+	}
+	else {
+		// Rows for the whole run have an empty image column.
+		fprintf(out,"image,stage,calls,wall_seconds,cpu_seconds,bytes\n");
+
+		for (ii=0; ii<numRecords; ii++) {
+			writeProfileStagesCSV(out,records[ii].image,records[ii].stages);
+		}
+
+		writeProfileStagesCSV(out,"",runTotals);
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	for (ii=0; ii<numRecords; ii++) {
+		free(records[ii].image);
+	}
+
+	free(records);
+	records = NULL;
+	numRecords = 0;
+	recordsCapacity = 0;
+	memset(runTotals,0,sizeof(runTotals));
+
+	return 0;
+}
@@ -0,0 +1,318 @@
+/**
+ * @file rate.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Accounting of the compressed size of the files written (compression benchmarking, -CB).
+ *
+ * Sizes are taken from the byte counts of the encoder rather than from the files written, so no file
+ * has to be looked at again once it has been written.  The JPEG 2000 images, lossless copies, noise
+ * fields and residual images are accounted for separately, and the packets of the JPEG 2000 images are
+ * also split by quality layer, using the index of the codestream built by the encoder.  Rates are given
+ * in bits per pixel, and compression ratios relative to the size of the FITS data encoded (not the size
+ * of the FITS file, which also includes headers and padding).
+ */
+
+#include "f2j.h"
+
+/**
+ * Names of the kinds of file, used in the output.
+ */
+static const char *outputNames[RATE_OUTPUTS] = {"image","lossless","noise_field","residual"};
+
+/**
+ * Get the name of a kind of file written.
+ *
+ * @param output Kind of file.
+ *
+ * @return name of the kind of file.
+ */
+const char *getRateOutputName(rate_output output) {
+	return output >= 0 && output < RATE_OUTPUTS ? outputNames[output] : "unknown";
+}
+
+/**
+ * Add the size of the packets of each quality layer of a codestream to an array.  The layer each packet
+ * belongs to follows from the progression order: the layer is the outermost loop of LRCP, the second
+ * loop of RLCP and the innermost loop of the other orders.  All components are assumed to have the same
+ * number of resolutions and precincts, as is the case for the images written by f2j.
+ *
+ * @param cstr_info Reference to the index of the codestream built by the encoder.
+ * @param layerBytes Array with one entry per quality layer, to which the size of the packets is added.
+ * @param packetBytes Reference to a value to which the size of all the packets is added.
+ *
+ * @return 0 if the packets could be split by layer, 1 otherwise.
+ */
+static int countLayerBytes(opj_codestream_info_t *cstr_info, unsigned long long *layerBytes, unsigned long long *packetBytes) {
+	if (cstr_info->tile == NULL || cstr_info->numdecompos == NULL || cstr_info->numlayers < 1 || cstr_info->numlayers > RATE_MAX_LAYERS) {
+		return 1;
+	}
+
+	// Loop variables
+	int tileno,resno,layno;
+	long ii,packno;
+
+	int layers = cstr_info->numlayers;
+	int resolutions = cstr_info->numdecompos[0] + 1;
+
+	for (tileno=0; tileno<cstr_info->tw*cstr_info->th; tileno++) {
+		opj_tile_info_t *tile = &cstr_info->tile[tileno];
+
+		if (tile->packet == NULL) {
+			return 1;
+		}
+
+		// Number of packets in each resolution of a single layer.
+		long resolutionPackets[33];
+		long layerPackets = 0;
+
+		for (resno=0; resno<resolutions; resno++) {
+			resolutionPackets[resno] = (long) cstr_info->numcomps * tile->pw[resno] * tile->ph[resno];
+			layerPackets += resolutionPackets[resno];
+		}
+
+		packno = 0;
+
+#define COUNT_PACKET(layer) {\
+	opj_packet_info_t *packet = &tile->packet[packno++];\
+	unsigned long long size = (unsigned long long) (packet->end_pos - packet->start_pos + 1);\
+	layerBytes[layer] += size;\
+	*packetBytes += size;\
+}
+
+		switch (cstr_info->prog) {
+			case LRCP:
+				for (layno=0; layno<layers; layno++) {
+					for (ii=0; ii<layerPackets; ii++) {
+						COUNT_PACKET(layno);
+					}
+				}
+				break;
+			case RLCP:
+				for (resno=0; resno<resolutions; resno++) {
+					for (layno=0; layno<layers; layno++) {
+						for (ii=0; ii<resolutionPackets[resno]; ii++) {
+							COUNT_PACKET(layno);
+						}
+					}
+				}
+				break;
+			case RPCL:
+			case PCRL:
+			case CPRL:
+				for (ii=0; ii<layerPackets; ii++) {
+					for (layno=0; layno<layers; layno++) {
+						COUNT_PACKET(layno);
+					}
+				}
+				break;
+			default:
+				return 1;
+		}
+
+#undef COUNT_PACKET
+	}
+
+	return 0;
+}
+
+/**
+ * Account for a file just encoded by createJPEG2000Image.
+ *
+ * @param rates Reference to rate_account structure to add the file to.
+ * @param output Kind of file encoded.
+ * @param frame Image encoded.
+ * @param parameters Compression parameters used.
+ * @param cstr_info Reference to the index of the codestream built by the encoder, used to find the size of the
+ * headers and of each quality layer.  May be null, in which case only the total size is recorded.
+ * @param codestreamLength Number of bytes written by the encoder.
+ */
+void countEncodedRate(rate_account *rates, rate_output output, opj_image_t *frame, opj_cparameters_t *parameters, opj_codestream_info_t *cstr_info,
+		int codestreamLength) {
+	if (rates == NULL || frame == NULL || parameters == NULL || output < 0 || output >= RATE_OUTPUTS) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	rate_account encoded;
+	memset(&encoded,0,sizeof(rate_account));
+
+	rate_counter *counter = &encoded.outputs[output];
+	counter->images = 1;
+	counter->bytes = codestreamLength;
+
+	for (ii=0; ii<frame->numcomps; ii++) {
+		counter->pixels += (unsigned long long) frame->comps[ii].w * frame->comps[ii].h;
+	}
+
+	// Packets are only indexed reliably if each tile is written in a single part, with a single progression.
+	if (cstr_info != NULL && parameters->numpocs == 0 && !parameters->tp_on) {
+		unsigned long long packetBytes = 0;
+
+		if (countLayerBytes(cstr_info,encoded.layerBytes,&packetBytes) == 0 && packetBytes <= counter->bytes) {
+			counter->headerBytes = counter->bytes - packetBytes;
+
+			if (output == RATE_IMAGE) {
+				encoded.layers = cstr_info->numlayers;
+			}
+		}
+	}
+
+	if (encoded.layers == 0) {
+		memset(encoded.layerBytes,0,sizeof(encoded.layerBytes));
+	}
+
+	addRateAccount(rates,&encoded);
+}
+
+/**
+ * Set the size of the FITS data encoded in each kind of file, from the number of pixels encoded.
+ *
+ * @param rates Reference to rate_account structure for files encoded from FITS data of a single type.
+ * @param bitpix Type of the FITS data (BITPIX).
+ */
+void setRawPayload(rate_account *rates, int bitpix) {
+	if (rates == NULL) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	for (ii=0; ii<RATE_OUTPUTS; ii++) {
+		rates->outputs[ii].rawBytes = rates->outputs[ii].pixels * (unsigned long long) (abs(bitpix)/8);
+	}
+}
+
+/**
+ * Add the compressed sizes in one rate_account structure to another.  The sizes of the quality layers are
+ * only added if both have the same number of layers; otherwise the split by layer is no longer known.
+ *
+ * @param total Reference to rate_account structure to add to.
+ * @param rates Reference to rate_account structure to add.
+ */
+void addRateAccount(rate_account *total, rate_account *rates) {
+	if (total == NULL || rates == NULL) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	if (rates->outputs[RATE_IMAGE].images > 0) {
+		if (total->outputs[RATE_IMAGE].images == 0) {
+			total->layers = rates->layers;
+			memcpy(total->layerBytes,rates->layerBytes,sizeof(total->layerBytes));
+		}
+		else if (total->layers == rates->layers) {
+			for (ii=0; ii<total->layers; ii++) {
+				total->layerBytes[ii] += rates->layerBytes[ii];
+			}
+		}
+		else {
+			total->layers = 0;
+			memset(total->layerBytes,0,sizeof(total->layerBytes));
+		}
+	}
+
+	for (ii=0; ii<RATE_OUTPUTS; ii++) {
+		total->outputs[ii].images += rates->outputs[ii].images;
+		total->outputs[ii].bytes += rates->outputs[ii].bytes;
+		total->outputs[ii].headerBytes += rates->outputs[ii].headerBytes;
+		total->outputs[ii].pixels += rates->outputs[ii].pixels;
+		total->outputs[ii].rawBytes += rates->outputs[ii].rawBytes;
+	}
+}
+
+/**
+ * Get the rate achieved by a set of files.
+ *
+ * @param counter Reference to rate_counter structure for the files.
+ *
+ * @return number of bits written per pixel encoded, or 0 if no pixels were encoded.
+ */
+double getBitsPerPixel(rate_counter *counter) {
+	return counter->pixels > 0 ? 8.0*((double) counter->bytes)/((double) counter->pixels) : 0.0;
+}
+
+/**
+ * Get the compression ratio achieved by a set of files.
+ *
+ * @param counter Reference to rate_counter structure for the files.
+ *
+ * @return size of the files relative to the size of the FITS data encoded, or 0 if no data was encoded.
+ */
+double getCompressionRatio(rate_counter *counter) {
+	return counter->rawBytes > 0 ? ((double) counter->bytes)/((double) counter->rawBytes) : 0.0;
+}
+
+/**
+ * Print the compressed size of each JPEG 2000 image recorded in a conversion_result structure (one line
+ * per plane, unless several planes are packed into each image).
+ *
+ * @param out Stream to print to.
+ * @param result Reference to conversion_result structure with information on each image recorded.
+ */
+void printImageRates(FILE *out, conversion_result *result) {
+	if (out == NULL || result == NULL || result->imageResults == NULL) {
+		return;
+	}
+
+	// Loop variable
+	long ii;
+
+	fprintf(out,"[JPEG 2000 image] [planes] [pixels] [size of FITS data] [size of compressed JPEG 2000 image] [bits per pixel] [compression ratio]\n");
+
+	for (ii=0; ii<result->images; ii++) {
+		rate_counter *counter = &result->imageResults[ii].rate;
+
+		fprintf(out,"%s %d %llu %llu %llu %f %f\n",result->imageResults[ii].file,result->imageResults[ii].numcomps,counter->pixels,counter->rawBytes,
+				counter->bytes,getBitsPerPixel(counter),getCompressionRatio(counter));
+	}
+}
+
+/**
+ * Print the compressed size of each kind of file written, and of each quality layer of the JPEG 2000 images.
+ * The size of a layer includes all the layers before it, giving the rate achieved if the images were
+ * truncated after that layer; the headers are counted with the first layer.
+ *
+ * @param out Stream to print to.
+ * @param name Name of the FITS file (or set of files) converted.
+ * @param rates Reference to rate_account structure to print.
+ */
+void printRateAccount(FILE *out, const char *name, rate_account *rates) {
+	if (out == NULL || name == NULL || rates == NULL) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	fprintf(out,"[FITS file] [output] [files] [pixels] [size of FITS data] [size of compressed file(s)] [size of headers] [bits per pixel] [compression ratio]\n");
+
+	for (ii=0; ii<RATE_OUTPUTS; ii++) {
+		rate_counter *counter = &rates->outputs[ii];
+
+		if (counter->images == 0) {
+			continue;
+		}
+
+		fprintf(out,"%s %s %ld %llu %llu %llu %llu %f %f\n",name,outputNames[ii],counter->images,counter->pixels,counter->rawBytes,counter->bytes,
+				counter->headerBytes,getBitsPerPixel(counter),getCompressionRatio(counter));
+	}
+
+	if (rates->layers > 0) {
+		rate_counter cumulative = rates->outputs[RATE_IMAGE];
+		cumulative.bytes = cumulative.headerBytes;
+
+		fprintf(out,"[FITS file] [layer] [size of layer] [cumulative size] [cumulative bits per pixel] [cumulative compression ratio]\n");
+
+		for (ii=0; ii<rates->layers; ii++) {
+			cumulative.bytes += rates->layerBytes[ii];
+
+			fprintf(out,"%s %d %llu %llu %f %f\n",name,ii+1,rates->layerBytes[ii],cumulative.bytes,getBitsPerPixel(&cumulative),getCompressionRatio(&cumulative));
+		}
+	}
+}
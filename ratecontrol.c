@@ -0,0 +1,290 @@
+/**
+ * @file ratecontrol.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Adaptive rate control (-deadline, -min_psnr and -target_bpp).
+ *
+ * The time taken to encode a plane depends on the data as well as on the compression parameters, so a
+ * fixed set of parameters can't guarantee that a data cube is converted within a given time.  When rate
+ * control is on, the parameters used for each image of a data cube are derived from those given by the
+ * user, and adjusted after each image from the time it took, its size and (if a minimum PSNR is given)
+ * its quality:
+ *
+ * - If the time per pixel measured so far means the cube would not be finished by the deadline, the next
+ *   image is encoded one speed level higher.  The levels, in order, turn on the bypass (lazy) mode switch
+ *   (-M 1), use 64x64 code-blocks, use the irreversible 9-7 wavelet (lossy compression only), then remove
+ *   one resolution level at a time, down to two resolutions.  Steps that the user's parameters already
+ *   include are skipped.  A level is dropped again if the time measured at the level below shows that the
+ *   deadline can comfortably be met with it.
+ * - The compression ratios given by -r are scaled so that the images reach the target rate, measured from
+ *   the size of the previous images.  Without -r, the last layer is given the target rate.
+ * - If a plane falls below the minimum PSNR, the speed level is lowered (and not raised above that level
+ *   again), or if already at the user's parameters, the compression ratios are lowered.  The minimum PSNR
+ *   takes priority over the deadline and target rate.
+ *
+ * Measuring PSNR requires every image to be decoded again, which adds to the time taken.
+ */
+
+#include "f2j.h"
+
+/**
+ * Steps by which encoding can be made faster, in the order they are taken.
+ */
+typedef enum {
+	STEP_BYPASS /** Turn on the bypass mode switch. */,
+	STEP_CODE_BLOCKS /** Use 64x64 code-blocks. */,
+	STEP_IRREVERSIBLE /** Use the irreversible 9-7 wavelet. */,
+	STEP_RESOLUTIONS /** Remove a resolution level. */
+} speed_step;
+
+/**
+ * Bits per pixel assumed for each component when the first image is given the target rate, before the size
+ * of an image has been measured.
+ */
+#define RATE_CONTROL_ASSUMED_PRECISION 16.0
+
+/**
+ * Is any form of rate control requested?
+ *
+ * @param info Reference to rate_control_info structure.
+ *
+ * @return true if a deadline, minimum PSNR or target rate is given, false otherwise.
+ */
+bool isRateControlOn(rate_control_info *info) {
+	return info != NULL && (info->deadline > 0.0 || info->minPSNR > 0.0 || info->targetBPP > 0.0);
+}
+
+/**
+ * Is lossy compression being performed, so that the compression ratios and the irreversible wavelet can be used?
+ *
+ * @param controller Reference to rate_controller structure.
+ *
+ * @return true if the user's parameters (or the target rate) call for lossy compression, false otherwise.
+ */
+static bool isLossy(rate_controller *controller) {
+	// Loop variable
+	int ii;
+
+	if (controller->info->targetBPP > 0.0 || controller->base.irreversible || controller->base.cp_fixed_quality || controller->base.cp_fixed_alloc) {
+		return true;
+	}
+
+	for (ii=0; ii<controller->base.tcp_numlayers; ii++) {
+		if (controller->base.tcp_rates[ii] > 0.0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * List the steps by which encoding can be made faster, given the user's parameters.
+ *
+ * @param controller Reference to rate_controller structure.
+ * @param steps Array with RATE_CONTROL_MAX_LEVELS entries, which will be populated with the steps.
+ *
+ * @return number of steps.
+ */
+static int listSpeedSteps(rate_controller *controller, speed_step *steps) {
+	opj_cparameters_t *base = &controller->base;
+	int count = 0;
+	int resolutions;
+
+	if (!(base->mode & 1)) {
+		steps[count++] = STEP_BYPASS;
+	}
+
+	if (base->cblockw_init * base->cblockh_init < 4096) {
+		steps[count++] = STEP_CODE_BLOCKS;
+	}
+
+	if (!base->irreversible && isLossy(controller)) {
+		steps[count++] = STEP_IRREVERSIBLE;
+	}
+
+	for (resolutions=base->numresolution; resolutions>2 && count<RATE_CONTROL_MAX_LEVELS-1; resolutions--) {
+		steps[count++] = STEP_RESOLUTIONS;
+	}
+
+	return count;
+}
+
+/**
+ * Start rate control for a data cube.
+ *
+ * @param controller Reference to rate_controller structure to initialise.
+ * @param info Reference to rate_control_info structure specifying the rate control requested.
+ * @param parameters Compression parameters given by the user.
+ * @param pixels Number of pixels in the planes of the data cube to convert.
+ */
+void startRateControl(rate_controller *controller, rate_control_info *info, opj_cparameters_t *parameters, unsigned long long pixels) {
+	speed_step steps[RATE_CONTROL_MAX_LEVELS];
+
+	memset(controller,0,sizeof(rate_controller));
+	controller->info = info;
+	controller->base = *parameters;
+	controller->maxLevel = listSpeedSteps(controller,steps);
+	controller->rateScale = 1.0;
+	controller->maxRateScale = INFINITY;
+	controller->startTime = getWallClockTime();
+	controller->lastTime = controller->startTime;
+	controller->pixels = pixels;
+}
+
+/**
+ * Get the compression parameters to use for the next image.
+ *
+ * @param controller Reference to rate_controller structure.
+ * @param parameters Reference to opj_cparameters_t structure which will be populated with the parameters.
+ */
+void getRateControlledParameters(rate_controller *controller, opj_cparameters_t *parameters) {
+	// Loop variable
+	int ii;
+
+	speed_step steps[RATE_CONTROL_MAX_LEVELS];
+	listSpeedSteps(controller,steps);
+
+	*parameters = controller->base;
+
+	for (ii=0; ii<controller->level; ii++) {
+		switch (steps[ii]) {
+			case STEP_BYPASS:
+				parameters->mode |= 1;
+				break;
+			case STEP_CODE_BLOCKS:
+				parameters->cblockw_init = 64;
+				parameters->cblockh_init = 64;
+				break;
+			case STEP_IRREVERSIBLE:
+				parameters->irreversible = 1;
+				break;
+			case STEP_RESOLUTIONS:
+				parameters->numresolution--;
+				break;
+		}
+	}
+
+	// Scale the compression ratios of the layers, giving the last layer the target rate if it has no ratio.
+	if (parameters->cp_disto_alloc) {
+		for (ii=0; ii<parameters->tcp_numlayers; ii++) {
+			float rate = parameters->tcp_rates[ii];
+
+			if (rate <= 0.0 && ii == parameters->tcp_numlayers-1 && controller->info->targetBPP > 0.0) {
+				rate = RATE_CONTROL_ASSUMED_PRECISION / controller->info->targetBPP;
+			}
+
+			if (rate > 0.0) {
+				rate *= controller->rateScale;
+				parameters->tcp_rates[ii] = rate < 1.0 ? 1.0 : rate;
+			}
+		}
+	}
+}
+
+/**
+ * Describe the parameters used at the current speed level, for messages.
+ *
+ * @param controller Reference to rate_controller structure.
+ * @param description Array of at least 200 characters which will be populated with the description.
+ */
+static void describeLevel(rate_controller *controller, char *description) {
+	opj_cparameters_t parameters;
+	getRateControlledParameters(controller,&parameters);
+
+	sprintf(description,"level %d of %d: %s, %dx%d code-blocks, %d resolutions, %s wavelet, compression ratio scaled by %f",
+			controller->level,controller->maxLevel,(parameters.mode & 1) ? "bypass" : "no bypass",parameters.cblockw_init,
+			parameters.cblockh_init,parameters.numresolution,parameters.irreversible ? "9-7" : "5-3",controller->rateScale);
+}
+
+/**
+ * Update rate control after an image has been written, choosing the parameters for the next image.
+ *
+ * @param controller Reference to rate_controller structure.
+ * @param imageResult Reference to image_result structure with information on the image written.  The size of the
+ * image must have been recorded, as must its quality if a minimum PSNR is given.
+ */
+void updateRateControl(rate_controller *controller, image_result *imageResult) {
+	if (controller == NULL || imageResult == NULL || imageResult->rate.pixels == 0) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	rate_control_info *info = controller->info;
+	int level = controller->level;
+	double now = getWallClockTime();
+	double seconds = now - controller->lastTime;
+
+	controller->lastTime = now;
+	controller->pixelsDone += imageResult->rate.pixels;
+
+	// Smoothed time per pixel at this level.
+	double perPixel = seconds / (double) imageResult->rate.pixels;
+	double *levelSeconds = &controller->levelSeconds[level];
+	*levelSeconds = *levelSeconds > 0.0 ? 0.5*(*levelSeconds + perPixel) : perPixel;
+
+	// The minimum PSNR takes priority: step back towards the user's parameters if it wasn't reached.
+	if (info->minPSNR > 0.0 && imageResult->quality != NULL) {
+		double psnr = INFINITY;
+
+		for (ii=0; ii<imageResult->numcomps; ii++) {
+			if (imageResult->quality[ii].valid && imageResult->quality[ii].peakSignalToNoiseRatio < psnr) {
+				psnr = imageResult->quality[ii].peakSignalToNoiseRatio;
+			}
+		}
+
+		if (psnr < info->minPSNR) {
+			if (controller->level > 0) {
+				controller->level--;
+				controller->maxLevel = controller->level;
+			}
+			else if (isLossy(controller)) {
+				controller->rateScale *= 0.8;
+				controller->maxRateScale = controller->rateScale;
+			}
+		}
+	}
+
+	// Scale the compression ratios so that the measured rate approaches the target.
+	if (info->targetBPP > 0.0) {
+		double bitsPerPixel = getBitsPerPixel(&imageResult->rate);
+
+		if (bitsPerPixel > 0.0) {
+			double correction = bitsPerPixel / info->targetBPP;
+
+			// Limit the correction made after a single image, in case it was unusual.
+			correction = correction < 0.25 ? 0.25 : (correction > 4.0 ? 4.0 : correction);
+			controller->rateScale *= correction;
+
+			if (controller->rateScale > controller->maxRateScale) {
+				controller->rateScale = controller->maxRateScale;
+			}
+		}
+	}
+
+	// Speed up if the deadline would be missed at the current level, or slow down if the level below would
+	// finish comfortably within it.
+	if (info->deadline > 0.0 && controller->level == level) {
+		double elapsed = now - controller->startTime;
+		double remaining = controller->pixels > controller->pixelsDone ? (double) (controller->pixels - controller->pixelsDone) : 0.0;
+
+		if (elapsed + remaining*controller->levelSeconds[level] > info->deadline) {
+			if (level < controller->maxLevel) {
+				controller->level++;
+			}
+		}
+		else if (level > 0 && controller->levelSeconds[level-1] > 0.0 &&
+				elapsed + remaining*controller->levelSeconds[level-1] < 0.9*info->deadline) {
+			controller->level--;
+		}
+	}
+
+	if (controller->level != level) {
+		char description[200];
+		describeLevel(controller,description);
+		fprintf(stderr,"Rate control after %s: %s.\n",imageResult->file != NULL ? imageResult->file : "image",description);
+	}
+}
@@ -0,0 +1,254 @@
+/**
+ * @file readahead.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Reading ahead of the planes of a data cube while the current plane is encoded.
+ *
+ * The planes of a data cube are read in a fixed order (see convertFITSImage), so the data needed next is
+ * known in advance.  On network file systems each read is otherwise a synchronous stall.  A prefetch thread
+ * keeps the next few planes (in the order they will be read) in the page cache: it hints each plane to the
+ * kernel with posix_fadvise(POSIX_FADV_WILLNEED), then reads it through, so that the data is cached even
+ * on file systems that ignore the hint.  When CFITSIO reads the plane, it is served from memory.
+ *
+ * Read ahead is only possible for uncompressed images in plain disk files, where the position of each
+ * plane in the file is known.
+ */
+
+#include "f2j.h"
+
+#include <fcntl.h>
+
+/**
+ * Size of the reads used to bring planes into the page cache.
+ */
+#define PREFETCH_CHUNK_SIZE (1 << 20)
+
+/**
+ * Thread function which reads planes into the page cache until told to stop.
+ *
+ * @param arg Reference to the plane_prefetcher.
+ *
+ * @return Null.
+ */
+static void *prefetchPlanes(void *arg) {
+	plane_prefetcher *prefetcher = (plane_prefetcher *) arg;
+
+	while (true) {
+		pthread_mutex_lock(&prefetcher->mutex);
+
+		while (!prefetcher->stop && (prefetcher->next > prefetcher->target || prefetcher->next >= prefetcher->count)) {
+			pthread_cond_wait(&prefetcher->condition,&prefetcher->mutex);
+		}
+
+		if (prefetcher->stop) {
+			pthread_mutex_unlock(&prefetcher->mutex);
+			break;
+		}
+
+		off_t offset = prefetcher->offsets[prefetcher->next++];
+
+		pthread_mutex_unlock(&prefetcher->mutex);
+
+		posix_fadvise(prefetcher->fd,offset,prefetcher->length,POSIX_FADV_WILLNEED);
+
+		// Read the plane through, in case the file system ignored the hint.  Stop early if read ahead
+		// is being stopped.
+		off_t position;
+
+		for (position=0; position<prefetcher->length; position+=PREFETCH_CHUNK_SIZE) {
+			size_t size = prefetcher->length - position < PREFETCH_CHUNK_SIZE ? prefetcher->length - position : PREFETCH_CHUNK_SIZE;
+
+			pthread_mutex_lock(&prefetcher->mutex);
+			bool stopping = prefetcher->stop;
+			pthread_mutex_unlock(&prefetcher->mutex);
+
+			if (stopping || pread(prefetcher->fd,prefetcher->buffer,size,offset+position) <= 0) {
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Start reading ahead of the planes of a data cube.  The planes are expected to be read in the order used by
+ * convertFITSImage: groups of planesPerImage frames, each group being read for every stoke in turn.  Read ahead
+ * is silently skipped (info->prefetcher is left null) if it isn't possible for this file.
+ *
+ * @param fptr Pointer to a fitsfile structure, positioned at the HDU being converted.
+ * @param info Reference to cube_info structure describing the data cube and the region of each plane read.
+ * @param startFrame First frame read.
+ * @param endFrame Last frame read.
+ * @param startStoke First stoke read.
+ * @param endStoke Last stoke read.
+ * @param planesPerImage Number of consecutive frames read for each image.
+ * @param depth Number of planes to keep read ahead of the plane being read.
+ *
+ * @return 0 unless the parameters are invalid.  Failing to start read ahead is not an error.
+ */
+int startPrefetcher(fitsfile *fptr, cube_info *info, long startFrame, long endFrame, long startStoke, long endStoke, long planesPerImage, int depth) {
+	if (fptr == NULL || info == NULL) {
+		fprintf(stderr,"Parameters to startPrefetcher cannot be null.\n");
+		return 1;
+	}
+
+	info->prefetcher = NULL;
+
+	if (depth < 1 || info->compressed || planesPerImage < 1) {
+		return 0;
+	}
+
+	// Loop variables
+	long ii,jj,kk;
+
+	// Only plain disk files can be read directly.  Other files (e.g. gzipped files) are held in memory by CFITSIO.
+	char urlType[FLEN_FILENAME];
+	char fileName[FLEN_FILENAME];
+	LONGLONG headStart,dataStart,dataEnd;
+	int status = 0;
+
+	fits_url_type(fptr,urlType,&status);
+	fits_file_name(fptr,fileName,&status);
+	fits_get_hduaddrll(fptr,&headStart,&dataStart,&dataEnd,&status);
+
+	if (status != 0 || strcmp(urlType,"file://") != 0) {
+		return 0;
+	}
+
+	plane_prefetcher *prefetcher = (plane_prefetcher *) calloc(1,sizeof(plane_prefetcher));
+
+	if (prefetcher == NULL) {
+		return 0;
+	}
+
+	prefetcher->fd = open(fileName,O_RDONLY);
+	prefetcher->buffer = (char *) malloc(PREFETCH_CHUNK_SIZE);
+
+	// Number of planes in the order they are read.
+	long numFrames = endFrame - startFrame + 1;
+	long numStokes = endStoke - startStoke + 1;
+
+	prefetcher->offsets = (off_t *) malloc(sizeof(off_t)*numFrames*numStokes);
+	prefetcher->frames = (long *) malloc(sizeof(long)*numFrames*numStokes);
+	prefetcher->stokes = (long *) malloc(sizeof(long)*numFrames*numStokes);
+
+	if (prefetcher->fd < 0 || prefetcher->buffer == NULL || prefetcher->offsets == NULL || prefetcher->frames == NULL || prefetcher->stokes == NULL) {
+		info->prefetcher = prefetcher;
+		stopPrefetcher(info);
+		return 0;
+	}
+
+	// Only the rows covering the region are needed from each plane.
+	off_t rowSize = (off_t) info->planeWidth * (abs(info->bitpix)/8);
+	off_t planeSize = rowSize * info->planeHeight;
+
+	prefetcher->length = rowSize * info->height;
+
+	for (ii=startFrame; ii<=endFrame; ii+=planesPerImage) {
+		for (jj=startStoke; jj<=endStoke; jj++) {
+			for (kk=ii; kk<ii+planesPerImage && kk<=endFrame; kk++) {
+				prefetcher->frames[prefetcher->count] = kk;
+				prefetcher->stokes[prefetcher->count] = jj;
+				prefetcher->offsets[prefetcher->count] = dataStart + planeSize*((jj-1)*info->depth + kk-1) + rowSize*info->y0;
+				prefetcher->count++;
+			}
+		}
+	}
+
+	prefetcher->depth = depth;
+	prefetcher->position = 0;
+	prefetcher->next = 0;
+	prefetcher->target = depth-1;
+	prefetcher->stop = false;
+
+	pthread_mutex_init(&prefetcher->mutex,NULL);
+	pthread_cond_init(&prefetcher->condition,NULL);
+
+	if (pthread_create(&prefetcher->thread,NULL,prefetchPlanes,prefetcher) != 0) {
+		pthread_mutex_destroy(&prefetcher->mutex);
+		pthread_cond_destroy(&prefetcher->condition);
+		info->prefetcher = prefetcher;
+		stopPrefetcher(info);
+		return 0;
+	}
+
+	prefetcher->started = true;
+	info->prefetcher = prefetcher;
+
+	return 0;
+}
+
+/**
+ * Tell the prefetch thread that a plane is about to be read, so that it keeps the following planes read ahead.
+ * The prefetch thread skips any planes it hasn't reached yet up to and including this one.
+ *
+ * @param prefetcher Reference to the plane_prefetcher.  Nothing is done if it is null.
+ * @param frame Frame about to be read.
+ * @param stoke Stoke about to be read.
+ */
+void advancePrefetcher(plane_prefetcher *prefetcher, long frame, long stoke) {
+	if (prefetcher == NULL) {
+		return;
+	}
+
+	// Loop variable
+	long ii;
+
+	pthread_mutex_lock(&prefetcher->mutex);
+
+	// Find the plane, starting from the last one read.  Planes read out of order are ignored.
+	for (ii=prefetcher->position; ii<prefetcher->count; ii++) {
+		if (prefetcher->frames[ii] == frame && prefetcher->stokes[ii] == stoke) {
+			prefetcher->position = ii;
+			prefetcher->target = ii + prefetcher->depth;
+
+			if (prefetcher->next <= ii) {
+				prefetcher->next = ii+1;
+			}
+
+			pthread_cond_signal(&prefetcher->condition);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&prefetcher->mutex);
+}
+
+/**
+ * Stop reading ahead and free the prefetcher (if any), setting info->prefetcher to null.
+ *
+ * @param info Reference to cube_info structure describing the data cube.
+ */
+void stopPrefetcher(cube_info *info) {
+	if (info == NULL || info->prefetcher == NULL) {
+		return;
+	}
+
+	plane_prefetcher *prefetcher = info->prefetcher;
+
+	if (prefetcher->started) {
+		pthread_mutex_lock(&prefetcher->mutex);
+		prefetcher->stop = true;
+		pthread_cond_signal(&prefetcher->condition);
+		pthread_mutex_unlock(&prefetcher->mutex);
+
+		pthread_join(prefetcher->thread,NULL);
+
+		pthread_mutex_destroy(&prefetcher->mutex);
+		pthread_cond_destroy(&prefetcher->condition);
+	}
+
+	if (prefetcher->fd >= 0) {
+		close(prefetcher->fd);
+	}
+
+	free(prefetcher->buffer);
+	free(prefetcher->offsets);
+	free(prefetcher->frames);
+	free(prefetcher->stokes);
+	free(prefetcher);
+
+	info->prefetcher = NULL;
+}
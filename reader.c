@@ -0,0 +1,719 @@
+/**
+ * @file reader.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Functions for reading planes (or regions of planes) from FITS files.
+ *
+ * When only a region (cutout) of each plane is converted, only the rows and columns covering
+ * the region are read, so the I/O and processing needed scale with the size of the cutout rather
+ * than the size of the image.
+ *
+ * Tile-compressed images (e.g. written by fpack, using RICE, HCOMPRESS, GZIP or PLIO compression) are
+ * decompressed by CFITSIO one tile at a time.  To use more than one core, the rows of each plane are
+ * split into bands aligned to the tile boundaries, and each band is read by its own thread through an
+ * independently opened handle on the file, as CFITSIO requires for reading a file from several threads.
+ *
+ * The keywords describing the data (WCS, units, beam) are read from the header once per image, to be recorded
+ * in each JPEG 2000 image written and restored by j2f.
+ */
+
+#include "f2j.h"
+
+/**
+ * Structure describing a band of rows of a plane to be read by one thread.
+ */
+typedef struct {
+	fitsfile *fptr /** Handle used to read the band. */;
+	int datatype /** CFITSIO constant specifying the type of the array to read into. */;
+	long *fpixel /** First pixel of the band in each dimension. */;
+	long *lpixel /** Last pixel of the band in each dimension. */;
+	long *inc /** Increment between pixels in each dimension. */;
+	bool wholeRows /** Does the band cover whole rows of the plane, making it contiguous in the file? */;
+	long numPixels /** Number of pixels in the band. */;
+	void *array /** Array to read the band into. */;
+	int status /** CFITSIO status of the read. */;
+} band_read;
+
+/**
+ * Restrict the part of each plane that is read to a region specified by the user.  The width, height,
+ * x0 and y0 members of the cube_info structure are updated to describe the region.  The region is clipped
+ * to the plane.
+ *
+ * A region given in sky coordinates is converted to pixel coordinates using the WCS keywords in the
+ * header of the FITS file.  The bounding box of the four corners of the region is used, so that the
+ * whole region is covered even if the image is rotated.
+ *
+ * @param fptr Pointer to a fitsfile structure.  Must have been opened by the time that this function
+ * is called.
+ * @param info Reference to cube_info structure describing the data cube.  Assumed to describe the whole
+ * of each plane when this function is called.
+ * @param region Reference to region_info structure specifying the region to read.
+ * @param status Reference to status integer for CFITSIO.  Assumed to be initialised to 0 by this point.
+ *
+ * @return 0 if the region was applied successfully, 1 otherwise.
+ */
+int applyRegion(fitsfile *fptr, cube_info *info, region_info *region, int *status) {
+	if (fptr == NULL || info == NULL || region == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to applyRegion cannot be null.\n");
+		return 1;
+	}
+
+	if (region->type == REGION_NONE) {
+		return 0;
+	}
+
+	// Bounds of the region in pixel coordinates (starting from 1).
+	double xmin,xmax,ymin,ymax;
+
+	if (region->type == REGION_PIXEL) {
+		xmin = fmin(region->x0,region->x1);
+		xmax = fmax(region->x0,region->x1);
+		ymin = fmin(region->y0,region->y1);
+		ymax = fmax(region->y0,region->y1);
+	}
+	else {
+		// WCS information from header.
+		double xrval,yrval,xrpix,yrpix,xinc,yinc,rot;
+		char coordtype[5];
+
+		fits_read_img_coord(fptr,&xrval,&yrval,&xrpix,&yrpix,&xinc,&yinc,&rot,coordtype,status);
+
+		if (*status != 0) {
+			fprintf(stderr,"Unable to read WCS keywords needed to convert the sky region to pixels.\n");
+			return 1;
+		}
+
+		// Convert each corner of the region.
+		double corners[4][2] = {{region->x0,region->y0},{region->x0,region->y1},{region->x1,region->y0},{region->x1,region->y1}};
+		int ii;
+
+		for (ii=0; ii<4; ii++) {
+			double xpix,ypix;
+
+			fits_world_to_pix(corners[ii][0],corners[ii][1],xrval,yrval,xrpix,yrpix,xinc,yinc,rot,coordtype,&xpix,&ypix,status);
+
+			if (*status != 0) {
+				fprintf(stderr,"Unable to convert sky coordinates (%f, %f) to pixels.\n",corners[ii][0],corners[ii][1]);
+				return 1;
+			}
+
+			if (ii == 0 || xpix < xmin) {
+				xmin = xpix;
+			}
+			if (ii == 0 || xpix > xmax) {
+				xmax = xpix;
+			}
+			if (ii == 0 || ypix < ymin) {
+				ymin = ypix;
+			}
+			if (ii == 0 || ypix > ymax) {
+				ymax = ypix;
+			}
+		}
+	}
+
+	// Each pixel covers half a pixel either side of its (integer) coordinate, so include every pixel the
+	// region touches, then clip to the plane.
+	long firstColumn = (long) floor(xmin + 0.5);
+	long lastColumn = (long) floor(xmax + 0.5);
+	long firstRow = (long) floor(ymin + 0.5);
+	long lastRow = (long) floor(ymax + 0.5);
+
+	if (firstColumn < 1) {
+		firstColumn = 1;
+	}
+	if (lastColumn > info->planeWidth) {
+		lastColumn = info->planeWidth;
+	}
+	if (firstRow < 1) {
+		firstRow = 1;
+	}
+	if (lastRow > info->planeHeight) {
+		lastRow = info->planeHeight;
+	}
+
+	if (firstColumn > lastColumn || firstRow > lastRow) {
+		fprintf(stderr,"The region requested lies outside the image.\n");
+		return 1;
+	}
+
+	info->x0 = firstColumn - 1;
+	info->y0 = firstRow - 1;
+	info->width = lastColumn - firstColumn + 1;
+	info->height = lastRow - firstRow + 1;
+
+	return 0;
+}
+
+/**
+ * Get the size of a single value of a CFITSIO datatype.
+ *
+ * @param datatype CFITSIO constant, such as TFLOAT.
+ *
+ * @return Size of a value in bytes, or 0 if the datatype isn't supported.
+ */
+static size_t getDatatypeSize(int datatype) {
+	switch (datatype) {
+		case TBYTE:
+		case TSBYTE:
+			return sizeof(char);
+		case TSHORT:
+		case TUSHORT:
+			return sizeof(short);
+		case TINT:
+		case TUINT:
+			return sizeof(int);
+		case TLONG:
+		case TULONG:
+			return sizeof(long);
+		case TLONGLONG:
+			return sizeof(long long);
+		case TFLOAT:
+			return sizeof(float);
+		case TDOUBLE:
+			return sizeof(double);
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Thread function reading a single band of rows of a plane.
+ *
+ * @param arg Reference to the band_read structure describing the band.
+ *
+ * @return Null.
+ */
+static void *readBand(void *arg) {
+	band_read *band = (band_read *) arg;
+
+	if (band->wholeRows) {
+		fits_read_pix(band->fptr,band->datatype,band->fpixel,band->numPixels,NULL,band->array,NULL,&band->status);
+	}
+	else {
+		fits_read_subset(band->fptr,band->datatype,band->fpixel,band->lpixel,band->inc,NULL,band->array,NULL,&band->status);
+	}
+
+	return NULL;
+}
+
+/**
+ * Read a plane (or region of a plane) of a tile-compressed image, decompressing bands of rows in parallel
+ * using the handles in info->reader.  Each band covers whole rows of tiles, so no tile is decompressed
+ * by more than one thread.
+ *
+ * @param info Reference to cube_info structure describing the data cube.  info->reader must not be null.
+ * @param datatype CFITSIO constant, such as TFLOAT, specifying the type of the array to read into.
+ * @param fpixel First pixel to read in each dimension.
+ * @param lpixel Last pixel to read in each dimension.
+ * @param inc Increment between pixels in each dimension.
+ * @param array Array to read into.  Must have room for info->width*info->height values of the given type.
+ * @param status Reference to status integer for CFITSIO.
+ *
+ * @return 0 if the plane was read successfully, 1 otherwise.
+ */
+static int readBandsInParallel(cube_info *info, int datatype, long *fpixel, long *lpixel, long *inc, void *array, int *status) {
+	parallel_reader *reader = info->reader;
+	size_t elementSize = getDatatypeSize(datatype);
+
+	if (elementSize == 0) {
+		fprintf(stderr,"Unsupported datatype for reading a compressed image: %d\n",datatype);
+		return 1;
+	}
+
+	// Loop variables
+	int ii,jj;
+
+	// Rows of tiles covering the rows to read.
+	long firstTileRow = (fpixel[1]-1) / reader->tileHeight;
+	long numTileRows = (lpixel[1]-1) / reader->tileHeight - firstTileRow + 1;
+
+	// Give each thread a (nearly) equal number of rows of tiles.
+	int numBands = reader->count;
+
+	if (numBands > numTileRows) {
+		numBands = numTileRows;
+	}
+
+	band_read bands[numBands];
+	pthread_t threads[numBands];
+	bool started[numBands];
+	long coordinates[numBands][2][info->naxis];
+
+	for (ii=0; ii<numBands; ii++) {
+		long firstRow = (firstTileRow + numTileRows*ii/numBands) * reader->tileHeight + 1;
+		long lastRow = (firstTileRow + numTileRows*(ii+1)/numBands) * reader->tileHeight;
+
+		if (firstRow < fpixel[1]) {
+			firstRow = fpixel[1];
+		}
+		if (lastRow > lpixel[1]) {
+			lastRow = lpixel[1];
+		}
+
+		for (jj=0; jj<info->naxis; jj++) {
+			coordinates[ii][0][jj] = fpixel[jj];
+			coordinates[ii][1][jj] = lpixel[jj];
+		}
+
+		coordinates[ii][0][1] = firstRow;
+		coordinates[ii][1][1] = lastRow;
+
+		bands[ii].fptr = reader->handles[ii];
+		bands[ii].datatype = datatype;
+		bands[ii].fpixel = coordinates[ii][0];
+		bands[ii].lpixel = coordinates[ii][1];
+		bands[ii].inc = inc;
+		bands[ii].wholeRows = info->width == info->planeWidth;
+		bands[ii].numPixels = info->width * (lastRow-firstRow+1);
+		bands[ii].array = (char *) array + elementSize * info->width * (firstRow-fpixel[1]);
+		bands[ii].status = 0;
+	}
+
+	// The first band is read by this thread.  If a thread can't be started, its band is read here too.
+	for (ii=1; ii<numBands; ii++) {
+		started[ii] = pthread_create(&threads[ii],NULL,readBand,&bands[ii]) == 0;
+	}
+
+	readBand(&bands[0]);
+
+	for (ii=1; ii<numBands; ii++) {
+		if (started[ii]) {
+			pthread_join(threads[ii],NULL);
+		}
+		else {
+			readBand(&bands[ii]);
+		}
+	}
+
+	for (ii=0; ii<numBands; ii++) {
+		if (bands[ii].status != 0) {
+			*status = bands[ii].status;
+			fprintf(stderr,"Error reading rows %ld to %ld of compressed image.\n",bands[ii].fpixel[1],bands[ii].lpixel[1]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Read a plane of a FITS file, or the region of it described by the cube_info structure.  Only the rows
+ * and columns covering the region are read.
+ *
+ * @param fptr Pointer to a fitsfile structure.  Must have been opened by the time that this function
+ * is called.
+ * @param datatype CFITSIO constant, such as TFLOAT, specifying the type of the array to read into.
+ * @param info Reference to cube_info structure describing the data cube and the region of each plane to read.
+ * @param frame Plane of data to read for a 3D data cube.  Arbitrary for a 2D image.
+ * @param stoke Stoke of data to read for a 4D data volume.  Arbitrary for 2D/3D images.
+ * @param array Array to read into.  Must have room for info->width*info->height values of the given type.
+ * @param status Reference to status integer for CFITSIO.  Assumed to be initialised to 0 by this point.
+ *
+ * @return 0 if the plane was read successfully, 1 otherwise.
+ */
+int readFITSPlane(fitsfile *fptr, int datatype, cube_info *info, long frame, long stoke, void *array, int *status) {
+	if (fptr == NULL || info == NULL || array == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to readFITSPlane cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	// First and last pixels to read in each dimension, and the increment between pixels.  Any dimension
+	// above the 4th has length 1 for a valid FITS file for this program.
+	long fpixel[info->naxis];
+	long lpixel[info->naxis];
+	long inc[info->naxis];
+
+	for (ii=0; ii<info->naxis; ii++) {
+		fpixel[ii] = 1;
+		lpixel[ii] = 1;
+		inc[ii] = 1;
+	}
+
+	fpixel[0] = info->x0 + 1;
+	lpixel[0] = info->x0 + info->width;
+	fpixel[1] = info->y0 + 1;
+	lpixel[1] = info->y0 + info->height;
+
+	if (info->naxis > 2) {
+		fpixel[2] = frame;
+		lpixel[2] = frame;
+
+		if (info->naxis > 3) {
+			fpixel[3] = stoke;
+			lpixel[3] = stoke;
+		}
+	}
+
+	// Keep the following planes read ahead (if reading ahead) and time the read.
+	advancePrefetcher(info->prefetcher,frame,stoke);
+
+	double startTime = getWallClockTime();
+	PROFILE_START(readTimer);
+
+	if (info->reader != NULL) {
+		int result = readBandsInParallel(info,datatype,fpixel,lpixel,inc,array,status);
+		info->readSeconds += getWallClockTime() - startTime;
+		PROFILE_STOP(readTimer,PROFILE_READ,getDatatypeSize(datatype)*info->width*info->height);
+
+		return result;
+	}
+
+	if (info->width == info->planeWidth && info->height == info->planeHeight) {
+		// The whole plane is contiguous in the file, so read it in one go.
+		fits_read_pix(fptr,datatype,fpixel,info->width*info->height,NULL,array,NULL,status);
+	}
+	else {
+		fits_read_subset(fptr,datatype,fpixel,lpixel,inc,NULL,array,NULL,status);
+	}
+
+	info->readSeconds += getWallClockTime() - startTime;
+	PROFILE_STOP(readTimer,PROFILE_READ,getDatatypeSize(datatype)*info->width*info->height);
+
+	if (*status != 0) {
+		fprintf(stderr,"Error reading frame %ld of image.\n",frame);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Turn off BSCALE/BZERO scaling of the values read from a FITS file, so that raw values are read.  Scaling
+ * is turned off for the handles used to read in parallel as well, if there are any.
+ *
+ * @param fptr Pointer to a fitsfile structure.  Must have been opened by the time that this function
+ * is called.
+ * @param info Reference to cube_info structure describing the data cube.
+ * @param status Reference to status integer for CFITSIO.
+ *
+ * @return 0 if scaling was turned off successfully, 1 otherwise.
+ */
+int setRawScaling(fitsfile *fptr, cube_info *info, int *status) {
+	if (fptr == NULL || info == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to setRawScaling cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	fits_set_bscale(fptr,1.0,0.0,status);
+
+	if (info->reader != NULL) {
+		for (ii=0; ii<info->reader->count; ii++) {
+			fits_set_bscale(info->reader->handles[ii],1.0,0.0,status);
+		}
+	}
+
+	return *status == 0 ? 0 : 1;
+}
+
+/**
+ * Prefixes of the names of indexed keywords copied by readHeaderCards.  A keyword is copied if its name is one of
+ * these followed by a digit, e.g. CTYPE3, CD1_2, PC001002 or PV2_1 (but not PCOUNT).
+ */
+static const char *indexedCardNames[] = {"CTYPE","CRVAL","CRPIX","CDELT","CUNIT","CROTA","CD","PC","PV","PS","CRDER","CSYER",NULL};
+
+/**
+ * Names of the other keywords copied by readHeaderCards, also copied with an alternate WCS letter appended.
+ */
+static const char *namedCards[] = {"WCSAXES","WCSNAME","EQUINOX","EPOCH","RADESYS","RADECSYS","LONPOLE","LATPOLE","RESTFRQ",
+		"RESTFREQ","RESTWAV","SPECSYS","SSYSOBS","VELREF","VELOSYS","ZSOURCE","DATE-OBS","MJD-OBS","BUNIT","BTYPE","BMAJ","BMIN",
+		"BPA","OBJECT","TELESCOP","INSTRUME","OBSERVER","OBSRA","OBSDEC","OBSGEO-X","OBSGEO-Y","OBSGEO-Z",NULL};
+
+/**
+ * Should a header keyword be recorded with the images written?
+ *
+ * @param name Name of the keyword.
+ *
+ * @return true if the keyword is part of the world coordinate system or otherwise describes the data.
+ */
+static bool isRecordedCard(const char *name) {
+	// Loop variable
+	int ii;
+
+	for (ii=0; indexedCardNames[ii] != NULL; ii++) {
+		size_t length = strlen(indexedCardNames[ii]);
+
+		if (strncmp(name,indexedCardNames[ii],length) == 0 && name[length] >= '0' && name[length] <= '9') {
+			return true;
+		}
+	}
+
+	for (ii=0; namedCards[ii] != NULL; ii++) {
+		size_t length = strlen(namedCards[ii]);
+
+		if (strncmp(name,namedCards[ii],length) == 0 && (name[length] == '\0' ||
+				(name[length] >= 'A' && name[length] <= 'Z' && name[length+1] == '\0'))) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Read the keywords describing the data from the header of the current HDU (the world coordinate system, units,
+ * beam and observation) into info->headerCards, so that they can be recorded in the images written and written
+ * back to FITS by j2f.  If only a region of each plane is read, the reference pixel of the first two axes
+ * (CRPIX1 and CRPIX2) is moved so that the cards describe the region.  At most HEADER_CARDS_MAX_LENGTH
+ * characters are kept.  Free with freeHeaderCards.
+ *
+ * @param fptr Pointer to a fitsfile structure, positioned at the HDU containing the image.
+ * @param info Reference to cube_info structure describing the data cube.  The region must have been applied.
+ * @param status Reference to status integer for CFITSIO.
+ *
+ * @return 0 if the header was read successfully, 1 otherwise.
+ */
+int readHeaderCards(fitsfile *fptr, cube_info *info, int *status) {
+	if (fptr == NULL || info == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to readHeaderCards cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	info->headerCards = NULL;
+
+	int nkeys;
+	fits_get_hdrspace(fptr,&nkeys,NULL,status);
+
+	if (*status != 0) {
+		fprintf(stderr,"Unable to get the number of header keywords.\n");
+		return 1;
+	}
+
+	char *cards = (char *) malloc(HEADER_CARDS_MAX_LENGTH + 1);
+
+	if (cards == NULL) {
+		fprintf(stderr,"Unable to allocate memory for header keywords.\n");
+		return 1;
+	}
+
+	size_t length = 0;
+	bool truncated = false;
+
+	for (ii=1; ii<=nkeys; ii++) {
+		char card[FLEN_CARD];
+		char name[9];
+
+		fits_read_record(fptr,ii,card,status);
+
+		if (*status != 0) {
+			fprintf(stderr,"Error reading keyword number %d.\n",ii);
+			free(cards);
+			return 1;
+		}
+
+		// The name fills the first 8 characters of a value card, padded with spaces.
+		size_t nameLength = strcspn(card," =");
+
+		if (nameLength > 8 || strncmp(card+8,"= ",2) != 0) {
+			continue;
+		}
+
+		memcpy(name,card,nameLength);
+		name[nameLength] = '\0';
+
+		if (!isRecordedCard(name)) {
+			continue;
+		}
+
+		// Describe the region read rather than the whole plane.  Only the reference pixels of the first two axes
+		// (CRPIX1 and CRPIX2, with or without an alternate WCS letter) are moved, not those of e.g. CRPIX10.
+		bool axisReference = strncmp(name,"CRPIX",5) == 0 && (nameLength == 6 || (nameLength == 7 && name[6] >= 'A' && name[6] <= 'Z'));
+
+		if (axisReference && ((info->x0 != 0 && name[5] == '1') || (info->y0 != 0 && name[5] == '2'))) {
+			double value = strtod(card+10,NULL) - (name[5] == '1' ? info->x0 : info->y0);
+			snprintf(card,sizeof(card),"%-8s= %20.15G",name,value);
+		}
+
+		// Trailing spaces are not needed to rebuild the card.
+		size_t cardLength = strlen(card);
+
+		while (cardLength > 0 && card[cardLength-1] == ' ') {
+			cardLength--;
+		}
+
+		if (length + cardLength + 1 > HEADER_CARDS_MAX_LENGTH) {
+			truncated = true;
+			continue;
+		}
+
+		memcpy(cards+length,card,cardLength);
+		length += cardLength;
+		cards[length++] = '\n';
+	}
+
+	if (truncated) {
+		fprintf(stderr,"Only the first %d characters of the WCS keywords are recorded in each image.\n",HEADER_CARDS_MAX_LENGTH);
+	}
+
+	if (length == 0) {
+		free(cards);
+		return 0;
+	}
+
+	// Drop the newline ending the last card.
+	cards[length-1] = '\0';
+	info->headerCards = cards;
+
+	return 0;
+}
+
+/**
+ * Free the cards read by readHeaderCards (if any) and set info->headerCards to null.
+ *
+ * @param info Reference to cube_info structure describing the data cube.
+ */
+void freeHeaderCards(cube_info *info) {
+	if (info == NULL) {
+		return;
+	}
+
+	free(info->headerCards);
+	info->headerCards = NULL;
+}
+
+/**
+ * Choose how many threads to use to decompress each plane of a tile-compressed image, sharing the cores
+ * of the machine between the files being converted at once.
+ *
+ * @param workers Number of files being converted at once.
+ *
+ * @return Number of threads to use for each file.  At least 1.
+ */
+int getAutomaticReadThreads(int workers) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (workers < 1) {
+		workers = 1;
+	}
+
+	if (cores <= workers) {
+		return 1;
+	}
+
+	return (int) (cores / workers);
+}
+
+/**
+ * Open the handles needed to decompress the planes of a tile-compressed image in parallel, storing them
+ * in info->reader.  Planes are read serially (info->reader is left null) if the image isn't compressed,
+ * only one thread is requested, CFITSIO wasn't built to be reentrant or the handles can't be opened.
+ * Free with destroyParallelReader.
+ *
+ * @param fptr Pointer to a fitsfile structure, positioned at the HDU containing the image.
+ * @param info Reference to cube_info structure describing the data cube.
+ * @param threads Number of threads to decompress each plane with.
+ * @param status Reference to status integer for CFITSIO.
+ *
+ * @return 0 unless the parameters are invalid.  Failing to open the handles is not an error, as the
+ * image can still be read serially.
+ */
+int createParallelReader(fitsfile *fptr, cube_info *info, int threads, int *status) {
+	if (fptr == NULL || info == NULL || status == NULL) {
+		fprintf(stderr,"Parameters to createParallelReader cannot be null.\n");
+		return 1;
+	}
+
+	info->reader = NULL;
+
+	if (!info->compressed || threads < 2 || info->height < 2) {
+		return 0;
+	}
+
+	// Reading a file from several threads is only safe if CFITSIO was built to be reentrant.
+	if (!fits_is_reentrant()) {
+		return 0;
+	}
+
+	// Loop variable
+	int ii;
+
+	// Name of the file and HDU, so that each thread can open the image independently.
+	char fileName[FLEN_FILENAME];
+	int hdu;
+	long tileSize[2] = {0,0};
+	int localStatus = 0;
+
+	fits_file_name(fptr,fileName,&localStatus);
+	fits_get_hdu_num(fptr,&hdu);
+	fits_get_tile_dim(fptr,2,tileSize,&localStatus);
+
+	if (localStatus != 0) {
+		return 0;
+	}
+
+	parallel_reader *reader = (parallel_reader *) malloc(sizeof(parallel_reader));
+
+	if (reader == NULL) {
+		return 0;
+	}
+
+	reader->handles = (fitsfile **) calloc(threads,sizeof(fitsfile *));
+	reader->count = 0;
+	reader->tileHeight = tileSize[1] > 0 ? tileSize[1] : 1;
+
+	if (reader->handles == NULL) {
+		free(reader);
+		return 0;
+	}
+
+	for (ii=0; ii<threads; ii++) {
+		fits_open_file(&reader->handles[ii],fileName,READONLY,&localStatus);
+
+		if (localStatus == 0) {
+			fits_movabs_hdu(reader->handles[ii],hdu,NULL,&localStatus);
+		}
+
+		if (localStatus != 0) {
+			if (reader->handles[ii] != NULL) {
+				int closeStatus = 0;
+				fits_close_file(reader->handles[ii],&closeStatus);
+			}
+			break;
+		}
+
+		reader->count++;
+	}
+
+	info->reader = reader;
+
+	// Fall back to reading serially if the handles couldn't be opened.
+	if (localStatus != 0) {
+		fprintf(stderr,"Unable to open %s from several threads.  Decompressing serially.\n",fileName);
+		destroyParallelReader(info);
+	}
+
+	return 0;
+}
+
+/**
+ * Close the handles opened by createParallelReader (if any) and set info->reader to null.
+ *
+ * @param info Reference to cube_info structure describing the data cube.
+ */
+void destroyParallelReader(cube_info *info) {
+	if (info == NULL || info->reader == NULL) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	for (ii=0; ii<info->reader->count; ii++) {
+		int status = 0;
+		fits_close_file(info->reader->handles[ii],&status);
+	}
+
+	free(info->reader->handles);
+	free(info->reader);
+	info->reader = NULL;
+}
@@ -0,0 +1,914 @@
+/**
+ * @file sample.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Quality benchmarks estimated from part of each data cube, for quick-look monitoring.
+ *
+ * Benchmarking every pixel of every plane costs a full decode per image, which is as slow as encoding it.
+ * -QB_sample makes the benchmarks cheaper in three ways, which may be combined:
+ *
+ *   - reduce=n decodes each image with its n highest resolution levels discarded, skipping their code-blocks,
+ *     and compares it with the planes reduced by the same (low pass) wavelet as the encoder used.  Each level
+ *     cuts the work of the decoder by about 4.  The benchmarks are then those of the low resolution image,
+ *     which leave out errors at the finest scales.
+ *   - tiles=f decodes and compares a random fraction f of the tiles of each image.  The benchmarks are
+ *     estimated from the tiles sampled (as ratio estimators over the tiles), with 95% confidence intervals.
+ *     Images with a single tile are always compared whole, as OpenJPEG decodes areas tile by tile.
+ *   - planes=n only benchmarks every n-th image of a data cube.  The benchmarks of the whole cube are then
+ *     estimated from the planes sampled, with 95% confidence intervals, and printed once the cube is converted.
+ *
+ * The confidence intervals use the normal approximation and the finite population correction, so they are
+ * exact (of zero width) when every tile or plane is sampled.  With reduce, planes decorrelated by a spectral
+ * or multi-component transform are compared approximately, as the transforms are applied to the components
+ * at full resolution.
+ */
+
+#include "f2j.h"
+
+/**
+ * Quantile of the normal distribution giving 95% confidence intervals.
+ */
+#define SAMPLE_CONFIDENCE_Z 1.959963985
+
+/**
+ * Lifting coefficients of the 9-7 wavelet, as used by the OpenJPEG encoder.
+ */
+#define SAMPLE_ALPHA -1.586134342
+#define SAMPLE_BETA -0.052980118
+#define SAMPLE_GAMMA 0.882911075
+#define SAMPLE_DELTA 0.443506852
+#define SAMPLE_K 1.230174104914001
+
+/**
+ * Parse the specification of sampled quality benchmarking given to -QB_sample: a comma separated list of
+ * reduce=levels, tiles=fraction, planes=n and seed=n.
+ *
+ * @param specification Specification to parse.
+ * @param sampling Reference to quality_sampling structure which will be populated.  Settings not given are
+ * left unchanged.
+ *
+ * @return 0 if the specification is valid, 1 otherwise.
+ */
+int parseQualitySampling(const char *specification, quality_sampling *sampling) {
+	if (specification == NULL || sampling == NULL) {
+		fprintf(stderr,"Parameters to parseQualitySampling cannot be null.\n");
+		return 1;
+	}
+
+	char copy[strlen(specification)+1];
+	strcpy(copy,specification);
+
+	char *savePointer = NULL;
+	char *setting = strtok_r(copy,",",&savePointer);
+
+	if (setting == NULL) {
+		fprintf(stderr,"Option -QB_sample requires reduce=levels, tiles=fraction, planes=n and/or seed=n.\n");
+		return 1;
+	}
+
+	while (setting != NULL) {
+		char *value = strchr(setting,'=');
+		char *end = NULL;
+
+		if (value == NULL) {
+			fprintf(stderr,"Setting %s of option -QB_sample must be given as name=value.\n",setting);
+			return 1;
+		}
+
+		*value++ = '\0';
+
+		if (strcmp(setting,"reduce") == 0) {
+			sampling->reduce = strtol(value,&end,10);
+
+			if (*end != '\0' || sampling->reduce < 0 || sampling->reduce > MAX_REDUCE) {
+				fprintf(stderr,"Number of resolution levels to discard (reduce) must be between 0 and %d.\n",MAX_REDUCE);
+				return 1;
+			}
+		}
+		else if (strcmp(setting,"tiles") == 0) {
+			sampling->tiles = strtod(value,&end);
+
+			if (*end != '\0' || !(sampling->tiles > 0.0 && sampling->tiles <= 1.0)) {
+				fprintf(stderr,"Fraction of tiles to compare (tiles) must be greater than 0 and at most 1.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(setting,"planes") == 0) {
+			sampling->planes = strtol(value,&end,10);
+
+			if (*end != '\0' || sampling->planes < 1) {
+				fprintf(stderr,"Interval between the planes benchmarked (planes) must be at least 1.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(setting,"seed") == 0) {
+			sampling->seed = (unsigned int) strtoul(value,&end,10);
+
+			if (*end != '\0') {
+				fprintf(stderr,"Seed of the random choice of tiles (seed) must be a whole number.\n");
+				return 1;
+			}
+		}
+		else {
+			fprintf(stderr,"Unknown setting %s of option -QB_sample [reduce, tiles, planes, seed].\n",setting);
+			return 1;
+		}
+
+		setting = strtok_r(NULL,",",&savePointer);
+	}
+
+	return 0;
+}
+
+/**
+ * Are the benchmarks of each image estimated from a reduced resolution decode or some of its tiles, rather than
+ * from every pixel?  Benchmarking only some planes doesn't change how each image is benchmarked.
+ *
+ * @param sampling Reference to quality_sampling structure.
+ *
+ * @return true if each image is sampled.
+ */
+bool isQualitySampled(quality_sampling *sampling) {
+	return sampling != NULL && (sampling->reduce > 0 || (sampling->tiles > 0.0 && sampling->tiles < 1.0));
+}
+
+/**
+ * Low pass half of one level of the forward wavelet transform of a line of samples, as performed by the
+ * OpenJPEG encoder: lifting, with the line extended symmetrically at its ends.  The low pass samples are
+ * those at even positions on the reference grid.
+ *
+ * @param line Samples.  The low pass samples are written to the start of the line.
+ * @param n Number of samples.
+ * @param origin Position of the first sample.
+ * @param reversible Was the 5-3 (true) or 9-7 (false) wavelet used?
+ * @param work Buffer of at least n+8 doubles.
+ *
+ * @return Number of low pass samples.
+ */
+static long lowPassLine(double *line, long n, long origin, bool reversible, double *work) {
+	// Loop variable
+	long ii;
+
+	// Index of the first low pass sample.
+	long first = origin & 1;
+	long count = (n - first + 1) / 2;
+
+	// A single sample is left unchanged if it is a low pass sample.
+	if (n == 1) {
+		return count;
+	}
+
+	// Extend the line by 4 samples at each end, enough for the 4 lifting steps of the 9-7 wavelet.
+	double *x = work + 4;
+
+	for (ii=-4; ii<n+4; ii++) {
+		long jj = ii;
+
+		while (jj < 0 || jj >= n) {
+			jj = jj < 0 ? -jj : 2*(n-1) - jj;
+		}
+
+		x[ii] = line[jj];
+	}
+
+	// Each lifting step is valid one sample further in from the ends of the extended line than the last.
+	if (reversible) {
+		for (ii=-3+((-3-first)&1 ? 0 : 1); ii<n+3; ii+=2) {
+			x[ii] -= floor((x[ii-1] + x[ii+1]) / 2.0);
+		}
+
+		for (ii=-2+((-2-first)&1 ? 1 : 0); ii<n+2; ii+=2) {
+			x[ii] += floor((x[ii-1] + x[ii+1] + 2.0) / 4.0);
+		}
+	}
+	else {
+		for (ii=-3+((-3-first)&1 ? 0 : 1); ii<n+3; ii+=2) {
+			x[ii] += SAMPLE_ALPHA * (x[ii-1] + x[ii+1]);
+		}
+
+		for (ii=-2+((-2-first)&1 ? 1 : 0); ii<n+2; ii+=2) {
+			x[ii] += SAMPLE_BETA * (x[ii-1] + x[ii+1]);
+		}
+
+		for (ii=-1+((-1-first)&1 ? 0 : 1); ii<n+1; ii+=2) {
+			x[ii] += SAMPLE_GAMMA * (x[ii-1] + x[ii+1]);
+		}
+
+		for (ii=first; ii<n; ii+=2) {
+			x[ii] = (x[ii] + SAMPLE_DELTA * (x[ii-1] + x[ii+1])) / SAMPLE_K;
+		}
+	}
+
+	for (ii=0; ii<count; ii++) {
+		line[ii] = x[first + 2*ii];
+	}
+
+	return count;
+}
+
+/**
+ * Reduce the part of a plane covered by one tile by the low pass half of the wavelet transform, as the encoder
+ * did, giving the tile as decoded with resolution levels discarded (before quantisation).
+ *
+ * @param comp Component holding the plane at full resolution.
+ * @param x0 First column of the tile on the reference grid.
+ * @param y0 First row of the tile on the reference grid.
+ * @param x1 Column after the last column of the tile.
+ * @param y1 Row after the last row of the tile.
+ * @param reduce Number of resolution levels to discard.
+ * @param reversible Was the 5-3 (true) or 9-7 (false) wavelet used?
+ * @param reduced Buffer of (x1-x0)*(y1-y0) doubles which will hold the reduced tile, row by row.
+ * @param work Buffer of at least max(x1-x0,y1-y0)*2+8 doubles.
+ */
+static void reduceTile(opj_image_comp_t *comp, long x0, long y0, long x1, long y1, int reduce, bool reversible, double *reduced, double *work) {
+	// Loop variables
+	long ii,jj;
+	int level;
+
+	long width = x1 - x0;
+	long height = y1 - y0;
+
+	for (jj=0; jj<height; jj++) {
+		int *row = comp->data + (size_t) (y0 - comp->y0 + jj) * comp->w + (x0 - comp->x0);
+
+		for (ii=0; ii<width; ii++) {
+			reduced[jj*width + ii] = row[ii];
+		}
+	}
+
+	// The encoder transforms the columns of each level, then its rows.
+	double *line = work;
+	double *lineWork = work + (width > height ? width : height);
+
+	for (level=0; level<reduce; level++) {
+		long count = 0;
+
+		for (ii=0; ii<width; ii++) {
+			for (jj=0; jj<height; jj++) {
+				line[jj] = reduced[jj*width + ii];
+			}
+
+			count = lowPassLine(line,height,y0,reversible,lineWork);
+
+			for (jj=0; jj<count; jj++) {
+				reduced[jj*width + ii] = line[jj];
+			}
+		}
+
+		height = count;
+		y0 = (y0 + 1) >> 1;
+
+		for (jj=0; jj<height; jj++) {
+			memcpy(line,reduced + jj*width,sizeof(double)*width);
+			count = lowPassLine(line,width,x0,reversible,lineWork);
+			memcpy(reduced + jj*count,line,sizeof(double)*count);
+		}
+
+		width = count;
+		x0 = (x0 + 1) >> 1;
+	}
+}
+
+/**
+ * Estimate the ratio of the totals of two quantities from their values in a random sample of the tiles
+ * of an image, with the half width of its 95% confidence interval.
+ *
+ * @param y Numerator of each tile sampled.
+ * @param x Denominator of each tile sampled.
+ * @param n Number of tiles sampled.
+ * @param total Number of tiles in the image.
+ * @param halfWidth Reference to a variable which will hold the half width of the confidence interval.  0 if
+ * every tile was sampled, NaN if only a single tile was.
+ *
+ * @return The estimate.
+ */
+static double estimateRatio(double *y, double *x, long n, long total, double *halfWidth) {
+	// Loop variable
+	long ii;
+
+	double sumY = 0.0;
+	double sumX = 0.0;
+
+	for (ii=0; ii<n; ii++) {
+		sumY += y[ii];
+		sumX += x[ii];
+	}
+
+	double ratio = sumX > 0.0 ? sumY / sumX : 0.0;
+
+	if (n >= total) {
+		*halfWidth = 0.0;
+	}
+	else if (n < 2 || sumX <= 0.0) {
+		*halfWidth = NAN;
+	}
+	else {
+		double squares = 0.0;
+
+		for (ii=0; ii<n; ii++) {
+			double residual = y[ii] - ratio * x[ii];
+			squares += residual * residual;
+		}
+
+		double meanX = sumX / n;
+		double variance = (1.0 - (double) n / total) * squares / (n - 1) / (n * meanX * meanX);
+		*halfWidth = SAMPLE_CONFIDENCE_Z * sqrt(variance);
+	}
+
+	return ratio;
+}
+
+/**
+ * Print an estimate's 95% confidence interval as [low,high], or [-,-] if it is unknown.
+ *
+ * @param out Stream to print to.
+ * @param low Lower end of the interval.
+ * @param high Upper end of the interval.
+ */
+static void printInterval(FILE *out, double low, double high) {
+	if (isnan(low) || isnan(high)) {
+		fprintf(out," [-,-]");
+	}
+	else {
+		fprintf(out," [%f,%f]",low,high);
+	}
+}
+
+/**
+ * Convert a mean squared error to a PSNR.
+ *
+ * @param mse Mean squared error.
+ * @param peak Largest pixel value.
+ *
+ * @return The PSNR (in dB).  Infinite if the error is zero, NaN if it is unknown.
+ */
+static double getPSNR(double mse, double peak) {
+	if (isnan(mse)) {
+		return NAN;
+	}
+
+	return mse > 0.0 ? 10.0 * log10(peak * peak / mse) : INFINITY;
+}
+
+/**
+ * Benchmark the quality of a compressed image from a reduced resolution decode and/or a random sample of its tiles
+ * (see quality_sampling), printing the estimates with their 95% confidence intervals.  Used by
+ * performQualityBenchmarking when isQualitySampled is true.  Residual images can't be written from a sample.
+ *
+ * @param image Reference to OpenJPEG image structure representing uncompressed version of image.
+ * @param compressedFile File name of compressed JPEG 2000 image.
+ * @param encoded Reference to memory_stream structure holding the contents of compressedFile.  May be null, in which
+ * case the file is read.
+ * @param parameters Reference to quality_benchmark_info structure specifying what quality benchmarks should be
+ * performed, and how they are sampled.
+ * @param codec Codec (JP2 or J2K) of compressed image file.
+ * @param cubeParameters Reference to cube_encoding_info structure describing any spectral transform performed on the
+ * components of the image before it was encoded.  May be null if no spectral transform was performed.
+ * @param results Array with one entry per image component, which will be populated with the estimates for each
+ * component.  May be null.
+ *
+ * @return 0 if the benchmarking was performed successfully, 1 otherwise.
+ */
+int performSampledQualityBenchmarking(opj_image_t *image, char *compressedFile, memory_stream *encoded, quality_benchmark_info *parameters,
+		OPJ_CODEC_FORMAT codec, cube_encoding_info *cubeParameters, quality_benchmark_result *results) {
+	if (image == NULL || compressedFile == NULL || parameters == NULL) {
+		fprintf(stderr,"Compressed and uncompressed images cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variables
+	long ii,jj,kk;
+	int cc;
+
+	// Read the file if the codestream wasn't kept.
+	unsigned char *data = encoded != NULL ? encoded->data : NULL;
+	size_t length = encoded != NULL ? encoded->length : 0;
+	unsigned char *fileData = NULL;
+
+	if (data == NULL) {
+		OPJ_CODEC_FORMAT fileCodec;
+
+		if (readJPEG2000File(compressedFile,&fileData,&length,&fileCodec) != 0) {
+			fprintf(stderr,"Unable to read JPEG file: %s\n",compressedFile);
+			return 1;
+		}
+
+		data = fileData;
+	}
+
+	// Read the main header for the tiles and the wavelet of the image.
+	opj_event_mgr_t event_mgr;
+	memset(&event_mgr,0,sizeof(opj_event_mgr_t));
+	event_mgr.error_handler = error_callback;
+	event_mgr.warning_handler = warning_callback;
+	event_mgr.info_handler = info_callback;
+
+	opj_dparameters_t decodeParameters;
+	opj_set_default_decoder_parameters(&decodeParameters);
+
+	memory_stream stream = {data,length,0};
+	opj_stream_t *cio = createMemoryStream(&stream);
+	opj_codec_t *dinfo = opj_create_decompress_v2(codec);
+	opj_image_t *header = NULL;
+	opj_codestream_info_v2_t *cstrInfo = NULL;
+
+	if (cio == NULL || dinfo == NULL || !opj_setup_decoder_v2(dinfo,&decodeParameters,&event_mgr) || !opj_read_header(cio,dinfo,&header)
+			|| (cstrInfo = opj_get_cstr_info(dinfo)) == NULL) {
+		fprintf(stderr,"Unable to read the header of JPEG file: %s\n",compressedFile);
+
+		if (cio != NULL) {
+			opj_stream_destroy(cio);
+		}
+
+		if (dinfo != NULL) {
+			opj_destroy_codec(dinfo);
+		}
+
+		if (header != NULL) {
+			opj_image_destroy(header);
+		}
+
+		free(fileData);
+		return 1;
+	}
+
+	long tileX0 = cstrInfo->tx0;
+	long tileY0 = cstrInfo->ty0;
+	long tileWidth = cstrInfo->tdx;
+	long tileHeight = cstrInfo->tdy;
+	long tilesX = cstrInfo->tw;
+	long numTiles = (long) cstrInfo->tw * cstrInfo->th;
+	bool reversible = cstrInfo->m_default_tile_info.tccp_info[0].qmfbid == 1;
+	int reduce = parameters->sampling.reduce;
+
+	if (reduce > (int) cstrInfo->m_default_tile_info.tccp_info[0].numresolutions - 1) {
+		reduce = cstrInfo->m_default_tile_info.tccp_info[0].numresolutions - 1;
+	}
+
+	long imageX0 = header->x0;
+	long imageY0 = header->y0;
+	long imageX1 = header->x1;
+	long imageY1 = header->y1;
+
+	opj_destroy_cstr_info_v2(&cstrInfo);
+	opj_image_destroy(header);
+	opj_stream_destroy(cio);
+	opj_destroy_codec(dinfo);
+
+	if (imageX1 - imageX0 != image->comps[0].w || imageY1 - imageY0 != image->comps[0].h) {
+		fprintf(stdout,"Unable to perform pixel by pixel comparison on image %s\n",compressedFile);
+		free(fileData);
+		return 1;
+	}
+
+	// Choose the tiles to compare at random, so that different images sample different tiles.
+	long sampledTiles = numTiles;
+
+	if (parameters->sampling.tiles > 0.0 && parameters->sampling.tiles < 1.0) {
+		sampledTiles = (long) ceil(parameters->sampling.tiles * numTiles);
+	}
+
+	long tiles[numTiles];
+	unsigned int seed = parameters->sampling.seed;
+
+	for (ii=0; compressedFile[ii] != '\0'; ii++) {
+		seed = seed * 33 + (unsigned char) compressedFile[ii];
+	}
+
+	for (ii=0; ii<numTiles; ii++) {
+		tiles[ii] = ii;
+	}
+
+	for (ii=0; ii<sampledTiles && sampledTiles < numTiles; ii++) {
+		long chosen = ii + (long) (rand_r(&seed) % (numTiles - ii));
+		long swap = tiles[ii];
+		tiles[ii] = tiles[chosen];
+		tiles[chosen] = swap;
+	}
+
+	// Decode the whole image at once, unless only some of its tiles are compared.
+	decode_options decode = {reduce,0,{REGION_NONE,0.0,0.0,0.0,0.0},1};
+	opj_image_t *decoded = NULL;
+	long imageHeight = imageY1 - imageY0;
+	int result = 0;
+
+	PROFILE_START(decodeTimer);
+
+	if (sampledTiles == numTiles) {
+		result = decodeJPEG2000Image(data,length,codec,&decode,&decoded);
+
+		if (result == 0 && cubeParameters != NULL && cubeParameters->spectralTransform != SPECTRAL_NONE && decoded->numcomps > 1) {
+			result = spectralInverseTransform(decoded,cubeParameters->spectralTransform,cubeParameters->spectralLevels,
+					image->comps[0].prec,image->comps[0].sgnd);
+		}
+	}
+
+	PROFILE_STOP(decodeTimer,PROFILE_DECODE,0);
+
+	// Sums of each component over each tile compared.
+	int numcomps = image->numcomps;
+	double *sums = (double *) calloc((size_t) 4 * numcomps * sampledTiles,sizeof(double));
+	int maxAbsoluteError[numcomps];
+	unsigned long long totalPixels = 0;
+
+	if (sums == NULL) {
+		fprintf(stderr,"Unable to allocate memory to benchmark image %s\n",compressedFile);
+		opj_image_destroy(decoded);
+		free(fileData);
+		return 1;
+	}
+
+	// Pixels, squared error, absolute error and squared intensity of each tile, for each component.
+#define SAMPLE_SUMS(component,quantity) (sums + ((size_t) (component) * 4 + (quantity)) * sampledTiles)
+
+	for (cc=0; cc<numcomps; cc++) {
+		maxAbsoluteError[cc] = 0;
+	}
+
+	double *reduced = NULL;
+	double *work = NULL;
+
+	if (reduce > 0) {
+		reduced = (double *) malloc(sizeof(double) * tileWidth * tileHeight);
+		work = (double *) malloc(sizeof(double) * (2 * (tileWidth > tileHeight ? tileWidth : tileHeight) + 8));
+
+		if (reduced == NULL || work == NULL) {
+			result = 1;
+		}
+	}
+
+	for (ii=0; ii<sampledTiles && result == 0; ii++) {
+		// Position of the tile on the reference grid, at full and at reduced resolution.
+		long tx0 = tileX0 + (tiles[ii] % tilesX) * tileWidth;
+		long ty0 = tileY0 + (tiles[ii] / tilesX) * tileHeight;
+		long tx1 = tx0 + tileWidth < imageX1 ? tx0 + tileWidth : imageX1;
+		long ty1 = ty0 + tileHeight < imageY1 ? ty0 + tileHeight : imageY1;
+
+		tx0 = tx0 > imageX0 ? tx0 : imageX0;
+		ty0 = ty0 > imageY0 ? ty0 : imageY0;
+
+		long rx0 = reduceCoordinate(tx0,reduce);
+		long ry0 = reduceCoordinate(ty0,reduce);
+		long rx1 = reduceCoordinate(tx1,reduce);
+		long ry1 = reduceCoordinate(ty1,reduce);
+
+		opj_image_t *tile = decoded;
+
+		if (sampledTiles < numTiles) {
+			// Decode the tile alone.  The region is given in FITS pixels, which are flipped vertically.
+			decode.region.type = REGION_PIXEL;
+			decode.region.x0 = tx0 - imageX0 + 1;
+			decode.region.x1 = tx1 - imageX0;
+			decode.region.y0 = imageHeight - (ty1 - imageY0) + 1;
+			decode.region.y1 = imageHeight - (ty0 - imageY0);
+			tile = NULL;
+
+			PROFILE_START(tileTimer);
+			result = decodeJPEG2000Image(data,length,codec,&decode,&tile);
+
+			if (result == 0 && cubeParameters != NULL && cubeParameters->spectralTransform != SPECTRAL_NONE && tile->numcomps > 1) {
+				result = spectralInverseTransform(tile,cubeParameters->spectralTransform,cubeParameters->spectralLevels,
+						image->comps[0].prec,image->comps[0].sgnd);
+			}
+
+			PROFILE_STOP(tileTimer,PROFILE_DECODE,0);
+		}
+
+		if (result != 0 || tile->numcomps != numcomps) {
+			result = 1;
+			break;
+		}
+
+		PROFILE_START(qualityTimer);
+
+		for (cc=0; cc<numcomps; cc++) {
+			opj_image_comp_t *compUC = &image->comps[cc];
+			opj_image_comp_t *compC = &tile->comps[cc];
+
+			// Range of values the decoder clips to.
+			double low = compUC->sgnd ? -ldexp(1.0,compUC->prec-1) : 0.0;
+			double high = compUC->sgnd ? ldexp(1.0,compUC->prec-1) - 1.0 : ldexp(1.0,compUC->prec) - 1.0;
+
+			if (reduce > 0) {
+				reduceTile(compUC,tx0,ty0,tx1,ty1,reduce,reversible,reduced,work);
+			}
+
+			unsigned long long squaredError = 0;
+			unsigned long long absoluteError = 0;
+			double intensitySquareSum = 0.0;
+
+			for (jj=ry0; jj<ry1; jj++) {
+				int *decodedRow = compC->data + (size_t) (jj - tile->y0) * compC->w + (rx0 - tile->x0);
+
+				for (kk=rx0; kk<rx1; kk++) {
+					double uv;
+
+					if (reduce > 0) {
+						uv = floor(reduced[(jj-ry0)*(rx1-rx0) + (kk-rx0)] + 0.5);
+						uv = uv < low ? low : (uv > high ? high : uv);
+					}
+					else {
+						uv = compUC->data[(size_t) (jj - compUC->y0) * compUC->w + (kk - compUC->x0)];
+					}
+
+					long long error = (long long) uv - decodedRow[kk-rx0];
+					unsigned long long absolute = error < 0 ? -error : error;
+
+					squaredError += absolute * absolute;
+					absoluteError += absolute;
+					intensitySquareSum += uv * uv;
+
+					if ((int) absolute > maxAbsoluteError[cc]) {
+						maxAbsoluteError[cc] = (int) absolute;
+					}
+				}
+			}
+
+			SAMPLE_SUMS(cc,0)[ii] = (double) (rx1 - rx0) * (ry1 - ry0);
+			SAMPLE_SUMS(cc,1)[ii] = (double) squaredError;
+			SAMPLE_SUMS(cc,2)[ii] = (double) absoluteError;
+			SAMPLE_SUMS(cc,3)[ii] = intensitySquareSum;
+		}
+
+		PROFILE_STOP(qualityTimer,PROFILE_QUALITY,(size_t) sizeof(int)*numcomps*(tx1-tx0)*(ty1-ty0));
+
+		totalPixels += (unsigned long long) (rx1 - rx0) * (ry1 - ry0);
+
+		if (tile != decoded) {
+			opj_image_destroy(tile);
+		}
+	}
+
+	free(reduced);
+	free(work);
+	free(fileData);
+
+	if (decoded != NULL) {
+		opj_image_destroy(decoded);
+	}
+
+	if (result != 0) {
+		fprintf(stderr,"Unable to decode the tiles of JPEG file: %s\n",compressedFile);
+		free(sums);
+		return 1;
+	}
+
+	// Number of pixels in each component at the resolution compared.
+	double pixels = (double) (reduceCoordinate(imageX1,reduce) - reduceCoordinate(imageX0,reduce)) *
+			(reduceCoordinate(imageY1,reduce) - reduceCoordinate(imageY0,reduce));
+
+	for (cc=0; cc<numcomps; cc++) {
+		double peak = ldexp(1.0,image->comps[cc].prec) - 1.0;
+		double mseInterval, maeInterval, intensityInterval, fidelityInterval;
+		double mse = estimateRatio(SAMPLE_SUMS(cc,1),SAMPLE_SUMS(cc,0),sampledTiles,numTiles,&mseInterval);
+		double mae = estimateRatio(SAMPLE_SUMS(cc,2),SAMPLE_SUMS(cc,0),sampledTiles,numTiles,&maeInterval);
+		double intensity = estimateRatio(SAMPLE_SUMS(cc,3),SAMPLE_SUMS(cc,0),sampledTiles,numTiles,&intensityInterval);
+		double errorRatio = estimateRatio(SAMPLE_SUMS(cc,1),SAMPLE_SUMS(cc,3),sampledTiles,numTiles,&fidelityInterval);
+		double sampledPixels = 0.0;
+
+		for (ii=0; ii<sampledTiles; ii++) {
+			sampledPixels += SAMPLE_SUMS(cc,0)[ii];
+		}
+
+		if (results != NULL) {
+			results[cc].valid = true;
+			results[cc].pixels = (size_t) sampledPixels;
+			results[cc].meanSquaredError = mse;
+			results[cc].peakSignalToNoiseRatio = getPSNR(mse,peak);
+			results[cc].meanAbsoluteError = mae;
+			results[cc].fidelity = 1.0 - errorRatio;
+			results[cc].maximumAbsoluteDistortion = maxAbsoluteError[cc];
+			results[cc].meanSquaredErrorInterval = mseInterval;
+			results[cc].structuralSimilarity = NAN;
+			results[cc].multiScaleStructuralSimilarity = NAN;
+			results[cc].physicalRootMeanSquaredError = NAN;
+			results[cc].physicalMaximumError = NAN;
+		}
+
+		addQualitySummary(parameters->summary,mse,mae,maxAbsoluteError[cc],peak);
+
+		if (!parameters->performQualityBenchmarking) {
+			continue;
+		}
+
+		// Images may be benchmarked on several threads (see verify.c), so keep both lines together.
+		flockfile(stdout);
+
+		fprintf(stdout,"[Compressed File Name] [Pixels] [Sampled Pixels]");
+
+		if (parameters->squaredError) {
+			fprintf(stdout," [SE] [SE 95%% CI]");
+		}
+		if (parameters->meanSquaredError) {
+			fprintf(stdout," [MSE] [MSE 95%% CI]");
+		}
+		if (parameters->rootMeanSquaredError) {
+			fprintf(stdout," [RMSE] [RMSE 95%% CI]");
+		}
+		if (parameters->peakSignalToNoiseRatio) {
+			fprintf(stdout," [PSNR] [PSNR 95%% CI]");
+		}
+		if (parameters->absoluteError) {
+			fprintf(stdout," [AE] [AE 95%% CI]");
+		}
+		if (parameters->meanAbsoluteError) {
+			fprintf(stdout," [MAE] [MAE 95%% CI]");
+		}
+		if (parameters->squaredIntensitySum) {
+			fprintf(stdout," [SI] [SI 95%% CI]");
+		}
+		if (parameters->fidelity) {
+			fprintf(stdout," [FID] [FID 95%% CI]");
+		}
+		if (parameters->maximumAbsoluteDistortion) {
+			fprintf(stdout," [MAD]");
+		}
+		fprintf(stdout,"\n");
+
+		fprintf(stdout,"%s %.0f %.0f",compressedFile,pixels,sampledPixels);
+
+		if (parameters->squaredError) {
+			fprintf(stdout," %.0f",mse*pixels);
+			printInterval(stdout,fmax(mse-mseInterval,0.0)*pixels,(mse+mseInterval)*pixels);
+		}
+		if (parameters->meanSquaredError) {
+			fprintf(stdout," %f",mse);
+			printInterval(stdout,fmax(mse-mseInterval,0.0),mse+mseInterval);
+		}
+		if (parameters->rootMeanSquaredError) {
+			fprintf(stdout," %f",sqrt(mse));
+			printInterval(stdout,sqrt(fmax(mse-mseInterval,0.0)),sqrt(mse+mseInterval));
+		}
+		if (parameters->peakSignalToNoiseRatio) {
+			if (mse <= 0.0 && mseInterval == 0.0) {
+				fprintf(stdout," NO-PSNR [-,-]");
+			}
+			else {
+				fprintf(stdout," %f",getPSNR(mse,peak));
+				printInterval(stdout,getPSNR(mse+mseInterval,peak),getPSNR(fmax(mse-mseInterval,0.0),peak));
+			}
+		}
+		if (parameters->absoluteError) {
+			fprintf(stdout," %.0f",mae*pixels);
+			printInterval(stdout,fmax(mae-maeInterval,0.0)*pixels,(mae+maeInterval)*pixels);
+		}
+		if (parameters->meanAbsoluteError) {
+			fprintf(stdout," %f",mae);
+			printInterval(stdout,fmax(mae-maeInterval,0.0),mae+maeInterval);
+		}
+		if (parameters->squaredIntensitySum) {
+			fprintf(stdout," %.0f",intensity*pixels);
+			printInterval(stdout,fmax(intensity-intensityInterval,0.0)*pixels,(intensity+intensityInterval)*pixels);
+		}
+		if (parameters->fidelity) {
+			fprintf(stdout," %f",1.0-errorRatio);
+			printInterval(stdout,1.0-errorRatio-fidelityInterval,1.0-fmax(errorRatio-fidelityInterval,0.0));
+		}
+		if (parameters->maximumAbsoluteDistortion) {
+			fprintf(stdout," %d",maxAbsoluteError[cc]);
+		}
+		fprintf(stdout,"\n");
+
+		funlockfile(stdout);
+	}
+
+#undef SAMPLE_SUMS
+
+	free(sums);
+
+	return 0;
+}
+
+/**
+ * Add the benchmarks of a plane to the summary of the planes of a data cube sampled.
+ *
+ * @param summary Reference to quality_summary structure.  Nothing is done if it is null.
+ * @param mse Mean squared error of the plane.
+ * @param mae Mean absolute error of the plane.
+ * @param mad Maximum absolute distortion of the plane.
+ * @param peak Largest pixel value of the plane.
+ */
+void addQualitySummary(quality_summary *summary, double mse, double mae, int mad, double peak) {
+	if (summary == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&summary->mutex);
+
+	summary->planes++;
+	summary->meanSquaredErrorSum += mse;
+	summary->meanSquaredErrorSquares += mse * mse;
+	summary->meanAbsoluteErrorSum += mae;
+	summary->meanAbsoluteErrorSquares += mae * mae;
+
+	if (mad > summary->maximumAbsoluteDistortion) {
+		summary->maximumAbsoluteDistortion = mad;
+	}
+
+	if (peak > summary->peak) {
+		summary->peak = peak;
+	}
+
+	pthread_mutex_unlock(&summary->mutex);
+}
+
+/**
+ * Half width of the 95% confidence interval of the mean of a quantity over the planes of a data cube, estimated
+ * from the planes sampled.
+ *
+ * @param sum Sum of the quantity over the planes sampled.
+ * @param squares Sum of the squares of the quantity over the planes sampled.
+ * @param n Number of planes sampled.
+ * @param total Number of planes in the data cube (or the part of it converted).
+ *
+ * @return The half width.  0 if every plane was sampled, NaN if only one was.
+ */
+static double getPlaneInterval(double sum, double squares, long n, long total) {
+	if (n >= total) {
+		return 0.0;
+	}
+
+	if (n < 2) {
+		return NAN;
+	}
+
+	double mean = sum / n;
+	double variance = fmax(squares - n * mean * mean,0.0) / (n - 1);
+
+	return SAMPLE_CONFIDENCE_Z * sqrt((1.0 - (double) n / total) * variance / n);
+}
+
+/**
+ * Print the benchmarks of a data cube estimated from the planes sampled, with their 95% confidence intervals.
+ * Only the mean squared error, its root, the PSNR (of the mean squared error), the mean absolute error and the
+ * largest maximum absolute distortion of the planes sampled are summarised.
+ *
+ * @param out Stream to print to.
+ * @param name Name of the FITS file.
+ * @param summary Reference to quality_summary structure.
+ * @param planes Number of planes converted.
+ * @param parameters Reference to quality_benchmark_info structure specifying which benchmarks are displayed.
+ */
+void printQualitySummary(FILE *out, const char *name, quality_summary *summary, long planes, quality_benchmark_info *parameters) {
+	if (summary == NULL || parameters == NULL || summary->planes == 0) {
+		return;
+	}
+
+	long n = summary->planes;
+	double mse = summary->meanSquaredErrorSum / n;
+	double mae = summary->meanAbsoluteErrorSum / n;
+	double mseInterval = getPlaneInterval(summary->meanSquaredErrorSum,summary->meanSquaredErrorSquares,n,planes);
+	double maeInterval = getPlaneInterval(summary->meanAbsoluteErrorSum,summary->meanAbsoluteErrorSquares,n,planes);
+
+	flockfile(out);
+
+	fprintf(out,"[FITS File Name] [Planes] [Sampled Planes]");
+
+	if (parameters->meanSquaredError) {
+		fprintf(out," [MSE] [MSE 95%% CI]");
+	}
+	if (parameters->rootMeanSquaredError) {
+		fprintf(out," [RMSE] [RMSE 95%% CI]");
+	}
+	if (parameters->peakSignalToNoiseRatio) {
+		fprintf(out," [PSNR] [PSNR 95%% CI]");
+	}
+	if (parameters->meanAbsoluteError) {
+		fprintf(out," [MAE] [MAE 95%% CI]");
+	}
+	if (parameters->maximumAbsoluteDistortion) {
+		fprintf(out," [MAD]");
+	}
+	fprintf(out,"\n");
+
+	fprintf(out,"%s %ld %ld",name,planes,n);
+
+	if (parameters->meanSquaredError) {
+		fprintf(out," %f",mse);
+		printInterval(out,fmax(mse-mseInterval,0.0),mse+mseInterval);
+	}
+	if (parameters->rootMeanSquaredError) {
+		fprintf(out," %f",sqrt(mse));
+		printInterval(out,sqrt(fmax(mse-mseInterval,0.0)),sqrt(mse+mseInterval));
+	}
+	if (parameters->peakSignalToNoiseRatio) {
+		if (mse <= 0.0 && mseInterval == 0.0) {
+			fprintf(out," NO-PSNR [-,-]");
+		}
+		else {
+			fprintf(out," %f",getPSNR(mse,summary->peak));
+			printInterval(out,getPSNR(mse+mseInterval,summary->peak),getPSNR(fmax(mse-mseInterval,0.0),summary->peak));
+		}
+	}
+	if (parameters->meanAbsoluteError) {
+		fprintf(out," %f",mae);
+		printInterval(out,fmax(mae-maeInterval,0.0),mae+maeInterval);
+	}
+	if (parameters->maximumAbsoluteDistortion) {
+		fprintf(out," %d",summary->maximumAbsoluteDistortion);
+	}
+	fprintf(out,"\n");
+
+	funlockfile(out);
+}
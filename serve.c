@@ -0,0 +1,1283 @@
+/**
+ * @file serve.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Server mode: conversion jobs accepted over a Unix domain socket.
+ *
+ * Running f2j once per request pays for process start up, library initialisation and a cold cache every
+ * time.  In server mode (-serve or --serve), f2j listens on a Unix domain socket and converts files on
+ * request, using a pool of worker threads that live as long as the server.  Each worker keeps its own pool
+ * of component buffers, and information read from FITS headers is cached (see batch.c).
+ *
+ * Clients send one job per line as a JSON object and receive one JSON object per line in reply.  Jobs on
+ * the same connection are run one after another; open several connections to run jobs concurrently.  A
+ * job may contain the following members.  Only file is required.
+ *
+ * - file: FITS file to convert.
+ * - hdu: HDU to convert (1 is the primary HDU), as for -hdu.  Output file names are given the suffix _HDU[n].
+ *   Use "options": ["-hdu", "all"] to convert every image HDU of a multi-extension file.
+ * - frames: first frame to convert, or [first, last].
+ * - stokes: first stoke to convert, or [first, last].
+ * - transform: transform to perform on raw FITS data, as for -A.
+ * - suffix: suffix appended to output file names, as for -suffix.
+ * - params: parameter profile to apply, as file[:name] (see params.c).  The profile file is read once and shared
+ *   by every job until it is modified.
+ * - options: array of further command line options (as strings), for example ["-r", "40,20", "-QB"] or
+ *   ["-region", "1024,1024,1535,1535"] for a cutout.  These override the options given when the server was started.
+ *   Jobs without options start from the server's options, parsed once when it started; the command line of a job
+ *   with options is parsed again, so prefer params to options where the same settings are used repeatedly.
+ * - id: string or number copied into the reply, to help clients match replies to jobs.
+ * - command: "shutdown" stops the server once running jobs have finished.
+ *
+ * The reply contains the status of the job, its wall clock time (and the part of it spent waiting for FITS data),
+ * the total size of the JPEG 2000 images compared to the FITS data encoded, the size of each kind of file written
+ * (see rate.c) and of each quality layer of the images, and for each image written, its name, size, encoding time
+ * and any quality benchmarks.  For example:
+ *
+ * {"file":"cube.fits","frames":[1,2],"options":["-r","20","-QB"]}
+ *
+ * {"status":"ok","file":"cube.fits","seconds":0.41,"read_seconds":0.05,"images":2,"compressed_size":52011,"raw_size":2097152,
+ * "bits_per_pixel":0.793625,"compression_ratio":0.024800,"rates":{"image":{"files":2,"size":52011,"header_size":530,
+ * "pixels":524288,"raw_size":2097152,"bits_per_pixel":0.793625,"compression_ratio":0.0248}},"layers":[52011],
+ * "outputs":[{"file":"cube_1.jp2","size":26002,"bits_per_pixel":0.793518,"encode_seconds":0.17,
+ * "quality":[{"pixels":262144,"mse":3.01,"rmse":1.73,"psnr":63.35,"mae":1.21,"fidelity":0.999998,"mad":14}]}, ...]}
+ */
+
+#include "f2j.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Maximum length of a single job (one line of JSON).
+ */
+#define MAX_JOB_LENGTH (1024*1024)
+
+/**
+ * Maximum number of command line options in a single job.
+ */
+#define MAX_JOB_OPTIONS 256
+
+/**
+ * Length of buffer used for error messages.
+ */
+#define JOB_ERROR_LENGTH 256
+
+/**
+ * Options that can't be given in a job, because they would stop the server, change how it runs, convert images
+ * back to FITS or add noise (whose random number generators are shared by the whole process, see
+ * getIntegerGaussianNoise()).  Verifying on threads of their own (-verify_threads) is left to the server too.
+ */
+static const char *rejectedJobOptions[] = {"-h","-batch","-serve","--serve","-threads","-profile","-throughput","-microbench",
+		"-tune","--tune","-save_params","-j2f","-verify_threads","-noise","-noise_pct","-seed","-noise_field"};
+
+/**
+ * Number of options in rejectedJobOptions.
+ */
+#define NUM_REJECTED_JOB_OPTIONS ((int) (sizeof(rejectedJobOptions)/sizeof(rejectedJobOptions[0])))
+
+/**
+ * Structure holding a conversion job received from a client.  Strings are allocated while parsing
+ * and freed by freeJob.
+ */
+typedef struct {
+	char *id /** Identifier to copy into the reply.  Null if not given. */;
+	bool idIsNumber /** Was the identifier given as a number (rather than a string)? */;
+	char *file /** FITS file to convert. */;
+	long hdu /** HDU to convert.  0 if not given. */;
+	long firstFrame /** First frame to convert.  0 if not given. */;
+	long lastFrame /** Last frame to convert.  0 if not given. */;
+	long firstStoke /** First stoke to convert.  0 if not given. */;
+	long lastStoke /** Last stoke to convert.  0 if not given. */;
+	char *transform /** Transform to perform on raw data.  Null if not given. */;
+	char *suffix /** Suffix for output file names.  Null if not given. */;
+	char *params /** Parameter profile to apply, as file[:name].  Null if not given. */;
+	char *options[MAX_JOB_OPTIONS] /** Further command line options. */;
+	int numOptions /** Number of further command line options. */;
+	bool shutdown /** Should the server be stopped? */;
+} server_job;
+
+/**
+ * State shared by the server worker threads.
+ */
+typedef struct {
+	int listener /** Listening socket. */;
+	int argc /** Number of command line arguments the server was started with. */;
+	char **argv /** Command line arguments the server was started with.  Used as the basis of each job's options. */;
+	int readThreads /** Number of threads decompressing each plane of a tile-compressed image, unless a job says otherwise. */;
+	int encodeThreads /** Number of threads coding the code-blocks of each image, unless a job says otherwise. */;
+	conversion_options *options /** Options the server was started with, shared (read only) by jobs without options of their own. */;
+} server_state;
+
+/**
+ * Mutex serialising command line parsing, which uses global state in opj_getopt.
+ */
+static pthread_mutex_t parseMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Skip white space in a JSON document.
+ *
+ * @param p Current position.
+ *
+ * @return first position that isn't white space.
+ */
+static const char *skipWhitespace(const char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+		p++;
+	}
+
+	return p;
+}
+
+/**
+ * Parse a JSON string.  Escaped characters outside the ASCII range are replaced with '?'.
+ *
+ * @param p Current position, which must be the opening quote.
+ * @param value Reference to a pointer which will be set to the (allocated) string.
+ * @param error Buffer which will hold an error message if parsing fails.
+ *
+ * @return position after the closing quote, or null if parsing failed.
+ */
+static const char *parseJSONString(const char *p, char **value, char *error) {
+	if (*p != '"') {
+		snprintf(error,JOB_ERROR_LENGTH,"Expected a string");
+		return NULL;
+	}
+
+	p++;
+
+	// The parsed string can be no longer than the JSON representation.
+	const char *end = p;
+
+	while (*end != '"' && *end != '\0') {
+		if (*end == '\\' && *(end+1) != '\0') {
+			end++;
+		}
+		end++;
+	}
+
+	if (*end != '"') {
+		snprintf(error,JOB_ERROR_LENGTH,"Unterminated string");
+		return NULL;
+	}
+
+	char *string = (char *) malloc(end - p + 1);
+
+	if (string == NULL) {
+		snprintf(error,JOB_ERROR_LENGTH,"Unable to allocate memory for string");
+		return NULL;
+	}
+
+	char *out = string;
+
+	while (p < end) {
+		if (*p != '\\') {
+			*out++ = *p++;
+			continue;
+		}
+
+		p++;
+
+		switch (*p) {
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+			{
+				unsigned int code = 0;
+				int ii;
+
+				for (ii=1; ii<=4 && isxdigit((unsigned char) p[ii]); ii++) {
+					code = code*16 + (isdigit((unsigned char) p[ii]) ? p[ii]-'0' : (tolower((unsigned char) p[ii])-'a'+10));
+				}
+
+				if (ii != 5) {
+					snprintf(error,JOB_ERROR_LENGTH,"Invalid unicode escape in string");
+					free(string);
+					return NULL;
+				}
+
+				*out++ = (code > 0 && code < 128) ? (char) code : '?';
+				p += 4;
+			}
+			break;
+			default: *out++ = *p; break;
+		}
+
+		p++;
+	}
+
+	*out = '\0';
+	*value = string;
+
+	return end + 1;
+}
+
+/**
+ * Get the length of the JSON number at the start of a string: an optional minus sign, an integer part without
+ * leading zeros, then an optional fraction and exponent.
+ *
+ * @param p Current position.
+ *
+ * @return number of characters in the number, or 0 if there isn't a valid JSON number at p.
+ */
+static size_t getJSONNumberLength(const char *p) {
+	const char *start = p;
+
+	if (*p == '-') {
+		p++;
+	}
+
+	if (*p == '0') {
+		p++;
+	}
+	else if (*p >= '1' && *p <= '9') {
+		p += strspn(p,"0123456789");
+	}
+	else {
+		return 0;
+	}
+
+	if (*p == '.') {
+		size_t digits = strspn(p+1,"0123456789");
+
+		if (digits == 0) {
+			return 0;
+		}
+
+		p += 1 + digits;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+
+		if (*p == '+' || *p == '-') {
+			p++;
+		}
+
+		size_t digits = strspn(p,"0123456789");
+
+		if (digits == 0) {
+			return 0;
+		}
+
+		p += digits;
+	}
+
+	return (size_t) (p - start);
+}
+
+/**
+ * Parse a JSON number as a long integer.
+ *
+ * @param p Current position.
+ * @param value Reference to the long which will hold the number.
+ * @param error Buffer which will hold an error message if parsing fails.
+ *
+ * @return position after the number, or null if parsing failed.
+ */
+static const char *parseJSONLong(const char *p, long *value, char *error) {
+	char *end;
+
+	*value = strtol(p,&end,10);
+
+	if (end == p) {
+		snprintf(error,JOB_ERROR_LENGTH,"Expected an integer");
+		return NULL;
+	}
+
+	return end;
+}
+
+/**
+ * Parse a range of planes or stokes, given as a single number or an array of two numbers.
+ *
+ * @param p Current position.
+ * @param first Reference to the long which will hold the first value.
+ * @param last Reference to the long which will hold the last value.  Set to 0 if only one number is given.
+ * @param error Buffer which will hold an error message if parsing fails.
+ *
+ * @return position after the range, or null if parsing failed.
+ */
+static const char *parseJSONRange(const char *p, long *first, long *last, char *error) {
+	*last = 0;
+
+	if (*p != '[') {
+		return parseJSONLong(p,first,error);
+	}
+
+	p = skipWhitespace(p+1);
+	p = parseJSONLong(p,first,error);
+
+	if (p == NULL) {
+		return NULL;
+	}
+
+	p = skipWhitespace(p);
+
+	if (*p == ',') {
+		p = skipWhitespace(p+1);
+		p = parseJSONLong(p,last,error);
+
+		if (p == NULL) {
+			return NULL;
+		}
+
+		p = skipWhitespace(p);
+	}
+
+	if (*p != ']') {
+		snprintf(error,JOB_ERROR_LENGTH,"Expected a range [first, last]");
+		return NULL;
+	}
+
+	return p + 1;
+}
+
+/**
+ * Free the strings allocated for a job.
+ *
+ * @param job Job to free.
+ */
+static void freeJob(server_job *job) {
+	int ii;
+
+	free(job->id);
+	free(job->file);
+	free(job->transform);
+	free(job->suffix);
+	free(job->params);
+
+	for (ii=0; ii<job->numOptions; ii++) {
+		free(job->options[ii]);
+	}
+}
+
+/**
+ * Parse a job sent by a client.
+ *
+ * @param line JSON object describing the job.
+ * @param job Reference to job structure which will be populated.  Must be freed with freeJob, even if
+ * parsing fails.
+ * @param error Buffer which will hold an error message if parsing fails.
+ *
+ * @return 0 if the job was parsed successfully, 1 otherwise.
+ */
+static int parseJob(const char *line, server_job *job, char *error) {
+	memset(job,0,sizeof(server_job));
+
+	const char *p = skipWhitespace(line);
+
+	if (*p != '{') {
+		snprintf(error,JOB_ERROR_LENGTH,"Job must be a JSON object");
+		return 1;
+	}
+
+	p = skipWhitespace(p+1);
+
+	while (*p != '}') {
+		char *key = NULL;
+
+		p = parseJSONString(p,&key,error);
+
+		if (p == NULL) {
+			return 1;
+		}
+
+		p = skipWhitespace(p);
+
+		if (*p != ':') {
+			snprintf(error,JOB_ERROR_LENGTH,"Expected ':' after member %s",key);
+			free(key);
+			return 1;
+		}
+
+		p = skipWhitespace(p+1);
+
+		if (strcmp(key,"file") == 0) {
+			p = parseJSONString(p,&job->file,error);
+		}
+		else if (strcmp(key,"transform") == 0) {
+			p = parseJSONString(p,&job->transform,error);
+		}
+		else if (strcmp(key,"suffix") == 0) {
+			p = parseJSONString(p,&job->suffix,error);
+		}
+		else if (strcmp(key,"params") == 0) {
+			p = parseJSONString(p,&job->params,error);
+		}
+		else if (strcmp(key,"hdu") == 0) {
+			p = parseJSONLong(p,&job->hdu,error);
+		}
+		else if (strcmp(key,"frames") == 0) {
+			p = parseJSONRange(p,&job->firstFrame,&job->lastFrame,error);
+		}
+		else if (strcmp(key,"stokes") == 0) {
+			p = parseJSONRange(p,&job->firstStoke,&job->lastStoke,error);
+		}
+		else if (strcmp(key,"id") == 0) {
+			if (*p == '"') {
+				p = parseJSONString(p,&job->id,error);
+			}
+			else {
+				// Keep the number as it was written, so it must be a valid JSON number to be echoed in the reply.
+				size_t length = getJSONNumberLength(p);
+
+				if (length == 0 || (p[length] != '\0' && strchr("+-.0123456789eE",p[length]) != NULL)) {
+					snprintf(error,JOB_ERROR_LENGTH,"Member id must be a string or number");
+					p = NULL;
+				}
+				else {
+					job->id = strndup(p,length);
+					job->idIsNumber = true;
+					p += length;
+				}
+			}
+		}
+		else if (strcmp(key,"command") == 0) {
+			char *command = NULL;
+
+			p = parseJSONString(p,&command,error);
+
+			if (p != NULL) {
+				if (strcmp(command,"shutdown") == 0) {
+					job->shutdown = true;
+				}
+				else {
+					snprintf(error,JOB_ERROR_LENGTH,"Unknown command");
+					p = NULL;
+				}
+			}
+
+			free(command);
+		}
+		else if (strcmp(key,"options") == 0) {
+			if (*p != '[') {
+				snprintf(error,JOB_ERROR_LENGTH,"Member options must be an array of strings");
+				p = NULL;
+			}
+			else {
+				p = skipWhitespace(p+1);
+
+				while (p != NULL && *p != ']') {
+					if (job->numOptions == MAX_JOB_OPTIONS) {
+						snprintf(error,JOB_ERROR_LENGTH,"Too many options (maximum %d)",MAX_JOB_OPTIONS);
+						p = NULL;
+						break;
+					}
+
+					p = parseJSONString(p,&job->options[job->numOptions],error);
+
+					if (p == NULL) {
+						break;
+					}
+
+					job->numOptions++;
+					p = skipWhitespace(p);
+
+					if (*p == ',') {
+						p = skipWhitespace(p+1);
+					}
+					else if (*p != ']') {
+						snprintf(error,JOB_ERROR_LENGTH,"Expected ',' or ']' in options");
+						p = NULL;
+					}
+				}
+
+				if (p != NULL) {
+					p++;
+				}
+			}
+		}
+		else {
+			snprintf(error,JOB_ERROR_LENGTH,"Unknown member %s",key);
+			p = NULL;
+		}
+
+		free(key);
+
+		if (p == NULL) {
+			return 1;
+		}
+
+		p = skipWhitespace(p);
+
+		if (*p == ',') {
+			p = skipWhitespace(p+1);
+		}
+		else if (*p != '}') {
+			snprintf(error,JOB_ERROR_LENGTH,"Expected ',' or '}'");
+			return 1;
+		}
+	}
+
+	if (job->file == NULL && !job->shutdown) {
+		snprintf(error,JOB_ERROR_LENGTH,"Job must name a FITS file");
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write a string to a JSON document, escaping it as necessary.
+ *
+ * @param out Stream to write to.
+ * @param value String to write.
+ */
+static void writeJSONString(FILE *out, const char *value) {
+	fputc('"',out);
+
+	for (; *value != '\0'; value++) {
+		unsigned char c = (unsigned char) *value;
+
+		if (c == '"' || c == '\\') {
+			fprintf(out,"\\%c",c);
+		}
+		else if (c < 0x20) {
+			fprintf(out,"\\u%04x",c);
+		}
+		else {
+			fputc(c,out);
+		}
+	}
+
+	fputc('"',out);
+}
+
+/**
+ * Write a number to a JSON document.  Numbers that JSON can't represent (such as the infinite PSNR of
+ * identical images) are written as null.
+ *
+ * @param out Stream to write to.
+ * @param value Number to write.
+ */
+static void writeJSONNumber(FILE *out, double value) {
+	if (isfinite(value)) {
+		fprintf(out,"%.10g",value);
+	}
+	else {
+		fprintf(out,"null");
+	}
+}
+
+/**
+ * Write the compressed size of each kind of file written by a job as a JSON object, followed by the size of each
+ * quality layer of the JPEG 2000 images (an empty array if the split by layer isn't known).
+ *
+ * @param out Stream to write to.
+ * @param rates Reference to rate_account structure to write.
+ */
+static void writeJSONRates(FILE *out, rate_account *rates) {
+	// Loop variable
+	int ii;
+	bool first = true;
+
+	fprintf(out,"\"rates\":{");
+
+	for (ii=0; ii<RATE_OUTPUTS; ii++) {
+		rate_counter *counter = &rates->outputs[ii];
+
+		if (counter->images == 0) {
+			continue;
+		}
+
+		fprintf(out,"%s\"%s\":{\"files\":%ld,\"size\":%llu,\"header_size\":%llu,\"pixels\":%llu,\"raw_size\":%llu,\"bits_per_pixel\":",
+				first ? "" : ",",getRateOutputName(ii),counter->images,counter->bytes,counter->headerBytes,counter->pixels,counter->rawBytes);
+		writeJSONNumber(out,getBitsPerPixel(counter));
+		fprintf(out,",\"compression_ratio\":");
+		writeJSONNumber(out,getCompressionRatio(counter));
+		fputc('}',out);
+		first = false;
+	}
+
+	fprintf(out,"},\"layers\":[");
+
+	for (ii=0; ii<rates->layers; ii++) {
+		fprintf(out,"%s%llu",ii > 0 ? "," : "",rates->layerBytes[ii]);
+	}
+
+	fputc(']',out);
+}
+
+/**
+ * Set the options of a job with no command line options of its own, starting from the options the server
+ * was started with rather than parsing its command line again.
+ *
+ * @param job Job to run.
+ * @param state Server state.
+ * @param options Reference to conversion_options structure which will be populated.
+ * @param error Buffer which will hold an error message if the options are invalid.
+ *
+ * @return 0 if the options were set successfully, 1 otherwise.
+ */
+static int setJobOptions(server_job *job, server_state *state, conversion_options *options, char *error) {
+	*options = *state->options;
+	options->readThreads = state->readThreads;
+	options->encodeThreads = state->encodeThreads;
+	options->hduThreads = 1;
+
+	// As parse_cmdline_encoder would apply the members of the job: the profile first, then the other members.
+	if (job->params != NULL && loadParameterProfile(job->params,&options->parameters,&options->transform,&options->qualityBenchmarkParameters) != 0) {
+		snprintf(error,JOB_ERROR_LENGTH,"Invalid parameter profile %s",job->params);
+		return 1;
+	}
+
+	// The profile may make the encoding lossy, which DPCM can't be used with.
+	if (checkSpectralTransform(options->cubeParameters.spectralTransform,&options->parameters,&options->rateControl) != 0) {
+		snprintf(error,JOB_ERROR_LENGTH,"Parameter profile %s makes the encoding lossy, which -spectral DPCM cannot be used with",job->params);
+		return 1;
+	}
+
+	strncpy(options->parameters.infile,job->file,sizeof(options->parameters.infile)-1);
+	options->parameters.infile[sizeof(options->parameters.infile)-1] = '\0';
+
+	if (job->hdu > 0) {
+		options->hdus.all = false;
+		options->hdus.count = 1;
+		options->hdus.numbers[0] = job->hdu;
+	}
+
+	if (job->transform != NULL && parseTransform(job->transform,&options->transform) != 0) {
+		fprintf(stderr,"Unknown transform specified: %s.  Using default instead.\n",job->transform);
+	}
+
+	if (job->firstFrame > 0) {
+		options->startFrame = job->firstFrame;
+	}
+
+	if (job->lastFrame > 0) {
+		options->endFrame = job->lastFrame;
+	}
+
+	if (job->firstStoke > 0) {
+		options->startStoke = job->firstStoke;
+	}
+
+	if (job->lastStoke > 0) {
+		options->endStoke = job->lastStoke;
+	}
+
+	if (job->suffix != NULL) {
+		strncpy(options->parameters.outfile,job->suffix,sizeof(options->parameters.outfile)-1);
+		options->parameters.outfile[sizeof(options->parameters.outfile)-1] = '\0';
+	}
+
+	// The checks parse_cmdline_encoder makes on the options a profile can change.
+	if ((options->parameters.cp_tx0 > options->parameters.image_offset_x0) || (options->parameters.cp_ty0 > options->parameters.image_offset_y0)) {
+		snprintf(error,JOB_ERROR_LENGTH,"Tile offset must not be greater than the image offset");
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Set the options of a job with command line options of its own.  The job is turned into a command line (the
+ * server's own command line, followed by options built from the job) and parsed by parse_cmdline_encoder, so
+ * jobs accept exactly the same options as the program.
+ *
+ * @param job Job to run.
+ * @param state Server state.
+ * @param options Reference to conversion_options structure which will be populated.
+ * @param error Buffer which will hold an error message if the options are invalid.
+ *
+ * @return 0 if the options were set successfully, 1 otherwise.
+ */
+static int parseJobOptions(server_job *job, server_state *state, conversion_options *options, char *error) {
+	// Loop variables
+	int ii,jj;
+
+	int result = 0;
+
+	// Build command line.
+	char *jobArgv[state->argc + 18 + job->numOptions];
+	int jobArgc = 0;
+
+	for (ii=0; ii<state->argc; ii++) {
+		jobArgv[jobArgc++] = state->argv[ii];
+	}
+
+	if (job->params != NULL) {
+		jobArgv[jobArgc++] = "-params";
+		jobArgv[jobArgc++] = job->params;
+	}
+
+	jobArgv[jobArgc++] = "-i";
+	jobArgv[jobArgc++] = job->file;
+
+	// The HDU is selected as for -hdu, which also gives the output file names the suffix _HDU[n].
+	char hdu[32];
+
+	if (job->hdu > 0) {
+		sprintf(hdu,"%ld",job->hdu);
+		jobArgv[jobArgc++] = "-hdu";
+		jobArgv[jobArgc++] = hdu;
+	}
+
+	if (job->transform != NULL) {
+		jobArgv[jobArgc++] = "-A";
+		jobArgv[jobArgc++] = job->transform;
+	}
+
+	char ranges[4][32];
+
+	if (job->firstFrame > 0) {
+		sprintf(ranges[0],"%ld",job->firstFrame);
+		jobArgv[jobArgc++] = "-x";
+		jobArgv[jobArgc++] = ranges[0];
+	}
+
+	if (job->lastFrame > 0) {
+		sprintf(ranges[1],"%ld",job->lastFrame);
+		jobArgv[jobArgc++] = "-y";
+		jobArgv[jobArgc++] = ranges[1];
+	}
+
+	if (job->firstStoke > 0) {
+		sprintf(ranges[2],"%ld",job->firstStoke);
+		jobArgv[jobArgc++] = "-S1";
+		jobArgv[jobArgc++] = ranges[2];
+	}
+
+	if (job->lastStoke > 0) {
+		sprintf(ranges[3],"%ld",job->lastStoke);
+		jobArgv[jobArgc++] = "-S2";
+		jobArgv[jobArgc++] = ranges[3];
+	}
+
+	if (job->suffix != NULL) {
+		jobArgv[jobArgc++] = "-suffix";
+		jobArgv[jobArgc++] = job->suffix;
+	}
+
+	for (ii=0; ii<job->numOptions; ii++) {
+		char *option = job->options[ii];
+
+		// Options that would stop the server or change how it runs are not allowed.
+		for (jj=0; jj<NUM_REJECTED_JOB_OPTIONS; jj++) {
+			if (strcmp(option,rejectedJobOptions[jj]) == 0) {
+				snprintf(error,JOB_ERROR_LENGTH,"Option %s cannot be used in a job",option);
+				result = 1;
+				break;
+			}
+		}
+
+		jobArgv[jobArgc++] = option;
+	}
+
+	jobArgv[jobArgc] = NULL;
+
+	setDefaultConversionOptions(options);
+
+	if (result == 0) {
+		batch_info jobParameters;
+		jobParameters.source[0] = '\0';
+		jobParameters.socket[0] = '\0';
+		jobParameters.throughput[0] = '\0';
+		jobParameters.microbench[0] = '\0';
+		jobParameters.tune[0] = '\0';
+		jobParameters.saveParams[0] = '\0';
+		jobParameters.threads = 1;
+		jobParameters.readThreads = 0;
+		jobParameters.encodeThreads = 0;
+		jobParameters.verifyThreads = 0;
+		jobParameters.verifyMemory = 0;
+		jobParameters.rateDetail = false;
+
+#ifdef noise
+		// Noise options are rejected in jobs (and noise in server mode), so these are only needed to satisfy the parser.
+		double noiseDB = 0.0;
+		bool noiseSet = false;
+		unsigned long seed = 0;
+		bool seedSet = false;
+		double noisePct = 0.0;
+#endif
+
+		pthread_mutex_lock(&parseMutex);
+
+		result = parse_cmdline_encoder(jobArgc,jobArgv,&options->parameters,&options->transform,&options->writeUncompressed,&options->startFrame,
+				&options->endFrame,&options->qualityBenchmarkParameters,&options->compressionBenchmark,&options->startStoke,&options->endStoke,
+				&options->cubeParameters,&options->region,&options->hdus,&options->readahead,&options->rateControl,&jobParameters
+#ifdef noise
+				,&noiseDB,&noiseSet,&seed,&seedSet,&noisePct,&options->writeNoiseField
+#endif
+		);
+
+		pthread_mutex_unlock(&parseMutex);
+
+		if (result != 0) {
+			snprintf(error,JOB_ERROR_LENGTH,"Invalid options");
+		}
+
+		// Share the cores between the workers when decompressing tile-compressed images and coding code-blocks,
+		// unless the number of threads was given.
+		options->readThreads = jobParameters.readThreads > 0 ? jobParameters.readThreads : state->readThreads;
+		options->encodeThreads = jobParameters.encodeThreads > 0 ? jobParameters.encodeThreads : state->encodeThreads;
+
+		if (jobParameters.verifyMemory > 0) {
+			options->verifyMemory = jobParameters.verifyMemory;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Run a conversion job and write the reply.
+ *
+ * @param job Job to run.
+ * @param state Server state.
+ * @param pool Component buffer pool belonging to the worker running the job.
+ * @param out Stream to write the reply to.
+ */
+static void runJob(server_job *job, server_state *state, plane_buffer_pool *pool, FILE *out) {
+	double startTime = getWallClockTime();
+
+	// Loop variables
+	int ii;
+	long jj;
+
+	char error[JOB_ERROR_LENGTH] = "";
+
+	conversion_options options;
+	conversion_result conversionResult;
+	memset(&conversionResult,0,sizeof(conversion_result));
+	conversionResult.recordImages = true;
+
+	int result = job->numOptions == 0 ? setJobOptions(job,state,&options,error) : parseJobOptions(job,state,&options,error);
+
+	if (result == 0) {
+		// As in main().
+		options.parameters.tcp_mct = options.cubeParameters.multiComponentTransform ? 1 : 0;
+
+		// Compressed sizes are always reported.
+		options.compressionBenchmark = true;
+
+		result = convertFITSFile(job->file,&options,pool,&conversionResult);
+
+		if (result != 0) {
+			snprintf(error,JOB_ERROR_LENGTH,"Conversion failed");
+		}
+	}
+
+	// Jobs without options share the comment and fixed layer allocation of the server's options.
+	if (options.parameters.cp_comment != state->options->parameters.cp_comment) {
+		free(options.parameters.cp_comment);
+	}
+
+	if (options.parameters.cp_matrice != state->options->parameters.cp_matrice) {
+		free(options.parameters.cp_matrice);
+	}
+
+	// Write reply.
+	fputc('{',out);
+
+	if (job->id != NULL) {
+		fprintf(out,"\"id\":");
+		if (job->idIsNumber) {
+			fprintf(out,"%s",job->id);
+		}
+		else {
+			writeJSONString(out,job->id);
+		}
+		fputc(',',out);
+	}
+
+	fprintf(out,"\"status\":\"%s\",",result == 0 ? "ok" : "error");
+
+	if (result != 0) {
+		fprintf(out,"\"error\":");
+		writeJSONString(out,error);
+		fputc(',',out);
+	}
+
+	fprintf(out,"\"file\":");
+	writeJSONString(out,job->file);
+	fprintf(out,",\"seconds\":");
+	writeJSONNumber(out,getWallClockTime() - startTime);
+	fprintf(out,",\"read_seconds\":");
+	writeJSONNumber(out,conversionResult.readSeconds);
+	rate_counter *imageRate = &conversionResult.rate.outputs[RATE_IMAGE];
+	fprintf(out,",\"images\":%ld,\"compressed_size\":%llu,\"raw_size\":%llu,\"bits_per_pixel\":",conversionResult.images,imageRate->bytes,
+			imageRate->rawBytes);
+	writeJSONNumber(out,getBitsPerPixel(imageRate));
+	fprintf(out,",\"compression_ratio\":");
+	writeJSONNumber(out,getCompressionRatio(imageRate));
+	fputc(',',out);
+	writeJSONRates(out,&conversionResult.rate);
+	fprintf(out,",\"outputs\":[");
+
+	for (jj=0; jj<conversionResult.images; jj++) {
+		image_result *image = &conversionResult.imageResults[jj];
+
+		fprintf(out,"%s{\"file\":",jj > 0 ? "," : "");
+		writeJSONString(out,image->file != NULL ? image->file : "");
+		fprintf(out,",\"size\":%llu,\"bits_per_pixel\":",image->rate.bytes);
+		writeJSONNumber(out,getBitsPerPixel(&image->rate));
+		fprintf(out,",\"encode_seconds\":");
+		writeJSONNumber(out,image->seconds);
+
+		if (image->quality != NULL) {
+			fprintf(out,",\"quality\":[");
+
+			for (ii=0; ii<image->numcomps; ii++) {
+				quality_benchmark_result *quality = &image->quality[ii];
+
+				if (ii > 0) {
+					fputc(',',out);
+				}
+
+				if (!quality->valid) {
+					fprintf(out,"null");
+					continue;
+				}
+
+				fprintf(out,"{\"pixels\":%zu,\"mse\":",quality->pixels);
+				writeJSONNumber(out,quality->meanSquaredError);
+				fprintf(out,",\"rmse\":");
+				writeJSONNumber(out,sqrt(quality->meanSquaredError));
+				fprintf(out,",\"psnr\":");
+				writeJSONNumber(out,quality->peakSignalToNoiseRatio);
+				fprintf(out,",\"mae\":");
+				writeJSONNumber(out,quality->meanAbsoluteError);
+				fprintf(out,",\"fidelity\":");
+				writeJSONNumber(out,quality->fidelity);
+
+				// Benchmarks estimated from some of the tiles (-QB_sample) give the half width of their 95% confidence interval.
+				if (quality->meanSquaredErrorInterval != 0.0) {
+					fprintf(out,",\"mse_interval\":");
+					writeJSONNumber(out,quality->meanSquaredErrorInterval);
+				}
+
+				fprintf(out,",\"mad\":%d",quality->maximumAbsoluteDistortion);
+
+				if (!isnan(quality->structuralSimilarity)) {
+					fprintf(out,",\"ssim\":");
+					writeJSONNumber(out,quality->structuralSimilarity);
+				}
+
+				if (!isnan(quality->multiScaleStructuralSimilarity)) {
+					fprintf(out,",\"msssim\":");
+					writeJSONNumber(out,quality->multiScaleStructuralSimilarity);
+				}
+
+				if (!isnan(quality->physicalRootMeanSquaredError)) {
+					fprintf(out,",\"rmse_physical\":");
+					writeJSONNumber(out,quality->physicalRootMeanSquaredError);
+					fprintf(out,",\"max_error_physical\":");
+					writeJSONNumber(out,quality->physicalMaximumError);
+				}
+
+				fputc('}',out);
+			}
+
+			fputc(']',out);
+		}
+
+		fputc('}',out);
+	}
+
+	fprintf(out,"]}\n");
+
+	freeConversionResult(&conversionResult);
+}
+
+/**
+ * Write a buffer to a socket, retrying after partial writes.
+ *
+ * @param connection Socket to write to.
+ * @param buffer Data to write.
+ * @param length Number of bytes to write.
+ *
+ * @return 0 if all the data was written, 1 otherwise.
+ */
+static int writeAll(int connection, const char *buffer, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(connection,buffer,length);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+
+		buffer += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+/**
+ * Handle a single line received from a client.
+ *
+ * @param line Line received (without the new line character).
+ * @param state Server state.
+ * @param pool Component buffer pool belonging to the worker.
+ * @param connection Socket to write the reply to.
+ *
+ * @return 0 to keep reading jobs from the connection, 1 to close it.
+ */
+static int handleLine(char *line, server_state *state, plane_buffer_pool *pool, int connection) {
+	char *reply = NULL;
+	size_t replyLength = 0;
+	bool closeConnection = false;
+
+	FILE *out = open_memstream(&reply,&replyLength);
+
+	if (out == NULL) {
+		fprintf(stderr,"Unable to allocate memory for reply to job.\n");
+		return 1;
+	}
+
+	server_job job;
+	char error[JOB_ERROR_LENGTH];
+
+	if (parseJob(line,&job,error) != 0) {
+		fprintf(out,"{\"status\":\"error\",\"error\":");
+		writeJSONString(out,error);
+		fprintf(out,"}\n");
+	}
+	else if (job.shutdown) {
+		fprintf(out,"{\"status\":\"ok\",\"shutdown\":true}\n");
+
+		// Stop accepting connections.  Workers blocked in accept() return with an error and exit once
+		// they have finished their current connection.
+		shutdown(state->listener,SHUT_RDWR);
+		closeConnection = true;
+	}
+	else {
+		runJob(&job,state,pool,out);
+	}
+
+	freeJob(&job);
+	fclose(out);
+
+	if (writeAll(connection,reply,replyLength) != 0) {
+		closeConnection = true;
+	}
+
+	free(reply);
+
+	return closeConnection ? 1 : 0;
+}
+
+/**
+ * Read jobs from a connection, one per line, until the client closes it.
+ *
+ * @param state Server state.
+ * @param pool Component buffer pool belonging to the worker.
+ * @param connection Connected socket.
+ */
+static void handleConnection(server_state *state, plane_buffer_pool *pool, int connection) {
+	size_t capacity = 4096;
+	size_t length = 0;
+	char *buffer = (char *) malloc(capacity);
+
+	if (buffer == NULL) {
+		fprintf(stderr,"Unable to allocate memory to read jobs.\n");
+		return;
+	}
+
+	while (true) {
+		// Make room to read more data.
+		if (length + 1 == capacity) {
+			if (capacity >= MAX_JOB_LENGTH) {
+				const char *tooLong = "{\"status\":\"error\",\"error\":\"Job too long\"}\n";
+				writeAll(connection,tooLong,strlen(tooLong));
+				break;
+			}
+
+			char *larger = (char *) realloc(buffer,2*capacity);
+
+			if (larger == NULL) {
+				fprintf(stderr,"Unable to allocate memory to read jobs.\n");
+				break;
+			}
+
+			buffer = larger;
+			capacity *= 2;
+		}
+
+		ssize_t received = read(connection,buffer+length,capacity-length-1);
+
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (received <= 0) {
+			break;
+		}
+
+		length += received;
+		buffer[length] = '\0';
+
+		// Handle each complete line.
+		char *lineStart = buffer;
+		char *newLine;
+		bool closeConnection = false;
+
+		while (!closeConnection && (newLine = strchr(lineStart,'\n')) != NULL) {
+			*newLine = '\0';
+
+			if (*skipWhitespace(lineStart) != '\0') {
+				closeConnection = handleLine(lineStart,state,pool,connection) != 0;
+			}
+
+			lineStart = newLine + 1;
+		}
+
+		if (closeConnection) {
+			break;
+		}
+
+		// Keep any incomplete line.
+		length -= lineStart - buffer;
+		memmove(buffer,lineStart,length);
+	}
+
+	free(buffer);
+}
+
+/**
+ * Worker thread function.  Accepts connections and runs the jobs sent on them until the listening socket
+ * is shut down.
+ *
+ * @param arg Reference to the server_state.
+ *
+ * @return null.
+ */
+static void *serverWorker(void *arg) {
+	server_state *state = (server_state *) arg;
+	plane_buffer_pool pool = {NULL,0,0,0};
+
+	while (true) {
+		int connection = accept(state->listener,NULL,NULL);
+
+		if (connection < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+
+		handleConnection(state,&pool,connection);
+		close(connection);
+	}
+
+	freePlaneBufferPool(&pool);
+
+	return NULL;
+}
+
+/**
+ * Run f2j as a server, accepting conversion jobs on a Unix domain socket until a shutdown command is
+ * received.  See the description of this file for the job format.
+ *
+ * @param serverParameters Reference to batch_info structure giving the socket and the number of worker threads.
+ * @param argc Number of command line arguments the program was started with.
+ * @param argv Command line arguments the program was started with.  Options given here apply to every job,
+ * unless a job overrides them.
+ * @param options Reference to conversion_options structure holding the options parsed from argv.  Used as is by
+ * jobs without options of their own.
+ *
+ * @return 0 if the server ran and shut down successfully, 1 otherwise.
+ */
+int runServer(batch_info *serverParameters, int argc, char **argv, conversion_options *options) {
+	if (serverParameters == NULL || argv == NULL || options == NULL) {
+		fprintf(stderr,"Parameters to runServer cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	struct sockaddr_un address;
+	memset(&address,0,sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (strlen(serverParameters->socket) >= sizeof(address.sun_path)) {
+		fprintf(stderr,"Socket path is too long: %s\n",serverParameters->socket);
+		return 1;
+	}
+
+	strcpy(address.sun_path,serverParameters->socket);
+
+	// Remove a socket left behind by an earlier server, but never anything else.
+	struct stat fileInfo;
+
+	if (stat(serverParameters->socket,&fileInfo) == 0) {
+		if (!S_ISSOCK(fileInfo.st_mode)) {
+			fprintf(stderr,"%s exists and is not a socket.\n",serverParameters->socket);
+			return 1;
+		}
+
+		unlink(serverParameters->socket);
+	}
+
+	int threads = serverParameters->threads;
+
+	// CFITSIO can only be used from several threads at once if it was built to be reentrant.
+	if (threads > 1 && !fits_is_reentrant()) {
+		fprintf(stderr,"CFITSIO was not built to be reentrant, so jobs will be run one at a time.\n");
+		threads = 1;
+	}
+
+	// A client disconnecting before reading its reply must not stop the server.
+	signal(SIGPIPE,SIG_IGN);
+
+	server_state state;
+	state.argc = argc;
+	state.argv = argv;
+	state.options = options;
+	state.readThreads = serverParameters->readThreads > 0 ? serverParameters->readThreads : getAutomaticReadThreads(threads);
+	state.encodeThreads = serverParameters->encodeThreads > 0 ? serverParameters->encodeThreads : getAutomaticReadThreads(threads);
+	state.listener = socket(AF_UNIX,SOCK_STREAM,0);
+
+	if (state.listener < 0) {
+		fprintf(stderr,"Unable to create socket.\n");
+		return 1;
+	}
+
+	if (bind(state.listener,(struct sockaddr *) &address,sizeof(address)) != 0 || listen(state.listener,SOMAXCONN) != 0) {
+		fprintf(stderr,"Unable to listen on socket: %s\n",serverParameters->socket);
+		close(state.listener);
+		return 1;
+	}
+
+	fprintf(stdout,"Listening for conversion jobs on %s with %d worker thread(s).\n",serverParameters->socket,threads);
+	fflush(stdout);
+
+	pthread_t workers[threads];
+	int started = 0;
+
+	for (ii=0; ii<threads; ii++) {
+		if (pthread_create(&workers[started],NULL,serverWorker,&state) == 0) {
+			started++;
+		}
+	}
+
+	// Run jobs in this thread if no workers could be started.
+	if (started == 0) {
+		fprintf(stderr,"Unable to start worker threads, so jobs will be run one at a time.\n");
+		serverWorker(&state);
+	}
+
+	for (ii=0; ii<started; ii++) {
+		pthread_join(workers[ii],NULL);
+	}
+
+	close(state.listener);
+	unlink(serverParameters->socket);
+
+	return 0;
+}
@@ -0,0 +1,388 @@
+/**
+ * @file spectral.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Decorrelation of data cube planes along the spectral axis.
+ *
+ * Adjacent planes of a radio data cube are usually highly correlated.  When several planes are
+ * packed into the components of one JPEG 2000 image (see the -MC option), the functions in this
+ * file can transform the components along the spectral (component) axis before they are encoded,
+ * in the spirit of the multi-component transforms of JPEG 2000 Part 2.  Only the planes of a single
+ * image are transformed at once, so memory use is bounded by the number of planes per image rather
+ * than the depth of the cube.
+ *
+ * Both transforms are integer to integer and exactly reversible, so they can be used for lossless
+ * compression.  DPCM is open loop, so it is only used for lossless compression (see
+ * checkSpectralTransform).
+ */
+
+#include "f2j.h"
+
+/**
+ * Calculate the number of levels of the spectral wavelet transform that will actually be performed
+ * on an image with a given number of components.  Each level halves the number of low pass components,
+ * and the transform stops when only a single low pass component remains.
+ *
+ * @param numcomps Number of components (planes) in the image.
+ * @param levels Number of levels requested by the user.  0 means as many levels as possible.
+ *
+ * @return number of levels that will be performed.
+ */
+int getSpectralLevels(int numcomps, int levels) {
+	int possible = 0;
+	int length = numcomps;
+
+	while (length > 1) {
+		possible++;
+		length = (length+1)/2;
+	}
+
+	if (levels <= 0 || levels > possible) {
+		return possible;
+	}
+
+	return levels;
+}
+
+/**
+ * Get the name of a spectral transform, as used on the command line and in the metadata written
+ * to JPEG 2000 images.
+ *
+ * @param transform Spectral transform.
+ *
+ * @return name of the transform.
+ */
+const char *getSpectralTransformName(spectral_transform transform) {
+	if (transform == SPECTRAL_DPCM) {
+		return "DPCM";
+	}
+	else if (transform == SPECTRAL_DWT53) {
+		return "DWT53";
+	}
+
+	return "NONE";
+}
+
+/**
+ * Check that a spectral transform can be used with the given encoding parameters.  DPCM predicts each
+ * plane from the original (rather than the decoded) previous plane, so if the differences are encoded
+ * lossily their quantisation errors add up along the planes of each image when it is decoded.  DPCM is
+ * therefore only allowed when the images are encoded losslessly: with the reversible DWT 5-3, no rate,
+ * quality or fixed allocation below lossless and no adaptive rate control.  DWT53 does not accumulate
+ * errors in this way, so can be used with any encoding parameters.
+ *
+ * @param transform Spectral transform to perform.
+ * @param parameters JPEG 2000 compression parameters.
+ * @param rateControl Adaptive rate control.
+ *
+ * @return 0 if the transform can be used with the parameters, 1 otherwise.
+ */
+int checkSpectralTransform(spectral_transform transform, const opj_cparameters_t *parameters, const rate_control_info *rateControl) {
+	if (parameters == NULL || rateControl == NULL) {
+		fprintf(stderr,"Parameters to checkSpectralTransform cannot be null.\n");
+		return 1;
+	}
+
+	if (transform != SPECTRAL_DPCM) {
+		return 0;
+	}
+
+	// Loop variable
+	int ii;
+
+	bool lossless = !parameters->irreversible && !parameters->cp_fixed_alloc && rateControl->deadline <= 0.0 &&
+			rateControl->minPSNR <= 0.0 && rateControl->targetBPP <= 0.0;
+
+	for (ii=0; ii<parameters->tcp_numlayers && lossless; ii++) {
+		if ((parameters->cp_disto_alloc && parameters->tcp_rates[ii] > 0.0) ||
+				(parameters->cp_fixed_quality && parameters->tcp_distoratio[ii] > 0.0)) {
+			lossless = false;
+		}
+	}
+
+	if (!lossless) {
+		fprintf(stderr,"The DPCM spectral transform accumulates quantisation errors along the planes of each image, so can only be used for lossless encoding.  Use -spectral DWT53 with -r, -q, -f, -I or rate control.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Perform one level of the forward reversible 5-3 lifting transform along the component axis.  The
+ * components taking part are those with index start, start+step, start+2*step, ... (length of them).
+ * Low pass coefficients are left in the even positions of this sequence and high pass coefficients
+ * in the odd positions, as in the 'lazy' in place layout used by JPEG 2000.  Symmetric extension is
+ * used at the boundaries.
+ *
+ * Each lifting step runs over whole component arrays, so the inner loops stream through contiguous
+ * memory.
+ *
+ * @param comps Image components.
+ * @param step Distance between components taking part in this level.
+ * @param length Number of components taking part in this level.
+ * @param pixels Number of pixels in each component.
+ */
+static void forwardLifting53(opj_image_comp_t *comps, int step, int length, size_t pixels) {
+	int ii;
+	size_t kk;
+
+	// Predict step: odd samples become high pass coefficients.
+	for (ii=1; ii<length; ii+=2) {
+		int *d = comps[ii*step].data;
+		int *left = comps[(ii-1)*step].data;
+		int *right = (ii+1 < length) ? comps[(ii+1)*step].data : left;
+
+		for (kk=0; kk<pixels; kk++) {
+			d[kk] -= (left[kk] + right[kk]) >> 1;
+		}
+	}
+
+	// Update step: even samples become low pass coefficients.
+	for (ii=0; ii<length; ii+=2) {
+		int *s = comps[ii*step].data;
+		int *left = (ii > 0) ? comps[(ii-1)*step].data : NULL;
+		int *right = (ii+1 < length) ? comps[(ii+1)*step].data : NULL;
+
+		// Symmetric extension at the boundaries.
+		if (left == NULL) {
+			left = right;
+		}
+		if (right == NULL) {
+			right = left;
+		}
+
+		// A sequence of length 1 has no high pass coefficients to update from.
+		if (left == NULL) {
+			continue;
+		}
+
+		for (kk=0; kk<pixels; kk++) {
+			s[kk] += (left[kk] + right[kk] + 2) >> 2;
+		}
+	}
+}
+
+/**
+ * Invert one level of the reversible 5-3 lifting transform performed by forwardLifting53.
+ *
+ * @param comps Image components.
+ * @param step Distance between components taking part in this level.
+ * @param length Number of components taking part in this level.
+ * @param pixels Number of pixels in each component.
+ */
+static void inverseLifting53(opj_image_comp_t *comps, int step, int length, size_t pixels) {
+	int ii;
+	size_t kk;
+
+	// Undo update step.
+	for (ii=0; ii<length; ii+=2) {
+		int *s = comps[ii*step].data;
+		int *left = (ii > 0) ? comps[(ii-1)*step].data : NULL;
+		int *right = (ii+1 < length) ? comps[(ii+1)*step].data : NULL;
+
+		if (left == NULL) {
+			left = right;
+		}
+		if (right == NULL) {
+			right = left;
+		}
+
+		if (left == NULL) {
+			continue;
+		}
+
+		for (kk=0; kk<pixels; kk++) {
+			s[kk] -= (left[kk] + right[kk] + 2) >> 2;
+		}
+	}
+
+	// Undo predict step.
+	for (ii=1; ii<length; ii+=2) {
+		int *d = comps[ii*step].data;
+		int *left = comps[(ii-1)*step].data;
+		int *right = (ii+1 < length) ? comps[(ii+1)*step].data : left;
+
+		for (kk=0; kk<pixels; kk++) {
+			d[kk] += (left[kk] + right[kk]) >> 1;
+		}
+	}
+}
+
+/**
+ * Decorrelate the components of an image along the spectral axis.  Each component is assumed to hold one
+ * plane of a data cube, with consecutive components holding consecutive planes.
+ *
+ * After the transform, all components are marked as signed and their precision is set to the smallest
+ * value able to hold the transformed data.  Use spectralInverseTransform to recover the original planes.
+ *
+ * Very basic parameter checking is performed, but it is largely left to the calling function to ensure
+ * that parameters are valid and meaningful.
+ *
+ * @param image Image whose components should be transformed.  All components must have the same dimensions.
+ * @param transform Spectral transform to perform.
+ * @param levels Number of levels of the wavelet transform to perform (ignored for DPCM).  0 performs as many
+ * levels as possible.
+ *
+ * @return 0 if the transform was performed successfully, 1 otherwise.
+ */
+int spectralForwardTransform(opj_image_t *image, spectral_transform transform, int levels) {
+	if (image == NULL || image->comps == NULL) {
+		fprintf(stderr,"Image passed to spectralForwardTransform cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variables
+	int ii;
+	size_t kk;
+
+	int numcomps = image->numcomps;
+	size_t pixels = ((size_t) image->comps[0].w) * ((size_t) image->comps[0].h);
+
+	for (ii=1; ii<numcomps; ii++) {
+		if (image->comps[ii].w != image->comps[0].w || image->comps[ii].h != image->comps[0].h) {
+			fprintf(stderr,"All components must have the same dimensions to perform a spectral transform.\n");
+			return 1;
+		}
+	}
+
+	if (transform == SPECTRAL_DPCM) {
+		// Replace each plane by its difference from the previous plane.  Work backwards so each
+		// difference is taken against an untransformed plane.
+		for (ii=numcomps-1; ii>0; ii--) {
+			int *current = image->comps[ii].data;
+			int *previous = image->comps[ii-1].data;
+
+			for (kk=0; kk<pixels; kk++) {
+				current[kk] -= previous[kk];
+			}
+		}
+	}
+	else if (transform == SPECTRAL_DWT53) {
+		int level;
+		int step = 1;
+		int length = numcomps;
+
+		levels = getSpectralLevels(numcomps,levels);
+
+		for (level=0; level<levels; level++) {
+			forwardLifting53(image->comps,step,length,pixels);
+			step *= 2;
+			length = (length+1)/2;
+		}
+	}
+	else if (transform != SPECTRAL_NONE) {
+		fprintf(stderr,"Unknown spectral transform.\n");
+		return 1;
+	}
+	else {
+		return 0;
+	}
+
+	// Record the precision needed for each transformed component.
+	for (ii=0; ii<numcomps; ii++) {
+		int *data = image->comps[ii].data;
+		int min = 0;
+		int max = 0;
+
+		for (kk=0; kk<pixels; kk++) {
+			if (data[kk] < min) {
+				min = data[kk];
+			}
+			if (data[kk] > max) {
+				max = data[kk];
+			}
+		}
+
+		// Smallest signed precision holding [min,max].
+		int prec = 1;
+
+		while (min < -(1 << (prec-1)) || max > (1 << (prec-1)) - 1) {
+			prec++;
+		}
+
+		image->comps[ii].sgnd = 1;
+		image->comps[ii].prec = prec;
+		image->comps[ii].bpp = prec;
+	}
+
+	return 0;
+}
+
+/**
+ * Invert a spectral transform performed by spectralForwardTransform, recovering the original planes.  The
+ * number of components, transform and number of levels must match those used for the forward transform.
+ *
+ * @param image Image whose components should be transformed.  All components must have the same dimensions.
+ * @param transform Spectral transform that was performed.
+ * @param levels Number of levels of the wavelet transform requested when the forward transform was performed.
+ * @param prec Precision of the original planes.  Written to each component.
+ * @param sgnd Were the original planes signed?  Written to each component.
+ *
+ * @return 0 if the transform was inverted successfully, 1 otherwise.
+ */
+int spectralInverseTransform(opj_image_t *image, spectral_transform transform, int levels, int prec, int sgnd) {
+	if (image == NULL || image->comps == NULL) {
+		fprintf(stderr,"Image passed to spectralInverseTransform cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variables
+	int ii;
+	size_t kk;
+
+	int numcomps = image->numcomps;
+	size_t pixels = ((size_t) image->comps[0].w) * ((size_t) image->comps[0].h);
+
+	for (ii=1; ii<numcomps; ii++) {
+		if (image->comps[ii].w != image->comps[0].w || image->comps[ii].h != image->comps[0].h) {
+			fprintf(stderr,"All components must have the same dimensions to invert a spectral transform.\n");
+			return 1;
+		}
+	}
+
+	if (transform == SPECTRAL_DPCM) {
+		for (ii=1; ii<numcomps; ii++) {
+			int *current = image->comps[ii].data;
+			int *previous = image->comps[ii-1].data;
+
+			for (kk=0; kk<pixels; kk++) {
+				current[kk] += previous[kk];
+			}
+		}
+	}
+	else if (transform == SPECTRAL_DWT53) {
+		int level;
+
+		levels = getSpectralLevels(numcomps,levels);
+
+		// Undo the levels in reverse order.
+		for (level=levels-1; level>=0; level--) {
+			int step = 1 << level;
+			int length = numcomps;
+			int jj;
+
+			for (jj=0; jj<level; jj++) {
+				length = (length+1)/2;
+			}
+
+			inverseLifting53(image->comps,step,length,pixels);
+		}
+	}
+	else if (transform != SPECTRAL_NONE) {
+		fprintf(stderr,"Unknown spectral transform.\n");
+		return 1;
+	}
+	else {
+		return 0;
+	}
+
+	for (ii=0; ii<numcomps; ii++) {
+		image->comps[ii].sgnd = sgnd;
+		image->comps[ii].prec = prec;
+		image->comps[ii].bpp = prec;
+	}
+
+	return 0;
+}
@@ -0,0 +1,537 @@
+/**
+ * @file ssim.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Structural similarity (SSIM) and multi-scale structural similarity (MS-SSIM) quality benchmarks.
+ *
+ * The pointwise benchmarks (MSE, PSNR, MAE and the like) don't distinguish noise from the loss of structure
+ * such as faint sources or the sidelobes of a beam.  SSIM (Wang et al. 2004) compares the means, variances and
+ * covariance of the two images in a window around each pixel.  Here the window is an SSIM_WINDOW square box
+ * (as in the fast variants of SSIM, rather than a Gaussian), placed at every position inside the image, and
+ * SSIM is the mean over the positions.  MS-SSIM (Wang et al. 2003) combines the contrast and structure terms
+ * of up to SSIM_SCALES scales, each halving the images by 2x2 averaging, with the luminance term of the
+ * coarsest, using the weights of the paper (normalised over the scales that fit in the image).
+ *
+ * The sums over each window are taken from a summed-area table of the SSIM_WINDOW rows covering it: the
+ * column sums of those rows are updated as the window moves down (adding the row entering and subtracting
+ * the row leaving), and their prefix sums along the row give the sum over any window in O(1).  Integer
+ * pixels of up to 16 bits give exact sums in doubles.  The updates and the windows are computed two at a
+ * time with SSE2 where it is available, and the rows of window positions are split into bands computed on
+ * several threads.
+ */
+
+#include "f2j.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Width (and height) of the window over which SSIM is calculated, in pixels.  Smaller images use a window as
+ * large as they are.
+ */
+#define SSIM_WINDOW 8
+
+/**
+ * Largest number of scales combined by MS-SSIM.
+ */
+#define SSIM_SCALES 5
+
+/**
+ * Constants stabilising the luminance and contrast terms, as fractions of the dynamic range.
+ */
+#define SSIM_K1 0.01
+#define SSIM_K2 0.03
+
+/**
+ * Smallest number of rows of window positions given to each thread.
+ */
+#define SSIM_MIN_BAND_ROWS 32
+
+/**
+ * Number of sums taken over each window: x, y, x squared, y squared and x times y.
+ */
+#define SSIM_SUMS 5
+
+/**
+ * Weights of the scales of MS-SSIM, finest first.
+ */
+static const double scaleWeights[SSIM_SCALES] = {0.0448,0.2856,0.3001,0.2363,0.1333};
+
+/**
+ * Image compared at one scale: the integer pixels of a component at full resolution or the averages of a
+ * coarser scale.
+ */
+typedef struct {
+	const int *ints /** Pixels at full resolution, or null. */;
+	const double *doubles /** Pixels at a coarser scale, if ints is null. */;
+	long width /** Width of the image. */;
+	long height /** Height of the image. */;
+} ssim_plane;
+
+/**
+ * Band of rows of window positions, computed by one thread.
+ */
+typedef struct {
+	const ssim_plane *x /** Uncompressed image. */;
+	const ssim_plane *y /** Compressed image. */;
+	int window /** Width and height of the window. */;
+	long firstRow /** First row of window positions. */;
+	long lastRow /** Row after the last row of window positions. */;
+	double c1 /** Constant stabilising the luminance term. */;
+	double c2 /** Constant stabilising the contrast term. */;
+	double ssimSum /** Sum of SSIM over the positions of the band. */;
+	double csSum /** Sum of the contrast and structure term over the positions of the band. */;
+	int result /** 0 if the band was computed, 1 if memory couldn't be allocated. */;
+} ssim_band;
+
+/**
+ * Get a row of an image as doubles.
+ *
+ * @param plane Image.
+ * @param row Row to get.
+ * @param buffer Buffer of plane->width doubles, used if the image holds integers.
+ *
+ * @return The row.
+ */
+static const double *getPlaneRow(const ssim_plane *plane, long row, double *buffer) {
+	// Loop variable
+	long ii;
+
+	if (plane->ints == NULL) {
+		return plane->doubles + row * plane->width;
+	}
+
+	const int *pixels = plane->ints + row * plane->width;
+
+	for (ii=0; ii<plane->width; ii++) {
+		buffer[ii] = pixels[ii];
+	}
+
+	return buffer;
+}
+
+/**
+ * Add a row of both images to the column sums of the window, and optionally subtract another.
+ *
+ * @param sums Column sums of x, y, x squared, y squared and x times y.
+ * @param xAdd Row of the uncompressed image entering the window.
+ * @param yAdd Row of the compressed image entering the window.
+ * @param xSub Row of the uncompressed image leaving the window.  Null if no row leaves it.
+ * @param ySub Row of the compressed image leaving the window.
+ * @param width Width of the rows.
+ */
+static void updateColumnSums(double *sums[SSIM_SUMS], const double *xAdd, const double *yAdd, const double *xSub,
+		const double *ySub, long width) {
+	// Loop variable
+	long ii = 0;
+
+	if (xSub == NULL) {
+		for (ii=0; ii<width; ii++) {
+			sums[0][ii] += xAdd[ii];
+			sums[1][ii] += yAdd[ii];
+			sums[2][ii] += xAdd[ii] * xAdd[ii];
+			sums[3][ii] += yAdd[ii] * yAdd[ii];
+			sums[4][ii] += xAdd[ii] * yAdd[ii];
+		}
+
+		return;
+	}
+
+#ifdef __SSE2__
+	for (; ii+2<=width; ii+=2) {
+		__m128d xa = _mm_loadu_pd(xAdd+ii);
+		__m128d ya = _mm_loadu_pd(yAdd+ii);
+		__m128d xs = _mm_loadu_pd(xSub+ii);
+		__m128d ys = _mm_loadu_pd(ySub+ii);
+
+		_mm_storeu_pd(sums[0]+ii,_mm_add_pd(_mm_loadu_pd(sums[0]+ii),_mm_sub_pd(xa,xs)));
+		_mm_storeu_pd(sums[1]+ii,_mm_add_pd(_mm_loadu_pd(sums[1]+ii),_mm_sub_pd(ya,ys)));
+		_mm_storeu_pd(sums[2]+ii,_mm_add_pd(_mm_loadu_pd(sums[2]+ii),_mm_sub_pd(_mm_mul_pd(xa,xa),_mm_mul_pd(xs,xs))));
+		_mm_storeu_pd(sums[3]+ii,_mm_add_pd(_mm_loadu_pd(sums[3]+ii),_mm_sub_pd(_mm_mul_pd(ya,ya),_mm_mul_pd(ys,ys))));
+		_mm_storeu_pd(sums[4]+ii,_mm_add_pd(_mm_loadu_pd(sums[4]+ii),_mm_sub_pd(_mm_mul_pd(xa,ya),_mm_mul_pd(xs,ys))));
+	}
+#endif
+
+	for (; ii<width; ii++) {
+		sums[0][ii] += xAdd[ii] - xSub[ii];
+		sums[1][ii] += yAdd[ii] - ySub[ii];
+		sums[2][ii] += xAdd[ii] * xAdd[ii] - xSub[ii] * xSub[ii];
+		sums[3][ii] += yAdd[ii] * yAdd[ii] - ySub[ii] * ySub[ii];
+		sums[4][ii] += xAdd[ii] * yAdd[ii] - xSub[ii] * ySub[ii];
+	}
+}
+
+/**
+ * Calculate SSIM and its contrast and structure term over a row of window positions, from the prefix sums of
+ * the column sums of the window's rows.
+ *
+ * @param prefix Prefix sums (width+1 of each) of x, y, x squared, y squared and x times y.
+ * @param positions Number of window positions along the row.
+ * @param window Width and height of the window.
+ * @param c1 Constant stabilising the luminance term.
+ * @param c2 Constant stabilising the contrast term.
+ * @param ssimSum Reference to the sum of SSIM, to which the row is added.
+ * @param csSum Reference to the sum of the contrast and structure term, to which the row is added.
+ */
+static void sumWindowRow(double *prefix[SSIM_SUMS], long positions, int window, double c1, double c2, double *ssimSum, double *csSum) {
+	// Loop variable
+	long ii = 0;
+
+	double scale = 1.0 / ((double) window * window);
+	double ssim = 0.0;
+	double cs = 0.0;
+
+#ifdef __SSE2__
+	__m128d scaleVector = _mm_set1_pd(scale);
+	__m128d c1Vector = _mm_set1_pd(c1);
+	__m128d c2Vector = _mm_set1_pd(c2);
+	__m128d two = _mm_set1_pd(2.0);
+	__m128d ssimVector = _mm_setzero_pd();
+	__m128d csVector = _mm_setzero_pd();
+
+	for (; ii+2<=positions; ii+=2) {
+		__m128d mx = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(prefix[0]+ii+window),_mm_loadu_pd(prefix[0]+ii)),scaleVector);
+		__m128d my = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(prefix[1]+ii+window),_mm_loadu_pd(prefix[1]+ii)),scaleVector);
+		__m128d mxx = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(prefix[2]+ii+window),_mm_loadu_pd(prefix[2]+ii)),scaleVector);
+		__m128d myy = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(prefix[3]+ii+window),_mm_loadu_pd(prefix[3]+ii)),scaleVector);
+		__m128d mxy = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(prefix[4]+ii+window),_mm_loadu_pd(prefix[4]+ii)),scaleVector);
+
+		__m128d mxmy = _mm_mul_pd(mx,my);
+		__m128d mx2my2 = _mm_add_pd(_mm_mul_pd(mx,mx),_mm_mul_pd(my,my));
+		__m128d variances = _mm_sub_pd(_mm_add_pd(mxx,myy),mx2my2);
+		__m128d covariance = _mm_sub_pd(mxy,mxmy);
+
+		__m128d contrast = _mm_div_pd(_mm_add_pd(_mm_mul_pd(two,covariance),c2Vector),_mm_add_pd(variances,c2Vector));
+		__m128d luminance = _mm_div_pd(_mm_add_pd(_mm_mul_pd(two,mxmy),c1Vector),_mm_add_pd(mx2my2,c1Vector));
+
+		csVector = _mm_add_pd(csVector,contrast);
+		ssimVector = _mm_add_pd(ssimVector,_mm_mul_pd(luminance,contrast));
+	}
+
+	double lanes[2];
+	_mm_storeu_pd(lanes,ssimVector);
+	ssim = lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes,csVector);
+	cs = lanes[0] + lanes[1];
+#endif
+
+	for (; ii<positions; ii++) {
+		double mx = (prefix[0][ii+window] - prefix[0][ii]) * scale;
+		double my = (prefix[1][ii+window] - prefix[1][ii]) * scale;
+		double mxx = (prefix[2][ii+window] - prefix[2][ii]) * scale;
+		double myy = (prefix[3][ii+window] - prefix[3][ii]) * scale;
+		double mxy = (prefix[4][ii+window] - prefix[4][ii]) * scale;
+
+		double mx2my2 = mx * mx + my * my;
+		double contrast = (2.0 * (mxy - mx * my) + c2) / (mxx + myy - mx2my2 + c2);
+		double luminance = (2.0 * mx * my + c1) / (mx2my2 + c1);
+
+		cs += contrast;
+		ssim += luminance * contrast;
+	}
+
+	*ssimSum += ssim;
+	*csSum += cs;
+}
+
+/**
+ * Thread function computing SSIM over a band of rows of window positions.
+ *
+ * @param arg Reference to the ssim_band.
+ *
+ * @return Null.
+ */
+static void *computeSSIMBand(void *arg) {
+	ssim_band *band = (ssim_band *) arg;
+
+	// Loop variables
+	long ii,jj;
+	int kk;
+
+	long width = band->x->width;
+	int window = band->window;
+	long positions = width - window + 1;
+
+	band->ssimSum = 0.0;
+	band->csSum = 0.0;
+	band->result = 0;
+
+	// Column sums and their prefix sums, then buffers for the rows entering and leaving the window.
+	double *memory = (double *) calloc((size_t) SSIM_SUMS * (2 * width + 1) + 4 * width,sizeof(double));
+
+	if (memory == NULL) {
+		band->result = 1;
+		return NULL;
+	}
+
+	double *sums[SSIM_SUMS];
+	double *prefix[SSIM_SUMS];
+
+	for (kk=0; kk<SSIM_SUMS; kk++) {
+		sums[kk] = memory + kk * width;
+		prefix[kk] = memory + SSIM_SUMS * width + kk * (width + 1);
+	}
+
+	double *buffers = memory + SSIM_SUMS * (2 * width + 1);
+
+	for (ii=band->firstRow; ii<band->lastRow; ii++) {
+		if (ii == band->firstRow) {
+			for (jj=ii; jj<ii+window; jj++) {
+				updateColumnSums(sums,getPlaneRow(band->x,jj,buffers),getPlaneRow(band->y,jj,buffers+width),NULL,NULL,width);
+			}
+		}
+		else {
+			updateColumnSums(sums,getPlaneRow(band->x,ii+window-1,buffers),getPlaneRow(band->y,ii+window-1,buffers+width),
+					getPlaneRow(band->x,ii-1,buffers+2*width),getPlaneRow(band->y,ii-1,buffers+3*width),width);
+		}
+
+		for (kk=0; kk<SSIM_SUMS; kk++) {
+			double *columns = sums[kk];
+			double *row = prefix[kk];
+
+			for (jj=0; jj<width; jj++) {
+				row[jj+1] = row[jj] + columns[jj];
+			}
+		}
+
+		sumWindowRow(prefix,positions,window,band->c1,band->c2,&band->ssimSum,&band->csSum);
+	}
+
+	free(memory);
+
+	return NULL;
+}
+
+/**
+ * Calculate the mean SSIM and the mean of its contrast and structure term over the window positions of two
+ * images, splitting the rows of positions between threads.
+ *
+ * @param x Uncompressed image.
+ * @param y Compressed image, of the same size.
+ * @param window Width and height of the window.  At most the width and height of the images.
+ * @param c1 Constant stabilising the luminance term.
+ * @param c2 Constant stabilising the contrast term.
+ * @param threads Number of threads to use.
+ * @param ssim Reference to double which will hold the mean SSIM.
+ * @param cs Reference to double which will hold the mean contrast and structure term.
+ *
+ * @return 0 if successful, 1 if memory couldn't be allocated.
+ */
+static int computeSSIMScale(const ssim_plane *x, const ssim_plane *y, int window, double c1, double c2, int threads,
+		double *ssim, double *cs) {
+	// Loop variable
+	int ii;
+
+	long rows = x->height - window + 1;
+	int numBands = threads > 0 ? threads : 1;
+
+	if (numBands > rows / SSIM_MIN_BAND_ROWS) {
+		numBands = rows / SSIM_MIN_BAND_ROWS > 0 ? (int) (rows / SSIM_MIN_BAND_ROWS) : 1;
+	}
+
+	ssim_band bands[numBands];
+	pthread_t bandThreads[numBands];
+	bool started[numBands];
+
+	for (ii=0; ii<numBands; ii++) {
+		bands[ii].x = x;
+		bands[ii].y = y;
+		bands[ii].window = window;
+		bands[ii].firstRow = rows * ii / numBands;
+		bands[ii].lastRow = rows * (ii + 1) / numBands;
+		bands[ii].c1 = c1;
+		bands[ii].c2 = c2;
+	}
+
+	// The first band is computed by this thread.  If a thread can't be started, its band is computed here too.
+	for (ii=1; ii<numBands; ii++) {
+		started[ii] = pthread_create(&bandThreads[ii],NULL,computeSSIMBand,&bands[ii]) == 0;
+	}
+
+	computeSSIMBand(&bands[0]);
+
+	for (ii=1; ii<numBands; ii++) {
+		if (started[ii]) {
+			pthread_join(bandThreads[ii],NULL);
+		}
+		else {
+			computeSSIMBand(&bands[ii]);
+		}
+	}
+
+	double ssimSum = 0.0;
+	double csSum = 0.0;
+
+	for (ii=0; ii<numBands; ii++) {
+		if (bands[ii].result != 0) {
+			return 1;
+		}
+
+		ssimSum += bands[ii].ssimSum;
+		csSum += bands[ii].csSum;
+	}
+
+	double positions = (double) rows * (x->width - window + 1);
+
+	*ssim = ssimSum / positions;
+	*cs = csSum / positions;
+
+	return 0;
+}
+
+/**
+ * Halve an image by averaging each 2x2 block of pixels, for the next scale of MS-SSIM.  A last odd row or
+ * column is dropped.
+ *
+ * @param plane Image to halve.
+ * @param halved Reference to ssim_plane structure which will describe the halved image.  Its pixels are
+ * allocated by this function and should be freed by the caller.
+ *
+ * @return 0 if successful, 1 if memory couldn't be allocated.
+ */
+static int halvePlane(const ssim_plane *plane, ssim_plane *halved) {
+	// Loop variables
+	long ii,jj;
+
+	halved->ints = NULL;
+	halved->width = plane->width / 2;
+	halved->height = plane->height / 2;
+
+	double *pixels = (double *) malloc(sizeof(double) * (halved->width * halved->height + 2 * plane->width));
+
+	if (pixels == NULL) {
+		return 1;
+	}
+
+	double *buffers = pixels + halved->width * halved->height;
+
+	for (jj=0; jj<halved->height; jj++) {
+		const double *upper = getPlaneRow(plane,2*jj,buffers);
+		const double *lower = getPlaneRow(plane,2*jj+1,buffers+plane->width);
+		double *row = pixels + jj * halved->width;
+
+		for (ii=0; ii<halved->width; ii++) {
+			row[ii] = 0.25 * (upper[2*ii] + upper[2*ii+1] + lower[2*ii] + lower[2*ii+1]);
+		}
+	}
+
+	halved->doubles = pixels;
+
+	return 0;
+}
+
+/**
+ * Calculate the structural similarity of a compressed image component to the uncompressed one, and optionally
+ * the multi-scale structural similarity.
+ *
+ * @param uncompressed Pixels of the uncompressed component.
+ * @param compressed Pixels of the compressed component.
+ * @param width Width of the components.
+ * @param height Height of the components.
+ * @param prec Precision of the uncompressed component, giving the dynamic range of the pixels.
+ * @param multiScale Should MS-SSIM be calculated too?
+ * @param threads Number of threads to use.
+ * @param ssim Reference to double which will hold SSIM.
+ * @param msssim Reference to double which will hold MS-SSIM.  May be null if multiScale is false.
+ *
+ * @return 0 if successful, 1 otherwise.
+ */
+int computeStructuralSimilarity(int *uncompressed, int *compressed, long width, long height, int prec, bool multiScale, int threads,
+		double *ssim, double *msssim) {
+	if (uncompressed == NULL || compressed == NULL || ssim == NULL || (multiScale && msssim == NULL) || width < 1 || height < 1) {
+		fprintf(stderr,"Invalid parameters to computeStructuralSimilarity.\n");
+		return 1;
+	}
+
+	// Loop variables
+	int ii,jj;
+
+	int window = SSIM_WINDOW;
+
+	if (window > width) {
+		window = width;
+	}
+	if (window > height) {
+		window = height;
+	}
+
+	double range = ldexp(1.0,prec) - 1.0;
+	double c1 = (SSIM_K1 * range) * (SSIM_K1 * range);
+	double c2 = (SSIM_K2 * range) * (SSIM_K2 * range);
+
+	ssim_plane x = {uncompressed,NULL,width,height};
+	ssim_plane y = {compressed,NULL,width,height};
+	double cs[SSIM_SCALES];
+
+	if (computeSSIMScale(&x,&y,window,c1,c2,threads,ssim,&cs[0]) != 0) {
+		fprintf(stderr,"Unable to allocate memory to calculate SSIM.\n");
+		return 1;
+	}
+
+	if (!multiScale) {
+		return 0;
+	}
+
+	// Halve the images while they remain at least as large as the window.
+	int scales = 1;
+	double coarsestSSIM = *ssim;
+	int result = 0;
+
+	while (scales < SSIM_SCALES && x.width / 2 >= window && x.height / 2 >= window) {
+		ssim_plane halvedX, halvedY;
+
+		if (halvePlane(&x,&halvedX) != 0) {
+			result = 1;
+			break;
+		}
+
+		if (halvePlane(&y,&halvedY) != 0) {
+			free((double *) halvedX.doubles);
+			result = 1;
+			break;
+		}
+
+		if (scales > 1) {
+			free((double *) x.doubles);
+			free((double *) y.doubles);
+		}
+
+		x = halvedX;
+		y = halvedY;
+
+		if (computeSSIMScale(&x,&y,window,c1,c2,threads,&coarsestSSIM,&cs[scales]) != 0) {
+			result = 1;
+			scales++;
+			break;
+		}
+
+		scales++;
+	}
+
+	if (scales > 1) {
+		free((double *) x.doubles);
+		free((double *) y.doubles);
+	}
+
+	if (result != 0) {
+		fprintf(stderr,"Unable to allocate memory to calculate MS-SSIM.\n");
+		return 1;
+	}
+
+	// Weights of the scales used, normalised to sum to 1.  Negative terms (anticorrelated images) count as 0.
+	double weightSum = 0.0;
+
+	for (ii=0; ii<scales; ii++) {
+		weightSum += scaleWeights[ii];
+	}
+
+	*msssim = pow(fmax(coarsestSSIM,0.0),scaleWeights[scales-1] / weightSum);
+
+	for (jj=0; jj<scales-1; jj++) {
+		*msssim *= pow(fmax(cs[jj],0.0),scaleWeights[jj] / weightSum);
+	}
+
+	return 0;
+}
@@ -0,0 +1,1063 @@
+/**
+ * @file throughput.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Throughput benchmark of the conversion pipeline on synthetic FITS cubes (-throughput).
+ *
+ * benchmark.c measures the quality of the images written, not how fast they are written.  In benchmarking
+ * mode, f2j generates synthetic FITS cubes with CFITSIO (so that runs are reproducible and don't depend on
+ * archive data), then converts them with every combination of the settings in a matrix and writes a table
+ * of the throughput achieved by each: millions of pixels and megabytes of FITS data (uncompressed) per
+ * second, the peak resident set size of the process, the compression ratio and the throughput of decoding
+ * the images written.
+ *
+ * The matrix is given as a list of key=value[,value...] items separated by semicolons, e.g.
+ *
+ *   -throughput "bitpix=16,-32;size=2048;depth=8;transform=LINEAR,LOG;rate=0,20;threads=1,4;reader=plain,rice"
+ *
+ * Keys describing the synthetic cube (one value each unless noted):
+ * - bitpix: BITPIX of the cube (list; 8, 16, 32, 64, -32 or -64).  Default 16,-32.
+ * - size: width and height of each plane.  Default 1024.
+ * - depth: number of frames.  Default 4.
+ * - stokes: number of stokes.  Default 1.
+ * - mean, sigma: mean and standard deviation of the Gaussian background noise.  Defaults 1000 and 10.
+ * - seed: seed of the random number generator.  Default 1.
+ *
+ * Keys giving the matrix of settings (lists):
+ * - transform: transforms, as given to -A.  Default DEFAULT.
+ * - tile: tile width and height (0 for a single tile).  Default 0.
+ * - block: code-block width and height.  Default 64.
+ * - modes: mode switches: given (those given with -M, if any) or fast (adding those of -M_fast).
+ *   Default given.
+ * - rate: compression rates, as given to -r (0 for lossless).
+ * - psnr: target PSNRs, as given to -q.  If neither rate nor psnr is given, rates 0 and 20 are used.
+ * - threads: number of copies of the cube converted concurrently, each by its own thread.  Default 1.
+ * - reader: how the cube is read: plain (uncompressed), readahead (uncompressed, with -readahead 2), rice
+ *   (Rice tile-compressed, decompressed serially) or rice_parallel (decompressed by -read_threads threads,
+ *   chosen automatically).  Default plain.
+ *
+ * - decode: numbers of threads decoding each image written (from memory, with decodeJPEG2000Image in j2f.c),
+ *   reported as one row each.  0 doesn't decode.  Default 1.
+ *
+ * Other keys:
+ * - repeat: number of times each combination is run.  The fastest run is reported.  Default 1.
+ * - dir: directory in which the synthetic cubes and images are written.  By default, a temporary directory
+ *   is created (and removed afterwards).
+ *
+ * Options given on the command line besides -throughput (e.g. -n, -p, -MC) apply to every combination.
+ * The peak resident set size is reset before each combination on Linux (through /proc/self/clear_refs);
+ * elsewhere, it is the peak of the process so far.
+ */
+
+#include "f2j.h"
+
+#include <dirent.h>
+#include <sys/resource.h>
+
+/**
+ * Maximum number of values of each setting in the matrix.
+ */
+#define MAX_THROUGHPUT_VALUES 16
+
+/**
+ * Number of point sources added to each synthetic plane.
+ */
+#define SYNTHETIC_SOURCES 32
+
+/**
+ * Prefix of the names of files written by the benchmark.
+ */
+#define THROUGHPUT_FILE_PREFIX "f2j_bench_"
+
+/**
+ * Enumerated type defining how the synthetic cube is stored and read.
+ */
+typedef enum {
+	READER_PLAIN /** Uncompressed, read a plane at a time. */,
+	READER_READAHEAD /** Uncompressed, with planes read ahead of the plane being encoded. */,
+	READER_RICE /** Rice tile-compressed, decompressed by a single thread. */,
+	READER_RICE_PARALLEL /** Rice tile-compressed, decompressed by several threads. */
+} reader_mode;
+
+/**
+ * Names of the reader modes, in the order of reader_mode.
+ */
+static const char *readerModeNames[] = {"plain","readahead","rice","rice_parallel"};
+
+/**
+ * Structure describing the synthetic cube and the matrix of settings to benchmark.
+ */
+typedef struct {
+	int bitpix[MAX_THROUGHPUT_VALUES] /** BITPIX of each cube generated. */;
+	int numBitpix /** Number of BITPIX values. */;
+	long size /** Width and height of each plane. */;
+	long depth /** Number of frames. */;
+	long stokes /** Number of stokes. */;
+	double mean /** Mean of the background noise. */;
+	double sigma /** Standard deviation of the background noise. */;
+	unsigned long seed /** Seed of the random number generator. */;
+	transform transforms[MAX_THROUGHPUT_VALUES] /** Transforms to benchmark. */;
+	int numTransforms /** Number of transforms. */;
+	int tiles[MAX_THROUGHPUT_VALUES] /** Tile sizes to benchmark (0 for a single tile). */;
+	int numTiles /** Number of tile sizes. */;
+	int blocks[MAX_THROUGHPUT_VALUES] /** Code-block sizes to benchmark. */;
+	int numBlocks /** Number of code-block sizes. */;
+	bool fastModes[MAX_THROUGHPUT_VALUES] /** Mode switches to benchmark: true to add those of -M_fast, false for those given. */;
+	int numModes /** Number of sets of mode switches. */;
+	float rates[MAX_THROUGHPUT_VALUES] /** Compression rates to benchmark (0 for lossless). */;
+	int numRates /** Number of compression rates. */;
+	float psnrs[MAX_THROUGHPUT_VALUES] /** Target PSNRs to benchmark. */;
+	int numPSNRs /** Number of target PSNRs. */;
+	int threads[MAX_THROUGHPUT_VALUES] /** Numbers of copies converted concurrently. */;
+	int numThreads /** Number of thread counts. */;
+	reader_mode readers[MAX_THROUGHPUT_VALUES] /** Reader modes to benchmark. */;
+	int numReaders /** Number of reader modes. */;
+	int decodeThreads[MAX_THROUGHPUT_VALUES] /** Numbers of threads decoding each image written.  0 doesn't decode. */;
+	int numDecodeThreads /** Number of decoding thread counts. */;
+	int repeat /** Number of runs of each combination. */;
+	char directory[OPJ_PATH_LEN] /** Directory in which files are written.  Empty to create a temporary directory. */;
+} throughput_matrix;
+
+/**
+ * State shared by the threads converting the copies of a cube.
+ */
+typedef struct {
+	char **files /** Copies of the cube to convert. */;
+	int count /** Number of copies. */;
+	conversion_options *options /** Options used for every copy. */;
+	conversion_result *results /** Result of converting each copy. */;
+	int *statuses /** 0 if each copy was converted successfully, 1 otherwise. */;
+	int next /** Index of the next copy to convert. */;
+	pthread_mutex_t mutex /** Mutex protecting next. */;
+} throughput_queue;
+
+/**
+ * Split a comma separated list of values into an array of strings.  The list is modified.
+ *
+ * @param list List to split.
+ * @param values Array which will be populated with the values.
+ * @param key Key the list was given for, used in error messages.
+ *
+ * @return Number of values, or -1 if there are too many.
+ */
+static int splitValues(char *list, char **values, const char *key) {
+	int count = 0;
+	char *savePointer = NULL;
+	char *value;
+
+	for (value=strtok_r(list,",",&savePointer); value != NULL; value=strtok_r(NULL,",",&savePointer)) {
+		if (count == MAX_THROUGHPUT_VALUES) {
+			fprintf(stderr,"At most %d values can be given for %s (option -throughput).\n",MAX_THROUGHPUT_VALUES,key);
+			return -1;
+		}
+
+		values[count++] = value;
+	}
+
+	return count;
+}
+
+/**
+ * Parse the matrix of settings given to -throughput, starting from the defaults.
+ *
+ * @param specification List of key=value[,value...] items separated by semicolons.
+ * @param matrix Reference to throughput_matrix which will be populated.
+ *
+ * @return 0 if the specification is valid, 1 otherwise.
+ */
+static int parseThroughputMatrix(const char *specification, throughput_matrix *matrix) {
+	// Loop variable
+	int ii;
+
+	memset(matrix,0,sizeof(throughput_matrix));
+	matrix->size = 1024;
+	matrix->depth = 4;
+	matrix->stokes = 1;
+	matrix->mean = 1000.0;
+	matrix->sigma = 10.0;
+	matrix->seed = 1;
+	matrix->repeat = 1;
+
+	char copy[strlen(specification)+1];
+	strcpy(copy,specification);
+
+	char *savePointer = NULL;
+	char *item;
+
+	for (item=strtok_r(copy,";",&savePointer); item != NULL; item=strtok_r(NULL,";",&savePointer)) {
+		if (strcmp(item,"default") == 0) {
+			continue;
+		}
+
+		char *equals = strchr(item,'=');
+
+		if (equals == NULL) {
+			fprintf(stderr,"Settings (option -throughput) must be given as key=value[,value...]: %s\n",item);
+			return 1;
+		}
+
+		*equals = '\0';
+
+		char *key = item;
+		char *values[MAX_THROUGHPUT_VALUES];
+		int count = splitValues(equals+1,values,key);
+
+		if (count < 0) {
+			return 1;
+		}
+
+		if (count == 0) {
+			fprintf(stderr,"No value given for %s (option -throughput).\n",key);
+			return 1;
+		}
+
+		if (strcmp(key,"bitpix") == 0) {
+			for (ii=0; ii<count; ii++) {
+				matrix->bitpix[ii] = strtol(values[ii],NULL,10);
+
+				if (matrix->bitpix[ii] != BYTE_IMG && matrix->bitpix[ii] != SHORT_IMG && matrix->bitpix[ii] != LONG_IMG &&
+						matrix->bitpix[ii] != LONGLONG_IMG && matrix->bitpix[ii] != FLOAT_IMG && matrix->bitpix[ii] != DOUBLE_IMG) {
+					fprintf(stderr,"BITPIX (option -throughput) must be 8, 16, 32, 64, -32 or -64.\n");
+					return 1;
+				}
+			}
+			matrix->numBitpix = count;
+		}
+		else if (strcmp(key,"size") == 0 || strcmp(key,"depth") == 0 || strcmp(key,"stokes") == 0) {
+			long value = strtol(values[0],NULL,10);
+
+			if (value < 1) {
+				fprintf(stderr,"The %s of the synthetic cube (option -throughput) must be at least 1.\n",key);
+				return 1;
+			}
+
+			if (key[0] == 's' && key[1] == 'i') {
+				matrix->size = value;
+			}
+			else if (key[0] == 'd') {
+				matrix->depth = value;
+			}
+			else {
+				matrix->stokes = value;
+			}
+		}
+		else if (strcmp(key,"mean") == 0) {
+			matrix->mean = strtod(values[0],NULL);
+		}
+		else if (strcmp(key,"sigma") == 0) {
+			matrix->sigma = strtod(values[0],NULL);
+
+			if (matrix->sigma < 0.0) {
+				fprintf(stderr,"Standard deviation of the noise (option -throughput) cannot be negative.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(key,"seed") == 0) {
+			matrix->seed = strtoul(values[0],NULL,10);
+		}
+		else if (strcmp(key,"transform") == 0) {
+			for (ii=0; ii<count; ii++) {
+				if (parseTransform(values[ii],&matrix->transforms[ii]) != 0) {
+					fprintf(stderr,"Unknown transform (option -throughput): %s\n",values[ii]);
+					return 1;
+				}
+			}
+			matrix->numTransforms = count;
+		}
+		else if (strcmp(key,"tile") == 0) {
+			for (ii=0; ii<count; ii++) {
+				matrix->tiles[ii] = strtol(values[ii],NULL,10);
+
+				if (matrix->tiles[ii] < 0) {
+					fprintf(stderr,"Tile size (option -throughput) cannot be negative.\n");
+					return 1;
+				}
+			}
+			matrix->numTiles = count;
+		}
+		else if (strcmp(key,"block") == 0) {
+			for (ii=0; ii<count; ii++) {
+				matrix->blocks[ii] = strtol(values[ii],NULL,10);
+
+				// Same restriction as -b, for square code-blocks.
+				if (matrix->blocks[ii] < 4 || matrix->blocks[ii] > 64) {
+					fprintf(stderr,"Code-block size (option -throughput) must be between 4 and 64.\n");
+					return 1;
+				}
+			}
+			matrix->numBlocks = count;
+		}
+		else if (strcmp(key,"modes") == 0) {
+			for (ii=0; ii<count; ii++) {
+				if (strcasecmp(values[ii],"fast") == 0) {
+					matrix->fastModes[ii] = true;
+				}
+				else if (strcasecmp(values[ii],"given") == 0) {
+					matrix->fastModes[ii] = false;
+				}
+				else {
+					fprintf(stderr,"Mode switches (option -throughput) must be given or fast.\n");
+					return 1;
+				}
+			}
+			matrix->numModes = count;
+		}
+		else if (strcmp(key,"rate") == 0 || strcmp(key,"psnr") == 0) {
+			float *settings = key[0] == 'r' ? matrix->rates : matrix->psnrs;
+
+			for (ii=0; ii<count; ii++) {
+				settings[ii] = strtof(values[ii],NULL);
+
+				if (settings[ii] < 0.0f) {
+					fprintf(stderr,"Compression rate or PSNR (option -throughput) cannot be negative.\n");
+					return 1;
+				}
+			}
+
+			if (key[0] == 'r') {
+				matrix->numRates = count;
+			}
+			else {
+				matrix->numPSNRs = count;
+			}
+		}
+		else if (strcmp(key,"threads") == 0) {
+			for (ii=0; ii<count; ii++) {
+				matrix->threads[ii] = strtol(values[ii],NULL,10);
+
+				if (matrix->threads[ii] < 1) {
+					fprintf(stderr,"Number of threads (option -throughput) must be at least 1.\n");
+					return 1;
+				}
+			}
+			matrix->numThreads = count;
+		}
+		else if (strcmp(key,"reader") == 0) {
+			for (ii=0; ii<count; ii++) {
+				int jj;
+
+				for (jj=READER_PLAIN; jj<=READER_RICE_PARALLEL; jj++) {
+					if (strcasecmp(values[ii],readerModeNames[jj]) == 0) {
+						matrix->readers[ii] = (reader_mode) jj;
+						break;
+					}
+				}
+
+				if (jj > READER_RICE_PARALLEL) {
+					fprintf(stderr,"Reader mode (option -throughput) must be plain, readahead, rice or rice_parallel.\n");
+					return 1;
+				}
+			}
+			matrix->numReaders = count;
+		}
+		else if (strcmp(key,"decode") == 0) {
+			for (ii=0; ii<count; ii++) {
+				matrix->decodeThreads[ii] = strtol(values[ii],NULL,10);
+
+				if (matrix->decodeThreads[ii] < 0) {
+					fprintf(stderr,"Number of decoding threads (option -throughput) cannot be negative.\n");
+					return 1;
+				}
+			}
+			matrix->numDecodeThreads = count;
+		}
+		else if (strcmp(key,"repeat") == 0) {
+			matrix->repeat = strtol(values[0],NULL,10);
+
+			if (matrix->repeat < 1) {
+				fprintf(stderr,"Number of repeats (option -throughput) must be at least 1.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(key,"dir") == 0) {
+			strncpy(matrix->directory,values[0],sizeof(matrix->directory)-1);
+		}
+		else {
+			fprintf(stderr,"Unknown setting (option -throughput): %s\n",key);
+			return 1;
+		}
+	}
+
+	// Defaults for settings that weren't given.
+	if (matrix->numBitpix == 0) {
+		matrix->bitpix[matrix->numBitpix++] = SHORT_IMG;
+		matrix->bitpix[matrix->numBitpix++] = FLOAT_IMG;
+	}
+
+	if (matrix->numTransforms == 0) {
+		matrix->transforms[matrix->numTransforms++] = DEFAULT;
+	}
+
+	if (matrix->numTiles == 0) {
+		matrix->tiles[matrix->numTiles++] = 0;
+	}
+
+	if (matrix->numBlocks == 0) {
+		matrix->blocks[matrix->numBlocks++] = 64;
+	}
+
+	if (matrix->numModes == 0) {
+		matrix->fastModes[matrix->numModes++] = false;
+	}
+
+	if (matrix->numRates == 0 && matrix->numPSNRs == 0) {
+		matrix->rates[matrix->numRates++] = 0.0f;
+		matrix->rates[matrix->numRates++] = 20.0f;
+	}
+
+	if (matrix->numThreads == 0) {
+		matrix->threads[matrix->numThreads++] = 1;
+	}
+
+	if (matrix->numReaders == 0) {
+		matrix->readers[matrix->numReaders++] = READER_PLAIN;
+	}
+
+	if (matrix->numDecodeThreads == 0) {
+		matrix->decodeThreads[matrix->numDecodeThreads++] = 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the next value from a xorshift64* random number generator.  A private generator is used, rather than
+ * the one used to simulate noise, so that the synthetic cubes only depend on the seed.
+ *
+ * @param state Reference to the state of the generator.  Must not be 0.
+ *
+ * @return Uniformly distributed value in (0,1).
+ */
+static double nextUniform(unsigned long long *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return ((double) ((*state * 2685821657736338717ULL) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/**
+ * Get a normally distributed value, using the Box-Muller transform.
+ *
+ * @param state Reference to the state of the generator.
+ *
+ * @return Value with mean 0 and standard deviation 1.
+ */
+static double nextGaussian(unsigned long long *state) {
+	double u = nextUniform(state);
+	double v = nextUniform(state);
+
+	return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/**
+ * Write a synthetic FITS cube: Gaussian background noise, a gentle gradient and point sources whose
+ * brightness varies smoothly along the spectral axis, so that neighbouring planes are correlated as in
+ * real data cubes.  Values are clipped to the range of integer types.
+ *
+ * @param fileName Name of the file to write.  Overwritten if it exists.
+ * @param matrix Reference to throughput_matrix describing the cube.
+ * @param bitpix BITPIX of the cube.
+ * @param compressed Should the cube be stored as a Rice tile-compressed image?
+ *
+ * @return 0 if the cube was written successfully, 1 otherwise.
+ */
+static int writeSyntheticCube(const char *fileName, throughput_matrix *matrix, int bitpix, bool compressed) {
+	// Loop variables
+	long ii,jj,kk,ll;
+
+	// Image limits for integer types.
+	double minimum = -HUGE_VAL;
+	double maximum = HUGE_VAL;
+
+	switch (bitpix) {
+		case BYTE_IMG: minimum = 0.0; maximum = 255.0; break;
+		case SHORT_IMG: minimum = -32768.0; maximum = 32767.0; break;
+		case LONG_IMG: minimum = -2147483648.0; maximum = 2147483647.0; break;
+		case LONGLONG_IMG: minimum = -9.2e18; maximum = 9.2e18; break;
+	}
+
+	unsigned long long state = matrix->seed != 0 ? matrix->seed : 1;
+
+	// Position, width and peak brightness of each source.
+	double sourceX[SYNTHETIC_SOURCES];
+	double sourceY[SYNTHETIC_SOURCES];
+	double sourceWidth[SYNTHETIC_SOURCES];
+	double sourcePeak[SYNTHETIC_SOURCES];
+
+	for (ii=0; ii<SYNTHETIC_SOURCES; ii++) {
+		sourceX[ii] = nextUniform(&state) * matrix->size;
+		sourceY[ii] = nextUniform(&state) * matrix->size;
+		sourceWidth[ii] = 1.0 + 3.0 * nextUniform(&state);
+		sourcePeak[ii] = (5.0 + 95.0 * nextUniform(&state)) * (matrix->sigma > 0.0 ? matrix->sigma : 1.0);
+	}
+
+	size_t planeLength = (size_t) matrix->size * matrix->size;
+	double *plane = (double *) malloc(sizeof(double)*planeLength);
+
+	if (plane == NULL) {
+		fprintf(stderr,"Unable to allocate memory for synthetic FITS cube.\n");
+		return 1;
+	}
+
+	// The leading ! makes CFITSIO overwrite any existing file.
+	char url[strlen(fileName) + 16];
+	sprintf(url,"!%s%s",fileName,compressed ? "[compress R]" : "");
+
+	fitsfile *fptr = NULL;
+	int status = 0;
+	int naxis = matrix->stokes > 1 ? 4 : (matrix->depth > 1 ? 3 : 2);
+	long naxes[4] = {matrix->size,matrix->size,matrix->depth,matrix->stokes};
+
+	fits_create_file(&fptr,url,&status);
+	fits_create_img(fptr,bitpix,naxis,naxes,&status);
+
+	for (ll=1; ll<=matrix->stokes && status == 0; ll++) {
+		for (kk=1; kk<=matrix->depth && status == 0; kk++) {
+			// Background noise and gradient.
+			for (jj=0; jj<matrix->size; jj++) {
+				for (ii=0; ii<matrix->size; ii++) {
+					plane[jj*matrix->size + ii] = matrix->mean + matrix->sigma * (nextGaussian(&state) + 2.0 * ((double) (ii + jj)) / matrix->size);
+				}
+			}
+
+			// Sources, only computed within 5 widths of their centres.
+			double spectralScale = (1.0 + 0.5 * sin(2.0 * M_PI * kk / matrix->depth)) / ll;
+			long source;
+
+			for (source=0; source<SYNTHETIC_SOURCES; source++) {
+				long x0 = (long) (sourceX[source] - 5.0 * sourceWidth[source]);
+				long x1 = (long) (sourceX[source] + 5.0 * sourceWidth[source]);
+				long y0 = (long) (sourceY[source] - 5.0 * sourceWidth[source]);
+				long y1 = (long) (sourceY[source] + 5.0 * sourceWidth[source]);
+
+				for (jj=(y0 < 0 ? 0 : y0); jj<=y1 && jj<matrix->size; jj++) {
+					for (ii=(x0 < 0 ? 0 : x0); ii<=x1 && ii<matrix->size; ii++) {
+						double dx = ii - sourceX[source];
+						double dy = jj - sourceY[source];
+
+						plane[jj*matrix->size + ii] += spectralScale * sourcePeak[source] *
+								exp(-(dx*dx + dy*dy) / (2.0 * sourceWidth[source] * sourceWidth[source]));
+					}
+				}
+			}
+
+			for (ii=0; ii<(long) planeLength; ii++) {
+				if (plane[ii] < minimum) {
+					plane[ii] = minimum;
+				}
+				else if (plane[ii] > maximum) {
+					plane[ii] = maximum;
+				}
+			}
+
+			long fpixel[4] = {1,1,kk,ll};
+			fits_write_pix(fptr,TDOUBLE,fpixel,planeLength,plane,&status);
+		}
+	}
+
+	free(plane);
+
+	if (fptr != NULL) {
+		int closeStatus = 0;
+		fits_close_file(fptr,&closeStatus);
+
+		if (status == 0) {
+			status = closeStatus;
+		}
+	}
+
+	if (status != 0) {
+		fprintf(stderr,"Unable to write synthetic FITS cube: %s\n",fileName);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Remove the files written by the benchmark from a directory.
+ *
+ * @param directory Directory to clean up.
+ * @param keepFITS Should the synthetic FITS cubes be kept (so that only the images written are removed)?
+ */
+static void removeThroughputFiles(const char *directory, bool keepFITS) {
+	DIR *dir = opendir(directory);
+
+	if (dir == NULL) {
+		return;
+	}
+
+	struct dirent *entry;
+
+	while ((entry = readdir(dir)) != NULL) {
+		size_t length = strlen(entry->d_name);
+
+		if (strncmp(entry->d_name,THROUGHPUT_FILE_PREFIX,strlen(THROUGHPUT_FILE_PREFIX)) != 0) {
+			continue;
+		}
+
+		if (keepFITS && length > 5 && strcmp(entry->d_name + length - 5,".fits") == 0) {
+			continue;
+		}
+
+		char path[strlen(directory) + length + 2];
+		sprintf(path,"%s/%s",directory,entry->d_name);
+		unlink(path);
+	}
+
+	closedir(dir);
+}
+
+/**
+ * Reset the peak resident set size of the process, where the operating system allows it (Linux).
+ */
+static void resetPeakMemory() {
+	FILE *clearRefs = fopen("/proc/self/clear_refs","w");
+
+	if (clearRefs != NULL) {
+		fputs("5",clearRefs);
+		fclose(clearRefs);
+	}
+}
+
+/**
+ * Get the peak resident set size of the process.
+ *
+ * @return Peak resident set size in kilobytes.
+ */
+static long getPeakMemory() {
+	FILE *statusFile = fopen("/proc/self/status","r");
+
+	if (statusFile != NULL) {
+		char line[256];
+		long peak = -1;
+
+		while (fgets(line,sizeof(line),statusFile) != NULL) {
+			if (strncmp(line,"VmHWM:",6) == 0) {
+				peak = strtol(line+6,NULL,10);
+				break;
+			}
+		}
+
+		fclose(statusFile);
+
+		if (peak >= 0) {
+			return peak;
+		}
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF,&usage);
+
+	return usage.ru_maxrss;
+}
+
+/**
+ * Worker thread function.  Converts copies of the cube from the queue until there are none left.
+ *
+ * @param arg Reference to the throughput_queue.
+ *
+ * @return Null.
+ */
+static void *throughputWorker(void *arg) {
+	throughput_queue *queue = (throughput_queue *) arg;
+	plane_buffer_pool pool = {NULL,0,0,0};
+
+	while (true) {
+		pthread_mutex_lock(&queue->mutex);
+		int index = queue->next++;
+		pthread_mutex_unlock(&queue->mutex);
+
+		if (index >= queue->count) {
+			break;
+		}
+
+		queue->statuses[index] = convertFITSFile(queue->files[index],queue->options,&pool,&queue->results[index]);
+	}
+
+	freePlaneBufferPool(&pool);
+
+	return NULL;
+}
+
+/**
+ * Convert copies of a cube concurrently, one thread per copy.
+ *
+ * @param files Copies of the cube to convert.
+ * @param count Number of copies (and threads).
+ * @param options Reference to conversion_options structure specifying how each copy is converted.
+ * @param seconds Reference to double which will be set to the wall clock time taken.
+ * @param compressedSize Reference which will be set to the total size of the images written.
+ * @param firstResult Reference to conversion_result structure which will be set to the result of converting the
+ * first copy, including the images written.  Free with freeConversionResult.
+ *
+ * @return 0 if every copy was converted successfully, 1 otherwise.
+ */
+static int convertCopies(char **files, int count, conversion_options *options, double *seconds, off_t *compressedSize,
+		conversion_result *firstResult) {
+	// Loop variable
+	int ii;
+
+	conversion_result results[count];
+	int statuses[count];
+
+	for (ii=0; ii<count; ii++) {
+		memset(&results[ii],0,sizeof(conversion_result));
+		statuses[ii] = 1;
+	}
+
+	// The images of the first copy are decoded afterwards.
+	results[0].recordImages = true;
+
+	throughput_queue queue;
+	queue.files = files;
+	queue.count = count;
+	queue.options = options;
+	queue.results = results;
+	queue.statuses = statuses;
+	queue.next = 0;
+	pthread_mutex_init(&queue.mutex,NULL);
+
+	double startTime = getWallClockTime();
+
+	if (count == 1) {
+		throughputWorker(&queue);
+	}
+	else {
+		pthread_t workers[count];
+		int started = 0;
+
+		for (ii=0; ii<count; ii++) {
+			if (pthread_create(&workers[started],NULL,throughputWorker,&queue) == 0) {
+				started++;
+			}
+		}
+
+		if (started == 0) {
+			throughputWorker(&queue);
+		}
+
+		for (ii=0; ii<started; ii++) {
+			pthread_join(workers[ii],NULL);
+		}
+	}
+
+	*seconds = getWallClockTime() - startTime;
+
+	pthread_mutex_destroy(&queue.mutex);
+
+	int failed = 0;
+	*compressedSize = 0;
+
+	for (ii=0; ii<count; ii++) {
+		*compressedSize += results[ii].rate.outputs[RATE_IMAGE].bytes;
+		failed += statuses[ii] != 0;
+	}
+
+	*firstResult = results[0];
+
+	return failed == 0 ? 0 : 1;
+}
+
+/**
+ * Decode the images written for a copy of the cube from memory, timing only the decoding.
+ *
+ * @param result Reference to conversion_result structure recording the images written.
+ * @param threads Number of threads decoding each image.
+ * @param seconds Reference to double which will be set to the wall clock time spent decoding.
+ * @param pixels Reference to double which will be set to the number of pixels decoded.
+ *
+ * @return 0 if every image was decoded successfully, 1 otherwise.
+ */
+static int decodeImages(conversion_result *result, int threads, double *seconds, double *pixels) {
+	// Loop variable
+	long ii;
+
+	decode_options decode = {0,0,{REGION_NONE,0.0,0.0,0.0,0.0},threads};
+
+	*seconds = 0.0;
+	*pixels = 0.0;
+
+	for (ii=0; ii<result->images; ii++) {
+		unsigned char *data = NULL;
+		size_t length;
+		OPJ_CODEC_FORMAT codec;
+		opj_image_t *image = NULL;
+
+		if (readJPEG2000File(result->imageResults[ii].file,&data,&length,&codec) != 0) {
+			return 1;
+		}
+
+		double startTime = getWallClockTime();
+		int status = decodeJPEG2000Image(data,length,codec,&decode,&image);
+		*seconds += getWallClockTime() - startTime;
+
+		free(data);
+
+		if (status != 0) {
+			return 1;
+		}
+
+		*pixels += (double) image->comps[0].w * image->comps[0].h * image->numcomps;
+		opj_image_destroy(image);
+	}
+
+	return 0;
+}
+
+/**
+ * Run the throughput benchmark: generate synthetic FITS cubes, convert them with every combination of the
+ * settings in the matrix and write a table of the throughput achieved to stdout.
+ *
+ * @param specification Matrix of settings given to -throughput (see the description of this file).
+ * @param options Reference to conversion_options structure specifying the options common to every combination.
+ *
+ * @return 0 if every combination was converted successfully, 1 otherwise.
+ */
+int runThroughputBenchmark(const char *specification, conversion_options *options) {
+	if (specification == NULL || options == NULL) {
+		fprintf(stderr,"Parameters to runThroughputBenchmark cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variables
+	int bb,rr,tt,ss,cc,qq,hh,dd,ii;
+
+	throughput_matrix matrix;
+
+	if (parseThroughputMatrix(specification,&matrix) != 0) {
+		return 1;
+	}
+
+	// Directory in which to write the cubes and images.
+	char directory[OPJ_PATH_LEN];
+	bool temporaryDirectory = matrix.directory[0] == '\0';
+
+	if (temporaryDirectory) {
+		const char *tmp = getenv("TMPDIR");
+		snprintf(directory,sizeof(directory),"%s/f2j_throughput_XXXXXX",tmp != NULL && tmp[0] != '\0' ? tmp : "/tmp");
+
+		if (mkdtemp(directory) == NULL) {
+			fprintf(stderr,"Unable to create a temporary directory for the throughput benchmark.\n");
+			return 1;
+		}
+	}
+	else {
+		strcpy(directory,matrix.directory);
+	}
+
+	// The most copies converted at once.
+	int maxThreads = 1;
+
+	for (ii=0; ii<matrix.numThreads; ii++) {
+		if (matrix.threads[ii] > maxThreads) {
+			maxThreads = matrix.threads[ii];
+		}
+	}
+
+	char *files[maxThreads];
+	size_t fileNameLength = strlen(directory) + strlen(THROUGHPUT_FILE_PREFIX) + 64;
+
+	for (ii=0; ii<maxThreads; ii++) {
+		files[ii] = (char *) malloc(fileNameLength);
+
+		if (files[ii] == NULL) {
+			fprintf(stderr,"Unable to allocate memory for the throughput benchmark.\n");
+			while (--ii >= 0) {
+				free(files[ii]);
+			}
+			return 1;
+		}
+	}
+
+	long planes = matrix.depth * matrix.stokes;
+	double pixels = (double) matrix.size * matrix.size * planes;
+
+	fprintf(stdout,"Synthetic cube: %ldx%ldx%ldx%ld, background mean %f, sigma %f, %d sources, seed %lu, in %s\n",
+			matrix.size,matrix.size,matrix.depth,matrix.stokes,matrix.mean,matrix.sigma,SYNTHETIC_SOURCES,matrix.seed,directory);
+	fprintf(stdout,"[BITPIX] [reader] [transform] [tile] [code-block] [modes] [rate/quality] [threads] [Mpixels/s] [MB/s] [peak RSS (MB)] [compression ratio] [decode threads] [decode Mpixels/s] [status]\n");
+
+	int failed = 0;
+
+	for (bb=0; bb<matrix.numBitpix; bb++) {
+		int bitpix = matrix.bitpix[bb];
+		double rawBytes = pixels * abs(bitpix) / 8;
+
+		// Has the cube been generated uncompressed and tile-compressed for this BITPIX?
+		bool generated[2] = {false,false};
+
+		for (rr=0; rr<matrix.numReaders; rr++) {
+			reader_mode reader = matrix.readers[rr];
+			int compressed = reader == READER_RICE || reader == READER_RICE_PARALLEL;
+
+			for (ii=0; ii<maxThreads; ii++) {
+				snprintf(files[ii],fileNameLength,"%s/%s%d_%s_%d.fits",directory,THROUGHPUT_FILE_PREFIX,bitpix,compressed ? "rice" : "plain",ii);
+			}
+
+			if (!generated[compressed]) {
+				if (writeSyntheticCube(files[0],&matrix,bitpix,compressed) != 0) {
+					failed++;
+					continue;
+				}
+
+				// Each thread converts its own copy, so that the images written have different names.
+				for (ii=1; ii<maxThreads; ii++) {
+					unlink(files[ii]);
+
+					if (link(files[0],files[ii]) != 0 && symlink(files[0],files[ii]) != 0) {
+						fprintf(stderr,"Unable to copy synthetic FITS cube to %s.\n",files[ii]);
+						break;
+					}
+				}
+
+				if (ii < maxThreads) {
+					failed++;
+					continue;
+				}
+
+				generated[compressed] = true;
+			}
+
+			for (tt=0; tt<matrix.numTransforms; tt++) {
+				for (ss=0; ss<matrix.numTiles; ss++) {
+					// Each code-block size is benchmarked with each set of mode switches.
+					for (cc=0; cc<matrix.numBlocks * matrix.numModes; cc++) {
+						int block = matrix.blocks[cc / matrix.numModes];
+						bool fastModes = matrix.fastModes[cc % matrix.numModes];
+
+						for (qq=0; qq<matrix.numRates + matrix.numPSNRs; qq++) {
+							for (hh=0; hh<matrix.numThreads; hh++) {
+								int threads = matrix.threads[hh];
+
+								conversion_options caseOptions = *options;
+								caseOptions.transform = matrix.transforms[tt];
+								caseOptions.compressionBenchmark = true;
+								caseOptions.hdus.all = false;
+								caseOptions.hdus.count = 0;
+								caseOptions.hduThreads = 1;
+								caseOptions.readahead = reader == READER_READAHEAD ? 2 : 0;
+								caseOptions.readThreads = reader == READER_RICE_PARALLEL ? getAutomaticReadThreads(threads) : 1;
+								caseOptions.encodeThreads = getAutomaticReadThreads(threads);
+
+								opj_cparameters_t *parameters = &caseOptions.parameters;
+
+								if (matrix.tiles[ss] > 0) {
+									parameters->cp_tdx = matrix.tiles[ss];
+									parameters->cp_tdy = matrix.tiles[ss];
+									parameters->tile_size_on = OPJ_TRUE;
+								}
+								else {
+									parameters->tile_size_on = OPJ_FALSE;
+								}
+
+								parameters->cblockw_init = block;
+								parameters->cblockh_init = block;
+								if (fastModes) {
+									parameters->mode |= FAST_MODE_SWITCHES;
+								}
+								parameters->tcp_numlayers = 1;
+
+								char setting[32];
+
+								if (qq < matrix.numRates) {
+									parameters->tcp_rates[0] = matrix.rates[qq];
+									parameters->cp_disto_alloc = 1;
+									parameters->cp_fixed_quality = 0;
+									snprintf(setting,sizeof(setting),"r%g",matrix.rates[qq]);
+								}
+								else {
+									parameters->tcp_distoratio[0] = matrix.psnrs[qq - matrix.numRates];
+									parameters->cp_disto_alloc = 0;
+									parameters->cp_fixed_quality = 1;
+									snprintf(setting,sizeof(setting),"q%g",matrix.psnrs[qq - matrix.numRates]);
+								}
+
+								char combination[256];
+
+								snprintf(combination,sizeof(combination),"%d %s %s %d %d %s %s %d",bitpix,readerModeNames[reader],
+										getTransformName(matrix.transforms[tt]),matrix.tiles[ss],block,fastModes ? "fast" : "given",setting,threads);
+
+								// CFITSIO can only be used from several threads at once if it was built to be reentrant.
+								if (threads > 1 && !fits_is_reentrant()) {
+									fprintf(stdout,"%s 0 0 0 0 0 0 SKIPPED\n",combination);
+									fflush(stdout);
+									continue;
+								}
+
+								double bestSeconds = HUGE_VAL;
+								double bestDecodeSeconds[matrix.numDecodeThreads];
+								double decodedPixels = 0.0;
+								off_t compressedSize = 0;
+								int status = 0;
+
+								for (dd=0; dd<matrix.numDecodeThreads; dd++) {
+									bestDecodeSeconds[dd] = HUGE_VAL;
+								}
+
+								resetPeakMemory();
+
+								for (ii=0; ii<matrix.repeat && status == 0; ii++) {
+									double seconds;
+									conversion_result firstResult;
+
+									status = convertCopies(files,threads,&caseOptions,&seconds,&compressedSize,&firstResult);
+
+									if (seconds < bestSeconds) {
+										bestSeconds = seconds;
+									}
+
+									// Decode the images of the first copy with each number of threads.
+									for (dd=0; dd<matrix.numDecodeThreads && status == 0; dd++) {
+										if (matrix.decodeThreads[dd] > 0) {
+											double decodeSeconds;
+
+											status = decodeImages(&firstResult,matrix.decodeThreads[dd],&decodeSeconds,&decodedPixels);
+
+											if (decodeSeconds < bestDecodeSeconds[dd]) {
+												bestDecodeSeconds[dd] = decodeSeconds;
+											}
+										}
+									}
+
+									freeConversionResult(&firstResult);
+									removeThroughputFiles(directory,true);
+								}
+
+								long peakMemory = getPeakMemory();
+
+								for (dd=0; dd<matrix.numDecodeThreads; dd++) {
+									if (status != 0) {
+										fprintf(stdout,"%s 0 0 %f 0 %d 0 FAILED\n",combination,peakMemory/1024.0,matrix.decodeThreads[dd]);
+									}
+									else {
+										fprintf(stdout,"%s %f %f %f %f %d %f OK\n",combination,pixels*threads/bestSeconds/1.0e6,
+												rawBytes*threads/bestSeconds/1.0e6,peakMemory/1024.0,((double) compressedSize)/(rawBytes*threads),
+												matrix.decodeThreads[dd],matrix.decodeThreads[dd] > 0 ? decodedPixels/bestDecodeSeconds[dd]/1.0e6 : 0.0);
+									}
+								}
+
+								failed += status != 0;
+								fflush(stdout);
+							}
+						}
+					}
+				}
+			}
+		}
+
+		// Only keep the cubes for one BITPIX at a time.
+		removeThroughputFiles(directory,false);
+	}
+
+	for (ii=0; ii<maxThreads; ii++) {
+		free(files[ii]);
+	}
+
+	if (temporaryDirectory) {
+		rmdir(directory);
+	}
+
+	return failed == 0 ? 0 : 1;
+}
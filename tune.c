@@ -0,0 +1,873 @@
+/**
+ * @file tune.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Auto-tuner of the compression parameters for a class of data (-tune).
+ *
+ * The best code-block size, number of resolutions, mode switches, tiling, progression order and
+ * precincts depend on the data: the noise, the structure and the size of the planes.  In tuning mode,
+ * f2j reads a few evenly spaced planes of the FITS file given by -i (which should be typical of the data
+ * to be converted) and encodes each with every set of parameters in a search space, measuring the CPU
+ * time taken to encode and decode each image, its compression ratio and its PSNR.  The sets are run in
+ * parallel, each image being encoded and decoded by a single thread.  A table of every set is written to
+ * stdout, marking the sets on the Pareto frontier (those for which no other set is at least as good by
+ * every measure, and better by one), and the set recommended for the goal given is written as a
+ * parameter profile (see params.c), to be loaded with -params when converting the data.
+ *
+ * The search space is given as a list of key=value[,value...] items separated by semicolons, e.g.
+ *
+ *   -tune "block=32,64;resolutions=4,5,6;mode=0,1;progression=LRCP,RPCL;goal=speed"
+ *
+ * Keys giving the search space (lists):
+ * - block: code-block width and height.  Default 32,64.
+ * - resolutions: number of resolutions.  Default 4,6.  Values too large for the planes (or tiles) are skipped.
+ * - mode: mode switches, as the sum of the values given to -M.  Default 0,1.
+ * - tile: tile width and height (0 for a single tile).  Default 0,512.
+ * - progression: progression orders.  Default LRCP,RPCL.
+ * - precinct: precinct width and height of every resolution (0 for none).  Default 0.
+ * - wavelet: 53 or 97.  Default 53.  The 9-7 wavelet is skipped for lossless compression.
+ *
+ * Other keys:
+ * - planes: number of planes sampled.  Default 4.
+ * - threads: number of images encoded concurrently.  Default: the number of online processors.
+ * - goal: speed (the fastest set to encode and decode), ratio (the smallest images) or balanced (the
+ *   fastest set whose images are within tolerance per cent of the smallest and, if lossy, within 0.5 dB
+ *   of the best PSNR).  Only sets on the Pareto frontier are recommended.  Default balanced.
+ * - tolerance: tolerance on the compression ratio for the balanced goal, in per cent.  Default 2.
+ * - out: parameter profile to save the recommended set to, as file[:name].  Default f2j_tuned.params, with the
+ *   profile named tuned.  Other profiles in the file are kept.
+ * - dir: directory in which the images are written.  By default, a temporary directory is created (and
+ *   removed afterwards).
+ *
+ * Options given on the command line besides -tune (e.g. -r, -q, -A, -region) apply to every set.
+ */
+
+#include "f2j.h"
+
+#include <limits.h>
+
+/**
+ * Maximum number of values of each setting in the search space.
+ */
+#define MAX_TUNE_VALUES 16
+
+/**
+ * Maximum number of sets of parameters in the search space.
+ */
+#define MAX_TUNE_SETS 1024
+
+/**
+ * Prefix of the names of files written by the tuner.
+ */
+#define TUNE_FILE_PREFIX "f2j_tune_"
+
+/**
+ * Enumerated type defining the goal of tuning.
+ */
+typedef enum {
+	GOAL_BALANCED /** Fast, with images close to the smallest. */,
+	GOAL_SPEED /** Fastest to encode and decode. */,
+	GOAL_RATIO /** Smallest images. */
+} tune_goal;
+
+/**
+ * Names of the goals, in the order of tune_goal.
+ */
+static const char *goalNames[] = {"balanced","speed","ratio"};
+
+/**
+ * Structure describing the search space and how it is explored.
+ */
+typedef struct {
+	int blocks[MAX_TUNE_VALUES] /** Code-block sizes. */;
+	int numBlocks /** Number of code-block sizes. */;
+	int resolutions[MAX_TUNE_VALUES] /** Numbers of resolutions. */;
+	int numResolutions /** Number of numbers of resolutions. */;
+	int modes[MAX_TUNE_VALUES] /** Mode switches. */;
+	int numModes /** Number of mode switches. */;
+	int tiles[MAX_TUNE_VALUES] /** Tile sizes (0 for a single tile). */;
+	int numTiles /** Number of tile sizes. */;
+	OPJ_PROG_ORDER progressions[MAX_TUNE_VALUES] /** Progression orders. */;
+	int numProgressions /** Number of progression orders. */;
+	int precincts[MAX_TUNE_VALUES] /** Precinct sizes (0 for none). */;
+	int numPrecincts /** Number of precinct sizes. */;
+	int wavelets[MAX_TUNE_VALUES] /** Wavelets (0 for 5-3, 1 for 9-7). */;
+	int numWavelets /** Number of wavelets. */;
+	int planes /** Number of planes sampled. */;
+	int threads /** Number of images encoded concurrently. */;
+	tune_goal goal /** Goal of tuning. */;
+	double tolerance /** Tolerance on the compression ratio for the balanced goal, in per cent. */;
+	char output[OPJ_PATH_LEN] /** File to write the recommended parameter profile to. */;
+	char directory[OPJ_PATH_LEN] /** Directory in which images are written.  Empty to create a temporary directory. */;
+} tune_space;
+
+/**
+ * Structure holding a set of parameters and the measurements made with it.
+ */
+typedef struct {
+	opj_cparameters_t parameters /** Compression parameters. */;
+	double encodeSeconds /** CPU time taken to encode the sampled planes. */;
+	double decodeSeconds /** CPU time taken to decode the sampled planes. */;
+	rate_account rate /** Size of the images. */;
+	double psnr /** Lowest PSNR of the sampled planes.  Infinite if lossless. */;
+	int failures /** Number of sampled planes that couldn't be encoded or decoded. */;
+	bool pareto /** Is the set on the Pareto frontier? */;
+} tune_set;
+
+/**
+ * State shared by the threads encoding the sampled planes.
+ */
+typedef struct {
+	tune_set *sets /** Sets of parameters. */;
+	int numSets /** Number of sets. */;
+	opj_image_t *samples /** Sampled planes.  Only read by the encoder, so shared by the threads. */;
+	int numSamples /** Number of sampled planes. */;
+	const char *directory /** Directory in which images are written. */;
+	int next /** Index of the next image (set and sampled plane) to encode. */;
+	pthread_mutex_t mutex /** Mutex protecting next and the measurements of each set. */;
+} tune_queue;
+
+/**
+ * Split a comma separated list of values into an array of strings.  The list is modified.
+ *
+ * @param list List to split.
+ * @param values Array which will be populated with the values.
+ * @param key Key the list was given for, used in error messages.
+ *
+ * @return Number of values, or -1 if there are too many.
+ */
+static int splitTuneValues(char *list, char **values, const char *key) {
+	int count = 0;
+	char *savePointer = NULL;
+	char *value;
+
+	for (value=strtok_r(list,",",&savePointer); value != NULL; value=strtok_r(NULL,",",&savePointer)) {
+		if (count == MAX_TUNE_VALUES) {
+			fprintf(stderr,"At most %d values can be given for %s (option -tune).\n",MAX_TUNE_VALUES,key);
+			return -1;
+		}
+
+		values[count++] = value;
+	}
+
+	return count;
+}
+
+/**
+ * Parse a list of integers given for a key of the search space.
+ *
+ * @param values Values to parse.
+ * @param count Number of values.
+ * @param settings Array which will be populated with the integers.
+ * @param minimum Smallest value allowed.
+ * @param maximum Largest value allowed.
+ * @param description Description of the setting, used in error messages.
+ *
+ * @return 0 if every value is valid, 1 otherwise.
+ */
+static int parseTuneIntegers(char **values, int count, int *settings, int minimum, int maximum, const char *description) {
+	// Loop variable
+	int ii;
+
+	for (ii=0; ii<count; ii++) {
+		char *end;
+		settings[ii] = strtol(values[ii],&end,10);
+
+		if (*end != '\0' || settings[ii] < minimum || settings[ii] > maximum) {
+			fprintf(stderr,"%s (option -tune) must be between %d and %d.\n",description,minimum,maximum);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Parse the search space given to -tune, starting from the defaults.
+ *
+ * @param specification List of key=value[,value...] items separated by semicolons.
+ * @param space Reference to tune_space which will be populated.
+ *
+ * @return 0 if the specification is valid, 1 otherwise.
+ */
+static int parseTuneSpace(const char *specification, tune_space *space) {
+	// Loop variables
+	int ii,jj;
+
+	memset(space,0,sizeof(tune_space));
+	space->planes = 4;
+	space->goal = GOAL_BALANCED;
+	space->tolerance = 2.0;
+	strcpy(space->output,"f2j_tuned.params");
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	space->threads = cores > 0 ? (int) cores : 1;
+
+	char copy[strlen(specification)+1];
+	strcpy(copy,specification);
+
+	char *savePointer = NULL;
+	char *item;
+
+	for (item=strtok_r(copy,";",&savePointer); item != NULL; item=strtok_r(NULL,";",&savePointer)) {
+		if (strcmp(item,"default") == 0) {
+			continue;
+		}
+
+		char *equals = strchr(item,'=');
+
+		if (equals == NULL) {
+			fprintf(stderr,"Settings (option -tune) must be given as key=value[,value...]: %s\n",item);
+			return 1;
+		}
+
+		*equals = '\0';
+
+		char *key = item;
+		char *values[MAX_TUNE_VALUES];
+		int count = splitTuneValues(equals+1,values,key);
+
+		if (count < 0) {
+			return 1;
+		}
+
+		if (count == 0) {
+			fprintf(stderr,"No value given for %s (option -tune).\n",key);
+			return 1;
+		}
+
+		if (strcmp(key,"block") == 0) {
+			// Same restriction as -b, for square code-blocks.
+			if (parseTuneIntegers(values,count,space->blocks,4,64,"Code-block size") != 0) {
+				return 1;
+			}
+			space->numBlocks = count;
+		}
+		else if (strcmp(key,"resolutions") == 0) {
+			if (parseTuneIntegers(values,count,space->resolutions,1,33,"Number of resolutions") != 0) {
+				return 1;
+			}
+			space->numResolutions = count;
+		}
+		else if (strcmp(key,"mode") == 0) {
+			if (parseTuneIntegers(values,count,space->modes,0,63,"Mode switches") != 0) {
+				return 1;
+			}
+			space->numModes = count;
+		}
+		else if (strcmp(key,"tile") == 0) {
+			if (parseTuneIntegers(values,count,space->tiles,0,INT_MAX,"Tile size") != 0) {
+				return 1;
+			}
+			space->numTiles = count;
+		}
+		else if (strcmp(key,"precinct") == 0) {
+			if (parseTuneIntegers(values,count,space->precincts,0,32768,"Precinct size") != 0) {
+				return 1;
+			}
+			space->numPrecincts = count;
+		}
+		else if (strcmp(key,"progression") == 0) {
+			for (ii=0; ii<count; ii++) {
+				for (jj=LRCP; jj<=CPRL; jj++) {
+					if (strcasecmp(values[ii],getProgressionName((OPJ_PROG_ORDER) jj)) == 0) {
+						space->progressions[ii] = (OPJ_PROG_ORDER) jj;
+						break;
+					}
+				}
+
+				if (jj > CPRL) {
+					fprintf(stderr,"Progression order (option -tune) must be LRCP, RLCP, RPCL, PCRL or CPRL.\n");
+					return 1;
+				}
+			}
+			space->numProgressions = count;
+		}
+		else if (strcmp(key,"wavelet") == 0) {
+			for (ii=0; ii<count; ii++) {
+				if (strcmp(values[ii],"53") == 0 || strcmp(values[ii],"5-3") == 0) {
+					space->wavelets[ii] = 0;
+				}
+				else if (strcmp(values[ii],"97") == 0 || strcmp(values[ii],"9-7") == 0) {
+					space->wavelets[ii] = 1;
+				}
+				else {
+					fprintf(stderr,"Wavelet (option -tune) must be 53 or 97.\n");
+					return 1;
+				}
+			}
+			space->numWavelets = count;
+		}
+		else if (strcmp(key,"planes") == 0) {
+			space->planes = strtol(values[0],NULL,10);
+
+			if (space->planes < 1) {
+				fprintf(stderr,"Number of planes sampled (option -tune) must be at least 1.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(key,"threads") == 0) {
+			space->threads = strtol(values[0],NULL,10);
+
+			if (space->threads < 1) {
+				fprintf(stderr,"Number of threads (option -tune) must be at least 1.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(key,"goal") == 0) {
+			for (ii=GOAL_BALANCED; ii<=GOAL_RATIO; ii++) {
+				if (strcasecmp(values[0],goalNames[ii]) == 0) {
+					space->goal = (tune_goal) ii;
+					break;
+				}
+			}
+
+			if (ii > GOAL_RATIO) {
+				fprintf(stderr,"Goal (option -tune) must be balanced, speed or ratio.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(key,"tolerance") == 0) {
+			space->tolerance = strtod(values[0],NULL);
+
+			if (space->tolerance < 0.0) {
+				fprintf(stderr,"Tolerance (option -tune) cannot be negative.\n");
+				return 1;
+			}
+		}
+		else if (strcmp(key,"out") == 0) {
+			strncpy(space->output,values[0],sizeof(space->output)-1);
+		}
+		else if (strcmp(key,"dir") == 0) {
+			strncpy(space->directory,values[0],sizeof(space->directory)-1);
+		}
+		else {
+			fprintf(stderr,"Unknown setting (option -tune): %s\n",key);
+			return 1;
+		}
+	}
+
+	// Defaults for settings that weren't given.
+	if (space->numBlocks == 0) {
+		space->blocks[space->numBlocks++] = 32;
+		space->blocks[space->numBlocks++] = 64;
+	}
+
+	if (space->numResolutions == 0) {
+		space->resolutions[space->numResolutions++] = 4;
+		space->resolutions[space->numResolutions++] = 6;
+	}
+
+	if (space->numModes == 0) {
+		space->modes[space->numModes++] = 0;
+		space->modes[space->numModes++] = 1;
+	}
+
+	if (space->numTiles == 0) {
+		space->tiles[space->numTiles++] = 0;
+		space->tiles[space->numTiles++] = 512;
+	}
+
+	if (space->numProgressions == 0) {
+		space->progressions[space->numProgressions++] = LRCP;
+		space->progressions[space->numProgressions++] = RPCL;
+	}
+
+	if (space->numPrecincts == 0) {
+		space->precincts[space->numPrecincts++] = 0;
+	}
+
+	if (space->numWavelets == 0) {
+		space->wavelets[space->numWavelets++] = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Build every valid set of parameters in the search space.
+ *
+ * @param space Reference to the search space.
+ * @param base Compression parameters given on the command line, common to every set.
+ * @param width Width of the sampled planes.
+ * @param height Height of the sampled planes.
+ * @param sets Array with MAX_TUNE_SETS entries, which will be populated with the sets.
+ *
+ * @return Number of sets, or -1 if there are too many.
+ */
+static int buildTuneSets(tune_space *space, opj_cparameters_t *base, long width, long height, tune_set *sets) {
+	// Loop variables
+	int bb,rr,mm,tt,pp,cc,ww,ii;
+
+	// The 9-7 wavelet is only used for lossy compression.
+	bool lossy = base->irreversible || base->cp_fixed_quality || base->cp_fixed_alloc;
+
+	for (ii=0; ii<base->tcp_numlayers; ii++) {
+		lossy = lossy || base->tcp_rates[ii] > 0.0;
+	}
+
+	int count = 0;
+
+	for (bb=0; bb<space->numBlocks; bb++) {
+		for (rr=0; rr<space->numResolutions; rr++) {
+			for (mm=0; mm<space->numModes; mm++) {
+				for (tt=0; tt<space->numTiles; tt++) {
+					for (pp=0; pp<space->numProgressions; pp++) {
+						for (cc=0; cc<space->numPrecincts; cc++) {
+							for (ww=0; ww<space->numWavelets; ww++) {
+								if (space->wavelets[ww] && !lossy) {
+									continue;
+								}
+
+								// Every tile must be large enough for the lowest resolution to be at least a pixel wide.
+								long tileWidth = space->tiles[tt] > 0 && space->tiles[tt] < width ? space->tiles[tt] : width;
+								long tileHeight = space->tiles[tt] > 0 && space->tiles[tt] < height ? space->tiles[tt] : height;
+								long smallest = tileWidth < tileHeight ? tileWidth : tileHeight;
+
+								if (space->resolutions[rr] > 1 && (smallest >> (space->resolutions[rr]-1)) < 1) {
+									continue;
+								}
+
+								if (count == MAX_TUNE_SETS) {
+									fprintf(stderr,"The search space (option -tune) has more than %d sets of parameters.\n",MAX_TUNE_SETS);
+									return -1;
+								}
+
+								tune_set *set = &sets[count++];
+								memset(set,0,sizeof(tune_set));
+								set->psnr = INFINITY;
+
+								opj_cparameters_t *parameters = &set->parameters;
+								*parameters = *base;
+								parameters->cblockw_init = space->blocks[bb];
+								parameters->cblockh_init = space->blocks[bb];
+								parameters->numresolution = space->resolutions[rr];
+								parameters->mode = space->modes[mm];
+								parameters->prog_order = space->progressions[pp];
+								parameters->irreversible = space->wavelets[ww];
+								parameters->tcp_mct = 0;
+
+								if (space->tiles[tt] > 0) {
+									parameters->cp_tdx = space->tiles[tt];
+									parameters->cp_tdy = space->tiles[tt];
+									parameters->tile_size_on = OPJ_TRUE;
+								}
+								else {
+									parameters->tile_size_on = OPJ_FALSE;
+								}
+
+								if (space->precincts[cc] > 0) {
+									parameters->csty |= 0x01;
+									parameters->res_spec = 1;
+									parameters->prcw_init[0] = space->precincts[cc];
+									parameters->prch_init[0] = space->precincts[cc];
+								}
+								else {
+									parameters->csty &= ~0x01;
+									parameters->res_spec = 0;
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Worker thread function.  Encodes and decodes sampled planes with each set of parameters, until there
+ * are none left.
+ *
+ * @param arg Reference to the tune_queue.
+ *
+ * @return Null.
+ */
+static void *tuneWorker(void *arg) {
+	tune_queue *queue = (tune_queue *) arg;
+
+	while (true) {
+		pthread_mutex_lock(&queue->mutex);
+		int index = queue->next++;
+		pthread_mutex_unlock(&queue->mutex);
+
+		if (index >= queue->numSets * queue->numSamples) {
+			break;
+		}
+
+		tune_set *set = &queue->sets[index / queue->numSamples];
+		opj_image_t *sample = &queue->samples[index % queue->numSamples];
+		OPJ_CODEC_FORMAT codec = set->parameters.cod_format;
+
+		char file[strlen(queue->directory) + strlen(TUNE_FILE_PREFIX) + 32];
+		sprintf(file,"%s/%s%d.%s",queue->directory,TUNE_FILE_PREFIX,index,codec == CODEC_J2K ? "j2k" : "jp2");
+
+		// Each thread encodes with its own copy of the parameters.
+		opj_cparameters_t parameters = set->parameters;
+		rate_account rate;
+		memset(&rate,0,sizeof(rate_account));
+
+		double startTime = getThreadCPUTime();
+		memory_stream encoded;
+		int result = createJPEG2000Image(file,codec,&parameters,sample,&rate,RATE_IMAGE,&encoded);
+		double encodeSeconds = getThreadCPUTime() - startTime;
+
+		opj_image_t *decoded = NULL;
+		double decodeSeconds = 0.0;
+
+		if (result == 0) {
+			startTime = getThreadCPUTime();
+			result = readJ2KFromMemory(&encoded,&decoded,codec);
+			decodeSeconds = getThreadCPUTime() - startTime;
+			free(encoded.data);
+		}
+
+		unlink(file);
+
+		size_t pixels = (size_t) sample->comps[0].w * sample->comps[0].h;
+		double psnr = INFINITY;
+
+		if (result == 0 && (decoded == NULL || decoded->numcomps < 1 || decoded->comps[0].w != sample->comps[0].w ||
+				decoded->comps[0].h != sample->comps[0].h)) {
+			result = 1;
+		}
+
+		if (result == 0) {
+			quality_benchmark_info qualityParameters;
+			memset(&qualityParameters,0,sizeof(quality_benchmark_info));
+			qualityParameters.peakSignalToNoiseRatio = true;
+
+			pixel_comparison comparison;
+			memset(&comparison,0,sizeof(pixel_comparison));
+
+			if (comparePixels(sample->comps[0].data,decoded->comps[0].data,pixels,&qualityParameters,NULL,0,0,file,&comparison) != COMPARISON_OK) {
+				result = 1;
+			}
+			else if (comparison.squaredError > 0) {
+				double maxPixValue = (double) ((1 << sample->comps[0].prec) - 1);
+				double mse = ((double) comparison.squaredError) / ((double) pixels);
+				psnr = 10.0 * log10(maxPixValue * maxPixValue / mse);
+			}
+		}
+
+		if (decoded != NULL) {
+			opj_image_destroy(decoded);
+		}
+
+		pthread_mutex_lock(&queue->mutex);
+
+		if (result == 0) {
+			set->encodeSeconds += encodeSeconds;
+			set->decodeSeconds += decodeSeconds;
+			addRateAccount(&set->rate,&rate);
+
+			if (psnr < set->psnr) {
+				set->psnr = psnr;
+			}
+		}
+		else {
+			set->failures++;
+		}
+
+		pthread_mutex_unlock(&queue->mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * Does one set of parameters dominate another: is it at least as good by every measure (encoding and
+ * decoding time, compression ratio and PSNR), and better by at least one?
+ *
+ * @param a Reference to the first set.
+ * @param b Reference to the second set.
+ *
+ * @return true if a dominates b, false otherwise.
+ */
+static bool dominates(tune_set *a, tune_set *b) {
+	double ratioA = getCompressionRatio(&a->rate.outputs[RATE_IMAGE]);
+	double ratioB = getCompressionRatio(&b->rate.outputs[RATE_IMAGE]);
+
+	if (a->encodeSeconds > b->encodeSeconds || a->decodeSeconds > b->decodeSeconds || ratioA > ratioB || a->psnr < b->psnr) {
+		return false;
+	}
+
+	return a->encodeSeconds < b->encodeSeconds || a->decodeSeconds < b->decodeSeconds || ratioA < ratioB || a->psnr > b->psnr;
+}
+
+/**
+ * Mark the sets on the Pareto frontier and choose the set to recommend for the goal.
+ *
+ * @param space Reference to the search space, giving the goal.
+ * @param sets Sets of parameters, measured.
+ * @param numSets Number of sets.
+ *
+ * @return index of the set recommended, or -1 if no set was measured successfully.
+ */
+static int recommendTuneSet(tune_space *space, tune_set *sets, int numSets) {
+	// Loop variables
+	int ii,jj;
+
+	double bestRatio = INFINITY;
+	double bestPSNR = -INFINITY;
+
+	for (ii=0; ii<numSets; ii++) {
+		sets[ii].pareto = sets[ii].failures == 0;
+
+		for (jj=0; jj<numSets && sets[ii].pareto; jj++) {
+			if (jj != ii && sets[jj].failures == 0 && dominates(&sets[jj],&sets[ii])) {
+				sets[ii].pareto = false;
+			}
+		}
+
+		if (sets[ii].pareto) {
+			double ratio = getCompressionRatio(&sets[ii].rate.outputs[RATE_IMAGE]);
+
+			bestRatio = ratio < bestRatio ? ratio : bestRatio;
+			bestPSNR = sets[ii].psnr > bestPSNR ? sets[ii].psnr : bestPSNR;
+		}
+	}
+
+	int recommended = -1;
+	double bestScore = INFINITY;
+
+	for (ii=0; ii<numSets; ii++) {
+		if (!sets[ii].pareto) {
+			continue;
+		}
+
+		double seconds = sets[ii].encodeSeconds + sets[ii].decodeSeconds;
+		double ratio = getCompressionRatio(&sets[ii].rate.outputs[RATE_IMAGE]);
+		double score;
+
+		switch (space->goal) {
+			case GOAL_SPEED:
+				score = seconds;
+				break;
+			case GOAL_RATIO:
+				score = ratio;
+				break;
+			default:
+				if (ratio > bestRatio * (1.0 + space->tolerance/100.0) || (isfinite(bestPSNR) && sets[ii].psnr < bestPSNR - 0.5)) {
+					continue;
+				}
+				score = seconds;
+				break;
+		}
+
+		if (score < bestScore) {
+			bestScore = score;
+			recommended = ii;
+		}
+	}
+
+	return recommended;
+}
+
+/**
+ * Run the auto-tuner: sample planes of a FITS file, measure every set of parameters in the search space on
+ * them, write a table of the results to stdout and write the set recommended as a parameter profile.
+ *
+ * @param specification Search space given to -tune (see the description of this file).
+ * @param options Reference to conversion_options structure specifying the FITS file (-i) and the options
+ * common to every set.
+ *
+ * @return 0 if a parameter profile was written, 1 otherwise.
+ */
+int runTuner(const char *specification, conversion_options *options) {
+	if (specification == NULL || options == NULL) {
+		fprintf(stderr,"Parameters to runTuner cannot be null.\n");
+		return 1;
+	}
+
+	// Loop variable
+	int ii;
+
+	tune_space space;
+
+	if (parseTuneSpace(specification,&space) != 0) {
+		return 1;
+	}
+
+	char *ffname = options->parameters.infile;
+	fitsfile *fptr = NULL;
+	int status = 0;
+	cube_info info;
+
+	if (openFITSFile(ffname,&fptr,&info,&status) != 0) {
+		fprintf(stderr,"FITS file %s cannot be opened or is invalid.\n",ffname);
+		if (fptr != NULL) {
+			fits_close_file(fptr,&status);
+		}
+		return 1;
+	}
+
+	if (applyRegion(fptr,&info,&options->region,&status) != 0) {
+		fprintf(stderr,"Unable to apply region to FITS file %s.\n",ffname);
+		fits_close_file(fptr,&status);
+		return 1;
+	}
+
+	// Sample evenly spaced frames of the first stoke (or the requested stoke).
+	long frames = info.naxis > 2 ? info.depth : 1;
+	long stoke = info.naxis > 3 && options->startStoke >= 1 && options->startStoke <= info.stokes ? options->startStoke : 1;
+	int numSamples = space.planes < frames ? space.planes : (int) frames;
+	size_t pixels = (size_t) info.width * info.height;
+
+	opj_image_t samples[numSamples];
+	opj_image_comp_t components[numSamples];
+	memset(samples,0,sizeof(samples));
+	memset(components,0,sizeof(components));
+
+	int result = 0;
+
+	for (ii=0; ii<numSamples && result == 0; ii++) {
+		long frame = numSamples > 1 ? 1 + (long) ii * (frames-1) / (numSamples-1) : 1 + (frames-1)/2;
+
+		samples[ii].numcomps = 1;
+		samples[ii].comps = &components[ii];
+		components[ii].data = (int *) malloc(pixels * sizeof(int));
+
+		if (components[ii].data == NULL) {
+			fprintf(stderr,"Unable to allocate memory for the planes sampled by the tuner.\n");
+			result = 1;
+			break;
+		}
+
+		result = createImageFromFITS(fptr,options->transform,&samples[ii],frame,stoke,0,&info,NULL,NULL,&status
+#ifdef noise
+				,NULL,false,false
+#endif
+				);
+	}
+
+	fits_close_file(fptr,&status);
+
+	tune_set *sets = NULL;
+	int numSets = 0;
+
+	if (result == 0) {
+		sets = (tune_set *) malloc(MAX_TUNE_SETS * sizeof(tune_set));
+
+		if (sets == NULL) {
+			fprintf(stderr,"Unable to allocate memory for the tuner.\n");
+			result = 1;
+		}
+		else if ((numSets = buildTuneSets(&space,&options->parameters,info.width,info.height,sets)) <= 0) {
+			if (numSets == 0) {
+				fprintf(stderr,"No set of parameters in the search space (option -tune) is valid for %ldx%ld planes.\n",info.width,info.height);
+			}
+			result = 1;
+		}
+	}
+
+	// Directory in which to write the images.
+	char directory[OPJ_PATH_LEN];
+	bool temporaryDirectory = space.directory[0] == '\0';
+
+	if (result == 0) {
+		if (temporaryDirectory) {
+			const char *tmp = getenv("TMPDIR");
+			snprintf(directory,sizeof(directory),"%s/f2j_tune_XXXXXX",tmp != NULL && tmp[0] != '\0' ? tmp : "/tmp");
+
+			if (mkdtemp(directory) == NULL) {
+				fprintf(stderr,"Unable to create a temporary directory for the tuner.\n");
+				result = 1;
+			}
+		}
+		else {
+			strcpy(directory,space.directory);
+		}
+	}
+
+	if (result == 0) {
+		fprintf(stdout,"Tuning on %d plane(s) of %ldx%ld from %s: %d sets of parameters, %d thread(s), goal %s\n",numSamples,info.width,
+				info.height,ffname,numSets,space.threads,goalNames[space.goal]);
+		fflush(stdout);
+
+		tune_queue queue;
+		queue.sets = sets;
+		queue.numSets = numSets;
+		queue.samples = samples;
+		queue.numSamples = numSamples;
+		queue.directory = directory;
+		queue.next = 0;
+		pthread_mutex_init(&queue.mutex,NULL);
+
+		pthread_t workers[space.threads];
+		int started = 0;
+
+		for (ii=0; ii<space.threads && space.threads > 1; ii++) {
+			if (pthread_create(&workers[started],NULL,tuneWorker,&queue) == 0) {
+				started++;
+			}
+		}
+
+		if (started == 0) {
+			tuneWorker(&queue);
+		}
+
+		for (ii=0; ii<started; ii++) {
+			pthread_join(workers[ii],NULL);
+		}
+
+		pthread_mutex_destroy(&queue.mutex);
+
+		if (temporaryDirectory) {
+			rmdir(directory);
+		}
+
+		for (ii=0; ii<numSets; ii++) {
+			setRawPayload(&sets[ii].rate,info.bitpix);
+		}
+
+		int recommended = recommendTuneSet(&space,sets,numSets);
+		double megapixels = (double) pixels * numSamples / 1.0e6;
+
+		fprintf(stdout,"[set] [code-block] [resolutions] [mode] [tile] [progression] [precinct] [wavelet] [encode (CPU s/Mpixel)] "
+				"[decode (CPU s/Mpixel)] [bits per pixel] [compression ratio] [PSNR] [Pareto] [status]\n");
+
+		for (ii=0; ii<numSets; ii++) {
+			opj_cparameters_t *parameters = &sets[ii].parameters;
+			rate_counter *counter = &sets[ii].rate.outputs[RATE_IMAGE];
+
+			fprintf(stdout,"%d %d %d %d %d %s %d %s ",ii+1,parameters->cblockw_init,parameters->numresolution,parameters->mode,
+					parameters->tile_size_on ? parameters->cp_tdx : 0,getProgressionName(parameters->prog_order),
+					(parameters->csty & 0x01) ? parameters->prcw_init[0] : 0,parameters->irreversible ? "9-7" : "5-3");
+
+			if (sets[ii].failures > 0) {
+				fprintf(stdout,"0 0 0 0 0 no FAILED\n");
+			}
+			else {
+				fprintf(stdout,"%f %f %f %f %f %s %s\n",sets[ii].encodeSeconds/megapixels,sets[ii].decodeSeconds/megapixels,getBitsPerPixel(counter),
+						getCompressionRatio(counter),sets[ii].psnr,sets[ii].pareto ? "yes" : "no",ii == recommended ? "RECOMMENDED" : "OK");
+			}
+		}
+
+		if (recommended < 0) {
+			fprintf(stderr,"No set of parameters could be measured.\n");
+			result = 1;
+		}
+		else {
+			char description[OPJ_PATH_LEN + 100];
+			snprintf(description,sizeof(description),"Tuned on %s for goal %s (set %d).",ffname,goalNames[space.goal],recommended+1);
+
+			result = saveParameterProfile(space.output,"tuned",description,&sets[recommended].parameters,options->transform,NULL);
+
+			if (result == 0) {
+				fprintf(stdout,"Recommended set %d saved to %s.  Convert with -params %s\n",recommended+1,space.output,space.output);
+			}
+		}
+	}
+
+	for (ii=0; ii<numSamples; ii++) {
+		free(components[ii].data);
+	}
+
+	free(sets);
+
+	return result;
+}
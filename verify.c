@@ -0,0 +1,291 @@
+/**
+ * @file verify.c
+ * @author Andrew Cannon
+ * @date October 2026
+ *
+ * @brief Verifying the images written for a data cube while the following planes are encoded.
+ *
+ * Quality benchmarking (-QB and friends) and residual images need each image decoded and compared with the
+ * planes it was encoded from.  Done inline, this puts a full decode (and possibly a lossless encode of the
+ * residual) on the critical path of every image.  A quality_verifier takes the planes and the codestream of
+ * each image from setupCompression and verifies them on threads of its own, so that the next planes can be
+ * read and encoded meanwhile.
+ *
+ * The memory held by the images waiting to be verified is limited: when the limit is reached, submitting an
+ * image waits until an earlier one has been verified.  The planes of verified images are returned to the
+ * buffer pool of the thread encoding them, when it next submits an image, so that they are reused as before.
+ *
+ * As images are verified concurrently, their benchmarks may be printed out of order.  Each row names the image
+ * file, which identifies the frame (and stoke) of its planes.  When profiling, the decode and quality stages of
+ * an image are recorded by the verifying thread, under the same image name as its other stages.
+ */
+
+#include "f2j.h"
+
+/**
+ * Return the planes of the finished jobs of a verifier to a pool and free the jobs.  Must be called by the
+ * thread using the pool, with the mutex of the verifier held (or its threads joined).
+ *
+ * @param verifier Reference to the quality_verifier.
+ * @param pool Pool to return the planes to.  If null, the planes are freed.
+ */
+static void reclaimFinishedJobs(quality_verifier *verifier, plane_buffer_pool *pool) {
+	// Loop variable
+	int ii;
+
+	while (verifier->finished != NULL) {
+		verification_job *job = verifier->finished;
+		verifier->finished = job->next;
+
+		for (ii=0; ii<job->frame.numcomps; ii++) {
+			releasePlaneBuffer(pool,job->frame.comps[ii].data,job->planeLength);
+		}
+
+		free(job->frame.comps);
+		freePhysicalPlanes(job->physical,job->frame.numcomps);
+		free(job->file);
+		verifier->bytes -= job->bytes;
+		free(job);
+	}
+}
+
+/**
+ * Thread function which verifies the queued images until told to stop.  Images still queued when the
+ * threads are told to stop are verified first.
+ *
+ * @param arg Reference to the quality_verifier.
+ *
+ * @return Null.
+ */
+static void *verifyImages(void *arg) {
+	quality_verifier *verifier = (quality_verifier *) arg;
+
+	while (true) {
+		pthread_mutex_lock(&verifier->mutex);
+
+		while (verifier->queued == NULL && !verifier->stop) {
+			pthread_cond_wait(&verifier->queuedCondition,&verifier->mutex);
+		}
+
+		verification_job *job = verifier->queued;
+
+		if (job == NULL) {
+			pthread_mutex_unlock(&verifier->mutex);
+			break;
+		}
+
+		verifier->queued = job->next;
+
+		if (verifier->queued == NULL) {
+			verifier->lastQueued = NULL;
+		}
+
+		pthread_mutex_unlock(&verifier->mutex);
+
+		performQualityBenchmarking(&job->frame,job->file,&job->encoded,&verifier->parameters,job->codec,&verifier->cubeParameters,
+				job->physical,job->quality,verifier->countRates ? &job->rates : NULL);
+		finishProfiledImage(job->file);
+
+		free(job->encoded.data);
+		job->encoded.data = NULL;
+
+		pthread_mutex_lock(&verifier->mutex);
+
+		addRateAccount(&verifier->rates,&job->rates);
+		job->next = verifier->finished;
+		verifier->finished = job;
+
+		pthread_cond_broadcast(&verifier->finishedCondition);
+		pthread_mutex_unlock(&verifier->mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * Start a stage verifying the images written for a data cube.
+ *
+ * @param parameters Reference to quality_benchmark_info structure specifying the quality benchmarks to perform.  Copied.
+ * @param cubeParameters Reference to cube_encoding_info structure describing any spectral transform performed on the
+ * images.  Copied.
+ * @param countRates Should the size of residual images be counted?
+ * @param threads Number of threads verifying images.
+ * @param memory Limit (in MB) on the memory held by the images waiting to be verified.
+ *
+ * @return Reference to the quality_verifier, or null if it couldn't be started (in which case images should be
+ * verified inline).
+ */
+quality_verifier *startQualityVerifier(quality_benchmark_info *parameters, cube_encoding_info *cubeParameters, bool countRates, int threads, int memory) {
+	if (parameters == NULL || cubeParameters == NULL || threads < 1) {
+		return NULL;
+	}
+
+	quality_verifier *verifier = (quality_verifier *) calloc(1,sizeof(quality_verifier));
+
+	if (verifier == NULL) {
+		return NULL;
+	}
+
+	verifier->threads = (pthread_t *) malloc(sizeof(pthread_t)*threads);
+
+	if (verifier->threads == NULL) {
+		free(verifier);
+		return NULL;
+	}
+
+	verifier->parameters = *parameters;
+
+	// Share the cores between the verifying threads when calculating SSIM, unless told how many to use.
+	if (verifier->parameters.threads == 0) {
+		verifier->parameters.threads = getAutomaticReadThreads(threads);
+	}
+	verifier->cubeParameters = *cubeParameters;
+	verifier->countRates = countRates;
+	verifier->maxBytes = (size_t) (memory > 0 ? memory : VERIFY_DEFAULT_MEMORY) << 20;
+	verifier->stop = false;
+
+	pthread_mutex_init(&verifier->mutex,NULL);
+	pthread_cond_init(&verifier->queuedCondition,NULL);
+	pthread_cond_init(&verifier->finishedCondition,NULL);
+
+	for (verifier->numThreads=0; verifier->numThreads<threads; verifier->numThreads++) {
+		if (pthread_create(&verifier->threads[verifier->numThreads],NULL,verifyImages,verifier) != 0) {
+			break;
+		}
+	}
+
+	if (verifier->numThreads == 0) {
+		fprintf(stderr,"Unable to start the threads verifying images, so they will be verified as they are written.\n");
+		pthread_mutex_destroy(&verifier->mutex);
+		pthread_cond_destroy(&verifier->queuedCondition);
+		pthread_cond_destroy(&verifier->finishedCondition);
+		free(verifier->threads);
+		free(verifier);
+		return NULL;
+	}
+
+	return verifier;
+}
+
+/**
+ * Queue an image to be verified.  Waits for earlier images to be verified if the memory they hold would
+ * otherwise exceed the limit.  On success, the verifier takes the component data of the image, the physical
+ * values of its planes and the codestream: the component array of the image, the physical planes and the
+ * data of the codestream are set to null.
+ *
+ * @param verifier Reference to the quality_verifier.
+ * @param frame Image encoded, with any spectral transform undone.
+ * @param planeLength Number of pixels in each component.
+ * @param physical Reference to the array of physical values of the planes of the image (one per component), for
+ * quality benchmarking in physical units.  The array it refers to may be null.
+ * @param encoded Reference to memory_stream structure holding the codestream of the image.
+ * @param file Name of the JPEG 2000 image.  Copied.
+ * @param codec Codec of the image.
+ * @param quality Array with one entry per component, populated with the quality benchmarks of each component once
+ * the image has been verified (see finishQualityVerifier).  May be null.
+ * @param pool Pool to which the planes of images already verified are returned.  May be null.
+ *
+ * @return 0 if the image was queued, 1 otherwise (in which case the caller keeps the image and the codestream).
+ */
+int submitVerification(quality_verifier *verifier, opj_image_t *frame, size_t planeLength, physical_plane **physical, memory_stream *encoded, char *file,
+		OPJ_CODEC_FORMAT codec, quality_benchmark_result *quality, plane_buffer_pool *pool) {
+	if (verifier == NULL || frame == NULL || physical == NULL || encoded == NULL || encoded->data == NULL || file == NULL) {
+		return 1;
+	}
+
+	verification_job *job = (verification_job *) calloc(1,sizeof(verification_job));
+
+	if (job == NULL) {
+		return 1;
+	}
+
+	job->file = strdup(file);
+
+	if (job->file == NULL) {
+		free(job);
+		return 1;
+	}
+
+	job->frame = *frame;
+	job->planeLength = planeLength;
+	job->encoded = *encoded;
+	job->encoded.offset = 0;
+	job->codec = codec;
+	job->quality = quality;
+	job->physical = *physical;
+	job->bytes = sizeof(int)*planeLength*frame->numcomps + encoded->length;
+
+	if (job->physical != NULL) {
+		job->bytes += sizeof(double)*planeLength*frame->numcomps;
+	}
+
+	pthread_mutex_lock(&verifier->mutex);
+
+	reclaimFinishedJobs(verifier,pool);
+
+	while (verifier->bytes > 0 && verifier->bytes + job->bytes > verifier->maxBytes) {
+		pthread_cond_wait(&verifier->finishedCondition,&verifier->mutex);
+		reclaimFinishedJobs(verifier,pool);
+	}
+
+	verifier->bytes += job->bytes;
+
+	if (verifier->lastQueued != NULL) {
+		verifier->lastQueued->next = job;
+	}
+	else {
+		verifier->queued = job;
+	}
+
+	verifier->lastQueued = job;
+
+	pthread_cond_signal(&verifier->queuedCondition);
+	pthread_mutex_unlock(&verifier->mutex);
+
+	frame->comps = NULL;
+	frame->numcomps = 0;
+	*physical = NULL;
+	encoded->data = NULL;
+
+	return 0;
+}
+
+/**
+ * Wait for every image queued to be verified, then stop the threads and free the verifier.  The quality
+ * benchmarks of the images are complete once this returns.
+ *
+ * @param verifier Reference to the quality_verifier.  Nothing is done if it is null.
+ * @param pool Pool to which the planes of the images are returned.  May be null.
+ * @param totalRates Reference to rate_account structure to which the size of the residual images is added.  May be null.
+ * @param bitpix Type of the FITS data (BITPIX) the images were encoded from.
+ */
+void finishQualityVerifier(quality_verifier *verifier, plane_buffer_pool *pool, rate_account *totalRates, int bitpix) {
+	if (verifier == NULL) {
+		return;
+	}
+
+	// Loop variable
+	int ii;
+
+	pthread_mutex_lock(&verifier->mutex);
+	verifier->stop = true;
+	pthread_cond_broadcast(&verifier->queuedCondition);
+	pthread_mutex_unlock(&verifier->mutex);
+
+	for (ii=0; ii<verifier->numThreads; ii++) {
+		pthread_join(verifier->threads[ii],NULL);
+	}
+
+	reclaimFinishedJobs(verifier,pool);
+
+	if (totalRates != NULL && verifier->countRates) {
+		setRawPayload(&verifier->rates,bitpix);
+		addRateAccount(totalRates,&verifier->rates);
+	}
+
+	pthread_mutex_destroy(&verifier->mutex);
+	pthread_cond_destroy(&verifier->queuedCondition);
+	pthread_cond_destroy(&verifier->finishedCondition);
+	free(verifier->threads);
+	free(verifier);
+}